@@ -0,0 +1,338 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+
+#include "AllocationCheck.h"
+
+#include <dlfcn.h>
+#include <inttypes.h>
+#include <log/log.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unwind.h>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <new>
+
+// Nothing in here may allocate through operator new: it runs inside operator new.
+
+namespace android {
+namespace webcam {
+
+namespace {
+constexpr size_t kMaxThreads = 16;
+constexpr size_t kMaxThreadName = 32;
+constexpr size_t kMaxCallSites = 64;
+constexpr size_t kCallSiteDepth = 6;
+// Frames of the hook itself: recordCallSite, noteAllocation and operator new (or
+// recordFramePathAllocation). The helpers in between are always inlined.
+constexpr size_t kSkippedFrames = 3;
+
+struct ThreadStats {
+    char name[kMaxThreadName] = {};
+    std::atomic<uint64_t> allocations = 0;
+    std::atomic<uint64_t> bytes = 0;
+};
+
+// Allocations are grouped by the innermost frames of their stack.
+struct CallSite {
+    std::atomic<uint64_t> key = 0;  // hash of pcs, 0 while the entry is free
+    uintptr_t pcs[kCallSiteDepth] = {};
+    std::atomic<uint64_t> allocations = 0;
+    std::atomic<uint64_t> bytes = 0;
+};
+
+struct Backtrace {
+    uintptr_t pcs[kCallSiteDepth + kSkippedFrames] = {};
+    size_t depth = 0;
+};
+
+// Zero initialized statics only, operator new may run before any constructor.
+ThreadStats gThreads[kMaxThreads];
+std::atomic<size_t> gThreadCount = 0;
+std::mutex gThreadsLock;  // serializes trackFramePathAllocations
+CallSite gCallSites[kMaxCallSites];
+std::atomic<uint64_t> gDroppedCallSites = 0;
+std::atomic<bool> gArmed = false;
+std::atomic<uint32_t> gFramesDelivered = 0;
+
+thread_local int tThreadIndex = -1;
+thread_local bool tInHook = false;
+thread_local bool tAllowed = false;  // see ScopedFramePathAllocationsAllowed
+
+_Unwind_Reason_Code unwindCallback(struct _Unwind_Context* context, void* arg) {
+    auto* backtrace = static_cast<Backtrace*>(arg);
+    uintptr_t pc = _Unwind_GetIP(context);
+    if (pc == 0) {
+        return _URC_END_OF_STACK;
+    }
+    backtrace->pcs[backtrace->depth++] = pc;
+    constexpr size_t kMaxDepth = sizeof(backtrace->pcs) / sizeof(backtrace->pcs[0]);
+    return backtrace->depth < kMaxDepth ? _URC_NO_REASON : _URC_END_OF_STACK;
+}
+
+__attribute__((noinline)) void recordCallSite(size_t size) {
+    Backtrace backtrace;
+    _Unwind_Backtrace(&unwindCallback, &backtrace);
+    const uintptr_t* pcs = backtrace.pcs + kSkippedFrames;
+    size_t depth = backtrace.depth > kSkippedFrames ? backtrace.depth - kSkippedFrames : 0;
+
+    uint64_t key = 1469598103934665603ULL;  // FNV-1a
+    for (size_t i = 0; i < depth; i++) {
+        key = (key ^ pcs[i]) * 1099511628211ULL;
+    }
+    key |= 1;  // never 0
+
+    for (size_t probe = 0; probe < kMaxCallSites; probe++) {
+        CallSite& site = gCallSites[(key + probe) % kMaxCallSites];
+        uint64_t expected = 0;
+        if (site.key.compare_exchange_strong(expected, key)) {
+            memcpy(site.pcs, pcs, depth * sizeof(uintptr_t));
+        } else if (expected != key) {
+            continue;
+        }
+        site.allocations.fetch_add(1, std::memory_order_relaxed);
+        site.bytes.fetch_add(size, std::memory_order_relaxed);
+        return;
+    }
+    gDroppedCallSites.fetch_add(1, std::memory_order_relaxed);
+}
+
+__attribute__((noinline)) void noteAllocation(size_t size) {
+    if (!gArmed.load(std::memory_order_relaxed) || tThreadIndex < 0 || tInHook || tAllowed) {
+        return;
+    }
+    tInHook = true;
+    ThreadStats& thread = gThreads[tThreadIndex];
+    thread.allocations.fetch_add(1, std::memory_order_relaxed);
+    thread.bytes.fetch_add(size, std::memory_order_relaxed);
+    recordCallSite(size);
+    tInHook = false;
+}
+
+inline __attribute__((always_inline)) void* allocate(size_t size, size_t alignment) {
+    noteAllocation(size);
+    if (size == 0) {
+        size = 1;
+    }
+    if (alignment <= alignof(std::max_align_t)) {
+        return malloc(size);
+    }
+    void* mem = nullptr;
+    return posix_memalign(&mem, alignment, size) == 0 ? mem : nullptr;
+}
+
+inline __attribute__((always_inline)) void* allocateOrThrow(size_t size, size_t alignment) {
+    void* mem = allocate(size, alignment);
+    if (mem == nullptr) {
+        // Platform code is built without exceptions.
+        LOG_ALWAYS_FATAL("operator new: out of memory allocating %zu bytes", size);
+    }
+    return mem;
+}
+
+void logCallSite(const CallSite& site) {
+    ALOGE("  %" PRIu64 " allocations, %" PRIu64 " bytes at:",
+          site.allocations.load(std::memory_order_relaxed),
+          site.bytes.load(std::memory_order_relaxed));
+    for (size_t i = 0; i < kCallSiteDepth && site.pcs[i] != 0; i++) {
+        uintptr_t pc = site.pcs[i];
+        Dl_info info{};
+        if (dladdr(reinterpret_cast<void*>(pc), &info) == 0) {
+            ALOGE("    #%zu pc %" PRIxPTR, i, pc);
+            continue;
+        }
+        uintptr_t base = reinterpret_cast<uintptr_t>(info.dli_fbase);
+        const char* file = info.dli_fname != nullptr ? info.dli_fname : "?";
+        if (info.dli_sname == nullptr) {
+            ALOGE("    #%zu pc %08" PRIxPTR "  %s", i, pc - base, file);
+            continue;
+        }
+        ALOGE("    #%zu pc %08" PRIxPTR "  %s (%s+%" PRIuPTR ")", i, pc - base, file,
+              info.dli_sname, pc - reinterpret_cast<uintptr_t>(info.dli_saddr));
+    }
+}
+
+void resetStats() {
+    for (size_t i = 0; i < kMaxThreads; i++) {
+        gThreads[i].allocations = 0;
+        gThreads[i].bytes = 0;
+    }
+    for (CallSite& site : gCallSites) {
+        site.allocations = 0;
+        site.bytes = 0;
+        memset(site.pcs, 0, sizeof(site.pcs));
+        site.key = 0;
+    }
+    gDroppedCallSites = 0;
+}
+}  // anonymous namespace
+
+void trackFramePathAllocations(const char* name) {
+    if (tThreadIndex >= 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> l(gThreadsLock);
+    // Stage threads come and go with every stream, they keep the entry of their name.
+    size_t count = gThreadCount.load();
+    for (size_t i = 0; i < count; i++) {
+        if (strncmp(gThreads[i].name, name, kMaxThreadName - 1) == 0) {
+            tThreadIndex = static_cast<int>(i);
+            return;
+        }
+    }
+    if (count == kMaxThreads) {
+        ALOGW("%s: Not tracking %s, already tracking %zu threads", __FUNCTION__, name, count);
+        return;
+    }
+    strncpy(gThreads[count].name, name, kMaxThreadName - 1);
+    gThreadCount = count + 1;
+    tThreadIndex = static_cast<int>(count);
+}
+
+void onFramePathStreamOn() {
+    gArmed = false;
+    gFramesDelivered = 0;
+    resetStats();
+}
+
+void onFramePathFrameDelivered() {
+    if (gFramesDelivered.fetch_add(1) + 1 == kAllocationCheckWarmupFrames) {
+        ALOGI("%s: Warmed up, counting frame path allocations", __FUNCTION__);
+        gArmed = true;
+    }
+}
+
+__attribute__((noinline)) void recordFramePathAllocation(size_t size) {
+    noteAllocation(size);
+}
+
+uint64_t getFramePathAllocations() {
+    uint64_t total = 0;
+    size_t count = gThreadCount.load();
+    for (size_t i = 0; i < count; i++) {
+        total += gThreads[i].allocations.load();
+    }
+    return total;
+}
+
+void checkFramePathAllocations() {
+    gArmed = false;
+    uint32_t frames = gFramesDelivered.load();
+    if (frames < kAllocationCheckWarmupFrames) {
+        ALOGI("%s: Stream stopped after %u frames, during warm-up", __FUNCTION__, frames);
+        return;
+    }
+
+    uint64_t total = getFramePathAllocations();
+    size_t count = gThreadCount.load();
+    for (size_t i = 0; i < count; i++) {
+        uint64_t allocations = gThreads[i].allocations.load();
+        if (allocations > 0) {
+            ALOGE("%s: Thread %s made %" PRIu64 " allocations, %" PRIu64 " bytes", __FUNCTION__,
+                  gThreads[i].name, allocations, gThreads[i].bytes.load());
+        }
+    }
+    if (total == 0) {
+        ALOGI("%s: No frame path allocations in %u frames after warm-up", __FUNCTION__,
+              frames - kAllocationCheckWarmupFrames);
+        return;
+    }
+    for (const CallSite& site : gCallSites) {
+        if (site.key.load() != 0) {
+            logCallSite(site);
+        }
+    }
+    if (gDroppedCallSites.load() > 0) {
+        ALOGE("%s: %" PRIu64 " allocations from call sites that didn't fit the table",
+              __FUNCTION__, gDroppedCallSites.load());
+    }
+    LOG_ALWAYS_FATAL("%s: %" PRIu64 " frame path allocations in %u frames after warm-up",
+                     __FUNCTION__, total, frames - kAllocationCheckWarmupFrames);
+}
+
+ScopedFramePathAllocationsAllowed::ScopedFramePathAllocationsAllowed() : mWasAllowed(tAllowed) {
+    tAllowed = true;
+}
+
+ScopedFramePathAllocationsAllowed::~ScopedFramePathAllocationsAllowed() {
+    tAllowed = mWasAllowed;
+}
+
+}  // namespace webcam
+}  // namespace android
+
+using android::webcam::allocate;
+using android::webcam::allocateOrThrow;
+
+void* operator new(size_t size) {
+    return allocateOrThrow(size, alignof(std::max_align_t));
+}
+
+void* operator new[](size_t size) {
+    return allocateOrThrow(size, alignof(std::max_align_t));
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return allocate(size, alignof(std::max_align_t));
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return allocate(size, alignof(std::max_align_t));
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+    return allocateOrThrow(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+    return allocateOrThrow(size, static_cast<size_t>(alignment));
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return allocate(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return allocate(size, static_cast<size_t>(alignment));
+}
+
+// libc++ forwards the nothrow and aligned sized deletes to these.
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+    free(ptr);
+}
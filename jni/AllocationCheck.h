@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *  Checks that the frame path doesn't allocate once a stream has warmed up. Only built into
+ *  libjni_deviceAsWebcam_allocation_check (WEBCAM_ALLOCATION_CHECK), which replaces the global
+ *  operator new and counts the allocations made by frame path threads. Streaming for a while and
+ *  stopping the stream then either passes or aborts with the call sites that allocated. In regular
+ *  builds all of these are no-ops.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace android {
+namespace webcam {
+
+// Frames delivered to the gadget after STREAMON before allocations count. Covers lazily sized
+// buffers, the first huffman tables and the like.
+constexpr uint32_t kAllocationCheckWarmupFrames = 30;
+
+#ifdef WEBCAM_ALLOCATION_CHECK
+
+// Counts allocations of the calling thread from now on. name (copied) shows up in the report.
+// Cheap to call again from the same thread.
+void trackFramePathAllocations(const char* name);
+
+// Starts (or restarts, after a stall recovery) the warm-up. Allocations don't count until
+// kAllocationCheckWarmupFrames frames were delivered.
+void onFramePathStreamOn();
+void onFramePathFrameDelivered();
+
+// Allocations that don't go through operator new, like the heap fallbacks of libjpeg memory
+// managers.
+void recordFramePathAllocation(size_t size);
+
+// Allocations counted since warm-up ended, 0 during warm-up. Doesn't stop counting, for tests.
+uint64_t getFramePathAllocations();
+
+// Stops counting and logs the allocations made after warm-up, per thread and call site. Aborts if
+// there were any.
+void checkFramePathAllocations();
+
+// Allocations of the calling thread don't count while one is alive, for work outside the frame
+// path on a frame path thread.
+class ScopedFramePathAllocationsAllowed {
+  public:
+    ScopedFramePathAllocationsAllowed();
+    ~ScopedFramePathAllocationsAllowed();
+    ScopedFramePathAllocationsAllowed(const ScopedFramePathAllocationsAllowed&) = delete;
+    ScopedFramePathAllocationsAllowed& operator=(const ScopedFramePathAllocationsAllowed&) =
+            delete;
+
+  private:
+    bool mWasAllowed;
+};
+
+#else
+
+inline void trackFramePathAllocations(const char* /*name*/) {}
+inline void onFramePathStreamOn() {}
+inline void onFramePathFrameDelivered() {}
+inline void recordFramePathAllocation(size_t /*size*/) {}
+inline uint64_t getFramePathAllocations() {
+    return 0;
+}
+inline void checkFramePathAllocations() {}
+
+class ScopedFramePathAllocationsAllowed {
+  public:
+    // User provided, so that unused instances don't warn.
+    ScopedFramePathAllocationsAllowed() {}
+    ~ScopedFramePathAllocationsAllowed() {}
+};
+
+#endif
+
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+
+#include "BandWorkers.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <log/log.h>
+#include <string.h>
+#include <algorithm>
+
+#include "AllocationCheck.h"
+#include "Utils.h"
+
+namespace android {
+namespace webcam {
+
+void BandUsage::add(const BandUsage& usage) {
+    if (usage.bands == 0) {
+        return;
+    }
+    perf = bands == 0 ? usage.perf : PerfCounts::sum(perf, usage.perf);
+    bands += usage.bands;
+    cpuNs += usage.cpuNs;
+}
+
+BandWorkers::BandWorkers(uint32_t workers, bool perfCounters) : mPerfCounters(perfCounters) {
+    workers = std::clamp(workers, 1u, kMaxWorkers);
+    mThreads.reserve(workers - 1);
+    for (uint32_t band = 1; band < workers; band++) {
+        mThreads.emplace_back(&BandWorkers::threadLoop, this, band);
+    }
+}
+
+BandWorkers::~BandWorkers() {
+    {
+        std::lock_guard<std::mutex> l(mLock);
+        mRunning = false;
+    }
+    mWorkCondition.notify_all();
+    for (std::thread& thread : mThreads) {
+        thread.join();
+    }
+}
+
+bool BandWorkers::runBands(uint32_t rows, uint32_t workers, uint64_t cpuMask,
+                           BandFunction function, void* context, BandUsage* helperUsage) {
+    uint32_t bands = std::min({workers, getMaxWorkers(), (rows + 1) / 2});
+    if (bands <= 1) {
+        return function(context, 0, rows);
+    }
+    uint32_t bandRows = (rows + bands - 1) / bands;
+    bandRows += bandRows & 1;
+    // Rounding up may leave the last bands without rows.
+    bands = (rows + bandRows - 1) / bandRows;
+    {
+        std::lock_guard<std::mutex> l(mLock);
+        mFunction = function;
+        mContext = context;
+        mRows = rows;
+        mBandRows = bandRows;
+        mBands = bands;
+        mCpuMask = cpuMask;
+        mPending = bands - 1;
+        mFailed = false;
+        mHelperUsage = {};
+        mGeneration++;
+    }
+    mWorkCondition.notify_all();
+    bool success = function(context, 0, bandRows);
+
+    std::unique_lock<std::mutex> l(mLock);
+    mDoneCondition.wait(l, [this] { return mPending == 0; });
+    helperUsage->add(mHelperUsage);
+    return success && !mFailed;
+}
+
+void BandWorkers::threadLoop(uint32_t band) {
+    // Opened before the allocations are tracked, like the encoder thread's.
+    std::unique_ptr<PerfCounters> perfCounters =
+            mPerfCounters ? PerfCounters::openForCallingThread() : nullptr;
+    trackFramePathAllocations("BandWorker");
+    // Where the helper goes back to when the encoder thread's mask is cleared, 0 if unknown.
+    const uint64_t initialCpuMask = getThreadCpuMask();
+    uint64_t appliedCpuMask = initialCpuMask;
+    uint64_t generation = 0;
+    std::unique_lock<std::mutex> l(mLock);
+    while (true) {
+        mWorkCondition.wait(l, [this, generation] {
+            return !mRunning || mGeneration != generation;
+        });
+        if (!mRunning) {
+            return;
+        }
+        generation = mGeneration;
+        if (band >= mBands) {
+            continue;
+        }
+        BandFunction function = mFunction;
+        void* context = mContext;
+        uint32_t begin = band * mBandRows;
+        uint32_t end = std::min(begin + mBandRows, mRows);
+        uint64_t cpuMask = mCpuMask;
+        l.unlock();
+
+        // Follow the encoder thread's cpus. Not retried on failure, like Encoder::applyCpuMask.
+        if (cpuMask == 0) {
+            cpuMask = initialCpuMask;
+        }
+        if (cpuMask != 0 && cpuMask != appliedCpuMask) {
+            appliedCpuMask = cpuMask;
+            if (!setThreadCpuMask(cpuMask)) {
+                ALOGW("%s: Failed to move band %u to cpus 0x%" PRIx64 ": %s", __FUNCTION__, band,
+                      cpuMask, strerror(errno));
+            }
+        }
+        BandUsage usage;
+        usage.bands = 1;
+        PerfCounts perfStart;
+        if (perfCounters != nullptr) {
+            perfCounters->read(&perfStart);
+        }
+        uint64_t cpuStartNs = getThreadCpuTimeNs();
+        bool success = function(context, begin, end);
+        usage.cpuNs = getThreadCpuTimeNs() - cpuStartNs;
+        if (perfCounters != nullptr) {
+            PerfCounts perfEnd;
+            perfCounters->read(&perfEnd);
+            usage.perf = PerfCounts::between(perfStart, perfEnd);
+        }
+
+        l.lock();
+        mFailed = mFailed || !success;
+        mHelperUsage.add(usage);
+        if (--mPending == 0) {
+            mDoneCondition.notify_one();
+        }
+    }
+}
+
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *  Runs a row by row conversion as horizontal bands on several threads, for the frames a single
+ *  thread can't convert within a frame interval (eg: 4K YUYV).
+ */
+#pragma once
+
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "PerfCounters.h"
+
+namespace android {
+namespace webcam {
+
+// What the helper threads spent on the bands they converted.
+struct BandUsage {
+    uint32_t bands = 0;
+    uint64_t cpuNs = 0;
+    // Summed over the bands, for the events counted in all of them. None unless the helpers count
+    // perf events.
+    PerfCounts perf;
+
+    // Adds up usage of more bands.
+    void add(const BandUsage& usage);
+    // callerPerf, counted by the calling thread over the same runs, plus the helpers' counts.
+    [[nodiscard]] PerfCounts addPerfTo(const PerfCounts& callerPerf) const {
+        return bands == 0 ? callerPerf : PerfCounts::sum(callerPerf, perf);
+    }
+};
+
+// The calling thread converts the first band, helper threads started up front the others. Bands
+// are an even number of rows, so that they start on a chroma row of 4:2:0 images, and each writes
+// its own rows of the output: no two threads touch the same memory.
+//
+// Used by one thread at a time (the encoder thread).
+class BandWorkers {
+  public:
+    static constexpr uint32_t kMaxWorkers = 8;
+
+    // Starts workers - 1 helper threads, workers is capped to kMaxWorkers. With perfCounters,
+    // each helper counts perf events like the calling thread does (see PerfCounters).
+    BandWorkers(uint32_t workers, bool perfCounters);
+    ~BandWorkers();
+
+    [[nodiscard]] uint32_t getMaxWorkers() const {
+        return static_cast<uint32_t>(mThreads.size()) + 1;
+    }
+
+    // Calls convert(begin, end) for the rows [begin, end) of each band, up to workers bands over
+    // rows rows. Returns once all bands are done, false if any of them failed. Helpers move to the
+    // cpus of cpuMask first, back to the ones they started on if it is 0. What the helpers spent
+    // is added to *helperUsage.
+    template <typename F>
+    bool run(uint32_t rows, uint32_t workers, uint64_t cpuMask, F& convert,
+             BandUsage* helperUsage) {
+        BandFunction function = [](void* context, uint32_t begin, uint32_t end) {
+            return (*static_cast<F*>(context))(begin, end);
+        };
+        return runBands(rows, workers, cpuMask, function, &convert, helperUsage);
+    }
+
+  private:
+    // No std::function: capturing lambdas could allocate on every frame.
+    using BandFunction = bool (*)(void* context, uint32_t begin, uint32_t end);
+
+    bool runBands(uint32_t rows, uint32_t workers, uint64_t cpuMask, BandFunction function,
+                  void* context, BandUsage* helperUsage);
+    // band is the index of the band the helper converts, from 1.
+    void threadLoop(uint32_t band);
+
+    const bool mPerfCounters;
+    std::vector<std::thread> mThreads;
+
+    std::mutex mLock;
+    std::condition_variable mWorkCondition;  // guarded by mLock
+    std::condition_variable mDoneCondition;  // guarded by mLock
+    bool mRunning = true;                    // guarded by mLock
+    uint64_t mGeneration = 0;                // guarded by mLock, changes with every run
+    // The current run, guarded by mLock.
+    BandFunction mFunction = nullptr;
+    void* mContext = nullptr;
+    uint32_t mRows = 0;
+    uint32_t mBandRows = 0;
+    uint32_t mBands = 0;
+    uint64_t mCpuMask = 0;
+    uint32_t mPending = 0;  // helper bands not done yet
+    bool mFailed = false;
+    BandUsage mHelperUsage;
+};
+
+}  // namespace webcam
+}  // namespace android
@@ -17,47 +17,83 @@
 //#define LOG_NDEBUG 0
 
 #include "Buffer.h"
+#include <errno.h>
 #include <inttypes.h>
 #include <log/log.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <algorithm>
 
 namespace android {
 namespace webcam {
 
-BufferManager::BufferManager(BufferCreatorAndDestroyer* crD) : mCrD(crD) {
+const char* deliveryModeToString(DeliveryMode mode) {
+    switch (mode) {
+        case DeliveryMode::LATEST:
+            return "latest";
+        case DeliveryMode::FIFO:
+            return "fifo";
+        case DeliveryMode::HYBRID:
+            return "hybrid";
+    }
+    return "unknown";
+}
+
+template <typename BufferT>
+BufferManager<BufferT>::BufferManager(BufferCreatorAndDestroyer<BufferT>* crD,
+                                      DeliveryPolicy policy)
+    : mCrD(crD), mPolicy(policy) {
     if (crD == nullptr) {
         return;
     }
 
-    std::vector<std::shared_ptr<Buffer>> producerBuffers;
-    if (mCrD->allocateAndMapBuffers(&mConsumerBufferItem.buffer, &producerBuffers) != Status::OK) {
+    if (mCrD->allocateAndMapBuffers(&mConsumerBuffer, &mProducerBuffers) != Status::OK) {
         return;
     }
-    mConsumerBufferItem.state = BufferState::FREE;
-    for (auto& buf : producerBuffers) {
-        mProducerBufferItems.emplace_back(buf, BufferState::FREE);
+    // mProducerBuffers isn't resized after this, the items keep pointing at the same buffers.
+    mConsumerBufferItem = BufferItem(&mConsumerBuffer, BufferState::FREE);
+    mProducerBufferItems.reserve(mProducerBuffers.size());
+    for (auto& buf : mProducerBuffers) {
+        mProducerBufferItems.emplace_back(&buf, BufferState::FREE);
     }
     mInited = true;
 }
 
-BufferManager::~BufferManager() {
-    std::vector<std::shared_ptr<Buffer>> producerBuffers;
-    for (auto& buf : mProducerBufferItems) {
-        producerBuffers.push_back(buf.buffer);
+template <typename BufferT>
+BufferManager<BufferT>::~BufferManager() {
+    const DeliveryStats& stats = mDeliveryStats;
+    if (stats.delivered + stats.superseded + stats.expired + stats.noFreeBuffer > 0) {
+        ALOGI("%s: Delivery policy %s (depth %u, max age %lldms): delivered %" PRIu64
+              " superseded %" PRIu64 " expired %" PRIu64 " no free buffer %" PRIu64
+              " avg wait %" PRIu64 "us max wait %" PRIu64 "us, held %" PRIu64 " times avg %" PRIu64
+              "us",
+              __FUNCTION__, deliveryModeToString(mPolicy.mode), mPolicy.maxDepth,
+              static_cast<long long>(mPolicy.maxAge.count()), stats.delivered, stats.superseded,
+              stats.expired, stats.noFreeBuffer,
+              stats.delivered == 0 ? 0 : stats.totalWaitNs / stats.delivered / 1000,
+              stats.maxWaitNs / 1000, stats.held,
+              stats.held == 0 ? 0 : stats.totalHoldNs / stats.held / 1000);
     }
-    mCrD->destroyBuffers(mConsumerBufferItem.buffer, producerBuffers);
     mConsumerBufferItem.buffer = nullptr;
     mProducerBufferItems.clear();
+    if (mCrD != nullptr) {
+        mCrD->destroyBuffers(mConsumerBuffer, mProducerBuffers);
+    }
 }
 
-Buffer* BufferManager::getFreeBufferIfAvailable() {
+template <typename BufferT>
+Buffer* BufferManager<BufferT>::getFreeBufferIfAvailable() {
     // Producer call
-    std::unique_lock<std::mutex> l(mBufferLock);
+    InstrumentedMutex::UniqueLock l(mBufferLock);
     for (auto& bufferItem : mProducerBufferItems) {
         if (bufferItem.state == BufferState::FREE) {
             bufferItem.state = BufferState::IN_USE;
-            return bufferItem.buffer.get();
+            return bufferItem.buffer;
         }
     }
+    // The producer drops its frame. Counted here, as it is a cost of the delivery policy too.
+    mDeliveryStats.noFreeBuffer++;
+    publishDeliveryStatsLocked();
     for (const auto& bufferItem : mProducerBufferItems) {
         uint64_t bufferTs = bufferItem.buffer->getTimestamp();
         ALOGV("%s: Buffer at state %d, ts %" PRIu64 ", v4l2 index %u",
@@ -67,63 +103,124 @@ Buffer* BufferManager::getFreeBufferIfAvailable() {
     return nullptr;
 }
 
-bool BufferManager::filledProducerBufferAvailableLocked(uint32_t* index) {
-    uint32_t i = 0;
-    bool found = false;
-    uint32_t foundIndex = 0;
-    uint64_t ts = 0;
-    // Try to get the latest filled buffer.
-    for (auto& bufferItem : mProducerBufferItems) {
+template <typename BufferT>
+int BufferManager<BufferT>::findFilledBufferLocked(bool newest) {
+    int found = -1;
+    uint64_t foundTs = 0;
+    for (size_t i = 0; i < mProducerBufferItems.size(); i++) {
+        const BufferItem& bufferItem = mProducerBufferItems[i];
         uint64_t bufferTs = bufferItem.buffer->getTimestamp();
-        ALOGV("%s: Buffer at index i %u : state %d, ts %" PRIu64 ", v4l2 index %u", __FUNCTION__,
-                i, (int)bufferItem.state, bufferTs, bufferItem.buffer->getIndex());
-        if (bufferItem.state == BufferState::FILLED) {
-            if (bufferTs > ts) {
-                if (index != nullptr) {
-                    *index = i;
-                }
-                ts = bufferTs;
-                found = true;
-                foundIndex = i;
+        ALOGV("%s: Buffer at index i %zu : state %d, ts %" PRIu64 ", v4l2 index %u", __FUNCTION__,
+              i, (int)bufferItem.state, bufferTs, bufferItem.buffer->getIndex());
+        if (bufferItem.state != BufferState::FILLED) {
+            continue;
+        }
+        if (found < 0 || (newest ? bufferTs > foundTs : bufferTs < foundTs)) {
+            found = static_cast<int>(i);
+            foundTs = bufferTs;
+        }
+    }
+    return found;
+}
+
+template <typename BufferT>
+void BufferManager<BufferT>::dropFilledBufferLocked(BufferItem& bufferItem, uint64_t* counter) {
+    ALOGV("%s: Dropping filled buffer with ts %" PRIu64 ", v4l2 index %u", __FUNCTION__,
+          bufferItem.buffer->getTimestamp(), bufferItem.buffer->getIndex());
+    bufferItem.state = BufferState::FREE;
+    (*counter)++;
+}
+
+template <typename BufferT>
+bool BufferManager<BufferT>::filledProducerBufferAvailableLocked(uint32_t* index) {
+    if (mPolicy.mode == DeliveryMode::HYBRID) {
+        auto now = std::chrono::steady_clock::now();
+        for (auto& bufferItem : mProducerBufferItems) {
+            if (bufferItem.state == BufferState::FILLED &&
+                now - bufferItem.filledTime > mPolicy.maxAge) {
+                dropFilledBufferLocked(bufferItem, &mDeliveryStats.expired);
             }
         }
-        i++;
     }
-    // Actually cancel older buffers
-    uint32_t j = 0;
-    for (auto& bufferItem : mProducerBufferItems) {
-        if (bufferItem.state == BufferState::FILLED && j != foundIndex) {
-            bufferItem.state = BufferState::FREE;
+    int found = findFilledBufferLocked(/*newest*/ mPolicy.mode == DeliveryMode::LATEST);
+    if (found < 0) {
+        return false;
+    }
+    if (mPolicy.mode == DeliveryMode::LATEST) {
+        // Actually cancel older buffers
+        for (size_t i = 0; i < mProducerBufferItems.size(); i++) {
+            if (mProducerBufferItems[i].state == BufferState::FILLED &&
+                i != static_cast<size_t>(found)) {
+                dropFilledBufferLocked(mProducerBufferItems[i], &mDeliveryStats.superseded);
+            }
         }
-        j++;
     }
-    return found;
+    if (index != nullptr) {
+        *index = static_cast<uint32_t>(found);
+    }
+    return true;
 }
 
-Buffer* BufferManager::getFilledBufferAndSwap() {
+template <typename BufferT>
+std::chrono::nanoseconds BufferManager<BufferT>::getPhaseHold() {
+    InstrumentedMutex::UniqueLock l(mBufferLock);
+    if (mPolicy.mode != DeliveryMode::LATEST || !mPolicy.alignPhase) {
+        return std::chrono::nanoseconds(0);
+    }
+    int newest = findFilledBufferLocked(/*newest*/ true);
+    if (newest < 0) {
+        return std::chrono::nanoseconds(0);
+    }
+    std::chrono::nanoseconds hold = mPhaseController.getHold(
+            std::chrono::steady_clock::now(), mProducerBufferItems[newest].filledTime);
+    if (hold.count() > 0) {
+        mDeliveryStats.held++;
+        mDeliveryStats.totalHoldNs += hold.count();
+    }
+    return hold;
+}
+
+template <typename BufferT>
+BufferT* BufferManager<BufferT>::getFilledBufferAndSwap(std::chrono::milliseconds timeout) {
     // Consumer call
     // Wait for a producer buffer item state to be FILLED
     // and swap consumer and producer buffer
-    std::unique_lock<std::mutex> l(mBufferLock);
+    InstrumentedMutex::UniqueLock l(mBufferLock);
     uint32_t index = 0;
+    auto deadline = std::chrono::steady_clock::now() + timeout;
     while (!filledProducerBufferAvailableLocked(&index)) {
-        // TODO(b/267794640): Add a timeout to recover in case of a deadlock.
-        // Wait till the producer side has filled the buffer.
-        mProducerBufferFilled.wait(l);
+        // Wait till the producer side has filled the buffer. The consumer recovers from producer
+        // stalls on its own, so don't wait forever.
+        if (mProducerBufferFilled.wait_until(l, deadline) == std::cv_status::timeout &&
+            !filledProducerBufferAvailableLocked(&index)) {
+            mConsumerStarved = true;
+            publishDeliveryStatsLocked();
+            return nullptr;
+        }
     }
+    uint64_t waitNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              std::chrono::steady_clock::now() -
+                              mProducerBufferItems[index].filledTime)
+                              .count();
+    mConsumerStarved = false;
+    mDeliveryStats.delivered++;
+    mDeliveryStats.totalWaitNs += waitNs;
+    mDeliveryStats.maxWaitNs = std::max(mDeliveryStats.maxWaitNs, waitNs);
     // Mark it free so that the producer can start filling it.
     mConsumerBufferItem.state = BufferState::FREE;
     std::swap(mConsumerBufferItem, mProducerBufferItems[index]);
     // Now the consumer buffer is busy
     mConsumerBufferItem.state = BufferState::IN_USE;
-    return mConsumerBufferItem.buffer.get();
+    publishDeliveryStatsLocked();
+    return mConsumerBufferItem.buffer;
 }
 
-bool BufferManager::changeProducerBufferStateLocked(Buffer* buffer, BufferState newState) {
+template <typename BufferT>
+bool BufferManager<BufferT>::changeProducerBufferStateLocked(Buffer* buffer, BufferState newState) {
     bool found = false;
     uint32_t i = 0;
     for (auto& bufferItem : mProducerBufferItems) {
-        if (buffer->getIndex() == bufferItem.buffer->getIndex()) {
+        if (bufferItem.buffer == buffer) {
             found = true;
             break;
         }
@@ -136,27 +233,115 @@ bool BufferManager::changeProducerBufferStateLocked(Buffer* buffer, BufferState
     }
 
     mProducerBufferItems[i].state = newState;
+    if (newState == BufferState::FILLED) {
+        mProducerBufferItems[i].filledTime = std::chrono::steady_clock::now();
+    }
     return true;
 }
 
-Status BufferManager::cancelBuffer(Buffer* buffer) {
-    std::unique_lock<std::mutex> l(mBufferLock);
+template <typename BufferT>
+void BufferManager<BufferT>::cancelInFlightBuffers() {
+    InstrumentedMutex::UniqueLock l(mBufferLock);
+    for (auto& bufferItem : mProducerBufferItems) {
+        if (bufferItem.state != BufferState::FREE) {
+            ALOGW("%s: Cancelling buffer with v4l2 index %u in state %d", __FUNCTION__,
+                  bufferItem.buffer->getIndex(), (int)bufferItem.state);
+            bufferItem.state = BufferState::FREE;
+        }
+    }
+    publishDeliveryStatsLocked();
+}
+
+template <typename BufferT>
+void BufferManager<BufferT>::dumpState() {
+    InstrumentedMutex::UniqueLock l(mBufferLock);
+    ALOGI("%s: Consumer buffer: state %d, ts %" PRIu64 ", v4l2 index %u", __FUNCTION__,
+          (int)mConsumerBufferItem.state, mConsumerBufferItem.buffer->getTimestamp(),
+          mConsumerBufferItem.buffer->getIndex());
+    for (const auto& bufferItem : mProducerBufferItems) {
+        ALOGI("%s: Producer buffer: state %d, ts %" PRIu64 ", v4l2 index %u", __FUNCTION__,
+              (int)bufferItem.state, bufferItem.buffer->getTimestamp(),
+              bufferItem.buffer->getIndex());
+    }
+}
+
+template <typename BufferT>
+void BufferManager<BufferT>::publishDeliveryStatsLocked() {
+    DeliveryStats stats = mDeliveryStats;
+    for (const auto& bufferItem : mProducerBufferItems) {
+        stats.waiting += bufferItem.state == BufferState::FILLED ? 1 : 0;
+    }
+    mPublishedDeliveryStats.write(stats);
+}
+
+template <typename BufferT>
+DeliveryStats BufferManager<BufferT>::getDeliveryStats() const {
+    return mPublishedDeliveryStats.read();
+}
+
+template <typename BufferT>
+DeliveryPolicy BufferManager<BufferT>::getDeliveryPolicy() {
+    InstrumentedMutex::UniqueLock l(mBufferLock);
+    return mPolicy;
+}
+
+template <typename BufferT>
+void BufferManager<BufferT>::setDeliveryPolicy(const DeliveryPolicy& policy) {
+    InstrumentedMutex::UniqueLock l(mBufferLock);
+    mPolicy = policy;
+}
+
+template <typename BufferT>
+void BufferManager<BufferT>::setConsumerWakeFd(int fd) {
+    InstrumentedMutex::UniqueLock l(mBufferLock);
+    mConsumerWakeFd = fd;
+}
+
+template <typename BufferT>
+Status BufferManager<BufferT>::cancelBuffer(Buffer* buffer) {
+    InstrumentedMutex::UniqueLock l(mBufferLock);
     if (!changeProducerBufferStateLocked(buffer, BufferState::FREE)) {
         return Status::ERROR;
     }
     return Status::OK;
 }
 
-Status BufferManager::queueFilledBuffer(Buffer* buffer) {
-    std::unique_lock<std::mutex> l(mBufferLock);
+template <typename BufferT>
+Status BufferManager<BufferT>::queueFilledBuffer(Buffer* buffer) {
+    InstrumentedMutex::UniqueLock l(mBufferLock);
+    int wakeFd = -1;
 
     if (!changeProducerBufferStateLocked(buffer, BufferState::FILLED)) {
         return Status::ERROR;
     }
+    mPhaseController.onBufferFilled(std::chrono::steady_clock::now());
+    if (mPolicy.mode != DeliveryMode::LATEST) {
+        // Bound the queue, and with it the latency, by dropping the oldest frames.
+        uint32_t filled = 0;
+        for (const auto& bufferItem : mProducerBufferItems) {
+            filled += bufferItem.state == BufferState::FILLED ? 1 : 0;
+        }
+        for (; filled > std::max(mPolicy.maxDepth, 1u); filled--) {
+            int oldest = findFilledBufferLocked(/*newest*/ false);
+            dropFilledBufferLocked(mProducerBufferItems[oldest], &mDeliveryStats.superseded);
+        }
+    }
+    publishDeliveryStatsLocked();
+    if (mConsumerStarved && mConsumerWakeFd >= 0) {
+        // Once per starvation, not per frame.
+        mConsumerStarved = false;
+        wakeFd = mConsumerWakeFd;
+    }
+    l.unlock();
 
     mProducerBufferFilled.notify_one();
+    if (wakeFd >= 0 && eventfd_write(wakeFd, 1) != 0) {
+        ALOGE("%s: Couldn't wake the consumer: %s", __FUNCTION__, strerror(errno));
+    }
     return Status::OK;
 }
 
+template class BufferManager<V4L2Buffer>;
+
 }  // namespace webcam
 }  // namespace android
@@ -19,12 +19,17 @@
  */
 #pragma once
 
+#include <InstrumentedMutex.h>
+#include <PhaseController.h>
+#include <SeqLock.h>
 #include <Utils.h>
 #include <linux/videodev2.h>
+#include <chrono>
 #include <condition_variable>
 #include <map>
 #include <mutex>
 #include <queue>
+#include <type_traits>
 #include <variant>
 #include <vector>
 
@@ -56,20 +61,27 @@ struct ARGBHardwareBufferDesc {
     uint32_t rowStride = 0;
 };
 
+// Complete JPEG image from the camera's BLOB stream.
+struct JpegHardwareBufferDesc {
+    uint8_t* data = nullptr;
+    uint32_t size = 0;
+};
+
 struct HardwareBufferDesc {
     uint32_t width = 0;
     uint32_t height = 0;
     uint32_t format = 0;
     uint32_t bufferId = 0;
-    std::variant<ARGBHardwareBufferDesc, YuvHardwareBufferDesc> bufferDesc;
+    std::variant<ARGBHardwareBufferDesc, YuvHardwareBufferDesc, JpegHardwareBufferDesc> bufferDesc;
 };
 
+template <typename BufferT>
 class BufferManager;
 
 // Base class for Buffer, for future types apart from V4L2
 // Thin wrapper over struct v4l2_buffer. The client should not free the memory obtained from
 // getMem(). All Buffers are created by BufferManager through BufferCreatorAndDestroyer which is
-// transport specific.
+// transport specific, and handed to the consumer by their concrete type.
 // TODO(b/267794640): Change Buffer to have either a std::shared_ptr to BufferManager or have
 //                    BufferManager be a singleton. BufferManager should implement
 //                    counting 'handout' buffers before freeing. BufferManager should explicitly
@@ -90,13 +102,15 @@ class Buffer {
     [[nodiscard]] uint64_t getTimestamp() const { return mTimestamp; }
     [[nodiscard]] virtual uint32_t getIndex() const = 0;
 
+    template <typename BufferT>
     friend class BufferManager;
 
   private:
     uint64_t mTimestamp = 0;
 };
 
-class V4L2Buffer : public Buffer {
+// final, so that calls through the V4L2Buffer* the consumer gets are statically dispatched.
+class V4L2Buffer final : public Buffer {
   public:
     V4L2Buffer(void* mem, const struct v4l2_buffer* buffer) : mMem(mem), mBuffer(*buffer) {}
     V4L2Buffer() { memset(&mBuffer, 0, sizeof(mBuffer)); }
@@ -138,25 +152,70 @@ class BufferProducer {
     virtual ~BufferProducer() = default;
 };
 
+template <typename BufferT>
 class BufferConsumer {
   public:
-    // Gets a filled buffer from BufferManager (waits if one is not available) and returns the
-    // consumer side buffer for the BufferManager to give away to the producer to use.
+    // Gets a filled buffer from BufferManager (waits up to timeout if one is not available) and
+    // returns the consumer side buffer for the BufferManager to give away to the producer to use.
+    // Returns nullptr on timeout, in which case the consumer keeps its current buffer.
     // Buffer is owned by BufferConsumer. Caller should not manage the lifetime of the object.
-    virtual Buffer* getFilledBufferAndSwap() = 0;
+    virtual BufferT* getFilledBufferAndSwap(std::chrono::milliseconds timeout) = 0;
     virtual ~BufferConsumer() = default;
 };
 
+// Transport specific. Buffers are held by value in storage that doesn't move while the
+// BufferManager is alive.
+template <typename BufferT>
 class BufferCreatorAndDestroyer {
   public:
     virtual ~BufferCreatorAndDestroyer() = default;
-    virtual Status allocateAndMapBuffers(std::shared_ptr<Buffer>* consumerBuffer,
-                                         std::vector<std::shared_ptr<Buffer>>* producerBuffer) = 0;
-    virtual void destroyBuffers(std::shared_ptr<Buffer>& consumerBuffer,
-                                std::vector<std::shared_ptr<Buffer>>& producerBuffers) = 0;
+    virtual Status allocateAndMapBuffers(BufferT* consumerBuffer,
+                                         std::vector<BufferT>* producerBuffers) = 0;
+    virtual void destroyBuffers(BufferT& consumerBuffer, std::vector<BufferT>& producerBuffers) = 0;
+};
+
+// Which filled buffer the consumer gets when more than one is waiting.
+enum class DeliveryMode : uint32_t {
+    // Newest frame, everything older is dropped. Lowest latency.
+    LATEST = 0,
+    // Oldest frame first, at most maxDepth frames waiting (the oldest is dropped beyond that).
+    FIFO = 1,
+    // FIFO, but frames that waited longer than maxAge are dropped.
+    HYBRID = 2,
+};
+
+struct DeliveryPolicy {
+    DeliveryMode mode = DeliveryMode::LATEST;
+    uint32_t maxDepth = 2;                  // FIFO and HYBRID
+    std::chrono::milliseconds maxAge{100};  // HYBRID
+    // LATEST only: let the consumer hold on briefly for a frame that is about to be filled, see
+    // PhaseController and getPhaseHold. Off by default, holding delays the pickup.
+    bool alignPhase = false;
 };
 
-class BufferManager : public BufferConsumer, public BufferProducer {
+const char* deliveryModeToString(DeliveryMode mode);
+
+// Per stream counters, to compare delivery policies.
+struct DeliveryStats {
+    uint64_t delivered = 0;
+    uint64_t superseded = 0;   // dropped for a newer frame, or beyond the FIFO depth
+    uint64_t expired = 0;      // dropped for waiting longer than maxAge
+    // Frames the producer dropped because no buffer was free, typically since filled buffers were
+    // queued for the consumer.
+    uint64_t noFreeBuffer = 0;
+    uint64_t totalWaitNs = 0;  // time from queueFilledBuffer to the consumer taking the buffer
+    uint64_t maxWaitNs = 0;
+    uint64_t held = 0;  // pickups put off by getPhaseHold, for a fresher frame
+    uint64_t totalHoldNs = 0;
+    uint64_t waiting = 0;  // filled buffers waiting for the consumer
+};
+
+// Templated on the transport's buffer type: the consumer gets buffers by their concrete type
+// without casting. Producers, like the transport agnostic Encoder, go through BufferProducer.
+template <typename BufferT>
+class BufferManager final : public BufferConsumer<BufferT>, public BufferProducer {
+    static_assert(std::is_base_of_v<Buffer, BufferT>, "BufferT must be a Buffer");
+
     // There are 2 types of buffers : the consumer side buffer and the producer side buffers.
     // The consumer side needs only 1.
     // The producer side is typically some component which fills in frames such as a FrameProvider
@@ -168,13 +227,34 @@ class BufferManager : public BufferConsumer, public BufferProducer {
     // TODO(b/267794640): Look into better memory management
     // BufferCreatorAndDestroyer is owned by the caller, it must be active throughout the lifetime
     // of BufferManager
-    explicit BufferManager(BufferCreatorAndDestroyer* crD);
+    explicit BufferManager(BufferCreatorAndDestroyer<BufferT>* crD, DeliveryPolicy policy = {});
     ~BufferManager() override;
     [[nodiscard]] bool isInited() const { return mInited; }
     Buffer* getFreeBufferIfAvailable() override;
     Status queueFilledBuffer(Buffer* buffer) override;
     Status cancelBuffer(Buffer* buffer) override;
-    Buffer* getFilledBufferAndSwap() override;
+    BufferT* getFilledBufferAndSwap(std::chrono::milliseconds timeout) override;
+    // With phase alignment on, how long the consumer should put off its next pickup for a frame
+    // that is about to be filled. Zero to pick up now. Doesn't wait itself, so that the consumer
+    // decides whether it can afford to and doesn't wait holding mBufferLock.
+    std::chrono::nanoseconds getPhaseHold();
+
+    // Returns all producer buffers to the free state. Only for stall recovery, once the producer
+    // that held them is gone.
+    void cancelInFlightBuffers();
+    // Logs the state of every buffer.
+    void dumpState();
+
+    // Lock free, may be called from any thread.
+    [[nodiscard]] DeliveryStats getDeliveryStats() const;
+    [[nodiscard]] DeliveryPolicy getDeliveryPolicy();
+    // Takes effect from the next getFilledBufferAndSwap / queueFilledBuffer on, frames already
+    // waiting are kept.
+    void setDeliveryPolicy(const DeliveryPolicy& policy);
+    // eventfd that queueFilledBuffer signals when the last getFilledBufferAndSwap timed out, so
+    // that a consumer that doesn't block on the frame path picks the frame up right away. Owned
+    // by the caller, -1 for none.
+    void setConsumerWakeFd(int fd);
 
   private:
     enum BufferState {
@@ -183,24 +263,38 @@ class BufferManager : public BufferConsumer, public BufferProducer {
         FREE = 2,
     };
 
-    struct BufferItem {
-        BufferItem() : buffer(nullptr), state(BufferState::FREE) {}
-        BufferItem(std::shared_ptr<Buffer>& buf, BufferState st) : buffer(buf), state(st) {}
-        std::shared_ptr<Buffer> buffer;
+    // One cache line each: the producer and consumer threads update different items.
+    struct alignas(64) BufferItem {
+        BufferItem() = default;
+        BufferItem(BufferT* buf, BufferState st) : buffer(buf), state(st) {}
+        BufferT* buffer = nullptr;  // points into mConsumerBuffer / mProducerBuffers
         BufferState state = BufferState::FREE;
+        std::chrono::steady_clock::time_point filledTime;  // valid while FILLED
     };
 
-    // Checks if a filled buffer has been made available by the producer and gets the vector index,
-    // of the latest filled buffer. Cancels buffers older than the one referenced by index.
+    // Checks if a filled buffer has been made available by the producer and gets the vector index
+    // of the one to deliver next according to mPolicy. Drops filled buffers the policy says are
+    // not worth delivering anymore.
     bool filledProducerBufferAvailableLocked(uint32_t* index);
+    // Index of the oldest / newest FILLED buffer, -1 if there is none.
+    int findFilledBufferLocked(bool newest);
+    void dropFilledBufferLocked(BufferItem& bufferItem, uint64_t* counter);
     bool changeProducerBufferStateLocked(Buffer* buffer, BufferState newState);
+    // Makes mDeliveryStats visible to getDeliveryStats.
+    void publishDeliveryStatsLocked();
 
     bool mInited = false;
-    BufferCreatorAndDestroyer* mCrD = nullptr;
+    BufferCreatorAndDestroyer<BufferT>* mCrD = nullptr;
 
-    std::mutex mBufferLock;  // guards all operations relating to Buffer and BufferItems
-    std::condition_variable mProducerBufferFilled;  // guarded by mBufferLock
-    BufferItem mConsumerBufferItem;                 // guarded by mBufferLock
+    // Buffer storage, sized once by mCrD. Items swap pointers to these instead of the buffers.
+    BufferT mConsumerBuffer;
+    std::vector<BufferT> mProducerBuffers;
+
+    // guards all operations relating to Buffer and BufferItems
+    InstrumentedMutex mBufferLock{"BufferManager::mBufferLock"};
+    InstrumentedMutex::ConditionVariable mProducerBufferFilled;  // guarded by mBufferLock
+    DeliveryPolicy mPolicy;                                      // guarded by mBufferLock
+    BufferItem mConsumerBufferItem;                              // guarded by mBufferLock
     // Using a simple vector here as we don't expect to have more than 3-4 buffers in circulation
     // We have multiple producer buffers so that skews between other producers being used by the
     // producer side - eg: buffer from camera doesn't get blocked from getting encoded while
@@ -208,7 +302,16 @@ class BufferManager : public BufferConsumer, public BufferProducer {
     // producer buffer and 1 consumer buffer and there's a skew between camera frame production and
     // consumer (UVC gadget driver etc) frame consumption.
     std::vector<BufferItem> mProducerBufferItems;  // guarded by mBufferLock
+    DeliveryStats mDeliveryStats;                  // guarded by mBufferLock
+    PhaseController mPhaseController;              // guarded by mBufferLock
+    int mConsumerWakeFd = -1;                      // guarded by mBufferLock
+    // The last getFilledBufferAndSwap returned nullptr.
+    bool mConsumerStarved = false;  // guarded by mBufferLock
+    // Written with mBufferLock held, read without it.
+    SeqLock<DeliveryStats> mPublishedDeliveryStats;
 };
 
+using V4L2BufferManager = BufferManager<V4L2Buffer>;
+
 }  // namespace webcam
 }  // namespace android
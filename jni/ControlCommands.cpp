@@ -0,0 +1,301 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+
+#include "ControlCommands.h"
+
+#include <android-base/parsebool.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <inttypes.h>
+#include <log/log.h>
+#include <vector>
+
+#include "QuantTables.h"
+#include "Tunables.h"
+
+namespace android {
+namespace webcam {
+
+namespace {
+enum class Setting {
+    JPEG_QUALITY,
+    DCT,
+    QUANT_TABLES,
+    ENCODER_WORKERS,
+    FRAME_RATE_PERCENT,
+    ENCODER_CPUS,
+    DELIVERY_POLICY,
+    DELIVERY_DEPTH,
+    DELIVERY_MAX_AGE_MS,
+    PHASE_ALIGNMENT,
+};
+
+struct SettingDesc {
+    Setting setting;
+    const char* name;
+    const char* values;
+};
+
+// Names follow the properties of the same settings.
+constexpr SettingDesc kSettings[] = {
+        {Setting::JPEG_QUALITY, "jpeg_quality", "1-100"},
+        {Setting::DCT, "dct", "accurate | fast"},
+        {Setting::QUANT_TABLES, "quant_tables", "annex_k | webcam"},
+        {Setting::ENCODER_WORKERS, "encoder_workers", ">= 1"},
+        {Setting::FRAME_RATE_PERCENT, "frame_rate_percent", "1-100"},
+        {Setting::ENCODER_CPUS, "encoder_cpus", "cpu mask, 0 for the encoder profile's"},
+        {Setting::DELIVERY_POLICY, "delivery_policy", "latest | fifo | hybrid"},
+        {Setting::DELIVERY_DEPTH, "delivery_depth", ">= 1, fifo and hybrid"},
+        {Setting::DELIVERY_MAX_AGE_MS, "delivery_max_age_ms", ">= 1, hybrid"},
+        {Setting::PHASE_ALIGNMENT, "phase_alignment", "true | false, latest"},
+};
+
+const SettingDesc* findSetting(const std::string& name) {
+    for (const SettingDesc& desc : kSettings) {
+        if (name == desc.name) {
+            return &desc;
+        }
+    }
+    return nullptr;
+}
+
+bool isDeliverySetting(Setting setting) {
+    return setting == Setting::DELIVERY_POLICY || setting == Setting::DELIVERY_DEPTH ||
+           setting == Setting::DELIVERY_MAX_AGE_MS || setting == Setting::PHASE_ALIGNMENT;
+}
+
+bool parseDeliveryMode(const std::string& value, DeliveryMode* mode) {
+    for (DeliveryMode m : {DeliveryMode::LATEST, DeliveryMode::FIFO, DeliveryMode::HYBRID}) {
+        if (value == deliveryModeToString(m)) {
+            *mode = m;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool parseBool(const std::string& value, bool* result) {
+    switch (android::base::ParseBool(value)) {
+        case android::base::ParseBoolResult::kTrue:
+            *result = true;
+            return true;
+        case android::base::ParseBoolResult::kFalse:
+            *result = false;
+            return true;
+        default:
+            return false;
+    }
+}
+}  // anonymous namespace
+
+bool ControlCommands::processInput(std::string* input, std::string* out) {
+    size_t start = 0;
+    for (size_t end; (end = input->find('\n', start)) != std::string::npos; start = end + 1) {
+        runCommand(input->substr(start, end - start), out);
+    }
+    input->erase(0, start);
+    if (input->size() > kMaxCommandLength) {
+        *out += "error command too long\n";
+        return false;
+    }
+    return true;
+}
+
+void ControlCommands::runCommand(const std::string& line, std::string* out) {
+    std::vector<std::string> args = android::base::Tokenize(line, " \t\r");
+    if (args.empty()) {
+        return;
+    }
+    const std::string& command = args[0];
+    std::string error;
+    if (command == "get" && args.size() <= 2) {
+        if (args.size() == 2) {
+            if (findSetting(args[1]) == nullptr) {
+                error = "unknown setting " + args[1];
+            } else if (!get(args[1], out)) {
+                error = "no stream";
+            }
+        } else {
+            // Delivery settings are left out while there's no stream.
+            for (const SettingDesc& desc : kSettings) {
+                get(desc.name, out);
+            }
+        }
+    } else if (command == "set" && args.size() == 3) {
+        ALOGI("%s: %s", __FUNCTION__, line.c_str());
+        set(args[1], args[2], &error);
+    } else if (command == "reset" && args.size() == 1) {
+        ALOGI("%s: %s", __FUNCTION__, line.c_str());
+        Tunables::getInstance().resetToDefaults();
+        mListener->resetDeliveryPolicy();
+    } else if (command == "stats" && args.size() == 1) {
+        mListener->dumpStats(out);
+    } else if (command == "help" && args.size() == 1) {
+        *out += "get [<name>]\nset <name> <value>\nreset\nstats\nhelp\nsettings:\n";
+        for (const SettingDesc& desc : kSettings) {
+            android::base::StringAppendF(out, "  %s: %s\n", desc.name, desc.values);
+        }
+    } else {
+        error = "unknown command, try help";
+    }
+    *out += error.empty() ? "ok\n" : "error " + error + "\n";
+}
+
+bool ControlCommands::get(const std::string& name, std::string* out) {
+    const SettingDesc* desc = findSetting(name);
+    if (desc == nullptr) {
+        return false;
+    }
+    const Tunables& tunables = Tunables::getInstance();
+    DeliveryPolicy policy;
+    if (isDeliverySetting(desc->setting) && !mListener->getDeliveryPolicy(&policy)) {
+        return false;
+    }
+    switch (desc->setting) {
+        case Setting::JPEG_QUALITY:
+            android::base::StringAppendF(out, "%s %d\n", desc->name, tunables.getJpegQuality());
+            break;
+        case Setting::DCT:
+            android::base::StringAppendF(
+                    out, "%s %s\n", desc->name,
+                    tunables.getDctMethod() == JpegDctMethod::FAST ? "fast" : "accurate");
+            break;
+        case Setting::QUANT_TABLES:
+            android::base::StringAppendF(out, "%s %s\n", desc->name,
+                                         quantTablesToString(tunables.getQuantTables()));
+            break;
+        case Setting::ENCODER_WORKERS:
+            android::base::StringAppendF(out, "%s %u\n", desc->name,
+                                         tunables.getMaxEncoderWorkers());
+            break;
+        case Setting::FRAME_RATE_PERCENT:
+            android::base::StringAppendF(out, "%s %u\n", desc->name,
+                                         tunables.getFrameRatePercent());
+            break;
+        case Setting::ENCODER_CPUS:
+            android::base::StringAppendF(out, "%s 0x%" PRIx64 "\n", desc->name,
+                                         tunables.getEncoderCpuMask());
+            break;
+        case Setting::DELIVERY_POLICY:
+            android::base::StringAppendF(out, "%s %s\n", desc->name,
+                                         deliveryModeToString(policy.mode));
+            break;
+        case Setting::DELIVERY_DEPTH:
+            android::base::StringAppendF(out, "%s %u\n", desc->name, policy.maxDepth);
+            break;
+        case Setting::DELIVERY_MAX_AGE_MS:
+            android::base::StringAppendF(out, "%s %lld\n", desc->name,
+                                         static_cast<long long>(policy.maxAge.count()));
+            break;
+        case Setting::PHASE_ALIGNMENT:
+            android::base::StringAppendF(out, "%s %s\n", desc->name,
+                                         policy.alignPhase ? "true" : "false");
+            break;
+    }
+    return true;
+}
+
+bool ControlCommands::set(const std::string& name, const std::string& value, std::string* error) {
+    const SettingDesc* desc = findSetting(name);
+    if (desc == nullptr) {
+        *error = "unknown setting " + name;
+        return false;
+    }
+    Tunables& tunables = Tunables::getInstance();
+    DeliveryPolicy policy;
+    if (isDeliverySetting(desc->setting) && !mListener->getDeliveryPolicy(&policy)) {
+        *error = "no stream";
+        return false;
+    }
+    bool valid = false;
+    switch (desc->setting) {
+        case Setting::JPEG_QUALITY: {
+            int32_t quality = 0;
+            if ((valid = android::base::ParseInt(value, &quality, 1, 100))) {
+                tunables.setJpegQuality(quality);
+            }
+            break;
+        }
+        case Setting::DCT:
+            if ((valid = value == "accurate" || value == "fast")) {
+                tunables.setDctMethod(value == "fast" ? JpegDctMethod::FAST
+                                                      : JpegDctMethod::ACCURATE);
+            }
+            break;
+        case Setting::QUANT_TABLES: {
+            JpegQuantTables tables = JpegQuantTables::ANNEX_K;
+            if ((valid = parseQuantTables(value, &tables))) {
+                tunables.setQuantTables(tables);
+            }
+            break;
+        }
+        case Setting::ENCODER_WORKERS: {
+            uint32_t workers = 0;
+            if ((valid = android::base::ParseUint(value, &workers) && workers >= 1)) {
+                tunables.setMaxEncoderWorkers(workers);
+            }
+            break;
+        }
+        case Setting::FRAME_RATE_PERCENT: {
+            uint32_t percent = 0;
+            if ((valid = android::base::ParseUint(value, &percent,
+                                                  Tunables::kFullFrameRatePercent) &&
+                         percent >= 1)) {
+                tunables.setFrameRatePercent(percent);
+            }
+            break;
+        }
+        case Setting::ENCODER_CPUS: {
+            uint64_t cpuMask = 0;
+            if ((valid = android::base::ParseUint(value, &cpuMask))) {
+                tunables.setEncoderCpuMask(cpuMask);
+            }
+            break;
+        }
+        case Setting::DELIVERY_POLICY:
+            valid = parseDeliveryMode(value, &policy.mode);
+            break;
+        case Setting::DELIVERY_DEPTH:
+            valid = android::base::ParseUint(value, &policy.maxDepth) && policy.maxDepth >= 1;
+            break;
+        case Setting::DELIVERY_MAX_AGE_MS: {
+            uint32_t maxAgeMs = 0;
+            if ((valid = android::base::ParseUint(value, &maxAgeMs) && maxAgeMs >= 1)) {
+                policy.maxAge = std::chrono::milliseconds(maxAgeMs);
+            }
+            break;
+        }
+        case Setting::PHASE_ALIGNMENT:
+            valid = parseBool(value, &policy.alignPhase);
+            break;
+    }
+    if (!valid) {
+        *error = android::base::StringPrintf("invalid value %s for %s, expected %s",
+                                             value.c_str(), desc->name, desc->values);
+        return false;
+    }
+    if (isDeliverySetting(desc->setting) && !mListener->setDeliveryPolicy(policy)) {
+        *error = "no stream";
+        return false;
+    }
+    return true;
+}
+
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+
+#include "Buffer.h"
+
+namespace android {
+namespace webcam {
+
+// Parses and runs the ControlSocket's commands (see ControlSocket.h for the protocol), apart from
+// the socket I/O. Not thread safe, the caller serializes commands.
+class ControlCommands {
+  public:
+    static constexpr size_t kMaxCommandLength = 256;
+
+    // Settings and stats that belong to the stream rather than to Tunables.
+    class Listener {
+      public:
+        virtual ~Listener() = default;
+        // Returns false if there is no stream.
+        virtual bool getDeliveryPolicy(DeliveryPolicy* policy) = 0;
+        virtual bool setDeliveryPolicy(const DeliveryPolicy& policy) = 0;
+        // Goes back to the default delivery policy for the stream's configuration.
+        virtual void resetDeliveryPolicy() = 0;
+        // Appends "<name> <value>" lines.
+        virtual void dumpStats(std::string* out) = 0;
+    };
+
+    // listener must outlive the ControlCommands.
+    explicit ControlCommands(Listener* listener) : mListener(listener) {}
+
+    // Runs the complete lines of input and erases them from it, replies are appended to out.
+    // Returns false if the rest is longer than a command may be, the client is dropped then.
+    bool processInput(std::string* input, std::string* out);
+    // Runs one command line, the reply is appended to out.
+    void runCommand(const std::string& line, std::string* out);
+
+  private:
+    bool get(const std::string& name, std::string* out);
+    bool set(const std::string& name, const std::string& value, std::string* error);
+
+    Listener* mListener = nullptr;
+};
+
+}  // namespace webcam
+}  // namespace android
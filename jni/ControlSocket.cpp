@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+
+#include "ControlSocket.h"
+
+#include <android-base/properties.h>
+#include <errno.h>
+#include <log/log.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "AllocationCheck.h"
+
+namespace android {
+namespace webcam {
+
+namespace {
+constexpr uid_t kRootUid = 0;
+constexpr uid_t kShellUid = 2000;  // AID_SHELL
+}  // anonymous namespace
+
+bool ControlSocket::isEnabled() {
+    return android::base::GetBoolProperty(kEnableProperty, /*default_value*/ false);
+}
+
+Status ControlSocket::init() {
+    mEpollFd.reset(epoll_create1(EPOLL_CLOEXEC));
+    if (mEpollFd.get() < 0) {
+        ALOGE("%s: epoll_create1 failed: %s", __FUNCTION__, strerror(errno));
+        return Status::ERROR;
+    }
+    mListenFd.reset(socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, /*protocol*/ 0));
+    if (mListenFd.get() < 0) {
+        ALOGE("%s: socket failed: %s", __FUNCTION__, strerror(errno));
+        return Status::ERROR;
+    }
+    // Abstract namespace: sun_path starts with a 0 and isn't 0 terminated.
+    struct sockaddr_un addr {};
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path + 1, kSocketName, sizeof(kSocketName) - 1);
+    auto addrLen = static_cast<socklen_t>(offsetof(struct sockaddr_un, sun_path) + 1 +
+                                          sizeof(kSocketName) - 1);
+    if (bind(mListenFd.get(), reinterpret_cast<struct sockaddr*>(&addr), addrLen) != 0 ||
+        listen(mListenFd.get(), kMaxClients) != 0) {
+        ALOGE("%s: Unable to listen on @%s: %s", __FUNCTION__, kSocketName, strerror(errno));
+        mListenFd.reset();
+        return Status::ERROR;
+    }
+    struct epoll_event event {};
+    event.events = EPOLLIN;
+    event.data.fd = mListenFd.get();
+    if (epoll_ctl(mEpollFd.get(), EPOLL_CTL_ADD, mListenFd.get(), &event) != 0) {
+        ALOGE("%s: epoll_ctl failed: %s", __FUNCTION__, strerror(errno));
+        return Status::ERROR;
+    }
+    ALOGI("%s: Listening on @%s", __FUNCTION__, kSocketName);
+    return Status::OK;
+}
+
+void ControlSocket::processEvents() {
+    // Commands are rare and run between frames, they may allocate.
+    ScopedFramePathAllocationsAllowed allowAllocations;
+    struct epoll_event events[kMaxClients + 1];
+    int count = epoll_wait(mEpollFd.get(), events, kMaxClients + 1, /*timeout*/ 0);
+    for (int i = 0; i < count; i++) {
+        int fd = events[i].data.fd;
+        if (fd == mListenFd.get()) {
+            acceptClient();
+            continue;
+        }
+        for (Client& client : mClients) {
+            if (client.fd.get() == fd) {
+                if (!readClient(client)) {
+                    closeClient(client);
+                }
+                break;
+            }
+        }
+    }
+}
+
+void ControlSocket::acceptClient() {
+    android::base::unique_fd fd(accept4(mListenFd.get(), /*addr*/ nullptr,
+                                        /*addrlen*/ nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC));
+    if (fd.get() < 0) {
+        ALOGW("%s: accept4 failed: %s", __FUNCTION__, strerror(errno));
+        return;
+    }
+    struct ucred cred {};
+    socklen_t credLen = sizeof(cred);
+    if (getsockopt(fd.get(), SOL_SOCKET, SO_PEERCRED, &cred, &credLen) != 0) {
+        ALOGW("%s: Unable to get peer credentials: %s", __FUNCTION__, strerror(errno));
+        return;
+    }
+    if (cred.uid != kRootUid && cred.uid != kShellUid && cred.uid != getuid()) {
+        ALOGW("%s: Rejecting uid %u pid %d", __FUNCTION__, cred.uid, cred.pid);
+        return;
+    }
+    for (Client& client : mClients) {
+        if (client.fd.get() >= 0) {
+            continue;
+        }
+        struct epoll_event event {};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = fd.get();
+        if (epoll_ctl(mEpollFd.get(), EPOLL_CTL_ADD, fd.get(), &event) != 0) {
+            ALOGW("%s: epoll_ctl failed: %s", __FUNCTION__, strerror(errno));
+            return;
+        }
+        ALOGI("%s: Client uid %u pid %d connected", __FUNCTION__, cred.uid, cred.pid);
+        client.fd = std::move(fd);
+        client.pending.clear();
+        return;
+    }
+    ALOGW("%s: Rejecting pid %d, %zu clients connected already", __FUNCTION__, cred.pid,
+          kMaxClients);
+}
+
+bool ControlSocket::readClient(Client& client) {
+    char buf[kMaxCommandLength];
+    bool open = true;
+    while (true) {
+        ssize_t n = recv(client.fd.get(), buf, sizeof(buf), MSG_DONTWAIT);
+        if (n > 0) {
+            client.pending.append(buf, n);
+            if (client.pending.size() <= 2 * kMaxCommandLength) {
+                continue;
+            }
+            // Replies are sent as commands come in, no need to read further than a few commands.
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            open = false;
+        }
+        break;
+    }
+
+    std::string reply;
+    if (!mCommands.processInput(&client.pending, &reply)) {
+        open = false;
+    }
+    if (!reply.empty()) {
+        // Replies are small, a client that doesn't read them is dropped.
+        ssize_t sent = send(client.fd.get(), reply.data(), reply.size(),
+                            MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent != static_cast<ssize_t>(reply.size())) {
+            ALOGW("%s: Dropping client, reply not sent: %s", __FUNCTION__,
+                  sent < 0 ? strerror(errno) : "short write");
+            open = false;
+        }
+    }
+    return open;
+}
+
+void ControlSocket::closeClient(Client& client) {
+    // Closing the fd takes it out of the epoll set.
+    client.fd.reset();
+    client.pending.clear();
+}
+
+}  // namespace webcam
+}  // namespace android
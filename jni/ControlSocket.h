@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *  Local control endpoint to read stats and change the frame path's settings on a running stream,
+ *  for A/B testing performance settings without rebuilding.
+ */
+#pragma once
+
+#include <android-base/unique_fd.h>
+#include <array>
+#include <string>
+
+#include "ControlCommands.h"
+#include "Utils.h"
+
+namespace android {
+namespace webcam {
+
+// Abstract UNIX stream socket taking one command per line, enabled by kEnableProperty. Reachable
+// by root, shell and the service's own uid, eg:
+//   adb forward tcp:5555 localabstract:deviceaswebcam_control && nc localhost 5555
+//
+// Commands:
+//   get [<name>]        prints "<name> <value>" for one or all settings
+//   set <name> <value>  changes a setting
+//   reset               back to the stream's defaults
+//   stats               prints the stats of the current stream
+//   help                lists commands and settings
+// Every reply ends with a line that is either "ok" or "error <reason>".
+//
+// Settings last until the next STREAMON, which starts over from the encoder profile and the
+// properties. Controllers (eg: ThermalController) may overwrite them when their state changes.
+// Delivery settings are the exception: they belong to the stream configuration (format, size and
+// rate) and apply again whenever it streams.
+//
+// Not thread safe, driven by the thread calling processEvents (the UVC thread), which is also the
+// thread the Listener is called on. Changes are picked up by the frame path at frame boundaries.
+class ControlSocket {
+  public:
+    static constexpr char kEnableProperty[] = "debug.deviceaswebcam.control_socket";
+    static constexpr char kSocketName[] = "deviceaswebcam_control";
+    static constexpr size_t kMaxClients = 4;
+    static constexpr size_t kMaxCommandLength = ControlCommands::kMaxCommandLength;
+
+    using Listener = ControlCommands::Listener;
+
+    // listener must outlive the ControlSocket.
+    explicit ControlSocket(Listener* listener) : mCommands(listener) {}
+
+    [[nodiscard]] static bool isEnabled();
+
+    Status init();
+    // Becomes readable when processEvents has work to do.
+    [[nodiscard]] int getFd() const { return mEpollFd.get(); }
+    // Accepts connections and runs the commands that came in, without blocking.
+    void processEvents();
+
+  private:
+    struct Client {
+        android::base::unique_fd fd;
+        std::string pending;  // received, up to the next newline
+    };
+
+    void acceptClient();
+    // Returns false if the client is gone.
+    bool readClient(Client& client);
+    void closeClient(Client& client);
+
+    ControlCommands mCommands;
+    android::base::unique_fd mEpollFd;
+    android::base::unique_fd mListenFd;
+    std::array<Client, kMaxClients> mClients;
+};
+
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+
+#include "ConversionPlanner.h"
+
+#include <linux/videodev2.h>
+#include <log/log.h>
+#include <algorithm>
+
+#include "AllocationCheck.h"
+#include "EncoderArena.h"
+#include "JpegUtils.h"
+
+namespace android {
+namespace webcam {
+
+namespace {
+// libjpeg can scale by 1/2, 1/4 and 1/8 while decoding.
+constexpr uint32_t kMaxJpegDecodeScaleDenom = 8;
+
+// Rough ns / pixel figures for a mid range arm64 core, only used until the encoder benchmark has
+// measured the real ones.
+constexpr std::array<double, kConversionKernelCount> kDefaultCosts = {
+        0.35,  // ANDROID420_TO_I420
+        0.60,  // ANDROID420_TO_I420_ROTATE_180
+        0.90,  // ARGB_TO_I420
+        1.00,  // ARGB_TO_YUY2
+        0.40,  // I420_TO_YUY2
+        0.50,  // I420_ROTATE_180
+        1.20,  // I420_SCALE
+        6.00,  // I420_TO_JPEG
+        0.02,  // JPEG_PASSTHROUGH
+        3.00,  // JPEG_TO_I420
+        3.50,  // JPEG_CROP
+        8.00,  // JPEG_DOWNSCALE
+};
+
+const char* bufferToString(PlanBuffer buffer) {
+    switch (buffer) {
+        case PlanBuffer::SOURCE:
+            return "src";
+        case PlanBuffer::SCRATCH_0:
+            return "scratch0";
+        case PlanBuffer::SCRATCH_1:
+            return "scratch1";
+        case PlanBuffer::DESTINATION:
+            return "dst";
+    }
+    return "unknown";
+}
+}  // anonymous namespace
+
+const char* kernelToString(ConversionKernel kernel) {
+    switch (kernel) {
+        case ConversionKernel::ANDROID420_TO_I420:
+            return "Android420ToI420";
+        case ConversionKernel::ANDROID420_TO_I420_ROTATE_180:
+            return "Android420ToI420Rotate180";
+        case ConversionKernel::ARGB_TO_I420:
+            return "ARGBToI420";
+        case ConversionKernel::ARGB_TO_YUY2:
+            return "ARGBToYUY2";
+        case ConversionKernel::I420_TO_YUY2:
+            return "I420ToYUY2";
+        case ConversionKernel::I420_ROTATE_180:
+            return "I420Rotate180";
+        case ConversionKernel::I420_SCALE:
+            return "I420Scale";
+        case ConversionKernel::I420_TO_JPEG:
+            return "I420ToJpeg";
+        case ConversionKernel::JPEG_PASSTHROUGH:
+            return "JpegPassthrough";
+        case ConversionKernel::JPEG_TO_I420:
+            return "JpegToI420";
+        case ConversionKernel::JPEG_CROP:
+            return "JpegCrop";
+        case ConversionKernel::JPEG_DOWNSCALE:
+            return "JpegDownscale";
+        case ConversionKernel::COUNT:
+            break;
+    }
+    return "unknown";
+}
+
+KernelCostTable& KernelCostTable::getInstance() {
+    static KernelCostTable sInstance;
+    return sInstance;
+}
+
+KernelCostTable::KernelCostTable() {
+    resetToDefaults();
+}
+
+double KernelCostTable::getCost(ConversionKernel kernel) const {
+    return mCosts[static_cast<size_t>(kernel)].load(std::memory_order_relaxed);
+}
+
+void KernelCostTable::setCost(ConversionKernel kernel, double nsPerPixel) {
+    if (kernel == ConversionKernel::COUNT || nsPerPixel <= 0) {
+        ALOGE("%s: Invalid cost %f for kernel %s", __FUNCTION__, nsPerPixel,
+              kernelToString(kernel));
+        return;
+    }
+    mCosts[static_cast<size_t>(kernel)].store(nsPerPixel, std::memory_order_relaxed);
+}
+
+void KernelCostTable::resetToDefaults() {
+    for (size_t i = 0; i < kConversionKernelCount; i++) {
+        mCosts[i].store(kDefaultCosts[i], std::memory_order_relaxed);
+    }
+}
+
+std::string ConversionPlan::toString() const {
+    std::string ret;
+    for (size_t i = 0; i < numSteps; i++) {
+        const ConversionStep& step = steps[i];
+        if (i != 0) {
+            ret += " -> ";
+        }
+        ret += std::string(kernelToString(step.kernel)) + "(" + bufferToString(step.input) + ":" +
+               bufferToString(step.output) + " " + std::to_string(step.outWidth) + "x" +
+               std::to_string(step.outHeight) + ")";
+    }
+    ret += " est " + std::to_string(static_cast<int64_t>(estimatedCostNs / 1000)) + "us";
+    return ret;
+}
+
+ConversionPlanner::ConversionPlanner(uint32_t scratchWidth, uint32_t scratchHeight)
+    : mScratchWidth(scratchWidth), mScratchHeight(scratchHeight) {
+    mPlans.reserve(kMaxCachedPlans);
+}
+
+void ConversionPlanner::setScratchSize(uint32_t scratchWidth, uint32_t scratchHeight) {
+    mScratchWidth = scratchWidth;
+    mScratchHeight = scratchHeight;
+    mPlans.clear();
+    mOldestPlan = 0;
+}
+
+const ConversionPlan* ConversionPlanner::getPlan(const ConversionKey& key) {
+    for (const auto& [cachedKey, plan] : mPlans) {
+        if (cachedKey == key) {
+            return plan.numSteps == 0 ? nullptr : &plan;
+        }
+    }
+
+    ConversionPlan best;
+    if (key.rotationDegrees != 0 && key.rotationDegrees != 180) {
+        ALOGE("%s: Rotation by %u degrees is not supported", __FUNCTION__, key.rotationDegrees);
+    } else {
+        State state{};
+        switch (key.layout) {
+            case SourceLayout::ARGB:
+                state.representation = Representation::SRC_ARGB;
+                break;
+            case SourceLayout::YUV420_PLANAR:
+                state.representation = Representation::SRC_I420;
+                break;
+            case SourceLayout::YUV420_SEMI_PLANAR:
+                state.representation = Representation::SRC_ANDROID420;
+                break;
+            case SourceLayout::JPEG:
+                state.representation = Representation::SRC_JPEG;
+                break;
+        }
+        state.buffer = PlanBuffer::SOURCE;
+        state.width = key.srcWidth;
+        state.height = key.srcHeight;
+        state.rotated = false;
+        ConversionPlan current;
+        search(key, state, current, best);
+    }
+
+    // Failed plans are cached as well, so that a bad stream doesn't search (and log) every frame.
+    std::pair<ConversionKey, ConversionPlan>* entry;
+    if (mPlans.size() < kMaxCachedPlans) {
+        entry = &mPlans.emplace_back(key, best);
+    } else {
+        entry = &mPlans[mOldestPlan];
+        *entry = {key, best};
+        mOldestPlan = (mOldestPlan + 1) % kMaxCachedPlans;
+    }
+    if (best.numSteps == 0) {
+        ALOGE("%s: No conversion from layout %u %ux%u to fourcc %u %ux%u rotation %u",
+              __FUNCTION__, static_cast<uint32_t>(key.layout), key.srcWidth, key.srcHeight,
+              key.dstFourcc, key.dstWidth, key.dstHeight, key.rotationDegrees);
+        return nullptr;
+    }
+    // Once per key, the log line may allocate.
+    ScopedFramePathAllocationsAllowed allowed;
+    ALOGI("%s: Planned %s", __FUNCTION__, best.toString().c_str());
+    return &entry->second;
+}
+
+bool ConversionPlanner::fitsScratch(uint32_t width, uint32_t height) const {
+    // Scratch images are laid out with padded strides, compare the padded sizes.
+    return static_cast<uint64_t>(EncoderArena::getScratchLumaStride(width)) *
+                   EncoderArena::getScratchLumaRows(height) <=
+           static_cast<uint64_t>(EncoderArena::getScratchLumaStride(mScratchWidth)) *
+                   EncoderArena::getScratchLumaRows(mScratchHeight);
+}
+
+void ConversionPlanner::search(const ConversionKey& key, const State& state,
+                               const ConversionPlan& current, ConversionPlan& best) const {
+    bool needsRotation = key.rotationDegrees == 180 && !state.rotated;
+    bool needsScale = state.width != key.dstWidth || state.height != key.dstHeight;
+    bool finalStep = !needsRotation && !needsScale;
+    uint32_t w = state.width;
+    uint32_t h = state.height;
+
+    switch (state.representation) {
+        case Representation::SRC_ARGB:
+            tryStep(key, state, ConversionKernel::ARGB_TO_I420, Representation::I420, w, h,
+                    state.rotated, current, best);
+            if (finalStep && key.dstFourcc == V4L2_PIX_FMT_YUYV) {
+                tryStep(key, state, ConversionKernel::ARGB_TO_YUY2, Representation::YUY2, w, h,
+                        state.rotated, current, best);
+            }
+            return;
+        case Representation::SRC_ANDROID420:
+        case Representation::SRC_I420:
+            tryStep(key, state, ConversionKernel::ANDROID420_TO_I420, Representation::I420, w, h,
+                    state.rotated, current, best);
+            if (needsRotation) {
+                tryStep(key, state, ConversionKernel::ANDROID420_TO_I420_ROTATE_180,
+                        Representation::I420, w, h, /*rotated*/ true, current, best);
+            }
+            if (state.representation == Representation::SRC_ANDROID420) {
+                return;
+            }
+            break;
+        case Representation::SRC_JPEG:
+            // The camera's JPEG goes out untouched if it matches the stream, or cropped,
+            // downscaled and rotated in the DCT domain. Otherwise it is decoded (downscaled by
+            // the IDCT if it is larger than the stream) and takes the software path.
+            if (finalStep && key.dstFourcc == V4L2_PIX_FMT_MJPEG) {
+                tryStep(key, state, ConversionKernel::JPEG_PASSTHROUGH, Representation::JPEG, w,
+                        h, state.rotated, current, best);
+            }
+            if (!finalStep && key.dstFourcc == V4L2_PIX_FMT_MJPEG) {
+                JpegTransform transform;
+                if (planJpegTransform(w, h, key.dstWidth, key.dstHeight, needsRotation,
+                                      &transform)) {
+                    // Cropping only copies coefficients, downscaling transforms every block.
+                    tryStep(key, state,
+                            transform.scaleDenom == 1 ? ConversionKernel::JPEG_CROP
+                                                      : ConversionKernel::JPEG_DOWNSCALE,
+                            Representation::JPEG, key.dstWidth, key.dstHeight,
+                            state.rotated || needsRotation, current, best);
+                }
+            }
+            for (uint32_t scaleDenom = 1; scaleDenom <= kMaxJpegDecodeScaleDenom;
+                 scaleDenom *= 2) {
+                uint32_t scaledWidth = (w + scaleDenom - 1) / scaleDenom;
+                uint32_t scaledHeight = (h + scaleDenom - 1) / scaleDenom;
+                if (scaleDenom != 1 && (scaledWidth < key.dstWidth ||
+                                        scaledHeight < key.dstHeight)) {
+                    break;
+                }
+                tryStep(key, state, ConversionKernel::JPEG_TO_I420, Representation::I420,
+                        scaledWidth, scaledHeight, state.rotated, current, best);
+            }
+            return;
+        case Representation::I420:
+            break;
+        case Representation::YUY2:
+        case Representation::JPEG:
+            return;
+    }
+
+    // I420 kernels, for scratch buffers and planar sources alike.
+    if (needsRotation) {
+        tryStep(key, state, ConversionKernel::I420_ROTATE_180, Representation::I420, w, h,
+                /*rotated*/ true, current, best);
+    }
+    if (needsScale) {
+        tryStep(key, state, ConversionKernel::I420_SCALE, Representation::I420, key.dstWidth,
+                key.dstHeight, state.rotated, current, best);
+    }
+    if (finalStep) {
+        if (key.dstFourcc == V4L2_PIX_FMT_YUYV) {
+            tryStep(key, state, ConversionKernel::I420_TO_YUY2, Representation::YUY2, w, h,
+                    state.rotated, current, best);
+        } else if (key.dstFourcc == V4L2_PIX_FMT_MJPEG) {
+            tryStep(key, state, ConversionKernel::I420_TO_JPEG, Representation::JPEG, w, h,
+                    state.rotated, current, best);
+        }
+    }
+}
+
+bool ConversionPlanner::tryStep(const ConversionKey& key, const State& state,
+                                ConversionKernel kernel, Representation outRepresentation,
+                                uint32_t outWidth, uint32_t outHeight, bool rotated,
+                                const ConversionPlan& current, ConversionPlan& best) const {
+    if (current.numSteps == ConversionPlan::kMaxSteps) {
+        return false;
+    }
+    bool terminal =
+            outRepresentation == Representation::YUY2 || outRepresentation == Representation::JPEG;
+    PlanBuffer output = PlanBuffer::DESTINATION;
+    if (!terminal) {
+        // Ping-pong between the two scratch buffers.
+        output = state.buffer == PlanBuffer::SCRATCH_0 ? PlanBuffer::SCRATCH_1
+                                                       : PlanBuffer::SCRATCH_0;
+        if (!fitsScratch(outWidth, outHeight)) {
+            return false;
+        }
+    }
+
+    uint64_t pixels = std::max(static_cast<uint64_t>(state.width) * state.height,
+                               static_cast<uint64_t>(outWidth) * outHeight);
+    double cost = current.estimatedCostNs +
+                  KernelCostTable::getInstance().getCost(kernel) * static_cast<double>(pixels);
+    if (best.numSteps != 0 && cost >= best.estimatedCostNs) {
+        return false;
+    }
+
+    ConversionPlan next = current;
+    next.steps[next.numSteps++] = {kernel, state.buffer, output, outWidth, outHeight};
+    next.estimatedCostNs = cost;
+    if (terminal) {
+        best = next;
+        return true;
+    }
+    State nextState{outRepresentation, output, outWidth, outHeight, rotated};
+    search(key, nextState, next, best);
+    return true;
+}
+
+}  // namespace webcam
+}  // namespace android
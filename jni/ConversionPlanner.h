@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace android {
+namespace webcam {
+
+// Conversion kernels the Encoder knows how to run. Every kernel reads one buffer and writes one.
+enum class ConversionKernel : uint32_t {
+    ANDROID420_TO_I420 = 0,
+    ANDROID420_TO_I420_ROTATE_180,
+    ARGB_TO_I420,
+    ARGB_TO_YUY2,
+    I420_TO_YUY2,
+    I420_ROTATE_180,
+    I420_SCALE,
+    I420_TO_JPEG,
+    JPEG_PASSTHROUGH,
+    JPEG_TO_I420,
+    JPEG_CROP,
+    JPEG_DOWNSCALE,
+    COUNT,
+};
+
+constexpr size_t kConversionKernelCount = static_cast<size_t>(ConversionKernel::COUNT);
+
+const char* kernelToString(ConversionKernel kernel);
+
+// Estimated cost of each kernel, in ns per pixel processed (the larger of the input and output
+// pixel counts). Starts out with rough defaults, the encoder benchmark replaces them with values
+// measured on the device. Shared by all planners in the process.
+class KernelCostTable {
+  public:
+    static KernelCostTable& getInstance();
+
+    [[nodiscard]] double getCost(ConversionKernel kernel) const;
+    void setCost(ConversionKernel kernel, double nsPerPixel);
+    void resetToDefaults();
+
+  private:
+    KernelCostTable();
+    std::array<std::atomic<double>, kConversionKernelCount> mCosts;
+};
+
+enum class SourceLayout : uint32_t {
+    ARGB = 0,
+    YUV420_PLANAR,       // Android YUV_420_888 with a chroma pixel stride of 1, usable as I420
+    YUV420_SEMI_PLANAR,  // Android YUV_420_888 with interleaved chroma
+    JPEG,                // the camera's own JPEG (BLOB) output
+};
+
+struct ConversionKey {
+    SourceLayout layout = SourceLayout::YUV420_SEMI_PLANAR;
+    uint32_t srcWidth = 0;
+    uint32_t srcHeight = 0;
+    uint32_t dstFourcc = 0;
+    uint32_t dstWidth = 0;
+    uint32_t dstHeight = 0;
+    uint32_t rotationDegrees = 0;
+
+    bool operator==(const ConversionKey& other) const {
+        return layout == other.layout && srcWidth == other.srcWidth &&
+               srcHeight == other.srcHeight && dstFourcc == other.dstFourcc &&
+               dstWidth == other.dstWidth && dstHeight == other.dstHeight &&
+               rotationDegrees == other.rotationDegrees;
+    }
+};
+
+// Buffers a ConversionStep can read from or write to. SCRATCH_0 and SCRATCH_1 are I420 buffers
+// owned by the Encoder.
+enum class PlanBuffer : uint32_t {
+    SOURCE = 0,
+    SCRATCH_0,
+    SCRATCH_1,
+    DESTINATION,
+};
+
+struct ConversionStep {
+    ConversionKernel kernel = ConversionKernel::COUNT;
+    PlanBuffer input = PlanBuffer::SOURCE;
+    PlanBuffer output = PlanBuffer::DESTINATION;
+    // Size of the image written by this step.
+    uint32_t outWidth = 0;
+    uint32_t outHeight = 0;
+};
+
+struct ConversionPlan {
+    static constexpr size_t kMaxSteps = 4;
+    std::array<ConversionStep, kMaxSteps> steps;
+    size_t numSteps = 0;
+    double estimatedCostNs = 0;
+
+    [[nodiscard]] std::string toString() const;
+};
+
+// Picks the cheapest sequence of ConversionKernels that turns a source image into the destination
+// format, according to the KernelCostTable. Plans are computed on the first frame of each
+// ConversionKey and cached, so a stream only pays for planning once.
+class ConversionPlanner {
+  public:
+    // Plans kept at most. Only a handful of keys are seen over a stream's lifetime, more replace
+    // the oldest plan.
+    static constexpr size_t kMaxCachedPlans = 8;
+
+    // Intermediate I420 images must fit in scratch buffers of scratchWidth x scratchHeight.
+    ConversionPlanner(uint32_t scratchWidth, uint32_t scratchHeight);
+
+    // Changes the size of the scratch buffers, dropping the plans made for the previous size.
+    void setScratchSize(uint32_t scratchWidth, uint32_t scratchHeight);
+    // Returns nullptr if no sequence of kernels converts the source described by key. The plan
+    // stays valid until the next call.
+    const ConversionPlan* getPlan(const ConversionKey& key);
+
+  private:
+    enum class Representation {
+        SRC_ARGB,
+        SRC_ANDROID420,
+        SRC_I420,  // planar source, readable directly by the I420 kernels
+        SRC_JPEG,
+        I420,
+        YUY2,
+        JPEG,
+    };
+
+    struct State {
+        Representation representation;
+        PlanBuffer buffer;
+        uint32_t width;
+        uint32_t height;
+        bool rotated;
+    };
+
+    void search(const ConversionKey& key, const State& state, const ConversionPlan& current,
+                ConversionPlan& best) const;
+    bool tryStep(const ConversionKey& key, const State& state, ConversionKernel kernel,
+                 Representation outRepresentation, uint32_t outWidth, uint32_t outHeight,
+                 bool rotated, const ConversionPlan& current, ConversionPlan& best) const;
+    [[nodiscard]] bool fitsScratch(uint32_t width, uint32_t height) const;
+
+    uint32_t mScratchWidth = 0;
+    uint32_t mScratchHeight = 0;
+    // Reserved up front so that planning doesn't allocate on the frame path. Linear scan.
+    std::vector<std::pair<ConversionKey, ConversionPlan>> mPlans;
+    size_t mOldestPlan = 0;  // replaced next once mPlans is full
+};
+
+}  // namespace webcam
+}  // namespace android
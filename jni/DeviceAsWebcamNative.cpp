@@ -60,13 +60,15 @@ static inline jmethodID GetMethodIdOrDie(JNIEnv* env, jclass clazz, const char*
 }
 
 const JNINativeMethod DeviceAsWebcamNative::sMethods[] = {
-        {"setupServicesAndStartListeningNative", "([Ljava/lang/String;)I",
+        {"setupServicesAndStartListeningNative", "([Ljava/lang/String;Ljava/lang/String;I)I",
          (void*)com_android_DeviceAsWebcam_setupServicesAndStartListening},
         {"nativeOnDestroy", "()V", (void*)com_android_DeviceAsWebcam_onDestroy},
         {"shouldStartServiceNative", "([Ljava/lang/String;)Z",
          (void*)com_android_DeviceAsWebcam_shouldStartService},
         {"nativeEncodeImage", "(Landroid/hardware/HardwareBuffer;JI)I",
          (void*)com_android_DeviceAsWebcam_encodeImage},
+        {"nativeSetPreviewSurface", "(Landroid/view/Surface;)Z",
+         (void*)com_android_DeviceAsWebcam_setPreviewSurface},
 };
 
 int DeviceAsWebcamNative::registerJNIMethods(JNIEnv* e, JavaVM* jvm) {
@@ -96,9 +98,9 @@ jint DeviceAsWebcamNative::com_android_DeviceAsWebcam_encodeImage(JNIEnv* env, j
 }
 
 jint DeviceAsWebcamNative::com_android_DeviceAsWebcam_setupServicesAndStartListening(
-        JNIEnv* env, jobject thiz, jobjectArray jIgnoredNodes) {
-    return DeviceAsWebcamServiceManager::kInstance->setupServicesAndStartListening(env, thiz,
-                                                                                   jIgnoredNodes);
+        JNIEnv* env, jobject thiz, jobjectArray jIgnoredNodes, jstring jProfileDir, jint maxFps) {
+    return DeviceAsWebcamServiceManager::kInstance->setupServicesAndStartListening(
+            env, thiz, jIgnoredNodes, jProfileDir, maxFps);
 }
 
 jboolean DeviceAsWebcamNative::com_android_DeviceAsWebcam_shouldStartService(
@@ -110,6 +112,12 @@ void DeviceAsWebcamNative::com_android_DeviceAsWebcam_onDestroy(JNIEnv*, jobject
     DeviceAsWebcamServiceManager::kInstance->onDestroy();
 }
 
+jboolean DeviceAsWebcamNative::com_android_DeviceAsWebcam_setPreviewSurface(
+        JNIEnv* env, jobject, jobject surface) {
+    return DeviceAsWebcamServiceManager::kInstance->setPreviewSurface(env, surface) ? JNI_TRUE
+                                                                                  : JNI_FALSE;
+}
+
 void DeviceAsWebcamNative::setStreamConfig(jobject thiz, bool mjpeg, uint32_t width,
                                            uint32_t height, uint32_t fps) {
     JNIEnv* env = getJNIEnvOrAbort();
@@ -45,9 +45,12 @@ class DeviceAsWebcamNative {
                                                        jobject hardwareBuffer, jlong timestamp,
                                                        jint rotation);
     static jint com_android_DeviceAsWebcam_setupServicesAndStartListening(JNIEnv*, jobject,
-                                                                          jobjectArray);
+                                                                          jobjectArray, jstring,
+                                                                          jint);
     static jboolean com_android_DeviceAsWebcam_shouldStartService(JNIEnv*, jclass, jobjectArray);
     static void com_android_DeviceAsWebcam_onDestroy(JNIEnv*, jobject);
+    static jboolean com_android_DeviceAsWebcam_setPreviewSurface(JNIEnv* env, jobject thiz,
+                                                                 jobject surface);
 
     // Methods that call back into java code. The method signatures match their java counterparts
     // All threads calling these functions must be bound to kJVM and pass their JNIEnv to
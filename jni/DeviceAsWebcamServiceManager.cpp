@@ -16,8 +16,11 @@
 
 #include "DeviceAsWebcamServiceManager.h"
 #include <DeviceAsWebcamNative.h>
+#include <EncoderProfile.h>
+#include <PreviewSink.h>
 #include <UVCProvider.h>
 #include <android/hardware_buffer_jni.h>
+#include <android/native_window_jni.h>
 #include <log/log.h>
 #include <unordered_set>
 
@@ -53,7 +56,7 @@ DeviceAsWebcamServiceManager* DeviceAsWebcamServiceManager::kInstance =
 
 bool DeviceAsWebcamServiceManager::shouldStartService(jobjectArray jIgnoredNodes) {
     ALOGV("%s", __FUNCTION__);
-    std::lock_guard<std::mutex> l(mSerializationLock);
+    std::lock_guard<InstrumentedMutex> l(mSerializationLock);
     if (mServiceRunning) {
         ALOGW("Service already running, don't start it again.");
         return false;
@@ -64,17 +67,23 @@ bool DeviceAsWebcamServiceManager::shouldStartService(jobjectArray jIgnoredNodes
 }
 
 int DeviceAsWebcamServiceManager::setupServicesAndStartListening(JNIEnv* env, jobject javaService,
-                                                                 jobjectArray jIgnoredNodes) {
+                                                                 jobjectArray jIgnoredNodes,
+                                                                 jstring jProfileDir,
+                                                                 jint maxFps) {
     ALOGV("%s", __FUNCTION__);
-    std::lock_guard<std::mutex> l(mSerializationLock);
+    std::lock_guard<InstrumentedMutex> l(mSerializationLock);
     if (mUVCProvider == nullptr) {
         mUVCProvider = std::make_shared<UVCProvider>();
     }
 
     std::unordered_set<std::string> ignoredNodes = stringSetFromJavaArray(jIgnoredNodes);
+    const char* profileDir = env->GetStringUTFChars(jProfileDir, nullptr);
+    EncoderProfileStore::getInstance().init(profileDir);
+    env->ReleaseStringUTFChars(jProfileDir, profileDir);
     // Set up UVC stack
+    uint32_t maxCameraFps = maxFps > 0 ? static_cast<uint32_t>(maxFps) : 0;
     if ((mUVCProvider->init() != Status::OK) ||
-        (mUVCProvider->startService(ignoredNodes) != Status::OK)) {
+        (mUVCProvider->startService(ignoredNodes, maxCameraFps) != Status::OK)) {
         ALOGE("%s: Unable to init/ start service", __FUNCTION__);
         return -1;
     }
@@ -86,7 +95,7 @@ int DeviceAsWebcamServiceManager::setupServicesAndStartListening(JNIEnv* env, jo
 int DeviceAsWebcamServiceManager::encodeImage(JNIEnv* env, jobject hardwareBuffer,
                                               jlong timestamp, jint rotation) {
     ALOGV("%s", __FUNCTION__);
-    std::lock_guard<std::mutex> l(mSerializationLock);
+    std::lock_guard<InstrumentedMutex> l(mSerializationLock);
     if (!mServiceRunning) {
         ALOGE("%s called, but native service is not running. Ignoring call.", __FUNCTION__);
         return -1;
@@ -95,10 +104,33 @@ int DeviceAsWebcamServiceManager::encodeImage(JNIEnv* env, jobject hardwareBuffe
     return mUVCProvider->encodeImage(buffer, timestamp, rotation);
 }
 
+bool DeviceAsWebcamServiceManager::setPreviewSurface(JNIEnv* env, jobject surface) {
+    // Doesn't need mSerializationLock, the PreviewSink outlives the service.
+    if (surface == nullptr) {
+        PreviewSink::getInstance().setWindow(nullptr);
+        return true;
+    }
+    if (!PreviewSink::isEnabled()) {
+        return false;
+    }
+    ANativeWindow* window = ANativeWindow_fromSurface(env, surface);
+    if (window == nullptr) {
+        ALOGE("%s: Failed to get the preview surface's window", __FUNCTION__);
+        return false;
+    }
+    std::unique_ptr<PreviewWindow> previewWindow = PreviewWindow::fromNativeWindow(window);
+    ANativeWindow_release(window);  // previewWindow holds its own reference
+    if (previewWindow == nullptr) {
+        return false;
+    }
+    PreviewSink::getInstance().setWindow(std::move(previewWindow));
+    return true;
+}
+
 void DeviceAsWebcamServiceManager::setStreamConfig(bool mjpeg, uint32_t width, uint32_t height,
                                                    uint32_t fps) {
     ALOGV("%s", __FUNCTION__);
-    std::lock_guard<std::mutex> l(mSerializationLock);
+    std::lock_guard<InstrumentedMutex> l(mSerializationLock);
     if (!mServiceRunning) {
         ALOGE("%s called but java foreground service is not running. No-op-ing out", __FUNCTION__);
         return;
@@ -108,7 +140,7 @@ void DeviceAsWebcamServiceManager::setStreamConfig(bool mjpeg, uint32_t width, u
 
 void DeviceAsWebcamServiceManager::startStreaming() {
     ALOGV("%s", __FUNCTION__);
-    std::lock_guard<std::mutex> l(mSerializationLock);
+    std::lock_guard<InstrumentedMutex> l(mSerializationLock);
     if (!mServiceRunning) {
         ALOGE("%s called but java foreground service is not running. No-op-ing out", __FUNCTION__);
         return;
@@ -118,7 +150,7 @@ void DeviceAsWebcamServiceManager::startStreaming() {
 
 void DeviceAsWebcamServiceManager::stopStreaming() {
     ALOGV("%s", __FUNCTION__);
-    std::lock_guard<std::mutex> l(mSerializationLock);
+    std::lock_guard<InstrumentedMutex> l(mSerializationLock);
     if (!mServiceRunning) {
         ALOGE("%s called but java foreground service is not running. No-op-ing out", __FUNCTION__);
         return;
@@ -128,7 +160,7 @@ void DeviceAsWebcamServiceManager::stopStreaming() {
 
 void DeviceAsWebcamServiceManager::returnImage(long timestamp) {
     ALOGV("%s", __FUNCTION__);
-    std::lock_guard<std::mutex> l(mSerializationLock);
+    std::lock_guard<InstrumentedMutex> l(mSerializationLock);
     if (!mServiceRunning) {
         ALOGE("%s called but java foreground service is not running. No-op-ing out", __FUNCTION__);
         return;
@@ -138,7 +170,7 @@ void DeviceAsWebcamServiceManager::returnImage(long timestamp) {
 
 void DeviceAsWebcamServiceManager::stopService() {
     ALOGV("%s", __FUNCTION__);
-    std::lock_guard<std::mutex> l(mSerializationLock);
+    std::lock_guard<InstrumentedMutex> l(mSerializationLock);
     if (!mServiceRunning) {
         ALOGE("%s called but java foreground service is not running. No-op-ing out", __FUNCTION__);
         return;
@@ -160,7 +192,7 @@ void DeviceAsWebcamServiceManager::stopService() {
 // be running at this point.
 void DeviceAsWebcamServiceManager::onDestroy() {
     ALOGV("%s", __FUNCTION__);
-    std::lock_guard<std::mutex> l(mSerializationLock);
+    std::lock_guard<InstrumentedMutex> l(mSerializationLock);
     if (!mServiceRunning) {
         ALOGE("%s called after Java Service was already considered destroyed. No-op-ing out.",
               __FUNCTION__);
@@ -170,6 +202,7 @@ void DeviceAsWebcamServiceManager::onDestroy() {
     JNIEnv* env = DeviceAsWebcamNative::getJNIEnvOrAbort();
     // reset all non-static state
     mUVCProvider = nullptr;
+    PreviewSink::getInstance().setWindow(nullptr);
     env->DeleteGlobalRef(mJavaService);  // let Java Service be GC'ed by the JVM
     mJavaService = nullptr;
     mServiceRunning = false;
@@ -22,6 +22,8 @@
 #include <mutex>
 #include <thread>
 
+#include "InstrumentedMutex.h"
+
 namespace android {
 namespace webcam {
 
@@ -36,11 +38,17 @@ class DeviceAsWebcamServiceManager {
     // receiver which might multiple receive spurious calls to start the service.
     bool shouldStartService(jobjectArray jIgnoredNodes);
     // Inits the native side of the service. This function should be called by the Java service
-    // before any of the functions below it
+    // before any of the functions below it. Encoder profiles are kept in jProfileDir. maxFps is
+    // the camera's fastest AE target fps range, 0 if unknown.
     int setupServicesAndStartListening(JNIEnv* env, jobject javaService,
-                                       jobjectArray jIgnoredNodes);
+                                       jobjectArray jIgnoredNodes, jstring jProfileDir,
+                                       jint maxFps);
     // Called by Java to encode a frame
     int encodeImage(JNIEnv* env, jobject hardwareBuffer, jlong timestamp, jint rotation);
+    // Called by Java to have the native side draw the preview into surface, or to stop drawing it
+    // if surface is null. Returns false if the native side won't draw the preview, Java must feed
+    // surface from the camera then.
+    bool setPreviewSurface(JNIEnv* env, jobject surface);
     // Called by native service to set the stream configuration in the Java Service.
     void setStreamConfig(bool mjpeg, uint32_t width, uint32_t height, uint32_t fps);
     // Called by native service to notify the Java service to start streaming the camera.
@@ -60,7 +68,8 @@ class DeviceAsWebcamServiceManager {
   private:
     DeviceAsWebcamServiceManager() = default;
 
-    std::mutex mSerializationLock;   // Serializes all methods in class
+    // Serializes all methods in class
+    InstrumentedMutex mSerializationLock{"DeviceAsWebcamServiceManager::mSerializationLock"};
     bool mServiceRunning = false;    // if this is true, then the variables underneath can be
                                      // considered safe to use without further checking.
     jobject mJavaService = nullptr;  // strong reference to the current foreground service.
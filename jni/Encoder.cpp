@@ -18,85 +18,170 @@
 
 #include "Encoder.h"
 
-#include <DeviceAsWebcamNative.h>
-#include <condition_variable>
 #include <libyuv/convert.h>
 #include <libyuv/convert_from.h>
+#include <libyuv/convert_from_argb.h>
 #include <libyuv/rotate.h>
+#include <libyuv/scale.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <log/log.h>
-#include <queue>
 #include <sched.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+#include "PreviewSink.h"
+#include "SeqLock.h"
+#include "Tunables.h"
 
 namespace android {
 namespace webcam {
 
-Encoder::Encoder(CameraConfig& config, EncoderCallback* cb)
-    : mConfig(config), mCb(cb){
-    // Inititalize intermediate buffers here.
-    mI420.y = std::make_unique<uint8_t[]>(config.width * config.height);
+namespace {
+// Written by the encoder thread, read by the UVC thread when the host asks for it.
+SeqLock<EncoderTelemetry> gTelemetry;
+}  // anonymous namespace
 
-    // TODO:(b/267794640): Can the size be width * height / 4 as it is subsampled by height
-    //                     and width?
-    mI420.u = std::make_unique<uint8_t[]>(config.width * config.height / 2);
-    mI420.v = std::make_unique<uint8_t[]>(config.width * config.height / 2);
+Encoder::Encoder(CameraConfig& config, std::shared_ptr<EncoderArena> arena)
+    : mConfig(config), mArena(std::move(arena)), mPlanner(config.width, config.height) {
+    // Sources larger than the stream get larger scratch images on their first frame.
+    if (!allocateScratch(config.width, config.height)) {
+        return;
+    }
 
-    mI420.yRowStride = config.width;
-    mI420.uRowStride = config.width / 2;
-    mI420.vRowStride = config.width / 2;
+    // Frames too small for more than one band don't need the threads.
+    uint32_t workers = std::min(std::max(Tunables::getDefaultEncoderWorkers(),
+                                         Tunables::getInstance().getDefaultMaxEncoderWorkers()),
+                                BandWorkers::kMaxWorkers);
+    uint64_t framePixels = static_cast<uint64_t>(config.width) * config.height;
+    if (workers > 1 && framePixels >= 2 * kMinBandPixels) {
+        mBandWorkers = std::make_unique<BandWorkers>(
+                static_cast<uint32_t>(std::min<uint64_t>(workers, framePixels / kMinBandPixels)),
+                config.perfCounters);
+    }
 
-    if (mI420.y == nullptr || mI420.u == nullptr || mI420.v == nullptr) {
-        ALOGE("%s Failed to allocate memory for intermediate I420 buffers", __FUNCTION__);
-        return;
+    if (config.fcc == V4L2_PIX_FMT_MJPEG && config.optimizeHuffmanTables) {
+        mHuffmanOptimizer = std::make_unique<HuffmanOptimizer>(config.width, config.height);
+        mHuffmanOptimizer->start();
+    }
+    if (config.fcc == V4L2_PIX_FMT_MJPEG && config.evaluateQuantTables) {
+        mQuantTablesEvaluator =
+                std::make_unique<QuantTablesEvaluator>(config.width, config.height);
+        mQuantTablesEvaluator->start();
     }
 
     mInited = true;
 }
 
-bool Encoder::isInited() const {
-    return mInited;
-}
-
 Encoder::~Encoder() {
-    mContinueEncoding = false;
-    if (mEncoderThread.joinable()) {
-        mEncoderThread.join();
+    uint64_t framePixels = static_cast<uint64_t>(mConfig.width) * mConfig.height;
+    auto logCpuStats = [framePixels](const char* path, const CpuStats& stats) {
+        if (stats.frames == 0) {
+            return;
+        }
+        ALOGI("Encoder: %s path: %" PRIu64 " frames, avg cpu %" PRIu64 "us / frame", path,
+              stats.frames, stats.cpuNs / stats.frames / 1000);
+        if (stats.perf.validMask != 0) {
+            ALOGI("Encoder: %s path: %s", path,
+                  stats.perf.toString(stats.frames * framePixels).c_str());
+        }
+    };
+    logCpuStats("jpeg passthrough", mPassthroughCpuStats);
+    logCpuStats("jpeg transform", mTransformCpuStats);
+    logCpuStats("software", mSoftwareCpuStats);
+    for (size_t i = 0; i < kConversionKernelCount; i++) {
+        const KernelStats& stats = mKernelStats[i];
+        if (stats.perf.validMask != 0) {
+            ALOGI("Encoder: kernel %s: %s", kernelToString(static_cast<ConversionKernel>(i)),
+                  stats.perf.toString(stats.pixels).c_str());
+        }
+    }
+    auto logSizeStats = [](const char* tables, const JpegSizeStats& stats) {
+        if (stats.frames != 0) {
+            ALOGI("Encoder: %s huffman tables: %" PRIu64 " frames, avg %" PRIu64 " bytes / frame",
+                  tables, stats.frames, stats.bytes / stats.frames);
+        }
+    };
+    logSizeStats("standard", mStandardTablesStats);
+    logSizeStats("optimized", mOptimizedTablesStats);
+    // Change encoder_workers through the ControlSocket while streaming to compare worker counts.
+    for (size_t i = 0; i < mWorkerStats.size(); i++) {
+        const WorkerStats& stats = mWorkerStats[i];
+        if (stats.frames != 0 && mBandWorkers != nullptr) {
+            ALOGI("Encoder: %zu workers: %" PRIu64 " frames, avg %" PRIu64 "us / frame", i + 1,
+                  stats.frames, stats.encodeUs / stats.frames);
+        }
     }
 }
 
-void Encoder::encodeThreadLoop() {
-    using namespace std::chrono_literals;
-    ALOGV("%s Starting encode threadLoop", __FUNCTION__);
-    EncodeRequest request;
-    while (mContinueEncoding) {
-        {
-            std::unique_lock<std::mutex> l(mRequestLock);
-            while (mRequestQueue.empty()) {
-                mRequestCondition.wait_for(l, 50ms);
-                if (!mContinueEncoding) {
-                    return;
-                }
-            }
-            request = mRequestQueue.front();
-            mRequestQueue.pop();
+bool Encoder::allocateScratch(uint32_t width, uint32_t height) {
+    if (mArena == nullptr || !mArena->canFit(width, height)) {
+        ALOGW("%s: No shared arena large enough for %ux%u, mapping a dedicated one", __FUNCTION__,
+              width, height);
+        mArena = EncoderArena::create(width, height);
+        if (mArena == nullptr) {
+            ALOGE("%s Failed to create encoder arena", __FUNCTION__);
+            return false;
+        }
+    }
+
+    // Inititalize the scratch images conversion plans may use for intermediates. The chroma planes
+    // are subsampled by 2 in both directions.
+    mArena->reset();
+    size_t lumaSize = static_cast<size_t>(EncoderArena::getScratchLumaStride(width)) *
+                      EncoderArena::getScratchLumaRows(height);
+    for (I420& scratch : mScratch) {
+        scratch.y = static_cast<uint8_t*>(mArena->allocate(lumaSize));
+        scratch.u = static_cast<uint8_t*>(mArena->allocate(lumaSize / 4));
+        scratch.v = static_cast<uint8_t*>(mArena->allocate(lumaSize / 4));
+        if (scratch.y == nullptr || scratch.u == nullptr || scratch.v == nullptr) {
+            ALOGE("%s Failed to allocate memory for intermediate I420 buffers", __FUNCTION__);
+            return false;
         }
-        encode(request);
     }
 
-    // Thread signalled to exit.
-    ALOGV("%s Encode thread now exiting", __FUNCTION__);
-    std::unique_lock<std::mutex> l(mRequestLock);
-    // Return any pending buffers with encode failure callbacks.
-    while (!mRequestQueue.empty()) {
-        request = mRequestQueue.front();
-        mRequestQueue.pop();
-        mCb->onEncoded(request.dstBuffer, request.srcBuffer, /*success*/ false);
+    if (!initJpegRowTables()) {
+        ALOGE("%s Failed to allocate memory for jpeg row tables", __FUNCTION__);
+        return false;
     }
+    mJpegRowsSource = nullptr;
+    mScratchWidth = width;
+    mScratchHeight = height;
+    mPlanner.setScratchSize(width, height);
+    return true;
 }
 
-void Encoder::queueRequest(EncodeRequest& request) {
-    std::unique_lock<std::mutex> l(mRequestLock);
-    mRequestQueue.emplace(request);
-    mRequestCondition.notify_one();
+bool Encoder::initJpegRowTables() {
+    // Pad the input to be vertically macroblock aligned (YUV420 MCUs are 2 * DCTSIZE lines tall).
+    const uint32_t mcuV = DCTSIZE * 2;
+    mJpegPaddedHeight = mcuV * ((mConfig.height + mcuV - 1) / mcuV);
+    mYRows = static_cast<JSAMPROW*>(mArena->allocate(mJpegPaddedHeight * sizeof(JSAMPROW)));
+    mCbRows = static_cast<JSAMPROW*>(mArena->allocate(mJpegPaddedHeight / 2 * sizeof(JSAMPROW)));
+    mCrRows = static_cast<JSAMPROW*>(mArena->allocate(mJpegPaddedHeight / 2 * sizeof(JSAMPROW)));
+    return mYRows != nullptr && mCbRows != nullptr && mCrRows != nullptr;
+}
+
+void Encoder::fillJpegRowTables(const I420& src) {
+    if (mJpegRowsSource == src.y) {
+        return;
+    }
+    // Once we are in the padding territory we still point to the last line effectively
+    // replicating it several times ~ CLAMP_TO_EDGE
+    for (uint32_t i = 0; i < mJpegPaddedHeight; i++) {
+        uint32_t li = std::min(i, mConfig.height - 1);
+        mYRows[i] = static_cast<JSAMPROW>(src.y + li * src.yRowStride);
+        if (i < mJpegPaddedHeight / 2) {
+            li = std::min(i, (mConfig.height - 1) / 2);
+            mCbRows[i] = static_cast<JSAMPROW>(src.u + li * src.uRowStride);
+            mCrRows[i] = static_cast<JSAMPROW>(src.v + li * src.vRowStride);
+        }
+    }
+    mJpegRowsSource = src.y;
+}
+
+bool Encoder::isInited() const {
+    return mInited;
 }
 
 bool Encoder::checkError(const char* msg, j_common_ptr jpeg_error_info_) {
@@ -111,7 +196,7 @@ bool Encoder::checkError(const char* msg, j_common_ptr jpeg_error_info_) {
     return false;
 }
 
-uint32_t Encoder::i420ToJpeg(EncodeRequest& request) {
+uint32_t Encoder::i420ToJpeg(EncodeRequest& request, const I420& src) {
     ALOGV("%s: E cpu : %d", __FUNCTION__, sched_getcpu());
     j_common_ptr jpegErrorInfo;
     auto dstBuffer = request.dstBuffer;
@@ -122,19 +207,9 @@ uint32_t Encoder::i420ToJpeg(EncodeRequest& request) {
         bool success;
     } dmgr;
 
-    // Set up error management
+    // The compressor is long lived and allocates from the arena, so nothing here touches the heap.
     jpegErrorInfo = nullptr;
-    jpeg_error_mgr jErr;
-    auto jpegCompressDeleter =
-          [] (jpeg_compress_struct *c) {
-              jpeg_destroy_compress(c);
-              delete c;
-          };
-
-    std::unique_ptr<jpeg_compress_struct, decltype(jpegCompressDeleter)> cInfo(
-            new jpeg_compress_struct(), jpegCompressDeleter);
-
-    cInfo->err = jpeg_std_error(&jErr);
+    j_compress_ptr cInfo = mArena->getJpegCompressor();
     cInfo->err->error_exit = [](j_common_ptr cInfo) {
         (*cInfo->err->output_message)(cInfo);
         if (cInfo->client_data) {
@@ -143,11 +218,6 @@ uint32_t Encoder::i420ToJpeg(EncodeRequest& request) {
         }
     };
 
-    jpeg_create_compress(cInfo.get());
-    if (checkError("Error initializing compression", jpegErrorInfo)) {
-        return 0;
-    }
-
     dmgr.buffer = static_cast<JOCTET*>(dstBuffer->getMem());
     dmgr.bufferSize = dstBuffer->getLength();
     dmgr.encodedSize = 0;
@@ -171,6 +241,14 @@ uint32_t Encoder::i420ToJpeg(EncodeRequest& request) {
     };
 
     cInfo->dest = &dmgr;
+    // Detach the per frame state and return the compressor to its idle state on every exit path.
+    auto resetCompressor = [cInfo, &dmgr]() {
+        if (!dmgr.success) {
+            jpeg_abort_compress(cInfo);
+        }
+        cInfo->client_data = nullptr;
+        cInfo->dest = nullptr;
+    };
 
     // Set up compression parameters
     cInfo->image_width = mConfig.width;
@@ -178,16 +256,39 @@ uint32_t Encoder::i420ToJpeg(EncodeRequest& request) {
     cInfo->input_components = 3;
     cInfo->in_color_space = JCS_YCbCr;
 
-    jpeg_set_defaults(cInfo.get());
+    jpeg_set_defaults(cInfo);
     if (checkError("Error configuring defaults", jpegErrorInfo)) {
+        resetCompressor();
         return 0;
     }
 
-    jpeg_set_colorspace(cInfo.get(), JCS_YCbCr);
+    jpeg_set_colorspace(cInfo, JCS_YCbCr);
     if (checkError("Error configuring color space", jpegErrorInfo)) {
+        resetCompressor();
         return 0;
     }
 
+    // Controllers (eg: thermal) may trade quality for encode time while streaming.
+    EncoderSettings settings = getSettings();
+    int32_t quality = settings.jpegQuality;
+    JpegQuantTables quantTables = settings.quantTables;
+    setQuantTables(cInfo, quantTables, quality);
+    cInfo->dct_method = settings.dctMethod == JpegDctMethod::FAST ? JDCT_IFAST : JDCT_ISLOW;
+
+    // Fixed tables fitted to recent frames if there are any. The standard ones have to be set
+    // explicitly since the compressor is shared and may hold another stream's tables.
+    std::shared_ptr<const HuffmanTables> huffmanTables;
+    if (mHuffmanOptimizer != nullptr) {
+        mHuffmanOptimizer->offerFrame(src, quality, quantTables, settings.dctMethod);
+        huffmanTables = mHuffmanOptimizer->getTables(quality, quantTables);
+    }
+    if (mQuantTablesEvaluator != nullptr) {
+        mQuantTablesEvaluator->offerFrame(src, quality);
+    }
+    HuffmanOptimizer::applyTables(
+            huffmanTables != nullptr ? *huffmanTables : HuffmanOptimizer::getStandardTables(),
+            cInfo);
+
     cInfo->raw_data_in = 1;
 
     // YUV420 planar with chroma subsampling
@@ -203,159 +304,469 @@ uint32_t Encoder::i420ToJpeg(EncodeRequest& request) {
     cInfo->comp_info[2].v_samp_factor = 1; // V vertical sampling
 
     // This vertical subsampling is the same for both Cb and Cr components as defined in
-    // cInfo->comp_info.
+    // cInfo->comp_info. The row tables set up in fillJpegRowTables() match these factors.
+    fillJpegRowTables(src);
     int cvSubSampling = cInfo->comp_info[0].v_samp_factor / cInfo->comp_info[1].v_samp_factor;
 
     // Start compression
-    jpeg_start_compress(cInfo.get(), TRUE);
+    jpeg_start_compress(cInfo, TRUE);
     if (checkError("Error starting compression", jpegErrorInfo)) {
+        resetCompressor();
         return 0;
     }
 
-    // Compute our macroblock height, so we can pad our input to be vertically
-    // macroblock aligned.
-    int maxVSampFactor =
-            std::max({cInfo->comp_info[0].v_samp_factor, cInfo->comp_info[1].v_samp_factor,
-                      cInfo->comp_info[2].v_samp_factor});
-    size_t mcuV = DCTSIZE * maxVSampFactor;
-    size_t paddedHeight = mcuV * ((cInfo->image_height + mcuV - 1) / mcuV);
-
-    std::vector<JSAMPROW> yLines(paddedHeight);
-    std::vector<JSAMPROW> cbLines(paddedHeight / cvSubSampling);
-    std::vector<JSAMPROW> crLines(paddedHeight / cvSubSampling);
-
-    uint8_t* pY = mI420.y.get();
-    uint8_t* pCr = mI420.v.get();
-    uint8_t* pCb = mI420.u.get();
-
-    uint32_t cbCrStride = mConfig.width / 2;
-    uint32_t yStride = mConfig.width;
-
-    for (uint32_t i = 0; i < paddedHeight; i++) {
-        // Once we are in the padding territory we still point to the last line
-        // effectively replicating it several times ~ CLAMP_TO_EDGE
-        uint32_t li = std::min(i, cInfo->image_height - 1);
-        yLines[i] = static_cast<JSAMPROW>(pY + li * yStride);
-        if (i < paddedHeight / cvSubSampling) {
-            li = std::min(i, (cInfo->image_height - 1) / cvSubSampling);
-            crLines[i] = static_cast<JSAMPROW>(pCr + li * cbCrStride);
-            cbLines[i] = static_cast<JSAMPROW>(pCb + li * cbCrStride);
-        }
-    }
-
-    const uint32_t batchSize = DCTSIZE * maxVSampFactor;
-    while (cInfo->next_scanline < cInfo->image_height) {
-        JSAMPARRAY planes[3]{&yLines[cInfo->next_scanline],
-                             &cbLines[cInfo->next_scanline / cvSubSampling],
-                             &crLines[cInfo->next_scanline / cvSubSampling]};
+    const uint32_t batchSize = DCTSIZE * cInfo->comp_info[0].v_samp_factor;
+    while (cInfo->next_scanline < cInfo->image_height && dmgr.success) {
+        JSAMPARRAY planes[3]{&mYRows[cInfo->next_scanline],
+                             &mCbRows[cInfo->next_scanline / cvSubSampling],
+                             &mCrRows[cInfo->next_scanline / cvSubSampling]};
 
-        jpeg_write_raw_data(cInfo.get(), planes, batchSize);
+        jpeg_write_raw_data(cInfo, planes, batchSize);
         if (checkError("Error while compressing", jpegErrorInfo)) {
+            resetCompressor();
+            return 0;
+        }
+        if (isCancelled()) {
+            ALOGV("%s: Cancelled", __FUNCTION__);
+            resetCompressor();
             return 0;
         }
     }
 
-    jpeg_finish_compress(cInfo.get());
-    if (checkError("Error while finishing compression", jpegErrorInfo)) {
+    if (dmgr.success) {
+        jpeg_finish_compress(cInfo);
+    }
+    if (checkError("Error while finishing compression", jpegErrorInfo) || !dmgr.success) {
+        resetCompressor();
         return 0;
     }
+    resetCompressor();
 
+    JpegSizeStats& sizeStats =
+            huffmanTables != nullptr ? mOptimizedTablesStats : mStandardTablesStats;
+    sizeStats.frames++;
+    sizeStats.bytes += dmgr.encodedSize;
     ALOGV("%s: X", __FUNCTION__);
     return dmgr.encodedSize;
 }
 
-void Encoder::encodeToMJpeg(EncodeRequest& request) {
-    // First fill intermediate I420 buffers
-    // TODO(b/267794640) : Can we skip this conversion and encode to jpeg straight ?
-    if (convertToI420(request) != 0) {
-        ALOGE("%s: Encode from YUV_420 to I420 failed", __FUNCTION__);
-        mCb->onEncoded(request.dstBuffer, request.srcBuffer, /*success*/ false);
-        return;
+ConversionKey Encoder::getConversionKey(const EncodeRequest& request) const {
+    const HardwareBufferDesc& src = request.srcBuffer;
+    ConversionKey key;
+    if (src.format == AHARDWAREBUFFER_FORMAT_R8G8B8A8_UNORM) {
+        key.layout = SourceLayout::ARGB;
+    } else if (src.format == AHARDWAREBUFFER_FORMAT_BLOB) {
+        key.layout = SourceLayout::JPEG;
+    } else {
+        const auto& desc = std::get<YuvHardwareBufferDesc>(src.bufferDesc);
+        key.layout = desc.uvPixelStride == 1 ? SourceLayout::YUV420_PLANAR
+                                             : SourceLayout::YUV420_SEMI_PLANAR;
     }
+    key.srcWidth = src.width;
+    key.srcHeight = src.height;
+    key.dstFourcc = mConfig.fcc;
+    key.dstWidth = mConfig.width;
+    key.dstHeight = mConfig.height;
+    key.rotationDegrees = request.rotationDegrees;
+    return key;
+}
 
-    // Now encode the I420 to JPEG
-    uint32_t encodedSize = i420ToJpeg(request);
-    if (encodedSize == 0) {
-        ALOGE("%s: Encode from I420 to JPEG failed", __FUNCTION__);
-        mCb->onEncoded(request.dstBuffer, request.srcBuffer, /*success*/ false);
-        return;
+I420& Encoder::getScratch(PlanBuffer buffer) {
+    return mScratch[buffer == PlanBuffer::SCRATCH_1 ? 1 : 0];
+}
+
+bool Encoder::getI420Input(const ConversionStep& step, const EncodeRequest& request, I420* in) {
+    const HardwareBufferDesc& src = request.srcBuffer;
+    if (step.input != PlanBuffer::SOURCE) {
+        *in = getScratch(step.input);
+        return true;
+    }
+    if (!std::holds_alternative<YuvHardwareBufferDesc>(src.bufferDesc)) {
+        return false;
     }
-    request.dstBuffer->setBytesUsed(encodedSize);
+    const auto& desc = std::get<YuvHardwareBufferDesc>(src.bufferDesc);
+    *in = {desc.yData,      desc.uData,      desc.vData,
+           desc.yRowStride, desc.uRowStride, desc.vRowStride,
+           src.width,       src.height};
+    return true;
+}
 
-    mCb->onEncoded(request.dstBuffer, request.srcBuffer, /*success*/ true);
+void Encoder::offerPreviewFrame(const ConversionPlan& plan, const EncodeRequest& request) {
+    PreviewSink& previewSink = PreviewSink::getInstance();
+    if (!previewSink.isActive()) {
+        return;
+    }
+    // The last step's input is the frame the host gets, before it is packed or compressed. Plans
+    // that stay in JPEG or convert ARGB straight to YUYV have no such frame, the preview keeps
+    // showing its last one.
+    const ConversionStep& lastStep = plan.steps[plan.numSteps - 1];
+    I420 frame;
+    if ((lastStep.kernel == ConversionKernel::I420_TO_YUY2 ||
+         lastStep.kernel == ConversionKernel::I420_TO_JPEG) &&
+        getI420Input(lastStep, request, &frame)) {
+        previewSink.offerFrame(frame);
+    }
 }
 
-int Encoder::convertToI420(EncodeRequest& request) {
+bool Encoder::runStep(const ConversionStep& step, EncodeRequest& request) {
     HardwareBufferDesc& src = request.srcBuffer;
-    uint8_t* dstY = mI420.y.get();
-    uint8_t* dstU = mI420.u.get();
-    uint8_t* dstV = mI420.v.get();
-    int32_t dstYRowStride = mConfig.width;
-    int32_t dstURowStride = mConfig.width / 2;
-    int32_t dstVRowStride = mConfig.width / 2;
-    libyuv::RotationMode rotationMode = request.rotationDegrees == 180 ?
-        libyuv::kRotate180 : libyuv::kRotate0;
-    if (request.srcBuffer.format == AHARDWAREBUFFER_FORMAT_R8G8B8A8_UNORM) {
-        ARGBHardwareBufferDesc desc = std::get<ARGBHardwareBufferDesc>(src.bufferDesc);
-        return libyuv::ARGBToI420(desc.buf, desc.rowStride, dstY,
-                                  dstYRowStride, dstU, dstURowStride, dstV,
-                                  dstVRowStride, mConfig.width, mConfig.height);
-    }
-    YuvHardwareBufferDesc desc = std::get<YuvHardwareBufferDesc>(src.bufferDesc);
-    return libyuv::Android420ToI420Rotate(desc.yData, desc.yRowStride, desc.uData, desc.uRowStride,
-                                    desc.vData, desc.vRowStride, desc.uvPixelStride, dstY,
-                                    dstYRowStride, dstU, dstURowStride, dstV, dstVRowStride,
-                                    mConfig.width, mConfig.height, rotationMode);
+    Buffer* dstBuffer = request.dstBuffer;
+
+    // Input as I420, for kernels reading scratch images or planar sources.
+    I420 in;
+    getI420Input(step, request, &in);
+
+    I420* out = nullptr;
+    if (step.output != PlanBuffer::DESTINATION) {
+        out = &getScratch(step.output);
+        out->width = step.outWidth;
+        out->height = step.outHeight;
+        out->yRowStride = EncoderArena::getScratchLumaStride(step.outWidth);
+        out->uRowStride = out->yRowStride / 2;
+        out->vRowStride = out->yRowStride / 2;
+    } else if ((step.kernel == ConversionKernel::ARGB_TO_YUY2 ||
+                step.kernel == ConversionKernel::I420_TO_YUY2) &&
+               dstBuffer->getLength() < step.outWidth * step.outHeight * 2) {
+        ALOGE("%s: Producer buffer too small for %ux%u YUYV", __FUNCTION__, step.outWidth,
+              step.outHeight);
+        return false;
+    }
+    auto* dstMem = reinterpret_cast<uint8_t*>(dstBuffer->getMem());
+
+    switch (step.kernel) {
+        case ConversionKernel::ANDROID420_TO_I420:
+        case ConversionKernel::ANDROID420_TO_I420_ROTATE_180:
+        case ConversionKernel::ARGB_TO_I420:
+        case ConversionKernel::I420_ROTATE_180:
+            return convertInBands(step, src, in, out, dstMem);
+        case ConversionKernel::ARGB_TO_YUY2:
+        case ConversionKernel::I420_TO_YUY2:
+            if (!convertInBands(step, src, in, out, dstMem)) {
+                return false;
+            }
+            dstBuffer->setBytesUsed(step.outWidth * step.outHeight * 2);
+            return true;
+        case ConversionKernel::I420_SCALE: {
+            // Crop like JpegTransformer does rather than stretch, so that the field of view
+            // doesn't depend on the path a frame takes.
+            I420 crop = cropToAspectRatio(in, out->width, out->height);
+            return libyuv::I420Scale(crop.y, crop.yRowStride, crop.u, crop.uRowStride, crop.v,
+                                     crop.vRowStride, crop.width, crop.height, out->y,
+                                     out->yRowStride, out->u, out->uRowStride, out->v,
+                                     out->vRowStride, out->width, out->height,
+                                     libyuv::kFilterBilinear) == 0;
+        }
+        case ConversionKernel::I420_TO_JPEG: {
+            uint32_t encodedSize = i420ToJpeg(request, in);
+            if (encodedSize == 0) {
+                return false;
+            }
+            dstBuffer->setBytesUsed(encodedSize);
+            return true;
+        }
+        case ConversionKernel::JPEG_PASSTHROUGH:
+            return copyJpeg(src, dstBuffer);
+        case ConversionKernel::JPEG_TO_I420:
+            return jpegToI420(src, step, *out);
+        case ConversionKernel::JPEG_CROP:
+        case ConversionKernel::JPEG_DOWNSCALE:
+            return transformJpeg(src, step, request.rotationDegrees, dstBuffer);
+        case ConversionKernel::COUNT:
+            break;
+    }
+    return false;
 }
 
-void Encoder::encodeToYUYV(EncodeRequest& r) {
-    Buffer* dstBuffer = r.dstBuffer;
-    // First convert from Android YUV format to I420.
-    if (convertToI420(r) != 0) {
-        ALOGE("%s: Encode from YUV_420 to I420 failed", __FUNCTION__);
-        mCb->onEncoded(r.dstBuffer, r.srcBuffer, /*success*/ false);
-        return;
+bool Encoder::convertInBands(const ConversionStep& step, const HardwareBufferDesc& src,
+                             const I420& in, const I420* out, uint8_t* dstMem) {
+    auto convert = [&](uint32_t begin, uint32_t end) {
+        return convertRows(step, src, in, out, dstMem, begin, end);
+    };
+    // These kernels write as many rows as they read. Rotated bands are mirrored around the middle
+    // row, an odd row count would put them off the chroma rows.
+    uint32_t rows = step.outHeight;
+    uint64_t pixels = static_cast<uint64_t>(step.outWidth) * rows;
+    auto workers = static_cast<uint32_t>(
+            std::min<uint64_t>(mFrameWorkers, std::max<uint64_t>(pixels / kMinBandPixels, 1)));
+    if (mBandWorkers == nullptr || workers <= 1 || (rows & 1) != 0) {
+        return convert(0, rows);
+    }
+    return mBandWorkers->run(rows, workers, mCpuMask, convert, &mStepHelperUsage);
+}
+
+bool Encoder::convertRows(const ConversionStep& step, const HardwareBufferDesc& src,
+                          const I420& in, const I420* out, uint8_t* dstMem, uint32_t begin,
+                          uint32_t end) {
+    uint32_t rows = end - begin;
+    switch (step.kernel) {
+        case ConversionKernel::ANDROID420_TO_I420:
+        case ConversionKernel::ANDROID420_TO_I420_ROTATE_180: {
+            const auto& desc = std::get<YuvHardwareBufferDesc>(src.bufferDesc);
+            bool rotate = step.kernel == ConversionKernel::ANDROID420_TO_I420_ROTATE_180;
+            // Rotated by 180, the band lands at the mirrored rows of the output.
+            uint32_t outBegin = rotate ? src.height - end : begin;
+            return libyuv::Android420ToI420Rotate(
+                           desc.yData + static_cast<size_t>(begin) * desc.yRowStride,
+                           desc.yRowStride,
+                           desc.uData + static_cast<size_t>(begin / 2) * desc.uRowStride,
+                           desc.uRowStride,
+                           desc.vData + static_cast<size_t>(begin / 2) * desc.vRowStride,
+                           desc.vRowStride, desc.uvPixelStride,
+                           out->y + static_cast<size_t>(outBegin) * out->yRowStride,
+                           out->yRowStride,
+                           out->u + static_cast<size_t>(outBegin / 2) * out->uRowStride,
+                           out->uRowStride,
+                           out->v + static_cast<size_t>(outBegin / 2) * out->vRowStride,
+                           out->vRowStride, src.width, rows,
+                           rotate ? libyuv::kRotate180 : libyuv::kRotate0) == 0;
+        }
+        case ConversionKernel::ARGB_TO_I420: {
+            const auto& desc = std::get<ARGBHardwareBufferDesc>(src.bufferDesc);
+            return libyuv::ARGBToI420(desc.buf + static_cast<size_t>(begin) * desc.rowStride,
+                                      desc.rowStride,
+                                      out->y + static_cast<size_t>(begin) * out->yRowStride,
+                                      out->yRowStride,
+                                      out->u + static_cast<size_t>(begin / 2) * out->uRowStride,
+                                      out->uRowStride,
+                                      out->v + static_cast<size_t>(begin / 2) * out->vRowStride,
+                                      out->vRowStride, src.width, rows) == 0;
+        }
+        case ConversionKernel::ARGB_TO_YUY2: {
+            const auto& desc = std::get<ARGBHardwareBufferDesc>(src.bufferDesc);
+            return libyuv::ARGBToYUY2(desc.buf + static_cast<size_t>(begin) * desc.rowStride,
+                                      desc.rowStride,
+                                      dstMem + static_cast<size_t>(begin) * step.outWidth * 2,
+                                      step.outWidth * 2, step.outWidth, rows) == 0;
+        }
+        case ConversionKernel::I420_TO_YUY2:
+            return libyuv::I420ToYUY2(in.y + static_cast<size_t>(begin) * in.yRowStride,
+                                      in.yRowStride,
+                                      in.u + static_cast<size_t>(begin / 2) * in.uRowStride,
+                                      in.uRowStride,
+                                      in.v + static_cast<size_t>(begin / 2) * in.vRowStride,
+                                      in.vRowStride,
+                                      dstMem + static_cast<size_t>(begin) * step.outWidth * 2,
+                                      step.outWidth * 2, step.outWidth, rows) == 0;
+        case ConversionKernel::I420_ROTATE_180: {
+            uint32_t outBegin = in.height - end;
+            return libyuv::I420Rotate(in.y + static_cast<size_t>(begin) * in.yRowStride,
+                                      in.yRowStride,
+                                      in.u + static_cast<size_t>(begin / 2) * in.uRowStride,
+                                      in.uRowStride,
+                                      in.v + static_cast<size_t>(begin / 2) * in.vRowStride,
+                                      in.vRowStride,
+                                      out->y + static_cast<size_t>(outBegin) * out->yRowStride,
+                                      out->yRowStride,
+                                      out->u + static_cast<size_t>(outBegin / 2) * out->uRowStride,
+                                      out->uRowStride,
+                                      out->v + static_cast<size_t>(outBegin / 2) * out->vRowStride,
+                                      out->vRowStride, in.width, rows, libyuv::kRotate180) == 0;
+        }
+        default:
+            return false;
     }
+}
 
-    int32_t dstYRowStride = mConfig.width;
-    int32_t dstURowStride = mConfig.width / 2;
-    int32_t dstVRowStride = mConfig.width / 2;
-    uint8_t* dstY = mI420.y.get();
-    uint8_t* dstU = mI420.u.get();
-    uint8_t* dstV = mI420.v.get();
+bool Encoder::copyJpeg(const HardwareBufferDesc& src, Buffer* dst) {
+    // Already validated (SOI / EOI, frame header) by the frame provider.
+    const auto& desc = std::get<JpegHardwareBufferDesc>(src.bufferDesc);
+    if (desc.size > dst->getLength()) {
+        ALOGE("%s: %u byte JPEG doesn't fit in %zu byte producer buffer", __FUNCTION__, desc.size,
+              dst->getLength());
+        return false;
+    }
+    memcpy(dst->getMem(), desc.data, desc.size);
+    dst->setBytesUsed(desc.size);
+    return true;
+}
 
-    // Now convert from I420 to YUYV
-    if (libyuv::I420ToYUY2(dstY, dstYRowStride, dstU, dstURowStride, dstV, dstVRowStride,
-                           reinterpret_cast<uint8_t*>(dstBuffer->getMem()),
-                           /*rowStride*/ mConfig.width * 2, mConfig.width, mConfig.height) != 0) {
-        ALOGE("%s: Encode from I420 to YUYV failed", __FUNCTION__);
-        mCb->onEncoded(r.dstBuffer, r.srcBuffer, /*success*/ false);
-        return;
+bool Encoder::transformJpeg(const HardwareBufferDesc& src, const ConversionStep& step,
+                            uint32_t rotationDegrees, Buffer* dst) {
+    JpegTransform transform;
+    if (!planJpegTransform(src.width, src.height, step.outWidth, step.outHeight,
+                           rotationDegrees == 180, &transform)) {
+        return false;
+    }
+    if (mJpegTransformer == nullptr) {
+        mJpegTransformer = std::make_unique<JpegTransformer>();
+    }
+    const auto& desc = std::get<JpegHardwareBufferDesc>(src.bufferDesc);
+    size_t encodedSize = mJpegTransformer->transform(
+            desc.data, desc.size, transform, static_cast<uint8_t*>(dst->getMem()),
+            dst->getLength());
+    if (encodedSize == 0) {
+        return false;
+    }
+    dst->setBytesUsed(encodedSize);
+    return true;
+}
+
+bool Encoder::jpegToI420(const HardwareBufferDesc& src, const ConversionStep& step, I420& dst) {
+    if (mJpegDecoder == nullptr) {
+        mJpegDecoder = std::make_unique<JpegDecoder>();
+    }
+    // The planner picks the output size from the scales libjpeg can decode at.
+    uint32_t scaleDenom = 1;
+    while (scaleDenom < DCTSIZE && (src.width + scaleDenom - 1) / scaleDenom > step.outWidth) {
+        scaleDenom *= 2;
+    }
+    const auto& desc = std::get<JpegHardwareBufferDesc>(src.bufferDesc);
+    return mJpegDecoder->decodeToI420(desc.data, desc.size, src.width, src.height, scaleDenom,
+                                      dst.y, dst.yRowStride, dst.u, dst.uRowStride, dst.v,
+                                      dst.vRowStride);
+}
+
+EncoderTelemetry Encoder::getTelemetry() {
+    return gTelemetry.read();
+}
+
+bool Encoder::process(EncodeRequest& request) {
+    auto start = std::chrono::steady_clock::now();
+    bool success = encode(request);
+    auto encodeUs = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+                                                  std::chrono::steady_clock::now() - start)
+                                                  .count());
+    if (!success) {
+        mTelemetry.failures++;
+    }
+    if (mTelemetry.frames == 0) {
+        mTelemetry.avgEncodeUs = encodeUs;
+    } else {
+        int64_t delta = static_cast<int64_t>(encodeUs) - mTelemetry.avgEncodeUs;
+        mTelemetry.avgEncodeUs += delta / static_cast<int64_t>(kTelemetryAverageFrames);
     }
-    dstBuffer->setBytesUsed(mConfig.width * mConfig.height * 2);
-    // Call the callback
-    mCb->onEncoded(r.dstBuffer, r.srcBuffer, /*success*/ true);
+    mTelemetry.frames++;
+    mTelemetry.lastEncodeUs = encodeUs;
+    mTelemetry.maxEncodeUs = std::max(mTelemetry.maxEncodeUs, encodeUs);
+    gTelemetry.write(mTelemetry);
+    if (success) {
+        WorkerStats& stats = mWorkerStats[mFrameWorkers - 1];
+        stats.frames++;
+        stats.encodeUs += encodeUs;
+    }
+    return success;
 }
 
-void Encoder::encode(EncodeRequest& encodeRequest) {
+bool Encoder::encode(EncodeRequest& encodeRequest) {
     // Based on the config format
-    switch (mConfig.fcc) {
-        case V4L2_PIX_FMT_YUYV:
-            encodeToYUYV(encodeRequest);
-            break;
-        case V4L2_PIX_FMT_MJPEG:
-            encodeToMJpeg(encodeRequest);
-            break;
-        default:
-            ALOGE("%s: Fourcc %u not supported for encoding", __FUNCTION__, mConfig.fcc);
+    if (mConfig.fcc != V4L2_PIX_FMT_YUYV && mConfig.fcc != V4L2_PIX_FMT_MJPEG) {
+        ALOGE("%s: Fourcc %u not supported for encoding", __FUNCTION__, mConfig.fcc);
+        return false;
+    }
+    // Intermediates are at most as large as the larger of the source and the stream.
+    const HardwareBufferDesc& src = encodeRequest.srcBuffer;
+    if ((src.width > mScratchWidth || src.height > mScratchHeight) &&
+        !allocateScratch(std::max(src.width, mScratchWidth),
+                         std::max(src.height, mScratchHeight))) {
+        return false;
+    }
+    const ConversionPlan* plan = mPlanner.getPlan(getConversionKey(encodeRequest));
+    if (plan == nullptr) {
+        return false;
+    }
+    if (!mThreadInitialized) {
+        // The encoder stage keeps its thread for the Encoder's lifetime.
+        mInitialCpuMask = getThreadCpuMask();
+        mCpuMask = mInitialCpuMask;
+        if (mConfig.perfCounters) {
+            mPerfCounters = PerfCounters::openForCallingThread();
+        }
+        mThreadInitialized = true;
+    }
+    // Tunables may move the encoder to other cpus between frames.
+    uint64_t cpuMask = mFixedSettings ? 0 : Tunables::getInstance().getEncoderCpuMask();
+    applyCpuMask(cpuMask != 0 ? cpuMask : mConfig.cpuMask);
+    mFrameWorkers = getFrameWorkers();
+    PerfCounts perfStart;
+    readPerfCounters(&perfStart);
+    PerfCounts stepPerfStart = perfStart;
+    uint64_t cpuStartNs = getThreadCpuTimeNs();
+    uint64_t stepStartNs = cpuStartNs;
+    BandUsage helperUsage;
+    uint64_t inPixels = static_cast<uint64_t>(encodeRequest.srcBuffer.width) *
+                        encodeRequest.srcBuffer.height;
+    for (size_t i = 0; i < plan->numSteps; i++) {
+        const ConversionStep& step = plan->steps[i];
+        mStepHelperUsage = {};
+        if (!runStep(step, encodeRequest)) {
+            ALOGE("%s: Conversion step %s failed", __FUNCTION__, kernelToString(step.kernel));
+            return false;
+        }
+        // Pixels counted the way the planner costs steps.
+        uint64_t outPixels = static_cast<uint64_t>(step.outWidth) * step.outHeight;
+        uint64_t stepEndNs = getThreadCpuTimeNs();
+        PerfCounts stepPerfEnd;
+        readPerfCounters(&stepPerfEnd);
+        KernelStats& kernelStats = mKernelStats[static_cast<size_t>(step.kernel)];
+        kernelStats.runs++;
+        kernelStats.pixels += std::max(inPixels, outPixels);
+        // Band workers count in, so that costs don't depend on the number of workers.
+        kernelStats.cpuNs += stepEndNs - stepStartNs + mStepHelperUsage.cpuNs;
+        kernelStats.perf.add(
+                mStepHelperUsage.addPerfTo(PerfCounts::between(stepPerfStart, stepPerfEnd)));
+        helperUsage.add(mStepHelperUsage);
+        inPixels = outPixels;
+        stepStartNs = stepEndNs;
+        stepPerfStart = stepPerfEnd;
+    }
+    CpuStats* stats = &mSoftwareCpuStats;
+    if (plan->steps[0].kernel == ConversionKernel::JPEG_PASSTHROUGH) {
+        stats = &mPassthroughCpuStats;
+    } else if (plan->steps[0].kernel == ConversionKernel::JPEG_CROP ||
+               plan->steps[0].kernel == ConversionKernel::JPEG_DOWNSCALE) {
+        stats = &mTransformCpuStats;
     }
+    stats->frames++;
+    stats->cpuNs += stepStartNs - cpuStartNs + helperUsage.cpuNs;
+    stats->perf.add(helperUsage.addPerfTo(PerfCounts::between(perfStart, stepPerfStart)));
+    // Scratch images and the camera's buffer are only valid until the next frame.
+    offerPreviewFrame(*plan, encodeRequest);
+    return true;
 }
 
-void Encoder::startEncoderThread() {
-    // mEncoderThread can call into java as a part of EncoderCallback
-    mEncoderThread =
-            DeviceAsWebcamNative::createJniAttachedThread(&Encoder::encodeThreadLoop, this);
-    ALOGV("Started new Encoder Thread");
+uint32_t Encoder::getFrameWorkers() const {
+    uint32_t maxWorkers = mBandWorkers != nullptr ? mBandWorkers->getMaxWorkers() : 1;
+    if (mFixedSettings) {
+        return std::clamp(Tunables::getDefaultEncoderWorkers(), 1u, maxWorkers);
+    }
+    return std::clamp(Tunables::getInstance().getMaxEncoderWorkers(), 1u, maxWorkers);
+}
+
+void Encoder::setFixedSettings(const EncoderSettings& settings) {
+    mFixedSettings = settings;
+}
+
+EncoderSettings Encoder::getSettings() const {
+    if (mFixedSettings) {
+        return *mFixedSettings;
+    }
+    const Tunables& tunables = Tunables::getInstance();
+    EncoderSettings settings;
+    settings.jpegQuality = tunables.getJpegQuality();
+    settings.dctMethod = tunables.getDctMethod();
+    settings.quantTables = tunables.getQuantTables();
+    return settings;
+}
+
+void Encoder::readPerfCounters(PerfCounts* counts) const {
+    if (mPerfCounters != nullptr) {
+        mPerfCounters->read(counts);
+    }
+}
+
+void Encoder::applyCpuMask(uint64_t cpuMask) {
+    if (cpuMask == 0) {
+        cpuMask = mInitialCpuMask;
+    }
+    if (cpuMask == 0 || cpuMask == mCpuMask) {
+        return;
+    }
+    // Not retried on failure, a bad mask would otherwise be logged for every frame.
+    mCpuMask = cpuMask;
+    if (!setThreadCpuMask(cpuMask)) {
+        ALOGW("%s: Failed to move the encoder thread to cpus 0x%" PRIx64 ": %s", __FUNCTION__,
+              cpuMask, strerror(errno));
+    }
 }
 
 }  // namespace webcam
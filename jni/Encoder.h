@@ -16,17 +16,23 @@
 
 #pragma once
 #include <stdlib.h>
-#include <atomic>
-#include <condition_variable>
-#include <mutex>
-#include <queue>
-#include <thread>
 
 #include <android/hardware_buffer.h>
 #include <jpeglib.h>
+#include <atomic>
+#include <optional>
 
+#include "BandWorkers.h"
 #include "Buffer.h"
+#include "ConversionPlanner.h"
+#include "EncoderArena.h"
 #include "FrameProvider.h"
+#include "HuffmanOptimizer.h"
+#include "I420.h"
+#include "JpegUtils.h"
+#include "PerfCounters.h"
+#include "Pipeline.h"
+#include "QuantTables.h"
 #include "Utils.h"
 
 // Manages converting from formats available directly from the camera to standardized formats that
@@ -43,15 +49,6 @@ struct EncodeRequest {
     uint32_t rotationDegrees = 0;
 };
 
-struct I420 {
-    std::unique_ptr<uint8_t[]> y;
-    std::unique_ptr<uint8_t[]> u;
-    std::unique_ptr<uint8_t[]> v;
-    uint32_t yRowStride = 0;
-    uint32_t uRowStride = 0;
-    uint32_t vRowStride = 0;
-};
-
 class EncoderCallback {
   public:
     // Callback called by encoder into client when encoding is finished.
@@ -59,41 +56,186 @@ class EncoderCallback {
     virtual ~EncoderCallback() = default;
 };
 
-// Encoder for YUV_420_88 -> YUY2 / MJPEG conversion.
-class Encoder {
+// Terminal pipeline stage which hands successfully encoded buffers to the EncoderCallback.
+class EncodedFrameSink : public PipelineStage<EncodeRequest> {
   public:
-    Encoder(CameraConfig& config, EncoderCallback* cb);
-    ~Encoder();
-
-    [[nodiscard]] bool isInited() const;
-    void startEncoderThread();
-    void queueRequest(EncodeRequest& request);
+    explicit EncodedFrameSink(EncoderCallback* cb) : mCb(cb) {}
+    [[nodiscard]] const char* getName() const override { return "EncodedFrameSink"; }
+    bool process(EncodeRequest& request) override {
+        mCb->onEncoded(request.dstBuffer, request.srcBuffer, /*success*/ true);
+        return true;
+    }
 
   private:
-    // Main loop of the encoder thread. Calls EncoderCallback.onEncoded which might call back into
-    // java, so encoder thread must be registered with the JVM.
-    void encodeThreadLoop();
+    EncoderCallback* mCb = nullptr;
+};
+
+// Wall time the Encoder spends on frames, as seen from outside the frame path.
+struct EncoderTelemetry {
+    uint32_t frames = 0;
+    uint32_t failures = 0;
+    uint32_t lastEncodeUs = 0;
+    uint32_t avgEncodeUs = 0;  // moving average over about kTelemetryAverageFrames
+    uint32_t maxEncodeUs = 0;
+};
 
-    void encode(EncodeRequest& request);
+// Settings the Encoder otherwise reads from Tunables every frame.
+struct EncoderSettings {
+    int32_t jpegQuality = Tunables::kDefaultJpegQuality;
+    JpegDctMethod dctMethod = JpegDctMethod::ACCURATE;
+    JpegQuantTables quantTables = JpegQuantTables::ANNEX_K;
+};
 
-    int convertToI420(EncodeRequest& request);
-    uint32_t i420ToJpeg(EncodeRequest& request);
+// Encoder for YUV_420_88 / RGBA -> YUY2 / MJPEG conversion. The kernels run for a frame are picked
+// by a ConversionPlanner. Runs as a stage of the frame Pipeline, failed requests are returned
+// through the pipeline's drop handler.
+class Encoder : public PipelineStage<EncodeRequest> {
+  public:
+    // Scratch memory is taken from arena. If arena is null or too small for config, the Encoder
+    // maps a dedicated arena instead.
+    Encoder(CameraConfig& config, std::shared_ptr<EncoderArena> arena);
+    ~Encoder() override;
 
-    void encodeToMJpeg(EncodeRequest& request);
-    void encodeToYUYV(EncodeRequest& request);
+    [[nodiscard]] bool isInited() const;
 
-    static bool checkError(const char* msg, j_common_ptr jpeg_error_info_);
+    // PipelineStage overrides
+    [[nodiscard]] const char* getName() const override { return "Encoder"; }
+    bool process(EncodeRequest& request) override;
+
+    // Thread CPU time spent in each kernel, and the pixels it processed (the larger of the input
+    // and output pixel counts, like the KernelCostTable). Hardware counters only if
+    // CameraConfig::perfCounters is set and the device allows counting. Both include the band
+    // workers' threads.
+    struct KernelStats {
+        uint64_t runs = 0;
+        uint64_t pixels = 0;
+        uint64_t cpuNs = 0;
+        PerfCounts perf;
+    };
+    using KernelStatsArray = std::array<KernelStats, kConversionKernelCount>;
+    [[nodiscard]] const KernelStatsArray& getKernelStats() const { return mKernelStats; }
+
+    // Of the Encoder streaming last, lock free. Only one Encoder streams at a time.
+    [[nodiscard]] static EncoderTelemetry getTelemetry();
+
+    // For Encoders that don't serve a stream, like the EncoderCalibrator's, which must neither
+    // change the stream's Tunables nor follow them. From the next frame on, compresses with
+    // settings, keeps to CameraConfig::cpuMask and uses the default number of band workers.
+    void setFixedSettings(const EncoderSettings& settings);
+    // Frames fail as soon as cancel is set, checked between MCU rows while compressing. Lets a
+    // background Encoder give the arena up without finishing a large frame. cancel must outlive
+    // the Encoder.
+    void setCancelFlag(const std::atomic<bool>* cancel) { mCancel = cancel; }
 
-    std::mutex mRequestLock;
-    std::queue<EncodeRequest> mRequestQueue;    // guarded by mRequestLock
-    std::condition_variable mRequestCondition;  // guarded by mRequestLock
+  private:
+    static constexpr size_t kNumScratchImages = 2;
+    static constexpr uint32_t kTelemetryAverageFrames = 16;
+    // Smallest band worth handing to another thread, about 512x512.
+    static constexpr uint64_t kMinBandPixels = 1 << 18;
+
+    // Carves the scratch images and row tables for intermediates of up to width x height out of
+    // mArena, replacing mArena with a dedicated one if it is too small.
+    bool allocateScratch(uint32_t width, uint32_t height);
+    bool initJpegRowTables();
+    void fillJpegRowTables(const I420& src);
+    bool encode(EncodeRequest& request);
+    // Moves the calling thread to the cpus of cpuMask, or back to the cpus it started out on if
+    // cpuMask is 0. Does nothing if it is already there.
+    void applyCpuMask(uint64_t cpuMask);
+    // Reads the counters of the encoder thread into counts, if they are open.
+    void readPerfCounters(PerfCounts* counts) const;
+
+    // The fixed settings if there are any, the Tunables' otherwise.
+    [[nodiscard]] EncoderSettings getSettings() const;
+    [[nodiscard]] bool isCancelled() const {
+        return mCancel != nullptr && mCancel->load(std::memory_order_relaxed);
+    }
+    [[nodiscard]] ConversionKey getConversionKey(const EncodeRequest& request) const;
+    bool runStep(const ConversionStep& step, EncodeRequest& request);
+    // The I420 image step reads, false if it reads a JPEG or ARGB source.
+    bool getI420Input(const ConversionStep& step, const EncodeRequest& request, I420* in);
+    // Hands the converted frame to the PreviewSink, if it has a window.
+    void offerPreviewFrame(const ConversionPlan& plan, const EncodeRequest& request);
+    I420& getScratch(PlanBuffer buffer);
+    // Band workers to use for the frame: the Tunables', up to the threads there are.
+    [[nodiscard]] uint32_t getFrameWorkers() const;
+    // Runs a kernel that converts row by row on up to mFrameWorkers threads.
+    bool convertInBands(const ConversionStep& step, const HardwareBufferDesc& src, const I420& in,
+                        const I420* out, uint8_t* dstMem);
+    // Converts the rows [begin, end) of the step's input, begin and end even.
+    static bool convertRows(const ConversionStep& step, const HardwareBufferDesc& src,
+                            const I420& in, const I420* out, uint8_t* dstMem, uint32_t begin,
+                            uint32_t end);
+
+    uint32_t i420ToJpeg(EncodeRequest& request, const I420& src);
+    bool jpegToI420(const HardwareBufferDesc& src, const ConversionStep& step, I420& dst);
+    static bool copyJpeg(const HardwareBufferDesc& src, Buffer* dst);
+    bool transformJpeg(const HardwareBufferDesc& src, const ConversionStep& step,
+                       uint32_t rotationDegrees, Buffer* dst);
+
+    static bool checkError(const char* msg, j_common_ptr jpeg_error_info_);
 
-    std::thread mEncoderThread;
     CameraConfig mConfig;
-    EncoderCallback* mCb = nullptr;
-    volatile bool mContinueEncoding = true;
+    std::optional<EncoderSettings> mFixedSettings;
+    const std::atomic<bool>* mCancel = nullptr;
     bool mInited = false;
-    I420 mI420;
+    bool mThreadInitialized = false;
+    uint64_t mInitialCpuMask = 0;  // cpus the encoder thread started out on, 0 if unknown
+    uint64_t mCpuMask = 0;         // cpus the encoder thread was last moved to
+    // Opened on the encoder thread, by its first frame.
+    std::unique_ptr<PerfCounters> mPerfCounters;
+    std::shared_ptr<EncoderArena> mArena;
+    ConversionPlanner mPlanner;
+    I420 mScratch[kNumScratchImages];
+    uint32_t mScratchWidth = 0;
+    uint32_t mScratchHeight = 0;
+    // Row tables handed to jpeg_write_raw_data, padded to a whole number of MCU rows. They point
+    // into the image last compressed (mJpegRowsSource), which is usually the same every frame.
+    uint32_t mJpegPaddedHeight = 0;
+    const uint8_t* mJpegRowsSource = nullptr;
+    JSAMPROW* mYRows = nullptr;
+    JSAMPROW* mCbRows = nullptr;
+    JSAMPROW* mCrRows = nullptr;
+    // Only needed when camera JPEGs can't be passed through, created on first use.
+    std::unique_ptr<JpegDecoder> mJpegDecoder;
+    // Only needed when the camera's JPEGs are larger than the stream, created on first use.
+    std::unique_ptr<JpegTransformer> mJpegTransformer;
+    // Only for MJPEG streams, if enabled in the CameraConfig.
+    std::unique_ptr<HuffmanOptimizer> mHuffmanOptimizer;
+    // Only for MJPEG streams, if enabled in the CameraConfig.
+    std::unique_ptr<QuantTablesEvaluator> mQuantTablesEvaluator;
+    // Only for frames large enough for more than one band.
+    std::unique_ptr<BandWorkers> mBandWorkers;
+    uint32_t mFrameWorkers = 1;
+    // What the band workers spent on the step being run.
+    BandUsage mStepHelperUsage;
+
+    // Thread CPU time spent per frame, band workers included, split by whether the camera's JPEG
+    // was passed through, transformed or decoded / converted in software.
+    struct CpuStats {
+        uint64_t frames = 0;
+        uint64_t cpuNs = 0;
+        PerfCounts perf;
+    };
+    CpuStats mPassthroughCpuStats;
+    CpuStats mTransformCpuStats;
+    CpuStats mSoftwareCpuStats;
+    KernelStatsArray mKernelStats{};
+    // Size of the JPEGs compressed in software, split by the huffman tables used.
+    struct JpegSizeStats {
+        uint64_t frames = 0;
+        uint64_t bytes = 0;
+    };
+    JpegSizeStats mStandardTablesStats;
+    JpegSizeStats mOptimizedTablesStats;
+    // Published to getTelemetry() after every frame.
+    EncoderTelemetry mTelemetry;
+    // Wall time per frame by the number of band workers it was allowed.
+    struct WorkerStats {
+        uint64_t frames = 0;
+        uint64_t encodeUs = 0;
+    };
+    std::array<WorkerStats, BandWorkers::kMaxWorkers> mWorkerStats{};
 };
 
 }  // namespace webcam
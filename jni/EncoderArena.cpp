@@ -0,0 +1,425 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+
+#include "EncoderArena.h"
+#include "AllocationCheck.h"
+#include "ResidentMemory.h"
+
+#include <errno.h>
+#include <jerror.h>
+#include <log/log.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <new>
+
+// libjpeg only declares the virtual array control structures, their layout is up to the memory
+// manager.
+struct jvirt_sarray_control {
+    JSAMPARRAY mem = nullptr;
+    JDIMENSION rowsInArray = 0;
+    JDIMENSION samplesPerRow = 0;
+    boolean preZero = FALSE;
+    jvirt_sarray_control* next = nullptr;
+};
+
+struct jvirt_barray_control {
+    JBLOCKARRAY mem = nullptr;
+    JDIMENSION rowsInArray = 0;
+    JDIMENSION blocksPerRow = 0;
+    boolean preZero = FALSE;
+    jvirt_barray_control* next = nullptr;
+};
+
+namespace android {
+namespace webcam {
+
+namespace {
+// Enough for the compressor state, tables and per-MCU-row work buffers of a raw data compression.
+constexpr size_t kJpegPoolBaseSize = 256 * 1024;
+// Per-column allowance for libjpeg row buffers (3 components, an iMCU row of 2 * DCTSIZE lines).
+constexpr size_t kJpegPoolBytesPerColumn = 3 * 2 * DCTSIZE;
+// Width and height of a 4:2:0 MCU. Row tables and scratch images are padded to a multiple of this.
+constexpr uint32_t kMcuHeight = 2 * DCTSIZE;
+
+size_t alignUp(size_t value, size_t alignment) {
+    return ((value + alignment - 1) / alignment) * alignment;
+}
+
+// Header for allocations that did not fit in the pool. These are chained per pool. Blocks of the
+// image pool are kept for the next image when the pool is freed, the others are freed with their
+// pool. Padded so that the memory handed out stays aligned.
+struct alignas(EncoderArena::kAlignment) HeapBlock {
+    HeapBlock* next = nullptr;
+    size_t capacity = 0;
+};
+}  // anonymous namespace
+
+// libjpeg memory manager that bump allocates from a fixed region of the EncoderArena. The permanent
+// pool grows from the bottom of the region, the image pool (freed after every frame) from the top.
+// Without a region (useRecyclingJpegMemory) everything comes from recycled heap blocks.
+struct JpegArenaMemoryMgr {
+    jpeg_memory_mgr pub;  // must be first, libjpeg casts cinfo->mem to this
+    uint8_t* base = nullptr;
+    size_t size = 0;
+    size_t poolUsed[JPOOL_NUMPOOLS] = {};
+    HeapBlock* heapBlocks[JPOOL_NUMPOOLS] = {};
+    HeapBlock* spareBlocks = nullptr;  // freed image pool blocks
+    jvirt_sarray_control* virtSArrays[JPOOL_NUMPOOLS] = {};
+    jvirt_barray_control* virtBArrays[JPOOL_NUMPOOLS] = {};
+    bool warnedHeapFallback = false;
+    // Manager this one replaced, if it had to be kept alive, and whether this one is heap
+    // allocated (rather than living in the arena).
+    jpeg_memory_mgr* previous = nullptr;
+    bool ownsSelf = false;
+
+    static JpegArenaMemoryMgr* from(j_common_ptr cinfo) {
+        return reinterpret_cast<JpegArenaMemoryMgr*>(cinfo->mem);
+    }
+
+    static void* allocate(j_common_ptr cinfo, int poolId, size_t size) {
+        JpegArenaMemoryMgr* mgr = from(cinfo);
+        if (poolId < 0 || poolId >= JPOOL_NUMPOOLS) {
+            ERREXIT1(cinfo, JERR_BAD_POOL_ID, poolId);
+            return nullptr;
+        }
+        size = alignUp(size, EncoderArena::kAlignment);
+        size_t used = mgr->poolUsed[JPOOL_PERMANENT] + mgr->poolUsed[JPOOL_IMAGE];
+        if (size <= mgr->size - used) {
+            mgr->poolUsed[poolId] += size;
+            if (poolId == JPOOL_PERMANENT) {
+                return mgr->base + mgr->poolUsed[poolId] - size;
+            }
+            return mgr->base + mgr->size - mgr->poolUsed[poolId];
+        }
+
+        // The pool is sized generously, so this should not happen. Rather than failing the frame,
+        // fall back to the heap.
+        if (!mgr->warnedHeapFallback && mgr->size > 0) {
+            ALOGW("%s: libjpeg pool of %zu bytes exhausted, falling back to the heap", __FUNCTION__,
+                  mgr->size);
+            mgr->warnedHeapFallback = true;
+        }
+        HeapBlock* block = takeSpareBlock(mgr, size);
+        if (block == nullptr) {
+            recordFramePathAllocation(size);
+            void* mem = nullptr;
+            if (posix_memalign(&mem, EncoderArena::kAlignment, sizeof(HeapBlock) + size) != 0) {
+                ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+                return nullptr;
+            }
+            block = new (mem) HeapBlock();
+            block->capacity = size;
+        }
+        block->next = mgr->heapBlocks[poolId];
+        mgr->heapBlocks[poolId] = block;
+        return block + 1;
+    }
+
+    // Unlinks the smallest spare block with room for size. Frames of the same size make the same
+    // requests, so from the second frame on every request finds a block of exactly its size.
+    static HeapBlock* takeSpareBlock(JpegArenaMemoryMgr* mgr, size_t size) {
+        HeapBlock** best = nullptr;
+        for (HeapBlock** link = &mgr->spareBlocks; *link != nullptr; link = &(*link)->next) {
+            if ((*link)->capacity >= size &&
+                (best == nullptr || (*link)->capacity < (*best)->capacity)) {
+                best = link;
+                if ((*link)->capacity == size) {
+                    break;
+                }
+            }
+        }
+        if (best == nullptr) {
+            return nullptr;
+        }
+        HeapBlock* block = *best;
+        *best = block->next;
+        return block;
+    }
+
+    static void freeBlocks(HeapBlock* block) {
+        while (block != nullptr) {
+            HeapBlock* next = block->next;
+            free(block);
+            block = next;
+        }
+    }
+
+    static JSAMPARRAY allocSArray(j_common_ptr cinfo, int poolId, JDIMENSION samplesPerRow,
+                                  JDIMENSION numRows) {
+        // Keep rows aligned for libjpeg's SIMD routines.
+        size_t rowSize = alignUp(samplesPerRow * sizeof(JSAMPLE), EncoderArena::kAlignment);
+        auto rows = static_cast<JSAMPARRAY>(allocate(cinfo, poolId, numRows * sizeof(JSAMPROW)));
+        auto data = static_cast<uint8_t*>(allocate(cinfo, poolId, numRows * rowSize));
+        if (rows == nullptr || data == nullptr) {
+            return nullptr;
+        }
+        for (JDIMENSION i = 0; i < numRows; i++) {
+            rows[i] = reinterpret_cast<JSAMPROW>(data + i * rowSize);
+        }
+        return rows;
+    }
+
+    static JBLOCKARRAY allocBArray(j_common_ptr cinfo, int poolId, JDIMENSION blocksPerRow,
+                                   JDIMENSION numRows) {
+        size_t rowSize = blocksPerRow * sizeof(JBLOCK);
+        auto rows = static_cast<JBLOCKARRAY>(allocate(cinfo, poolId, numRows * sizeof(JBLOCKROW)));
+        auto data = static_cast<uint8_t*>(allocate(cinfo, poolId, numRows * rowSize));
+        if (rows == nullptr || data == nullptr) {
+            return nullptr;
+        }
+        for (JDIMENSION i = 0; i < numRows; i++) {
+            rows[i] = reinterpret_cast<JBLOCKROW>(data + i * rowSize);
+        }
+        return rows;
+    }
+
+    // Virtual arrays are only needed for multi-pass compression. They are always kept in memory.
+    static jvirt_sarray_ptr requestVirtSArray(j_common_ptr cinfo, int poolId, boolean preZero,
+                                              JDIMENSION samplesPerRow, JDIMENSION numRows,
+                                              JDIMENSION /*maxAccess*/) {
+        void* mem = allocate(cinfo, poolId, sizeof(jvirt_sarray_control));
+        if (mem == nullptr) {
+            return nullptr;
+        }
+        auto* array = new (mem) jvirt_sarray_control();
+        array->rowsInArray = numRows;
+        array->samplesPerRow = samplesPerRow;
+        array->preZero = preZero;
+        array->next = from(cinfo)->virtSArrays[poolId];
+        from(cinfo)->virtSArrays[poolId] = array;
+        return array;
+    }
+
+    static jvirt_barray_ptr requestVirtBArray(j_common_ptr cinfo, int poolId, boolean preZero,
+                                              JDIMENSION blocksPerRow, JDIMENSION numRows,
+                                              JDIMENSION /*maxAccess*/) {
+        void* mem = allocate(cinfo, poolId, sizeof(jvirt_barray_control));
+        if (mem == nullptr) {
+            return nullptr;
+        }
+        auto* array = new (mem) jvirt_barray_control();
+        array->rowsInArray = numRows;
+        array->blocksPerRow = blocksPerRow;
+        array->preZero = preZero;
+        array->next = from(cinfo)->virtBArrays[poolId];
+        from(cinfo)->virtBArrays[poolId] = array;
+        return array;
+    }
+
+    static void realizeVirtArrays(j_common_ptr cinfo) {
+        JpegArenaMemoryMgr* mgr = from(cinfo);
+        for (int pool = 0; pool < JPOOL_NUMPOOLS; pool++) {
+            for (auto* s = mgr->virtSArrays[pool]; s != nullptr; s = s->next) {
+                if (s->mem != nullptr) continue;
+                s->mem = allocSArray(cinfo, pool, s->samplesPerRow, s->rowsInArray);
+                for (JDIMENSION i = 0; s->preZero && s->mem != nullptr && i < s->rowsInArray;
+                     i++) {
+                    memset(s->mem[i], 0, s->samplesPerRow * sizeof(JSAMPLE));
+                }
+            }
+            for (auto* b = mgr->virtBArrays[pool]; b != nullptr; b = b->next) {
+                if (b->mem != nullptr) continue;
+                b->mem = allocBArray(cinfo, pool, b->blocksPerRow, b->rowsInArray);
+                for (JDIMENSION i = 0; b->preZero && b->mem != nullptr && i < b->rowsInArray;
+                     i++) {
+                    memset(b->mem[i], 0, b->blocksPerRow * sizeof(JBLOCK));
+                }
+            }
+        }
+    }
+
+    static JSAMPARRAY accessVirtSArray(j_common_ptr cinfo, jvirt_sarray_ptr ptr,
+                                       JDIMENSION startRow, JDIMENSION numRows,
+                                       boolean /*writable*/) {
+        if (ptr->mem == nullptr || startRow + numRows > ptr->rowsInArray) {
+            ERREXIT(cinfo, JERR_BAD_VIRTUAL_ACCESS);
+            return nullptr;
+        }
+        return ptr->mem + startRow;
+    }
+
+    static JBLOCKARRAY accessVirtBArray(j_common_ptr cinfo, jvirt_barray_ptr ptr,
+                                        JDIMENSION startRow, JDIMENSION numRows,
+                                        boolean /*writable*/) {
+        if (ptr->mem == nullptr || startRow + numRows > ptr->rowsInArray) {
+            ERREXIT(cinfo, JERR_BAD_VIRTUAL_ACCESS);
+            return nullptr;
+        }
+        return ptr->mem + startRow;
+    }
+
+    static void freePool(j_common_ptr cinfo, int poolId) {
+        JpegArenaMemoryMgr* mgr = from(cinfo);
+        if (poolId < 0 || poolId >= JPOOL_NUMPOOLS) {
+            ERREXIT1(cinfo, JERR_BAD_POOL_ID, poolId);
+            return;
+        }
+        HeapBlock* block = mgr->heapBlocks[poolId];
+        if (poolId == JPOOL_IMAGE) {
+            while (block != nullptr) {
+                HeapBlock* next = block->next;
+                block->next = mgr->spareBlocks;
+                mgr->spareBlocks = block;
+                block = next;
+            }
+        } else {
+            freeBlocks(block);
+        }
+        mgr->heapBlocks[poolId] = nullptr;
+        mgr->virtSArrays[poolId] = nullptr;
+        mgr->virtBArrays[poolId] = nullptr;
+        mgr->poolUsed[poolId] = 0;
+    }
+
+    static void selfDestruct(j_common_ptr cinfo) {
+        // An arena manager lives in the arena mapping, only heap fallbacks need freeing.
+        JpegArenaMemoryMgr* mgr = from(cinfo);
+        for (int pool = JPOOL_NUMPOOLS - 1; pool >= JPOOL_PERMANENT; pool--) {
+            freePool(cinfo, pool);
+        }
+        freeBlocks(mgr->spareBlocks);
+        cinfo->mem = mgr->previous;
+        if (mgr->ownsSelf) {
+            delete mgr;
+        }
+        if (cinfo->mem != nullptr) {
+            (*cinfo->mem->self_destruct)(cinfo);
+        }
+    }
+
+    JpegArenaMemoryMgr(uint8_t* poolBase, size_t poolSize) : base(poolBase), size(poolSize) {
+        pub.alloc_small = &allocate;
+        pub.alloc_large = &allocate;
+        pub.alloc_sarray = &allocSArray;
+        pub.alloc_barray = &allocBArray;
+        pub.request_virt_sarray = &requestVirtSArray;
+        pub.request_virt_barray = &requestVirtBArray;
+        pub.realize_virt_arrays = &realizeVirtArrays;
+        pub.access_virt_sarray = &accessVirtSArray;
+        pub.access_virt_barray = &accessVirtBArray;
+        pub.free_pool = &freePool;
+        pub.self_destruct = &selfDestruct;
+        pub.max_memory_to_use = static_cast<long>(poolSize);
+        pub.max_alloc_chunk = 1000000000L;
+    }
+};
+
+void useRecyclingJpegMemory(j_common_ptr cinfo) {
+    auto* mgr = new JpegArenaMemoryMgr(/*poolBase*/ nullptr, /*poolSize*/ 0);
+    mgr->ownsSelf = true;
+    // jpeg_create_decompress already put the marker reader and input controller in the permanent
+    // pool of the default manager, it stays around until jpeg_destroy().
+    mgr->previous = cinfo->mem;
+    cinfo->mem = &mgr->pub;
+}
+
+uint32_t EncoderArena::getScratchLumaStride(uint32_t width) {
+    return static_cast<uint32_t>(alignUp(width, kMcuHeight));
+}
+
+uint32_t EncoderArena::getScratchLumaRows(uint32_t height) {
+    return static_cast<uint32_t>(alignUp(height, kMcuHeight));
+}
+
+size_t EncoderArena::getScratchSize(uint32_t width, uint32_t height) {
+    size_t lumaSize = static_cast<size_t>(getScratchLumaStride(width)) * getScratchLumaRows(height);
+    size_t paddedHeight = alignUp(height, kMcuHeight);
+    // Two I420 images (conversion plans ping-pong between them) and the jpeg row tables.
+    return 2 * alignUp(lumaSize, kAlignment) + 4 * alignUp(lumaSize / 4, kAlignment) +
+           alignUp(paddedHeight * sizeof(JSAMPROW), kAlignment) +
+           2 * alignUp(paddedHeight / 2 * sizeof(JSAMPROW), kAlignment);
+}
+
+std::shared_ptr<EncoderArena> EncoderArena::create(uint32_t maxWidth, uint32_t maxHeight) {
+    size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t mgrSize = alignUp(sizeof(JpegArenaMemoryMgr), kAlignment);
+    size_t jpegPoolSize = alignUp(kJpegPoolBaseSize + kJpegPoolBytesPerColumn * maxWidth,
+                                  kAlignment);
+    size_t totalSize = alignUp(mgrSize + jpegPoolSize + getScratchSize(maxWidth, maxHeight),
+                               pageSize);
+
+    void* mem = mmap(/*addr*/ nullptr, totalSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, /*fd*/ -1, /*offset*/ 0);
+    if (mem == MAP_FAILED) {
+        ALOGE("%s: Unable to map %zu bytes for the encoder arena: %s", __FUNCTION__, totalSize,
+              strerror(errno));
+        return nullptr;
+    }
+    // The planes are several MB and walked linearly every frame, huge pages save TLB misses. The
+    // advice only applies to pages faulted in after it, so the mapping isn't populated up front
+    // (no residentMmapFlags()): makeResident faults it in.
+    madvise(mem, totalSize, MADV_HUGEPAGE);
+    makeResident(mem, totalSize, /*writable*/ true);
+
+    std::shared_ptr<EncoderArena> arena(new EncoderArena());
+    arena->mBase = static_cast<uint8_t*>(mem);
+    arena->mMappedSize = totalSize;
+    arena->mJpegMemoryMgr = new (mem) JpegArenaMemoryMgr(arena->mBase + mgrSize, jpegPoolSize);
+    arena->mScratch = arena->mBase + mgrSize + jpegPoolSize;
+    arena->mScratchSize = totalSize - mgrSize - jpegPoolSize;
+
+    // Create the compressor with libjpeg's default memory manager, then put the arena backed one
+    // in front of it. Whatever jpeg_create_compress allocated (libjpeg-turbo 3 puts the master
+    // control struct in the permanent pool) stays with the default manager, which is kept until
+    // jpeg_destroy(): it is per service, not per frame.
+    j_compress_ptr cinfo = &arena->mCompressInfo;
+    cinfo->err = jpeg_std_error(&arena->mJpegError);
+    // The default error_exit exits the process. Users of the compressor install their own.
+    arena->mJpegError.error_exit = [](j_common_ptr cinfo) { (*cinfo->err->output_message)(cinfo); };
+    jpeg_create_compress(cinfo);
+    arena->mJpegMemoryMgr->previous = cinfo->mem;
+    cinfo->mem = &arena->mJpegMemoryMgr->pub;
+
+    ALOGI("%s: Mapped %zu byte encoder arena for frames up to %ux%u", __FUNCTION__, totalSize,
+          maxWidth, maxHeight);
+    return arena;
+}
+
+EncoderArena::~EncoderArena() {
+    if (mCompressInfo.mem != nullptr) {
+        jpeg_destroy_compress(&mCompressInfo);
+    }
+    if (mBase != nullptr) {
+        releaseResident(mBase, mMappedSize);
+        munmap(mBase, mMappedSize);
+    }
+}
+
+bool EncoderArena::canFit(uint32_t width, uint32_t height) const {
+    return getScratchSize(width, height) <= mScratchSize;
+}
+
+void EncoderArena::reset() {
+    mScratchUsed = 0;
+}
+
+void* EncoderArena::allocate(size_t size, size_t alignment) {
+    size_t offset = alignUp(mScratchUsed, alignment);
+    if (offset + size > mScratchSize) {
+        ALOGE("%s: Arena exhausted: requested %zu bytes, %zu of %zu used", __FUNCTION__, size,
+              mScratchUsed, mScratchSize);
+        return nullptr;
+    }
+    mScratchUsed = offset + size;
+    return mScratch + offset;
+}
+
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <memory>
+
+#include <jpeglib.h>
+
+namespace android {
+namespace webcam {
+
+struct JpegArenaMemoryMgr;
+
+// Pre-sized memory for all Encoder scratch: intermediate planes, row tables and everything libjpeg
+// allocates (through a custom libjpeg memory manager). It is sized for the largest frame the UVC
+// gadget advertises and allocated once per service, so that starting a stream or switching formats
+// does not touch the heap.
+// The arena hands out memory with a bump allocator and is reset by each Encoder that uses it, so
+// only one Encoder may use an arena at a time.
+class EncoderArena {
+  public:
+    static constexpr size_t kAlignment = 64;
+
+    // Returns nullptr if the memory could not be mapped.
+    static std::shared_ptr<EncoderArena> create(uint32_t maxWidth, uint32_t maxHeight);
+    // Bytes of scratch memory needed by an Encoder for frames of the given size.
+    static size_t getScratchSize(uint32_t width, uint32_t height);
+    // Scratch I420 images are padded to whole 16x16 macroblocks so that libjpeg can decode into
+    // them. Chroma planes are half the padded luma plane in both directions.
+    static uint32_t getScratchLumaStride(uint32_t width);
+    static uint32_t getScratchLumaRows(uint32_t height);
+
+    ~EncoderArena();
+
+    [[nodiscard]] bool canFit(uint32_t width, uint32_t height) const;
+    // Releases all scratch memory handed out so far.
+    void reset();
+    // Returns nullptr if the arena is exhausted.
+    void* allocate(size_t size, size_t alignment = kAlignment);
+
+    // Long lived compressor whose memory manager allocates from the arena. Never null.
+    j_compress_ptr getJpegCompressor() { return &mCompressInfo; }
+
+    [[nodiscard]] size_t getCapacity() const { return mScratchSize; }
+    [[nodiscard]] size_t getUsed() const { return mScratchUsed; }
+
+  private:
+    EncoderArena() = default;
+
+    uint8_t* mBase = nullptr;
+    size_t mMappedSize = 0;
+
+    uint8_t* mScratch = nullptr;
+    size_t mScratchSize = 0;
+    size_t mScratchUsed = 0;
+
+    JpegArenaMemoryMgr* mJpegMemoryMgr = nullptr;  // lives at the start of the mapping
+    jpeg_compress_struct mCompressInfo{};
+    jpeg_error_mgr mJpegError{};
+};
+
+// Swaps the memory manager of a just created libjpeg object for one that keeps the memory freed
+// after each image for the next one, so that coding a stream of same sized frames stops allocating
+// after the first frame. jpeg_destroy() releases it.
+void useRecyclingJpegMemory(j_common_ptr cinfo);
+
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,568 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+
+#include "EncoderCalibrator.h"
+
+#include <android-base/file.h>
+#include <android-base/strings.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <libyuv/convert_from.h>
+#include <linux/videodev2.h>
+#include <log/log.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "Tunables.h"
+
+namespace android {
+namespace webcam {
+
+namespace {
+constexpr size_t kWarmupFrames = 2;
+constexpr size_t kMeasuredFrames = 8;
+constexpr auto kHuffmanTimeout = std::chrono::seconds(10);
+constexpr auto kHuffmanPollInterval = std::chrono::milliseconds(10);
+
+struct Variant {
+    int32_t jpegQuality;
+    JpegDctMethod dctMethod;
+};
+
+// Tried in this order, best looking first. A variant only gets measured if the ones before it
+// were too slow.
+constexpr Variant kMjpegVariants[] = {
+        {75, JpegDctMethod::ACCURATE}, {75, JpegDctMethod::FAST}, {65, JpegDctMethod::ACCURATE},
+        {65, JpegDctMethod::FAST},     {50, JpegDctMethod::ACCURATE}, {50, JpegDctMethod::FAST},
+};
+
+uint64_t getBudgetNs(uint32_t fps) {
+    if (fps == 0) {
+        return 0;
+    }
+    double budget = fps >= kHighFrameRate ? EncoderCalibrator::kHighFrameRateBudget
+                                          : EncoderCalibrator::kFrameBudget;
+    return static_cast<uint64_t>(budget * 1e9 / fps);
+}
+
+// "0-3" or "0 1 2 3" style cpu list, as found in sysfs.
+uint64_t parseCpuList(const std::string& list) {
+    uint64_t cpuMask = 0;
+    for (const std::string& range : android::base::Split(android::base::Trim(list), " ,")) {
+        if (range.empty()) {
+            continue;
+        }
+        char* end = nullptr;
+        uint32_t first = strtoul(range.c_str(), &end, /*base*/ 10);
+        uint32_t last = *end == '-' ? strtoul(end + 1, nullptr, /*base*/ 10) : first;
+        for (uint32_t cpu = first; cpu <= last && cpu < 64; cpu++) {
+            cpuMask |= uint64_t{1} << cpu;
+        }
+    }
+    return cpuMask;
+}
+
+const char* dctToString(JpegDctMethod method) {
+    return method == JpegDctMethod::FAST ? "fast" : "accurate";
+}
+}  // anonymous namespace
+
+// Stand-in for a camera frame: smooth gradients and shading, hard edges and some sensor noise, so
+// that the DCT and entropy coder have a realistic amount of work. Deterministic, so that runs can
+// be compared.
+struct EncoderCalibrator::CalibrationFrame {
+    CalibrationFrame(uint32_t w, uint32_t h)
+        : width(w), height(h), chromaWidth((w + 1) / 2), chromaHeight((h + 1) / 2) {
+        size_t lumaSize = static_cast<size_t>(width) * height;
+        size_t chromaSize = static_cast<size_t>(chromaWidth) * chromaHeight;
+        planar.resize(lumaSize + 2 * chromaSize);
+        semiPlanar.resize(lumaSize + 2 * chromaSize);
+        rgba.resize(lumaSize * 4);
+
+        uint32_t noise = 0x9e3779b9;
+        uint8_t* y = planar.data();
+        for (uint32_t row = 0; row < height; row++) {
+            for (uint32_t col = 0; col < width; col++) {
+                noise ^= noise << 13;
+                noise ^= noise >> 17;
+                noise ^= noise << 5;
+                double shade = 60 * sin(col * 0.02) * cos(row * 0.015) + 40.0 * col / width;
+                // Checkerboard of hard edges, like text or window frames.
+                double edge = ((col / 96 + row / 64) % 2 == 0) ? 25 : -25;
+                int value = 128 + static_cast<int>(shade + edge + noise % 17) - 8;
+                y[static_cast<size_t>(row) * width + col] =
+                        static_cast<uint8_t>(std::clamp(value, 0, 255));
+            }
+        }
+        uint8_t* u = planar.data() + lumaSize;
+        uint8_t* v = u + chromaSize;
+        for (uint32_t row = 0; row < chromaHeight; row++) {
+            for (uint32_t col = 0; col < chromaWidth; col++) {
+                size_t i = static_cast<size_t>(row) * chromaWidth + col;
+                u[i] = static_cast<uint8_t>(128 + 50 * sin(col * 0.01 + row * 0.02));
+                v[i] = static_cast<uint8_t>(128 + 50 * cos(col * 0.015 - row * 0.01));
+            }
+        }
+
+        memcpy(semiPlanar.data(), y, lumaSize);
+        uint8_t* uv = semiPlanar.data() + lumaSize;
+        for (size_t i = 0; i < chromaSize; i++) {
+            uv[2 * i] = u[i];
+            uv[2 * i + 1] = v[i];
+        }
+        libyuv::I420ToABGR(y, width, u, chromaWidth, v, chromaWidth, rgba.data(), width * 4, width,
+                           height);
+    }
+
+    [[nodiscard]] I420 getI420() {
+        size_t lumaSize = static_cast<size_t>(width) * height;
+        I420 ret;
+        ret.y = planar.data();
+        ret.u = planar.data() + lumaSize;
+        ret.v = ret.u + static_cast<size_t>(chromaWidth) * chromaHeight;
+        ret.yRowStride = width;
+        ret.uRowStride = chromaWidth;
+        ret.vRowStride = chromaWidth;
+        ret.width = width;
+        ret.height = height;
+        return ret;
+    }
+
+    [[nodiscard]] HardwareBufferDesc getPlanarDesc() {
+        I420 i420 = getI420();
+        YuvHardwareBufferDesc yuv;
+        yuv.yData = i420.y;
+        yuv.yDataLength = width * height;
+        yuv.yRowStride = width;
+        yuv.uData = i420.u;
+        yuv.vData = i420.v;
+        yuv.uDataLength = yuv.vDataLength = chromaWidth * chromaHeight;
+        yuv.uRowStride = yuv.vRowStride = chromaWidth;
+        yuv.uvPixelStride = 1;
+        return makeDesc(AHARDWAREBUFFER_FORMAT_Y8Cb8Cr8_420, yuv);
+    }
+
+    [[nodiscard]] HardwareBufferDesc getSemiPlanarDesc() {
+        YuvHardwareBufferDesc yuv;
+        yuv.yData = semiPlanar.data();
+        yuv.yDataLength = width * height;
+        yuv.yRowStride = width;
+        yuv.uData = semiPlanar.data() + yuv.yDataLength;
+        yuv.vData = yuv.uData + 1;
+        // Like the camera's NV12 planes, each ends on its last sample.
+        yuv.uDataLength = yuv.vDataLength = chromaWidth * chromaHeight * 2 - 1;
+        yuv.uRowStride = yuv.vRowStride = chromaWidth * 2;
+        yuv.uvPixelStride = 2;
+        return makeDesc(AHARDWAREBUFFER_FORMAT_Y8Cb8Cr8_420, yuv);
+    }
+
+    [[nodiscard]] HardwareBufferDesc getRgbaDesc() {
+        ARGBHardwareBufferDesc argb;
+        argb.buf = rgba.data();
+        argb.rowStride = width * 4;
+        return makeDesc(AHARDWAREBUFFER_FORMAT_R8G8B8A8_UNORM, argb);
+    }
+
+    template <typename T>
+    [[nodiscard]] HardwareBufferDesc makeDesc(uint32_t format, const T& bufferDesc) const {
+        HardwareBufferDesc ret;
+        ret.width = width;
+        ret.height = height;
+        ret.format = format;
+        ret.bufferDesc = bufferDesc;
+        return ret;
+    }
+
+    const uint32_t width;
+    const uint32_t height;
+    const uint32_t chromaWidth;
+    const uint32_t chromaHeight;
+    std::vector<uint8_t> planar;
+    std::vector<uint8_t> semiPlanar;
+    std::vector<uint8_t> rgba;
+};
+
+EncoderCalibrator::EncoderCalibrator(std::string sysfsRoot, std::shared_ptr<EncoderArena> arena)
+    : mSysfsRoot(std::move(sysfsRoot)), mSharedArena(std::move(arena)) {}
+
+EncoderCalibrator::~EncoderCalibrator() {
+    stop();
+}
+
+void EncoderCalibrator::start(std::vector<StreamSize> sizes) {
+    stop();
+    std::lock_guard<std::mutex> l(mLock);
+    mRunning = true;
+    mCancelled = false;
+    mThread = std::thread(&EncoderCalibrator::threadLoop, this, std::move(sizes));
+}
+
+void EncoderCalibrator::requestStop() {
+    {
+        std::lock_guard<std::mutex> l(mLock);
+        mRunning = false;
+        mCancelled = true;
+    }
+    mStopCondition.notify_all();
+}
+
+void EncoderCalibrator::stop() {
+    requestStop();
+    if (mThread.joinable()) {
+        mThread.join();
+    }
+}
+
+bool EncoderCalibrator::isStopping() {
+    std::lock_guard<std::mutex> l(mLock);
+    return !mRunning;
+}
+
+std::vector<EncoderCalibrator::Cluster> EncoderCalibrator::discoverClusters() const {
+    std::vector<Cluster> clusters;
+    uint64_t seenCpus = 0;
+    // Policies are named after their first cpu.
+    for (uint32_t cpu = 0; cpu < 64; cpu++) {
+        if ((seenCpus >> cpu) & 1) {
+            continue;
+        }
+        std::string policy =
+                mSysfsRoot + "/devices/system/cpu/cpufreq/policy" + std::to_string(cpu);
+        std::string relatedCpus;
+        std::string maxFreq;
+        if (!android::base::ReadFileToString(policy + "/related_cpus", &relatedCpus) ||
+            !android::base::ReadFileToString(policy + "/cpuinfo_max_freq", &maxFreq)) {
+            continue;
+        }
+        Cluster cluster;
+        cluster.cpuMask = parseCpuList(relatedCpus);
+        cluster.maxFreqKhz = strtoll(maxFreq.c_str(), nullptr, /*base*/ 10);
+        if (cluster.cpuMask == 0) {
+            continue;
+        }
+        seenCpus |= cluster.cpuMask;
+        clusters.push_back(cluster);
+    }
+    std::stable_sort(clusters.begin(), clusters.end(), [](const Cluster& a, const Cluster& b) {
+        return a.maxFreqKhz < b.maxFreqKhz;
+    });
+    if (clusters.size() < 2) {
+        clusters.clear();
+    }
+    return clusters;
+}
+
+void EncoderCalibrator::threadLoop(std::vector<StreamSize> sizes) {
+    {
+        std::unique_lock<std::mutex> l(mLock);
+        if (mStopCondition.wait_for(l, kStartDelay, [this] { return !mRunning; })) {
+            return;
+        }
+    }
+
+    EncoderProfileStore& store = EncoderProfileStore::getInstance();
+    std::vector<StreamSize> pending;
+    uint32_t maxWidth = 0;
+    uint32_t maxHeight = 0;
+    for (const StreamSize& size : sizes) {
+        EncoderProfile profile;
+        bool calibrated = std::all_of(size.fps.begin(), size.fps.end(), [&](uint32_t fps) {
+            return store.find(size.fcc, size.width, size.height, fps, &profile);
+        });
+        if (!calibrated) {
+            pending.push_back(size);
+            maxWidth = std::max(maxWidth, size.width);
+            maxHeight = std::max(maxHeight, size.height);
+        }
+    }
+    if (pending.empty()) {
+        ALOGV("%s: All stream configurations have encoder profiles", __FUNCTION__);
+        return;
+    }
+
+    std::vector<Cluster> clusters = discoverClusters();
+    ALOGI("%s: Calibrating %zu stream sizes on %zu cpu clusters", __FUNCTION__, pending.size(),
+          std::max<size_t>(clusters.size(), 1));
+    auto startTime = std::chrono::steady_clock::now();
+    mAllowedCpuMask = getThreadCpuMask();
+    mArena = mSharedArena != nullptr && mSharedArena->canFit(maxWidth, maxHeight)
+                     ? mSharedArena
+                     : EncoderArena::create(maxWidth, maxHeight);
+    mKernelStats = {};
+    bool completed = true;
+    for (const StreamSize& size : pending) {
+        if (!calibrate(size, clusters)) {
+            completed = false;
+            break;
+        }
+    }
+    if (mAllowedCpuMask != 0) {
+        setThreadCpuMask(mAllowedCpuMask);
+    }
+    mArena.reset();
+
+    std::array<double, kConversionKernelCount> nsPerPixel{};
+    for (size_t i = 0; i < kConversionKernelCount; i++) {
+        const Encoder::KernelStats& stats = mKernelStats[i];
+        if (stats.pixels > 0) {
+            nsPerPixel[i] = static_cast<double>(stats.cpuNs) / stats.pixels;
+            ALOGI("%s: Kernel %s: %.3f ns / pixel, %s", __FUNCTION__,
+                  kernelToString(static_cast<ConversionKernel>(i)), nsPerPixel[i],
+                  stats.perf.toString(stats.pixels).c_str());
+        }
+    }
+    store.putKernelCosts(nsPerPixel);
+    ALOGI("%s: Calibration %s after %lld ms", __FUNCTION__,
+          completed ? "completed" : "interrupted",
+          static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                         std::chrono::steady_clock::now() - startTime)
+                                         .count()));
+}
+
+bool EncoderCalibrator::calibrate(const StreamSize& size, const std::vector<Cluster>& clusters) {
+    if (size.fps.empty()) {
+        return true;
+    }
+    CalibrationFrame frame(size.width, size.height);
+    std::vector<uint8_t> dstMem(static_cast<size_t>(size.width) * size.height * 2);
+    struct v4l2_buffer dstDesc {};
+    dstDesc.length = dstMem.size();
+    V4L2Buffer dst(dstMem.data(), &dstDesc);
+    HardwareBufferDesc src = frame.getSemiPlanarDesc();
+
+    uint32_t maxFps = *std::max_element(size.fps.begin(), size.fps.end());
+    uint64_t tightestBudgetNs = UINT64_MAX;
+    for (uint32_t fps : size.fps) {
+        tightestBudgetNs = std::min(tightestBudgetNs, getBudgetNs(fps));
+    }
+    std::vector<Variant> variants;
+    if (size.fcc == V4L2_PIX_FMT_MJPEG) {
+        variants.assign(std::begin(kMjpegVariants), std::end(kMjpegVariants));
+    } else {
+        // JPEG settings don't apply, only the cpus matter.
+        variants.push_back({Tunables::kDefaultJpegQuality, JpegDctMethod::ACCURATE});
+    }
+    // Without distinct clusters everything runs wherever the scheduler puts it.
+    std::vector<Cluster> placements = clusters.empty() ? std::vector<Cluster>{Cluster{}} : clusters;
+
+    // frameNs[placement][variant], 0 if not measured.
+    std::vector<std::vector<uint64_t>> frameNs(placements.size(),
+                                               std::vector<uint64_t>(variants.size(), 0));
+    for (size_t p = 0; p < placements.size(); p++) {
+        uint64_t cpuMask = placements[p].cpuMask;
+        if (cpuMask != 0 &&
+            ((cpuMask & mAllowedCpuMask) != cpuMask || !setThreadCpuMask(cpuMask))) {
+            ALOGW("%s: Cannot run on cpus 0x%" PRIx64 ", skipping them", __FUNCTION__, cpuMask);
+            continue;
+        }
+        CameraConfig config;
+        config.width = size.width;
+        config.height = size.height;
+        config.fcc = size.fcc;
+        config.fps = maxFps;
+        Encoder encoder(config, mArena);
+        if (!encoder.isInited()) {
+            ALOGE("%s: Failed to create an encoder for %ux%u", __FUNCTION__, size.width,
+                  size.height);
+            return true;
+        }
+        encoder.setCancelFlag(&mCancelled);
+        for (size_t v = 0; v < variants.size(); v++) {
+            EncoderSettings settings;
+            settings.jpegQuality = variants[v].jpegQuality;
+            settings.dctMethod = variants[v].dctMethod;
+            settings.quantTables = Tunables::getInstance().getDefaultQuantTables();
+            encoder.setFixedSettings(settings);
+            uint64_t ns = measureFrameNs(encoder, src, /*rotation*/ 0, &dst);
+            if (ns == 0) {
+                return !isStopping();
+            }
+            frameNs[p][v] = ns;
+            if (ns <= tightestBudgetNs) {
+                // Every frame rate of this size is met, the variants after it are worse.
+                break;
+            }
+        }
+    }
+    if (mAllowedCpuMask != 0) {
+        setThreadCpuMask(mAllowedCpuMask);
+    }
+    if (!measureKernels(size, frame)) {
+        return false;
+    }
+
+    for (uint32_t fps : size.fps) {
+        uint64_t budgetNs = getBudgetNs(fps);
+        size_t bestPlacement = placements.size();
+        size_t bestVariant = variants.size();
+        // Best variant within budget, on the least capable cluster that manages it.
+        for (size_t v = 0; v < variants.size() && bestPlacement == placements.size(); v++) {
+            for (size_t p = 0; p < placements.size(); p++) {
+                if (frameNs[p][v] != 0 && frameNs[p][v] <= budgetNs) {
+                    bestPlacement = p;
+                    bestVariant = v;
+                    break;
+                }
+            }
+        }
+        if (bestPlacement == placements.size()) {
+            // Nothing keeps up, go for the fastest.
+            uint64_t fastestNs = UINT64_MAX;
+            for (size_t p = 0; p < placements.size(); p++) {
+                for (size_t v = 0; v < variants.size(); v++) {
+                    if (frameNs[p][v] != 0 && frameNs[p][v] < fastestNs) {
+                        fastestNs = frameNs[p][v];
+                        bestPlacement = p;
+                        bestVariant = v;
+                    }
+                }
+            }
+        }
+        if (bestPlacement == placements.size()) {
+            ALOGE("%s: No measurements for %ux%u", __FUNCTION__, size.width, size.height);
+            return true;
+        }
+
+        EncoderProfile profile;
+        profile.fcc = size.fcc;
+        profile.width = size.width;
+        profile.height = size.height;
+        profile.fps = fps;
+        profile.jpegQuality = variants[bestVariant].jpegQuality;
+        profile.dctMethod = variants[bestVariant].dctMethod;
+        profile.cpuMask = placements[bestPlacement].cpuMask;
+        profile.frameNs = frameNs[bestPlacement][bestVariant];
+        if (size.fcc == V4L2_PIX_FMT_MJPEG && !measureJpegBytes(frame, &profile)) {
+            return false;
+        }
+        ALOGI("%s: %ux%u@%u %s: quality %d, %s dct, cpus 0x%" PRIx64 ", %.2f ms / frame "
+              "(budget %.2f ms)",
+              __FUNCTION__, size.width, size.height, fps,
+              size.fcc == V4L2_PIX_FMT_MJPEG ? "MJPEG" : "YUYV", profile.jpegQuality,
+              dctToString(profile.dctMethod), profile.cpuMask, profile.frameNs / 1e6,
+              budgetNs / 1e6);
+        EncoderProfileStore::getInstance().put(profile);
+    }
+    return true;
+}
+
+bool EncoderCalibrator::measureKernels(const StreamSize& size, CalibrationFrame& frame) {
+    std::vector<uint8_t> dstMem(static_cast<size_t>(size.width) * size.height * 2);
+    struct v4l2_buffer dstDesc {};
+    dstDesc.length = dstMem.size();
+    V4L2Buffer dst(dstMem.data(), &dstDesc);
+
+    CameraConfig config;
+    config.width = size.width;
+    config.height = size.height;
+    config.fcc = size.fcc;
+    config.perfCounters = true;
+    Encoder encoder(config, mArena);
+    if (!encoder.isInited()) {
+        return true;
+    }
+    EncoderSettings settings;
+    settings.quantTables = Tunables::getInstance().getDefaultQuantTables();
+    encoder.setFixedSettings(settings);
+    encoder.setCancelFlag(&mCancelled);
+    struct Source {
+        HardwareBufferDesc desc;
+        uint32_t rotation;
+    };
+    Source sources[] = {
+            {frame.getSemiPlanarDesc(), 0},
+            {frame.getSemiPlanarDesc(), 180},
+            {frame.getPlanarDesc(), 0},
+            {frame.getRgbaDesc(), 0},
+    };
+    for (Source& source : sources) {
+        if (measureFrameNs(encoder, source.desc, source.rotation, &dst) == 0 && isStopping()) {
+            return false;
+        }
+    }
+    const Encoder::KernelStatsArray& stats = encoder.getKernelStats();
+    for (size_t i = 0; i < kConversionKernelCount; i++) {
+        mKernelStats[i].runs += stats[i].runs;
+        mKernelStats[i].pixels += stats[i].pixels;
+        mKernelStats[i].cpuNs += stats[i].cpuNs;
+        mKernelStats[i].perf.add(stats[i].perf);
+    }
+    return true;
+}
+
+uint64_t EncoderCalibrator::measureFrameNs(Encoder& encoder, HardwareBufferDesc& src,
+                                           uint32_t rotation, V4L2Buffer* dst) {
+    std::vector<uint64_t> samples;
+    for (size_t i = 0; i < kWarmupFrames + kMeasuredFrames; i++) {
+        if (isStopping()) {
+            return 0;
+        }
+        EncodeRequest request(src, dst, rotation);
+        auto start = std::chrono::steady_clock::now();
+        if (!encoder.process(request)) {
+            if (!isStopping()) {
+                ALOGE("%s: Encoding %ux%u failed", __FUNCTION__, src.width, src.height);
+            }
+            return 0;
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        if (i >= kWarmupFrames) {
+            samples.push_back(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+        }
+    }
+    std::nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+    return samples[samples.size() / 2];
+}
+
+bool EncoderCalibrator::measureJpegBytes(CalibrationFrame& frame, EncoderProfile* profile) {
+    HuffmanOptimizer optimizer(frame.width, frame.height);
+    optimizer.start();
+    optimizer.offerFrame(frame.getI420(), profile->jpegQuality,
+                         Tunables::getInstance().getDefaultQuantTables(), profile->dctMethod);
+    HuffmanStats stats;
+    auto deadline = std::chrono::steady_clock::now() + kHuffmanTimeout;
+    while ((stats = optimizer.getStats()).builds == 0 &&
+           std::chrono::steady_clock::now() < deadline) {
+        std::unique_lock<std::mutex> l(mLock);
+        if (mStopCondition.wait_for(l, kHuffmanPollInterval, [this] { return !mRunning; })) {
+            break;
+        }
+    }
+    optimizer.stop();
+    if (isStopping()) {
+        return false;
+    }
+    if (stats.builds == 0) {
+        ALOGW("%s: No huffman tables for %ux%u", __FUNCTION__, frame.width, frame.height);
+        return true;
+    }
+    profile->jpegBytes = stats.standardBytes;
+    profile->optimizedJpegBytes = stats.optimizedBytes;
+    ALOGI("%s: %ux%u quality %d: %" PRIu64 " bytes, %" PRIu64 " with fitted huffman tables "
+          "(%.1f%% smaller)",
+          __FUNCTION__, frame.width, frame.height, profile->jpegQuality, stats.standardBytes,
+          stats.optimizedBytes,
+          100.0 * (1.0 - static_cast<double>(stats.optimizedBytes) / stats.standardBytes));
+    return true;
+}
+
+}  // namespace webcam
+}  // namespace android
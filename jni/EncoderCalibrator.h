@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Encoder.h"
+#include "EncoderProfile.h"
+
+namespace android {
+namespace webcam {
+
+// Finds the encoder settings that keep up with each advertised stream configuration, while the
+// host isn't streaming. For every frame size it encodes a synthetic camera frame with decreasing
+// JPEG quality settings on each cpu cluster, then picks per frame rate the best quality whose
+// frames take at most kFrameBudget (kHighFrameRateBudget at high frame rates) of the frame
+// interval, on the least capable cluster that manages it. Results go to the EncoderProfileStore,
+// together with the measured conversion kernel costs. Configurations that already have a profile
+// are skipped.
+class EncoderCalibrator {
+  public:
+    // Set to true to drop the saved profiles and calibrate again.
+    static constexpr char kCalibrateProperty[] = "debug.deviceaswebcam.calibrate";
+    // Share of the frame interval the encoder may use, leaving time for the camera and transfer.
+    static constexpr double kFrameBudget = 0.5;
+    // At high frame rates the camera, encoder and USB stages overlap more, the deeper buffering
+    // absorbs the jitter.
+    static constexpr double kHighFrameRateBudget = 0.75;
+    // Calibration waits this long after start(), a host often starts streaming right away.
+    static constexpr std::chrono::seconds kStartDelay{5};
+
+    // Frame size of one advertised format, and the frame rates it is offered at.
+    struct StreamSize {
+        uint32_t fcc = 0;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        std::vector<uint32_t> fps;
+    };
+
+    // Encoders are created in arena, which must not be used by anyone else while calibrating. The
+    // calibrator maps its own arena if arena is null.
+    EncoderCalibrator(std::string sysfsRoot, std::shared_ptr<EncoderArena> arena);
+    ~EncoderCalibrator();
+
+    // Calibrates the stream sizes without profiles on a background thread.
+    void start(std::vector<StreamSize> sizes);
+    // Abandons a running calibration, cancelling the frame being encoded. Returns right away,
+    // the thread exits within about an MCU row. Profiles completed so far are kept.
+    void requestStop();
+    // requestStop(), then waits for the thread.
+    void stop();
+
+  private:
+    // Cpus sharing a cpufreq policy.
+    struct Cluster {
+        uint64_t cpuMask = 0;
+        int64_t maxFreqKhz = 0;
+    };
+
+    struct CalibrationFrame;
+
+    void threadLoop(std::vector<StreamSize> sizes);
+    [[nodiscard]] bool isStopping();
+    // Clusters by ascending max frequency, empty if they can't be told apart.
+    [[nodiscard]] std::vector<Cluster> discoverClusters() const;
+    // Measures and saves the profiles of size. Returns false if stopped.
+    bool calibrate(const StreamSize& size, const std::vector<Cluster>& clusters);
+    // Encodes the synthetic frame of every source layout with default settings, for the kernel
+    // costs. Returns false if stopped.
+    bool measureKernels(const StreamSize& size, CalibrationFrame& frame);
+    // Median time to encode src, 0 if stopped or failed.
+    uint64_t measureFrameNs(Encoder& encoder, HardwareBufferDesc& src, uint32_t rotation,
+                            V4L2Buffer* dst);
+    // Fills in the MJPEG sizes of profile. Returns false if stopped.
+    bool measureJpegBytes(CalibrationFrame& frame, EncoderProfile* profile);
+
+    const std::string mSysfsRoot;
+    const std::shared_ptr<EncoderArena> mSharedArena;
+    // Used by the calibration thread only.
+    std::shared_ptr<EncoderArena> mArena;
+    uint64_t mAllowedCpuMask = 0;  // cpus the thread started out on
+    // Kernel timings summed over all sizes.
+    Encoder::KernelStatsArray mKernelStats{};
+
+    std::mutex mLock;
+    std::condition_variable mStopCondition;  // guarded by mLock
+    bool mRunning = false;                   // guarded by mLock
+    // Cancels the calibration Encoders' frames, mirrors !mRunning.
+    std::atomic<bool> mCancelled = false;
+    std::thread mThread;
+};
+
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,216 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+
+#include "EncoderProfile.h"
+
+#include <android-base/file.h>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <log/log.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace android {
+namespace webcam {
+
+namespace {
+// One record per line:
+//   version <n>
+//   fingerprint <ro.build.fingerprint>
+//   kernel <name> <ns per pixel>
+//   profile <fcc> <width> <height> <fps> <quality> <dct> <workers> <cpu mask> <frame ns>
+//           <jpeg bytes> <optimized jpeg bytes>
+constexpr int kFileVersion = 1;
+constexpr int kProfileFields = 11;
+}  // anonymous namespace
+
+EncoderProfileStore& EncoderProfileStore::getInstance() {
+    static EncoderProfileStore sInstance;
+    return sInstance;
+}
+
+void EncoderProfileStore::init(const std::string& directory) {
+    std::lock_guard<std::mutex> l(mLock);
+    mPath = directory + "/" + kFileName;
+    mFingerprint = android::base::GetProperty(kFingerprintProperty, "");
+    mProfiles.clear();
+    mKernelCosts.fill(0);
+
+    std::string contents;
+    if (!android::base::ReadFileToString(mPath, &contents)) {
+        ALOGI("%s: No encoder profiles yet", __FUNCTION__);
+        return;
+    }
+    if (!parseLocked(contents)) {
+        // Stale or corrupt, the calibrator starts over.
+        mProfiles.clear();
+        mKernelCosts.fill(0);
+        return;
+    }
+    ALOGI("%s: Loaded %zu encoder profiles", __FUNCTION__, mProfiles.size());
+    applyKernelCostsLocked();
+}
+
+bool EncoderProfileStore::find(uint32_t fcc, uint32_t width, uint32_t height, uint32_t fps,
+                               EncoderProfile* profile) const {
+    std::lock_guard<std::mutex> l(mLock);
+    for (const EncoderProfile& candidate : mProfiles) {
+        if (candidate.matches(fcc, width, height, fps)) {
+            *profile = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+void EncoderProfileStore::put(const EncoderProfile& profile) {
+    std::lock_guard<std::mutex> l(mLock);
+    bool replaced = false;
+    for (EncoderProfile& existing : mProfiles) {
+        if (existing.matches(profile.fcc, profile.width, profile.height, profile.fps)) {
+            existing = profile;
+            replaced = true;
+            break;
+        }
+    }
+    if (!replaced) {
+        mProfiles.push_back(profile);
+    }
+    saveLocked();
+}
+
+void EncoderProfileStore::putKernelCosts(
+        const std::array<double, kConversionKernelCount>& nsPerPixel) {
+    std::lock_guard<std::mutex> l(mLock);
+    for (size_t i = 0; i < kConversionKernelCount; i++) {
+        if (nsPerPixel[i] > 0) {
+            mKernelCosts[i] = nsPerPixel[i];
+        }
+    }
+    applyKernelCostsLocked();
+    saveLocked();
+}
+
+void EncoderProfileStore::clear() {
+    std::lock_guard<std::mutex> l(mLock);
+    mProfiles.clear();
+    mKernelCosts.fill(0);
+    KernelCostTable::getInstance().resetToDefaults();
+    saveLocked();
+}
+
+bool EncoderProfileStore::parseLocked(const std::string& contents) {
+    std::vector<std::string> lines = android::base::Split(contents, "\n");
+    int version = 0;
+    std::string fingerprint;
+    for (const std::string& line : lines) {
+        std::vector<std::string> fields = android::base::Split(android::base::Trim(line), " ");
+        if (fields.empty() || fields[0].empty()) {
+            continue;
+        }
+        const std::string& type = fields[0];
+        if (type == "version" && fields.size() == 2) {
+            version = atoi(fields[1].c_str());
+        } else if (type == "fingerprint" && fields.size() == 2) {
+            fingerprint = fields[1];
+        } else if (type == "kernel" && fields.size() == 3) {
+            for (size_t i = 0; i < kConversionKernelCount; i++) {
+                if (fields[1] == kernelToString(static_cast<ConversionKernel>(i))) {
+                    mKernelCosts[i] = strtod(fields[2].c_str(), nullptr);
+                }
+            }
+        } else if (type == "profile" && fields.size() == kProfileFields + 1) {
+            EncoderProfile profile;
+            uint32_t dctMethod = 0;
+            int parsed = sscanf(line.c_str(),
+                                "profile %u %u %u %u %d %u %u %" SCNx64 " %" SCNu64 " %" SCNu64
+                                " %" SCNu64,
+                                &profile.fcc, &profile.width, &profile.height, &profile.fps,
+                                &profile.jpegQuality, &dctMethod, &profile.maxEncoderWorkers,
+                                &profile.cpuMask, &profile.frameNs, &profile.jpegBytes,
+                                &profile.optimizedJpegBytes);
+            if (parsed != kProfileFields) {
+                ALOGE("%s: Malformed profile '%s'", __FUNCTION__, line.c_str());
+                return false;
+            }
+            profile.dctMethod =
+                    dctMethod == 0 ? JpegDctMethod::ACCURATE : JpegDctMethod::FAST;
+            mProfiles.push_back(profile);
+        }
+    }
+    if (version != kFileVersion) {
+        ALOGI("%s: Encoder profiles have version %d, expected %d", __FUNCTION__, version,
+              kFileVersion);
+        return false;
+    }
+    if (fingerprint != mFingerprint) {
+        ALOGI("%s: Encoder profiles were measured on build %s, recalibrating", __FUNCTION__,
+              fingerprint.c_str());
+        return false;
+    }
+    return true;
+}
+
+std::string EncoderProfileStore::serializeLocked() const {
+    std::string ret = android::base::StringPrintf("version %d\nfingerprint %s\n", kFileVersion,
+                                                  mFingerprint.c_str());
+    for (size_t i = 0; i < kConversionKernelCount; i++) {
+        if (mKernelCosts[i] > 0) {
+            ret += android::base::StringPrintf(
+                    "kernel %s %.4f\n", kernelToString(static_cast<ConversionKernel>(i)),
+                    mKernelCosts[i]);
+        }
+    }
+    for (const EncoderProfile& p : mProfiles) {
+        ret += android::base::StringPrintf(
+                "profile %u %u %u %u %d %u %u %" PRIx64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+                p.fcc, p.width, p.height, p.fps, p.jpegQuality,
+                static_cast<uint32_t>(p.dctMethod), p.maxEncoderWorkers, p.cpuMask, p.frameNs,
+                p.jpegBytes, p.optimizedJpegBytes);
+    }
+    return ret;
+}
+
+void EncoderProfileStore::saveLocked() const {
+    if (mPath.empty()) {
+        return;
+    }
+    // Write and rename, so that a crash never leaves half a file behind.
+    std::string tmpPath = mPath + ".tmp";
+    if (!android::base::WriteStringToFile(serializeLocked(), tmpPath) ||
+        rename(tmpPath.c_str(), mPath.c_str()) != 0) {
+        ALOGE("%s: Failed to save encoder profiles to %s: %s", __FUNCTION__, mPath.c_str(),
+              strerror(errno));
+    }
+}
+
+void EncoderProfileStore::applyKernelCostsLocked() const {
+    KernelCostTable& costTable = KernelCostTable::getInstance();
+    for (size_t i = 0; i < kConversionKernelCount; i++) {
+        if (mKernelCosts[i] > 0) {
+            costTable.setCost(static_cast<ConversionKernel>(i), mKernelCosts[i]);
+        }
+    }
+}
+
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ConversionPlanner.h"
+#include "Tunables.h"
+
+namespace android {
+namespace webcam {
+
+// Encoder settings the EncoderCalibrator measured to be the best for one stream configuration.
+struct EncoderProfile {
+    uint32_t fcc = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t fps = 0;
+
+    int32_t jpegQuality = Tunables::kDefaultJpegQuality;
+    JpegDctMethod dctMethod = JpegDctMethod::ACCURATE;
+    uint32_t maxEncoderWorkers = 0;  // 0: Tunables::getDefaultEncoderWorkers()
+    uint64_t cpuMask = 0;            // see CameraConfig::cpuMask
+
+    // Measured with the settings above on the calibration frame.
+    uint64_t frameNs = 0;
+    uint64_t jpegBytes = 0;           // MJPEG only, with the standard huffman tables
+    uint64_t optimizedJpegBytes = 0;  // and with the HuffmanOptimizer's tables
+
+    [[nodiscard]] bool matches(uint32_t fcc, uint32_t width, uint32_t height,
+                               uint32_t fps) const {
+        return this->fcc == fcc && this->width == width && this->height == height &&
+               this->fps == fps;
+    }
+};
+
+// The device's encoder profiles and measured kernel costs, kept in a small text file in the app's
+// files directory. A file written by another build is ignored, so that an update triggers a new
+// calibration. Thread safe.
+class EncoderProfileStore {
+  public:
+    static constexpr char kFileName[] = "encoder_profiles.txt";
+    static constexpr char kFingerprintProperty[] = "ro.build.fingerprint";
+
+    static EncoderProfileStore& getInstance();
+
+    // Loads the profiles saved in directory and applies the kernel costs to the KernelCostTable.
+    void init(const std::string& directory);
+
+    [[nodiscard]] bool find(uint32_t fcc, uint32_t width, uint32_t height, uint32_t fps,
+                            EncoderProfile* profile) const;
+    // Adds or replaces the profile of a stream configuration and saves the file.
+    void put(const EncoderProfile& profile);
+    // Sets the measured cost of kernels, in ns per pixel, in the KernelCostTable too. 0 costs are
+    // skipped (not measured). Saves the file.
+    void putKernelCosts(const std::array<double, kConversionKernelCount>& nsPerPixel);
+    // Drops all profiles and measured costs, so that everything gets calibrated again.
+    void clear();
+
+  private:
+    EncoderProfileStore() = default;
+
+    bool parseLocked(const std::string& contents);
+    [[nodiscard]] std::string serializeLocked() const;
+    void saveLocked() const;
+    void applyKernelCostsLocked() const;
+
+    mutable std::mutex mLock;
+    std::string mPath;         // guarded by mLock, empty until init()
+    std::string mFingerprint;  // guarded by mLock
+    std::vector<EncoderProfile> mProfiles;                      // guarded by mLock
+    std::array<double, kConversionKernelCount> mKernelCosts{};  // guarded by mLock
+};
+
+}  // namespace webcam
+}  // namespace android
@@ -31,6 +31,20 @@ struct CameraConfig {
     uint32_t height = 0;
     uint32_t fps = 0;
     uint32_t fcc = V4L2_PIX_FMT_MJPEG;
+    // Convert camera frames only when the consumer asks for one (see requestFrame), instead of
+    // converting all of them and letting the BufferManager drop the excess.
+    bool pullMode = false;
+    // Compress MJPEG frames with huffman tables fitted to the stream (see HuffmanOptimizer). Saves
+    // a few percent at best, for extra compressions on a background thread and a frame copy on
+    // the encoder thread.
+    bool optimizeHuffmanTables = false;
+    // Compare quantization table sets on the stream's frames (see QuantTablesEvaluator).
+    bool evaluateQuantTables = false;
+    // Cpus the encoder thread is restricted to, one bit per cpu. 0 leaves placement to the
+    // scheduler.
+    uint64_t cpuMask = 0;
+    // Count cycles, cache misses etc. per conversion kernel and frame (see PerfCounters).
+    bool perfCounters = false;
 };
 
 // Abstract class which maps camera operations
@@ -43,6 +57,8 @@ class FrameProvider {
     virtual Status startStreaming() = 0;
     virtual Status stopStreaming() = 0;
     virtual Status encodeImage(AHardwareBuffer* hardwareBuffer, long timestamp, int rotation) = 0;
+    // Pull mode: the consumer will pick up one more frame. Called once per pickup.
+    virtual void requestFrame() {}
     [[nodiscard]] virtual bool isInited() const { return mInited; }
 
   protected:
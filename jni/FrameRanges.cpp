@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+
+#include "FrameRanges.h"
+
+#include <algorithm>
+
+namespace android {
+namespace webcam {
+
+namespace {
+bool isInSizeRange(const struct v4l2_frmsize_stepwise& range, uint32_t width, uint32_t height) {
+    if (width < range.min_width || width > range.max_width || height < range.min_height ||
+        height > range.max_height) {
+        return false;
+    }
+    return (range.step_width == 0 || (width - range.min_width) % range.step_width == 0) &&
+           (range.step_height == 0 || (height - range.min_height) % range.step_height == 0);
+}
+}  // anonymous namespace
+
+uint32_t toFrameInterval(const struct v4l2_fract& fract) {
+    if (fract.denominator == 0) {
+        return 0;
+    }
+    uint64_t interval = (static_cast<uint64_t>(fract.numerator) * FRAME_INTERVAL_NUM +
+                         fract.denominator / 2) /
+                        fract.denominator;
+    return static_cast<uint32_t>(std::min<uint64_t>(interval, UINT32_MAX));
+}
+
+uint32_t toFps(uint32_t frameInterval) {
+    return frameInterval == 0 ? 0 : (FRAME_INTERVAL_NUM + frameInterval / 2) / frameInterval;
+}
+
+std::vector<uint32_t> expandIntervalRange(uint32_t minInterval, uint32_t maxInterval,
+                                          uint32_t step) {
+    std::vector<uint32_t> ret;
+    if (minInterval == 0 || maxInterval < minInterval) {
+        return ret;
+    }
+    if (step > 0 && (maxInterval - minInterval) / step < kMaxEnumeratedIntervalSteps) {
+        for (uint64_t interval = minInterval; interval <= maxInterval; interval += step) {
+            ret.push_back(static_cast<uint32_t>(interval));
+        }
+        return ret;
+    }
+    ret.push_back(minInterval);
+    for (uint32_t fps : kStandardFrameRates) {
+        uint32_t interval = FRAME_INTERVAL_NUM / fps;
+        if (interval <= minInterval || interval >= maxInterval) {
+            continue;
+        }
+        if (step > 0) {
+            // Nearest interval on the range's grid.
+            interval = minInterval + (interval - minInterval + step / 2) / step * step;
+            interval = std::min(interval, maxInterval);
+        }
+        ret.push_back(interval);
+    }
+    ret.push_back(maxInterval);
+    return ret;
+}
+
+void limitFrameRate(std::vector<uint32_t>* intervals, uint32_t maxFps) {
+    if (maxFps == 0 || intervals->empty()) {
+        return;
+    }
+    auto firstAllowed = std::find_if(intervals->begin(), intervals->end(),
+                                     [maxFps](uint32_t interval) {
+                                         return toFps(interval) <= maxFps;
+                                     });
+    if (firstAllowed == intervals->end()) {
+        firstAllowed--;
+    }
+    intervals->erase(intervals->begin(), firstAllowed);
+}
+
+std::vector<FrameSize> expandSizeRange(const struct v4l2_frmsize_stepwise& range) {
+    std::vector<FrameSize> ret;
+    ret.push_back({range.min_width, range.min_height});
+    for (const FrameSize& size : kStandardFrameSizes) {
+        if (isInSizeRange(range, size.width, size.height)) {
+            ret.push_back(size);
+        }
+    }
+    ret.push_back({range.max_width, range.max_height});
+    ret.erase(std::unique(ret.begin(), ret.end(),
+                          [](const FrameSize& a, const FrameSize& b) {
+                              return a.width == b.width && a.height == b.height;
+                          }),
+              ret.end());
+    return ret;
+}
+
+}  // namespace webcam
+}  // namespace android
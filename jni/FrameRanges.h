@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <linux/videodev2.h>
+#include <cstdint>
+#include <vector>
+
+namespace android {
+namespace webcam {
+
+// Frame intervals are in units of 1 / FRAME_INTERVAL_NUM seconds, as in UVC descriptors.
+constexpr uint32_t FRAME_INTERVAL_NUM = 10'000'000;
+
+struct FrameSize {
+    uint32_t width;
+    uint32_t height;
+};
+
+// Rates offered for stepwise and continuous frame interval ranges, fastest first.
+constexpr uint32_t kStandardFrameRates[] = {120, 90, 60, 50, 30, 25, 24, 20, 15, 10, 5};
+// A stepwise interval range with fewer steps than this is offered in full.
+constexpr uint32_t kMaxEnumeratedIntervalSteps = 8;
+
+// Sizes offered for stepwise and continuous frame size ranges, by ascending area, along with the
+// range's minimum and maximum.
+constexpr FrameSize kStandardFrameSizes[] = {
+        {160, 120},  {176, 144},  {320, 180},   {320, 240},   {640, 360},
+        {640, 480},  {800, 600},  {960, 540},   {1024, 768},  {1280, 720},
+        {1280, 960}, {1600, 1200}, {1920, 1080}, {2560, 1440}, {3840, 2160},
+};
+
+// In units of 1 / FRAME_INTERVAL_NUM seconds, rounded. 0 if invalid.
+uint32_t toFrameInterval(const struct v4l2_fract& fract);
+
+// Rounded, so that eg: 29.97 fps counts as 30.
+uint32_t toFps(uint32_t frameInterval);
+
+// Discrete intervals standing for the range [minInterval, maxInterval], in steps of step (0 for
+// continuous ranges). Ascending, but standard rates snapped onto a coarse step may repeat. Empty
+// if the range is invalid.
+std::vector<uint32_t> expandIntervalRange(uint32_t minInterval, uint32_t maxInterval,
+                                          uint32_t step);
+
+// Drops the ascending intervals of rates above maxFps, keeping the slowest if that would leave
+// none. The camera is only streamed in a regular capture session, rates beyond its fastest AE
+// target fps range need a constrained high speed session. 0 for no limit.
+void limitFrameRate(std::vector<uint32_t>* intervals, uint32_t maxFps);
+
+// Discrete sizes standing for a stepwise or continuous size range, by ascending area.
+std::vector<FrameSize> expandSizeRange(const struct v4l2_frmsize_stepwise& range);
+
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+
+#include "GadgetStats.h"
+
+#include <android-base/stringprintf.h>
+#include <inttypes.h>
+#include <log/log.h>
+#include <algorithm>
+
+namespace android {
+namespace webcam {
+
+void GadgetStats::onQueued(uint32_t index, Clock::time_point now) {
+    if (index < kMaxBuffers) {
+        mQueueTimes[index] = now;
+    }
+}
+
+void GadgetStats::onReturned(const struct v4l2_buffer& buffer, Clock::time_point now) {
+    mReturned++;
+    if ((buffer.flags & V4L2_BUF_FLAG_ERROR) != 0) {
+        mErrors++;
+    }
+    // The driver numbers the buffers it completes, a gap is a buffer it never handed back.
+    int64_t sequence = buffer.sequence;
+    if (mLastSequence >= 0 && sequence > mLastSequence + 1) {
+        mSequenceGaps += sequence - mLastSequence - 1;
+    }
+    mLastSequence = sequence;
+
+    if (buffer.index >= kMaxBuffers || mQueueTimes[buffer.index] == Clock::time_point{}) {
+        return;
+    }
+    auto queueTime = mQueueTimes[buffer.index];
+    mQueueTimes[buffer.index] = {};
+    auto sentTime = now;
+    // f_uvc flags its buffers TIMESTAMP_COPY but stamps them with ktime_get_ns() as they
+    // complete, CLOCK_MONOTONIC like steady_clock. Buffers are queued with a zero timestamp, so
+    // a zero one wasn't stamped.
+    uint32_t timestampType = buffer.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK;
+    if ((timestampType == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC ||
+         timestampType == V4L2_BUF_FLAG_TIMESTAMP_COPY) &&
+        (buffer.timestamp.tv_sec != 0 || buffer.timestamp.tv_usec != 0)) {
+        sentTime = Clock::time_point(std::chrono::seconds(buffer.timestamp.tv_sec) +
+                                     std::chrono::microseconds(buffer.timestamp.tv_usec));
+        sentTime = std::clamp(sentTime, queueTime, now);
+        mPickupTimes[getTimeBucket(
+                std::chrono::duration_cast<std::chrono::microseconds>(now - sentTime).count())]++;
+    }
+    int64_t sendTimeUs =
+            std::chrono::duration_cast<std::chrono::microseconds>(sentTime - queueTime).count();
+    mSendTimes[getTimeBucket(sendTimeUs)]++;
+    mMaxSendTimeUs = std::max(mMaxSendTimeUs, static_cast<uint64_t>(sendTimeUs));
+}
+
+size_t GadgetStats::getTimeBucket(int64_t us) {
+    size_t bucket = 0;
+    for (int64_t ms = us / 1000; ms > 0 && bucket < kTimeBuckets - 1; ms >>= 1) {
+        bucket++;
+    }
+    return bucket;
+}
+
+std::string GadgetStats::formatTimeHistogram(const TimeHistogram& histogram) {
+    std::string out;
+    for (size_t i = 0; i < histogram.size(); i++) {
+        if (histogram[i] == 0) {
+            continue;
+        }
+        if (!out.empty()) {
+            out += ' ';
+        }
+        if (i == histogram.size() - 1) {
+            android::base::StringAppendF(&out, ">=%ums:%" PRIu64, 1u << (i - 1), histogram[i]);
+        } else {
+            android::base::StringAppendF(&out, "<%ums:%" PRIu64, 1u << i, histogram[i]);
+        }
+    }
+    return out.empty() ? "-" : out;
+}
+
+void GadgetStats::dump(std::string* out) const {
+    android::base::StringAppendF(
+            out,
+            "gadget_returned %" PRIu64 "\ngadget_errors %" PRIu64 "\ngadget_sequence_gaps %" PRIu64
+            "\ngadget_max_send_us %" PRIu64 "\ngadget_send_times %s\ngadget_pickup_times %s\n",
+            mReturned, mErrors, mSequenceGaps, mMaxSendTimeUs,
+            formatTimeHistogram(mSendTimes).c_str(), formatTimeHistogram(mPickupTimes).c_str());
+}
+
+void GadgetStats::log() const {
+    if (mReturned == 0) {
+        return;
+    }
+    ALOGI("Gadget: %" PRIu64 " buffers returned, %" PRIu64 " with errors, %" PRIu64
+          " sequence gaps, max send time %" PRIu64 "us",
+          mReturned, mErrors, mSequenceGaps, mMaxSendTimeUs);
+    ALOGI("Gadget: send times %s", formatTimeHistogram(mSendTimes).c_str());
+    ALOGI("Gadget: pickup times %s", formatTimeHistogram(mPickupTimes).c_str());
+}
+
+}  // namespace webcam
+}  // namespace android
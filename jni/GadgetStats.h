@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <linux/videodev2.h>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace android {
+namespace webcam {
+
+// What the gadget driver tells about the buffers it hands back, to tell USB side problems
+// (transfer errors, frames taking long to go out) from frame path ones. Logged at STREAMOFF. Not
+// thread safe, driven by the UVC thread.
+class GadgetStats {
+  public:
+    static constexpr size_t kMaxBuffers = 8;
+    // Histogram buckets: < 1ms, < 2ms, < 4ms ... the last one open ended.
+    static constexpr size_t kTimeBuckets = 8;
+    using TimeHistogram = std::array<uint64_t, kTimeBuckets>;
+    using Clock = std::chrono::steady_clock;
+
+    void onQueued(uint32_t index, Clock::time_point now);
+    // buffer as dequeued from the driver at now.
+    void onReturned(const struct v4l2_buffer& buffer, Clock::time_point now);
+
+    [[nodiscard]] uint64_t getReturned() const { return mReturned; }
+    [[nodiscard]] uint64_t getErrors() const { return mErrors; }
+    [[nodiscard]] uint64_t getSequenceGaps() const { return mSequenceGaps; }
+    [[nodiscard]] uint64_t getMaxSendTimeUs() const { return mMaxSendTimeUs; }
+    [[nodiscard]] const TimeHistogram& getSendTimes() const { return mSendTimes; }
+    [[nodiscard]] const TimeHistogram& getPickupTimes() const { return mPickupTimes; }
+
+    // Appends "<name> <value>" lines.
+    void dump(std::string* out) const;
+    void log() const;
+
+    static size_t getTimeBucket(int64_t us);
+    // As "<1ms:120 <2ms:3 >=64ms:1", empty buckets left out.
+    static std::string formatTimeHistogram(const TimeHistogram& histogram);
+
+  private:
+    // Per buffer index, when it was queued to the driver.
+    std::array<Clock::time_point, kMaxBuffers> mQueueTimes{};
+    uint64_t mReturned = 0;
+    uint64_t mErrors = 0;
+    uint64_t mSequenceGaps = 0;
+    int64_t mLastSequence = -1;
+    // Queued to sent, from the completion timestamp the driver sets. Drivers that don't set one
+    // count up to the dequeue instead.
+    TimeHistogram mSendTimes{};
+    uint64_t mMaxSendTimeUs = 0;
+    // Sent to dequeued by the UVC thread, only with a completion timestamp.
+    TimeHistogram mPickupTimes{};
+};
+
+}  // namespace webcam
+}  // namespace android
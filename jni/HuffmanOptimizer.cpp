@@ -0,0 +1,400 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+
+#include "HuffmanOptimizer.h"
+
+#include <inttypes.h>
+#include <libyuv/convert.h>
+#include <log/log.h>
+#include <algorithm>
+
+#include "I420.h"
+#include "QuantTables.h"
+
+namespace android {
+namespace webcam {
+
+namespace {
+constexpr int kMaxCodeLength = 16;
+// Code lengths can exceed kMaxCodeLength while building a table, before they are limited.
+constexpr int kMaxTreeDepth = 64;
+constexpr int kNumSymbols = 256;
+
+// Every symbol a baseline 8 bit scan can produce: DC magnitude categories 0 - 11, AC run / size
+// pairs with sizes 1 - 10 plus EOB and ZRL.
+std::vector<uint8_t> getSymbols(bool dc) {
+    std::vector<uint8_t> symbols;
+    if (dc) {
+        for (uint8_t category = 0; category <= 11; category++) {
+            symbols.push_back(category);
+        }
+        return symbols;
+    }
+    symbols.push_back(0x00);  // EOB
+    symbols.push_back(0xf0);  // ZRL
+    for (uint8_t run = 0; run < 16; run++) {
+        for (uint8_t size = 1; size <= 10; size++) {
+            symbols.push_back(static_cast<uint8_t>(run << 4 | size));
+        }
+    }
+    return symbols;
+}
+
+// Annex K.2 of the JPEG spec, the way libjpeg's jpeg_gen_optimal_table() does it: a Huffman tree
+// over freq, with a pseudo symbol reserving the all ones code, limited to kMaxCodeLength.
+void generateOptimalTable(std::array<long, kNumSymbols + 1> freq, JHUFF_TBL* table) {
+    std::array<int, kNumSymbols + 1> codeSize{};
+    std::array<int, kNumSymbols + 1> others;
+    others.fill(-1);
+    freq[kNumSymbols] = 1;
+
+    while (true) {
+        // The two least frequent subtrees, c1 being the one with the larger symbol on ties.
+        int c1 = -1;
+        int c2 = -1;
+        for (int i = 0; i <= kNumSymbols; i++) {
+            if (freq[i] == 0) {
+                continue;
+            }
+            if (c1 < 0 || freq[i] <= freq[c1]) {
+                c2 = c1;
+                c1 = i;
+            } else if (c2 < 0 || freq[i] <= freq[c2]) {
+                c2 = i;
+            }
+        }
+        if (c2 < 0) {
+            break;
+        }
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+        codeSize[c1]++;
+        while (others[c1] >= 0) {
+            c1 = others[c1];
+            codeSize[c1]++;
+        }
+        others[c1] = c2;
+        codeSize[c2]++;
+        while (others[c2] >= 0) {
+            c2 = others[c2];
+            codeSize[c2]++;
+        }
+    }
+
+    std::array<int, kMaxTreeDepth + 1> bits{};
+    for (int i = 0; i <= kNumSymbols; i++) {
+        if (codeSize[i] != 0) {
+            bits[std::min(codeSize[i], kMaxTreeDepth)]++;
+        }
+    }
+    // Shorten the longest codes: two leaves at depth i move up, the leaf at the deepest level j
+    // above them moves down to become their new parent's sibling.
+    for (int i = kMaxTreeDepth; i > kMaxCodeLength; i--) {
+        while (bits[i] > 0) {
+            int j = i - 2;
+            while (bits[j] == 0) {
+                j--;
+            }
+            bits[i] -= 2;
+            bits[i - 1]++;
+            bits[j + 1] += 2;
+            bits[j]--;
+        }
+    }
+    // Drop the pseudo symbol, it has one of the longest codes.
+    int longest = kMaxCodeLength;
+    while (bits[longest] == 0) {
+        longest--;
+    }
+    bits[longest]--;
+
+    table->bits[0] = 0;
+    for (int i = 1; i <= kMaxCodeLength; i++) {
+        table->bits[i] = static_cast<UINT8>(bits[i]);
+    }
+    // Symbols in order of code length. Limiting the lengths preserves that order.
+    std::array<int, kNumSymbols> order;
+    for (int i = 0; i < kNumSymbols; i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [&codeSize](int a, int b) { return codeSize[a] < codeSize[b]; });
+    int count = 0;
+    for (int symbol : order) {
+        if (codeSize[symbol] != 0) {
+            table->huffval[count++] = static_cast<UINT8>(symbol);
+        }
+    }
+    table->sent_table = FALSE;
+}
+
+}  // anonymous namespace
+
+// The code lengths stand in for the symbol counts libjpeg doesn't expose (a code of length l is
+// about right for a symbol with probability 2^-l), and the symbols that frame didn't use get the
+// lowest count so that they end up with the longest codes.
+void HuffmanOptimizer::completeTable(const JHUFF_TBL& optimal, bool dc, JHUFF_TBL* table) {
+    std::array<long, kNumSymbols + 1> freq{};
+    for (uint8_t symbol : getSymbols(dc)) {
+        freq[symbol] = 1;
+    }
+    int index = 0;
+    for (int length = 1; length <= kMaxCodeLength; length++) {
+        for (int i = 0; i < optimal.bits[length]; i++) {
+            freq[optimal.huffval[index++]] = 2L << (kMaxCodeLength - length);
+        }
+    }
+    generateOptimalTable(freq, table);
+}
+
+HuffmanOptimizer::HuffmanOptimizer(uint32_t width, uint32_t height)
+    : mWidth(width),
+      mHeight(height),
+      mChromaWidth((width + 1) / 2),
+      mChromaHeight((height + 1) / 2),
+      mWorker(SampledWorker::kBackgroundNice, [this] { processSample(); }) {
+    size_t lumaSize = static_cast<size_t>(mWidth) * mHeight;
+    size_t chromaSize = static_cast<size_t>(mChromaWidth) * mChromaHeight;
+    mSample.resize(lumaSize + 2 * chromaSize);
+
+    // Same padding to whole MCU rows as the Encoder, replicating the last row.
+    const uint32_t mcuV = DCTSIZE * 2;
+    uint32_t paddedHeight = mcuV * ((mHeight + mcuV - 1) / mcuV);
+    mYRows.resize(paddedHeight);
+    mCbRows.resize(paddedHeight / 2);
+    mCrRows.resize(paddedHeight / 2);
+    for (uint32_t i = 0; i < paddedHeight; i++) {
+        mYRows[i] = mSample.data() + std::min(i, mHeight - 1) * mWidth;
+        if (i < paddedHeight / 2) {
+            size_t offset = std::min(i, mChromaHeight - 1) * mChromaWidth;
+            mCbRows[i] = mSample.data() + lumaSize + offset;
+            mCrRows[i] = mSample.data() + lumaSize + chromaSize + offset;
+        }
+    }
+
+    mCompressInfo.err = jpeg_std_error(&mError.mgr);
+    mError.mgr.error_exit = [](j_common_ptr info) {
+        (*info->err->output_message)(info);
+        longjmp(reinterpret_cast<ErrorManager*>(info->err)->jumpBuffer, 1);
+    };
+    jpeg_create_compress(&mCompressInfo);
+    mCompressInfo.client_data = this;
+
+    // Only the size of the output matters, it goes round and round mDestBuffer.
+    mDest.init_destination = [](j_compress_ptr cInfo) {
+        auto* optimizer = static_cast<HuffmanOptimizer*>(cInfo->client_data);
+        optimizer->mDestBytes = 0;
+        cInfo->dest->next_output_byte = optimizer->mDestBuffer.data();
+        cInfo->dest->free_in_buffer = optimizer->mDestBuffer.size();
+    };
+    mDest.empty_output_buffer = [](j_compress_ptr cInfo) -> boolean {
+        auto* optimizer = static_cast<HuffmanOptimizer*>(cInfo->client_data);
+        optimizer->mDestBytes += optimizer->mDestBuffer.size();
+        cInfo->dest->next_output_byte = optimizer->mDestBuffer.data();
+        cInfo->dest->free_in_buffer = optimizer->mDestBuffer.size();
+        return TRUE;
+    };
+    mDest.term_destination = [](j_compress_ptr cInfo) {
+        auto* optimizer = static_cast<HuffmanOptimizer*>(cInfo->client_data);
+        optimizer->mDestBytes += optimizer->mDestBuffer.size() - cInfo->dest->free_in_buffer;
+    };
+    mCompressInfo.dest = &mDest;
+}
+
+HuffmanOptimizer::~HuffmanOptimizer() {
+    stop();
+    jpeg_destroy_compress(&mCompressInfo);
+    HuffmanStats stats = getStats();
+    if (stats.builds != 0 && stats.standardBytes != 0) {
+        ALOGI("HuffmanOptimizer: %" PRIu64 " table builds, sample frames %" PRIu64
+              " bytes with standard tables, %" PRIu64 " bytes with optimized ones (-%.1f%%)",
+              stats.builds, stats.standardBytes / stats.builds,
+              stats.optimizedBytes / stats.builds,
+              100.0 - 100.0 * stats.optimizedBytes / stats.standardBytes);
+    }
+}
+
+void HuffmanOptimizer::start() {
+    mWorker.start();
+}
+
+void HuffmanOptimizer::stop() {
+    mWorker.stop();
+    // The worker thread is gone, sample the first frame after the next start().
+    mNextSample = {};
+}
+
+void HuffmanOptimizer::offerFrame(const I420& frame, int32_t quality,
+                                  JpegQuantTables quantTables, JpegDctMethod dctMethod) {
+    if (!mWorker.isIdle()) {
+        return;
+    }
+    if (std::chrono::steady_clock::now() < mNextSample &&
+        mTablesQuality.load(std::memory_order_relaxed) == quality &&
+        mTablesQuantTables.load(std::memory_order_relaxed) == quantTables) {
+        return;
+    }
+    if (frame.width != mWidth || frame.height != mHeight) {
+        return;
+    }
+    uint8_t* y = mSample.data();
+    uint8_t* u = y + static_cast<size_t>(mWidth) * mHeight;
+    uint8_t* v = u + static_cast<size_t>(mChromaWidth) * mChromaHeight;
+    libyuv::I420Copy(frame.y, frame.yRowStride, frame.u, frame.uRowStride, frame.v,
+                     frame.vRowStride, y, mWidth, u, mChromaWidth, v, mChromaWidth, mWidth,
+                     mHeight);
+    mSampleQuality = quality;
+    mSampleQuantTables = quantTables;
+    mSampleDctMethod = dctMethod;
+    mWorker.submit();
+}
+
+std::shared_ptr<const HuffmanTables> HuffmanOptimizer::getTables(
+        int32_t quality, JpegQuantTables quantTables) const {
+    if (mTablesQuality.load(std::memory_order_relaxed) != quality ||
+        mTablesQuantTables.load(std::memory_order_relaxed) != quantTables) {
+        return nullptr;
+    }
+    std::shared_ptr<const HuffmanTables> tables = std::atomic_load(&mTables);
+    if (tables == nullptr || tables->quality != quality || tables->quantTables != quantTables) {
+        return nullptr;
+    }
+    return tables;
+}
+
+HuffmanStats HuffmanOptimizer::getStats() const {
+    std::lock_guard<std::mutex> l(mLock);
+    return mStats;
+}
+
+const HuffmanTables& HuffmanOptimizer::getStandardTables() {
+    static const HuffmanTables sTables = [] {
+        HuffmanTables tables;
+        jpeg_compress_struct cInfo{};
+        jpeg_error_mgr error;
+        cInfo.err = jpeg_std_error(&error);
+        jpeg_create_compress(&cInfo);
+        cInfo.in_color_space = JCS_YCbCr;
+        cInfo.input_components = 3;
+        jpeg_set_defaults(&cInfo);
+        for (size_t i = 0; i < tables.dc.size(); i++) {
+            tables.dc[i] = *cInfo.dc_huff_tbl_ptrs[i];
+            tables.ac[i] = *cInfo.ac_huff_tbl_ptrs[i];
+        }
+        jpeg_destroy_compress(&cInfo);
+        return tables;
+    }();
+    return sTables;
+}
+
+void HuffmanOptimizer::applyTables(const HuffmanTables& tables, j_compress_ptr cInfo) {
+    for (size_t i = 0; i < tables.dc.size(); i++) {
+        if (cInfo->dc_huff_tbl_ptrs[i] == nullptr || cInfo->ac_huff_tbl_ptrs[i] == nullptr) {
+            continue;
+        }
+        *cInfo->dc_huff_tbl_ptrs[i] = tables.dc[i];
+        *cInfo->ac_huff_tbl_ptrs[i] = tables.ac[i];
+    }
+}
+
+void HuffmanOptimizer::processSample() {
+    auto tables = std::make_shared<HuffmanTables>();
+    HuffmanStats stats;
+    if (buildTables(mSampleQuality, mSampleQuantTables, tables.get(), &stats)) {
+        std::atomic_store(&mTables, std::shared_ptr<const HuffmanTables>(std::move(tables)));
+        mTablesQuality.store(mSampleQuality, std::memory_order_relaxed);
+        mTablesQuantTables.store(mSampleQuantTables, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> l(mLock);
+        mStats.builds++;
+        mStats.standardBytes += stats.standardBytes;
+        mStats.optimizedBytes += stats.optimizedBytes;
+    }
+    mNextSample = std::chrono::steady_clock::now() + kRefreshInterval;
+}
+
+bool HuffmanOptimizer::buildTables(int32_t quality, JpegQuantTables quantTables,
+                                   HuffmanTables* tables, HuffmanStats* stats) {
+    const HuffmanTables& standardTables = getStandardTables();
+    if (compressSample(quality, quantTables, /*optimize*/ true, standardTables) == 0) {
+        return false;
+    }
+    tables->quality = quality;
+    tables->quantTables = quantTables;
+    for (size_t i = 0; i < tables->dc.size(); i++) {
+        const JHUFF_TBL* dc = mCompressInfo.dc_huff_tbl_ptrs[i];
+        const JHUFF_TBL* ac = mCompressInfo.ac_huff_tbl_ptrs[i];
+        if (dc == nullptr || ac == nullptr) {
+            return false;
+        }
+        completeTable(*dc, /*dc*/ true, &tables->dc[i]);
+        completeTable(*ac, /*dc*/ false, &tables->ac[i]);
+    }
+
+    // libjpeg rejects broken tables, so this also makes sure the Encoder can use them.
+    stats->standardBytes =
+            compressSample(quality, quantTables, /*optimize*/ false, standardTables);
+    stats->optimizedBytes = compressSample(quality, quantTables, /*optimize*/ false, *tables);
+    if (stats->standardBytes == 0 || stats->optimizedBytes == 0) {
+        return false;
+    }
+    ALOGV("%s: Quality %d: %zu bytes with standard tables, %zu with optimized ones", __FUNCTION__,
+          quality, static_cast<size_t>(stats->standardBytes),
+          static_cast<size_t>(stats->optimizedBytes));
+    return true;
+}
+
+size_t HuffmanOptimizer::compressSample(int32_t quality, JpegQuantTables quantTables,
+                                        bool optimize, const HuffmanTables& tables) {
+    j_compress_ptr cInfo = &mCompressInfo;
+    if (setjmp(mError.jumpBuffer)) {
+        jpeg_abort_compress(cInfo);
+        return 0;
+    }
+
+    // Same parameters as Encoder::i420ToJpeg().
+    cInfo->image_width = mWidth;
+    cInfo->image_height = mHeight;
+    cInfo->input_components = 3;
+    cInfo->in_color_space = JCS_YCbCr;
+    jpeg_set_defaults(cInfo);
+    jpeg_set_colorspace(cInfo, JCS_YCbCr);
+    setQuantTables(cInfo, quantTables, quality);
+    cInfo->dct_method = mSampleDctMethod == JpegDctMethod::FAST ? JDCT_IFAST : JDCT_ISLOW;
+    cInfo->raw_data_in = 1;
+    cInfo->optimize_coding = optimize ? TRUE : FALSE;
+    cInfo->comp_info[0].h_samp_factor = 2;
+    cInfo->comp_info[0].v_samp_factor = 2;
+    for (int i = 1; i < 3; i++) {
+        cInfo->comp_info[i].h_samp_factor = 1;
+        cInfo->comp_info[i].v_samp_factor = 1;
+    }
+    applyTables(tables, cInfo);
+
+    jpeg_start_compress(cInfo, TRUE);
+    const uint32_t batchSize = DCTSIZE * 2;
+    while (cInfo->next_scanline < cInfo->image_height) {
+        JSAMPARRAY planes[3]{&mYRows[cInfo->next_scanline], &mCbRows[cInfo->next_scanline / 2],
+                             &mCrRows[cInfo->next_scanline / 2]};
+        jpeg_write_raw_data(cInfo, planes, batchSize);
+    }
+    jpeg_finish_compress(cInfo);
+    return mDestBytes;
+}
+
+}  // namespace webcam
+}  // namespace android
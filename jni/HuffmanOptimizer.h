@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <jpeglib.h>
+
+#include "SampledWorker.h"
+#include "Tunables.h"
+
+namespace android {
+namespace webcam {
+
+struct I420;
+
+// Huffman tables fitted to the content of a stream, for one JPEG quality and quantization table
+// set. Index 0 is used by luma, 1 by chroma, like libjpeg's default tables. Every symbol a
+// baseline scan can produce has a code, so the tables can encode any frame, not just the one they
+// were built from.
+struct HuffmanTables {
+    int32_t quality = 0;
+    JpegQuantTables quantTables = JpegQuantTables::ANNEX_K;
+    std::array<JHUFF_TBL, 2> dc{};
+    std::array<JHUFF_TBL, 2> ac{};
+};
+
+// Size of the sample frames compressed with the standard and with the optimized tables, summed
+// over all table builds.
+struct HuffmanStats {
+    uint64_t builds = 0;
+    uint64_t standardBytes = 0;
+    uint64_t optimizedBytes = 0;
+};
+
+// optimize_coding costs a second pass over every frame, so the Encoder compresses with fixed
+// tables instead. HuffmanOptimizer keeps those tables close to optimal: every kRefreshInterval
+// (and right after a quality or quantization table change) it takes a copy of the frame being
+// encoded, has a low priority thread compress it with optimize_coding on, completes the resulting
+// tables with codes for the symbols that frame didn't use, and publishes them for the Encoder to
+// pick up at its next frame.
+class HuffmanOptimizer {
+  public:
+    static constexpr std::chrono::seconds kRefreshInterval{5};
+
+    HuffmanOptimizer(uint32_t width, uint32_t height);
+    ~HuffmanOptimizer();
+
+    // Starts / stops the background thread.
+    void start();
+    void stop();
+
+    // Called by the encoder thread with each frame it compresses at the given quality,
+    // quantization tables and DCT method. Copies the frame if new tables are due and the
+    // background thread is idle, returns right away otherwise.
+    void offerFrame(const I420& frame, int32_t quality, JpegQuantTables quantTables,
+                    JpegDctMethod dctMethod);
+    // Latest tables built for quality and quantTables, null if there are none.
+    [[nodiscard]] std::shared_ptr<const HuffmanTables> getTables(
+            int32_t quality, JpegQuantTables quantTables) const;
+    [[nodiscard]] HuffmanStats getStats() const;
+
+    // libjpeg's standard tables. jpeg_set_defaults() only sets them up in a compressor that has
+    // none yet, it doesn't restore them after other tables were applied or optimized.
+    static const HuffmanTables& getStandardTables();
+    // Replaces the tables of cInfo after jpeg_set_defaults(). optimize_coding must be off.
+    static void applyTables(const HuffmanTables& tables, j_compress_ptr cInfo);
+    // Turns a table optimize_coding built for one frame into one that can encode any frame: every
+    // symbol of a baseline DC or AC table gets a code, those optimal missed the longest ones.
+    static void completeTable(const JHUFF_TBL& optimal, bool dc, JHUFF_TBL* table);
+
+  private:
+    struct ErrorManager {
+        jpeg_error_mgr mgr;
+        jmp_buf jumpBuffer;
+    };
+
+    // Runs on mWorker's thread for each sample offerFrame() handed over.
+    void processSample();
+    // Builds tables from the sample and checks them by compressing the sample again.
+    bool buildTables(int32_t quality, JpegQuantTables quantTables, HuffmanTables* tables,
+                     HuffmanStats* stats);
+    // Compresses the sample at quality with the given tables, or with optimize_coding, which
+    // leaves the optimal tables for the sample in mCompressInfo. Returns the size of the JPEG, 0
+    // on failure.
+    size_t compressSample(int32_t quality, JpegQuantTables quantTables, bool optimize,
+                          const HuffmanTables& tables);
+
+    uint32_t mWidth = 0;
+    uint32_t mHeight = 0;
+    uint32_t mChromaWidth = 0;
+    uint32_t mChromaHeight = 0;
+    // Sample frame, planes at stride mWidth / mChromaWidth. Owned by the encoder thread while
+    // mWorker is idle, by its thread otherwise.
+    std::vector<uint8_t> mSample;
+    std::vector<JSAMPROW> mYRows;
+    std::vector<JSAMPROW> mCbRows;
+    std::vector<JSAMPROW> mCrRows;
+    int32_t mSampleQuality = 0;
+    JpegQuantTables mSampleQuantTables = JpegQuantTables::ANNEX_K;
+    JpegDctMethod mSampleDctMethod = JpegDctMethod::ACCURATE;
+    std::chrono::steady_clock::time_point mNextSample;
+
+    jpeg_compress_struct mCompressInfo{};
+    ErrorManager mError{};
+    jpeg_destination_mgr mDest{};
+    std::array<JOCTET, 16 * 1024> mDestBuffer{};  // output is counted, not kept
+    size_t mDestBytes = 0;
+
+    std::shared_ptr<const HuffmanTables> mTables;  // std::atomic_load / std::atomic_store
+    std::atomic<int32_t> mTablesQuality = 0;
+    std::atomic<JpegQuantTables> mTablesQuantTables = JpegQuantTables::ANNEX_K;
+
+    mutable std::mutex mLock;
+    HuffmanStats mStats;  // guarded by mLock
+
+    SampledWorker mWorker;
+};
+
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+
+#include "I420.h"
+
+namespace android {
+namespace webcam {
+
+I420 cropToAspectRatio(const I420& in, uint32_t width, uint32_t height) {
+    I420 ret = in;
+    uint64_t scaledInWidth = static_cast<uint64_t>(in.width) * height;
+    uint64_t scaledInHeight = static_cast<uint64_t>(in.height) * width;
+    if (scaledInWidth > scaledInHeight) {
+        ret.width = static_cast<uint32_t>(scaledInHeight / height) & ~1u;
+    } else if (scaledInWidth < scaledInHeight) {
+        ret.height = static_cast<uint32_t>(scaledInWidth / width) & ~1u;
+    }
+    uint32_t x = ((in.width - ret.width) / 2) & ~1u;
+    uint32_t y = ((in.height - ret.height) / 2) & ~1u;
+    ret.y += y * in.yRowStride + x;
+    ret.u += y / 2 * in.uRowStride + x / 2;
+    ret.v += y / 2 * in.vRowStride + x / 2;
+    return ret;
+}
+
+}  // namespace webcam
+}  // namespace android
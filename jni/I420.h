@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+namespace android {
+namespace webcam {
+
+// View of an I420 image. Scratch images are owned by the EncoderArena, planar sources by the
+// camera's AHardwareBuffer.
+struct I420 {
+    uint8_t* y = nullptr;
+    uint8_t* u = nullptr;
+    uint8_t* v = nullptr;
+    uint32_t yRowStride = 0;
+    uint32_t uRowStride = 0;
+    uint32_t vRowStride = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+};
+
+// Centered window of in with the aspect ratio of width x height, on even pixels.
+I420 cropToAspectRatio(const I420& in, uint32_t width, uint32_t height);
+
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,275 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+
+#include "InstrumentedMutex.h"
+
+#include <dlfcn.h>
+#include <inttypes.h>
+#include <log/log.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+
+namespace android {
+namespace webcam {
+
+namespace {
+constexpr size_t kMaxLocks = 16;
+constexpr size_t kMaxCallSites = 16;
+constexpr size_t kReportedCallSites = 5;
+// Bucket 0 counts times under 1us, bucket i times in [2^(i-1), 2^i) us, the last one everything
+// from 2^(kHistogramBuckets - 2) us (16ms) up.
+constexpr size_t kHistogramBuckets = 16;
+
+using Clock = std::chrono::steady_clock;
+using Histogram = std::array<std::atomic<uint64_t>, kHistogramBuckets>;
+
+// Where a contended lock() was called from.
+struct CallSite {
+    std::atomic<uintptr_t> pc = 0;  // 0 while the entry is free
+    std::atomic<uint64_t> count = 0;
+    std::atomic<uint64_t> waitNs = 0;
+};
+
+uint64_t nsSince(Clock::time_point start, Clock::time_point end) {
+    return static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+}
+
+size_t getBucket(uint64_t ns) {
+    uint64_t us = ns / 1000;
+    size_t bucket = 0;
+    while (us > 0 && bucket < kHistogramBuckets - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+void updateMax(std::atomic<uint64_t>* max, uint64_t value) {
+    uint64_t current = max->load(std::memory_order_relaxed);
+    while (value > current && !max->compare_exchange_weak(current, value)) {
+    }
+}
+
+// Histogram as "<1us:12 <2us:3 ...", empty buckets left out.
+void formatHistogram(const Histogram& histogram, char* buffer, size_t size) {
+    size_t used = 0;
+    buffer[0] = '\0';
+    for (size_t i = 0; i < kHistogramBuckets && used < size; i++) {
+        uint64_t count = histogram[i].load(std::memory_order_relaxed);
+        if (count == 0) {
+            continue;
+        }
+        int written = i == kHistogramBuckets - 1
+                              ? snprintf(buffer + used, size - used, ">=%uus:%" PRIu64 " ",
+                                         1u << (i - 1), count)
+                              : snprintf(buffer + used, size - used, "<%uus:%" PRIu64 " ",
+                                         1u << i, count);
+        used += std::max(written, 0);
+    }
+}
+}  // anonymous namespace
+
+struct LockStats {
+    const char* name = nullptr;
+    std::atomic<uint64_t> acquisitions = 0;
+    std::atomic<uint64_t> contended = 0;
+    std::atomic<uint64_t> totalWaitNs = 0;
+    std::atomic<uint64_t> maxWaitNs = 0;
+    std::atomic<uint64_t> totalHoldNs = 0;
+    std::atomic<uint64_t> maxHoldNs = 0;
+    Histogram waitHistogram{};
+    Histogram holdHistogram{};
+    std::array<CallSite, kMaxCallSites> callSites{};
+    std::atomic<uint64_t> droppedCallSites = 0;
+
+    void onAcquired(uint64_t waitNs, uintptr_t pc) {
+        acquisitions.fetch_add(1, std::memory_order_relaxed);
+        waitHistogram[getBucket(waitNs)].fetch_add(1, std::memory_order_relaxed);
+        if (pc == 0) {
+            return;
+        }
+        contended.fetch_add(1, std::memory_order_relaxed);
+        totalWaitNs.fetch_add(waitNs, std::memory_order_relaxed);
+        updateMax(&maxWaitNs, waitNs);
+        for (CallSite& site : callSites) {
+            uintptr_t expected = 0;
+            if (site.pc.compare_exchange_strong(expected, pc) || expected == pc) {
+                site.count.fetch_add(1, std::memory_order_relaxed);
+                site.waitNs.fetch_add(waitNs, std::memory_order_relaxed);
+                return;
+            }
+        }
+        droppedCallSites.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void onReleased(uint64_t holdNs) {
+        totalHoldNs.fetch_add(holdNs, std::memory_order_relaxed);
+        updateMax(&maxHoldNs, holdNs);
+        holdHistogram[getBucket(holdNs)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void dump() const;
+    void reset();
+};
+
+namespace {
+std::mutex gRegistryLock;
+std::array<LockStats, kMaxLocks> gLocks;  // guarded by gRegistryLock, as far as names go
+size_t gLockCount = 0;                    // guarded by gRegistryLock
+
+LockStats* getLockStats(const char* name) {
+    std::lock_guard<std::mutex> l(gRegistryLock);
+    for (size_t i = 0; i < gLockCount; i++) {
+        if (strcmp(gLocks[i].name, name) == 0) {
+            return &gLocks[i];
+        }
+    }
+    if (gLockCount == kMaxLocks) {
+        ALOGW("%s: Not recording stats of %s, already recording %zu locks", __FUNCTION__, name,
+              kMaxLocks);
+        return nullptr;
+    }
+    gLocks[gLockCount].name = name;
+    return &gLocks[gLockCount++];
+}
+}  // anonymous namespace
+
+void LockStats::dump() const {
+    uint64_t count = acquisitions.load();
+    if (count == 0) {
+        return;
+    }
+    uint64_t contendedCount = contended.load();
+    ALOGI("%s: %s: %" PRIu64 " acquisitions, %" PRIu64 " contended (%.1f%%), wait avg %" PRIu64
+          "us max %" PRIu64 "us, hold avg %" PRIu64 "us max %" PRIu64 "us",
+          __FUNCTION__, name, count, contendedCount, 100.0 * contendedCount / count,
+          contendedCount == 0 ? 0 : totalWaitNs.load() / contendedCount / 1000,
+          maxWaitNs.load() / 1000, totalHoldNs.load() / count / 1000, maxHoldNs.load() / 1000);
+    char histogram[512];
+    formatHistogram(waitHistogram, histogram, sizeof(histogram));
+    ALOGI("%s: %s: wait %s", __FUNCTION__, name, histogram);
+    formatHistogram(holdHistogram, histogram, sizeof(histogram));
+    ALOGI("%s: %s: hold %s", __FUNCTION__, name, histogram);
+
+    // Most waited on call sites first.
+    std::array<const CallSite*, kMaxCallSites> sites;
+    size_t siteCount = 0;
+    for (const CallSite& site : callSites) {
+        if (site.pc.load() != 0) {
+            sites[siteCount++] = &site;
+        }
+    }
+    std::sort(sites.begin(), sites.begin() + siteCount, [](const CallSite* a, const CallSite* b) {
+        return a->waitNs.load() > b->waitNs.load();
+    });
+    for (size_t i = 0; i < std::min(siteCount, kReportedCallSites); i++) {
+        uintptr_t pc = sites[i]->pc.load();
+        Dl_info info{};
+        const char* symbol = "?";
+        uintptr_t offset = 0;
+        if (dladdr(reinterpret_cast<void*>(pc), &info) != 0 && info.dli_sname != nullptr) {
+            symbol = info.dli_sname;
+            offset = pc - reinterpret_cast<uintptr_t>(info.dli_saddr);
+        }
+        ALOGI("%s: %s: contended %" PRIu64 " times, %" PRIu64 "us waited, at %s+%" PRIuPTR
+              " (pc %" PRIxPTR ")",
+              __FUNCTION__, name, sites[i]->count.load(), sites[i]->waitNs.load() / 1000, symbol,
+              offset, pc - reinterpret_cast<uintptr_t>(info.dli_fbase));
+    }
+    if (droppedCallSites.load() > 0) {
+        ALOGI("%s: %s: %" PRIu64 " contentions from call sites that didn't fit the table",
+              __FUNCTION__, name, droppedCallSites.load());
+    }
+}
+
+void LockStats::reset() {
+    acquisitions = 0;
+    contended = 0;
+    totalWaitNs = 0;
+    maxWaitNs = 0;
+    totalHoldNs = 0;
+    maxHoldNs = 0;
+    for (size_t i = 0; i < kHistogramBuckets; i++) {
+        waitHistogram[i] = 0;
+        holdHistogram[i] = 0;
+    }
+    for (CallSite& site : callSites) {
+        site.count = 0;
+        site.waitNs = 0;
+        site.pc = 0;
+    }
+    droppedCallSites = 0;
+}
+
+InstrumentedMutex::InstrumentedMutex(const char* name) : mStats(getLockStats(name)) {}
+
+// Out of line, so that the return address is the code taking the lock.
+void InstrumentedMutex::lock() {
+    if (mMutex.try_lock()) {
+        mLockedTime = Clock::now();
+        if (mStats != nullptr) {
+            mStats->onAcquired(/*waitNs*/ 0, /*pc*/ 0);
+        }
+        return;
+    }
+    Clock::time_point start = Clock::now();
+    mMutex.lock();
+    mLockedTime = Clock::now();
+    if (mStats != nullptr) {
+        mStats->onAcquired(nsSince(start, mLockedTime),
+                           reinterpret_cast<uintptr_t>(__builtin_return_address(0)));
+    }
+}
+
+bool InstrumentedMutex::try_lock() {
+    if (!mMutex.try_lock()) {
+        return false;
+    }
+    mLockedTime = Clock::now();
+    if (mStats != nullptr) {
+        mStats->onAcquired(/*waitNs*/ 0, /*pc*/ 0);
+    }
+    return true;
+}
+
+void InstrumentedMutex::unlock() {
+    if (mStats != nullptr) {
+        mStats->onReleased(nsSince(mLockedTime, Clock::now()));
+    }
+    mMutex.unlock();
+}
+
+void dumpLockStats() {
+    size_t count = 0;
+    {
+        std::lock_guard<std::mutex> l(gRegistryLock);
+        count = gLockCount;
+    }
+    // Entries are never removed, only the first count are looked at.
+    for (size_t i = 0; i < count; i++) {
+        gLocks[i].dump();
+        gLocks[i].reset();
+    }
+}
+
+}  // namespace webcam
+}  // namespace android
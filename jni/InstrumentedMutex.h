@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *  Mutex for the frame path locks that, in libjni_deviceAsWebcam_lock_stats (WEBCAM_LOCK_STATS),
+ *  records how long threads wait for and hold it. Locks with the same name share their stats, so
+ *  the stats of a lock outlive the objects owning it. In regular builds it is a plain std::mutex.
+ *
+ *  Use InstrumentedMutex::UniqueLock and InstrumentedMutex::ConditionVariable to wait on one.
+ */
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+namespace android {
+namespace webcam {
+
+#ifdef WEBCAM_LOCK_STATS
+
+struct LockStats;
+
+class InstrumentedMutex {
+  public:
+    using UniqueLock = std::unique_lock<InstrumentedMutex>;
+    // Waiting unlocks and relocks through lock() / unlock(), so that the time spent waiting for
+    // the condition isn't counted as held.
+    using ConditionVariable = std::condition_variable_any;
+
+    // name must outlive the process, use a string literal.
+    explicit InstrumentedMutex(const char* name);
+    InstrumentedMutex(const InstrumentedMutex&) = delete;
+    InstrumentedMutex& operator=(const InstrumentedMutex&) = delete;
+
+    void lock();
+    bool try_lock();
+    void unlock();
+
+  private:
+    std::mutex mMutex;
+    LockStats* mStats = nullptr;  // null if the registry is full
+    std::chrono::steady_clock::time_point mLockedTime;  // guarded by mMutex
+};
+
+// Logs wait and hold time histograms and the most contended call sites of every lock, and starts
+// counting over.
+void dumpLockStats();
+
+#else
+
+class InstrumentedMutex : public std::mutex {
+  public:
+    using UniqueLock = std::unique_lock<std::mutex>;
+    using ConditionVariable = std::condition_variable;
+
+    explicit InstrumentedMutex(const char* /*name*/) {}
+};
+
+inline void dumpLockStats() {}
+
+#endif
+
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,601 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+
+#include "JpegUtils.h"
+
+#include <jerror.h>
+#include <log/log.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#include "EncoderArena.h"
+
+namespace android {
+namespace webcam {
+
+namespace {
+// Layout compatible with both the HIDL camera3_jpeg_blob and the AIDL CameraBlob trailers.
+struct CameraBlobTrailer {
+    uint16_t blobId;
+    uint16_t reserved;
+    uint32_t blobSizeBytes;
+};
+constexpr uint16_t kCameraBlobIdJpeg = 0x00FF;
+
+constexpr uint8_t kMarkerPrefix = 0xFF;
+constexpr uint8_t kMarkerSoi = 0xD8;
+constexpr uint8_t kMarkerEoi = 0xD9;
+constexpr uint8_t kMarkerSos = 0xDA;
+
+bool isSofMarker(uint8_t marker) {
+    // SOF0 - SOF15, except DHT (C4), JPG (C8) and DAC (CC)
+    return marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 &&
+           marker != 0xCC;
+}
+
+bool hasSoi(const uint8_t* data, size_t size) {
+    return size >= 2 && data[0] == kMarkerPrefix && data[1] == kMarkerSoi;
+}
+
+bool hasEoi(const uint8_t* data, size_t size) {
+    return size >= 2 && data[size - 2] == kMarkerPrefix && data[size - 1] == kMarkerEoi;
+}
+
+// Crops are aligned for the largest MCUs camera JPEGs use (4:2:0 / 4:2:2).
+constexpr uint32_t kMcuAlignment = 2 * DCTSIZE;
+constexpr float kMaxCropFraction = 0.25f;
+// Largest scale first, it crops the least.
+constexpr uint32_t kScaleDenoms[] = {8, 4, 2, 1};
+// Limits of quantized coefficients in 8 bit baseline JPEGs.
+constexpr int32_t kMaxDcCoefficient = 2047;
+constexpr int32_t kMaxAcCoefficient = 1023;
+
+uint32_t divRoundUp(uint32_t a, uint32_t b) {
+    return (a + b - 1) / b;
+}
+
+// Blocks of a component in an image of the given size, padded to whole MCUs as libjpeg expects
+// coefficient arrays to be.
+uint32_t getPaddedBlocks(uint32_t size, int sampFactor, int maxSampFactor) {
+    uint32_t blocks = divRoundUp(divRoundUp(size * sampFactor, maxSampFactor), DCTSIZE);
+    return divRoundUp(blocks, sampFactor) * sampFactor;
+}
+
+// Orthonormal DCT-II basis function of an n point DCT.
+double dctBasis(uint32_t n, uint32_t freq, uint32_t x) {
+    double scale = freq == 0 ? sqrt(1.0 / n) : sqrt(2.0 / n);
+    return scale * cos((2 * x + 1) * freq * M_PI / (2 * n));
+}
+
+// Output rows one call to jpeg_read_raw_data produces for a component.
+uint32_t getScaledRowsPerIMcu(const jpeg_component_info& comp) {
+#if JPEG_LIB_VERSION >= 70
+    return comp.v_samp_factor * comp.DCT_v_scaled_size;
+#else
+    return comp.v_samp_factor * comp.DCT_scaled_size;
+#endif
+}
+
+// 2x2 box filter of two rows into outWidth samples.
+void halveRows(const uint8_t* row0, const uint8_t* row1, uint8_t* out, uint32_t outWidth) {
+    for (uint32_t x = 0; x < outWidth; x++) {
+        out[x] = static_cast<uint8_t>(
+                (row0[2 * x] + row0[2 * x + 1] + row1[2 * x] + row1[2 * x + 1] + 2) >> 2);
+    }
+}
+
+// Places a window of scaledSize source pixels centered in srcSize, starting on an MCU boundary or,
+// when rotating, ending on one.
+bool placeWindow(uint32_t srcSize, uint64_t scaledSize, bool rotate180, uint32_t* crop) {
+    uint64_t start = (srcSize - scaledSize) / 2;
+    if (!rotate180) {
+        *crop = static_cast<uint32_t>(start / kMcuAlignment * kMcuAlignment);
+        return true;
+    }
+    uint64_t end = (start + scaledSize) / kMcuAlignment * kMcuAlignment;
+    if (end < scaledSize) {
+        return false;
+    }
+    *crop = static_cast<uint32_t>(end - scaledSize);
+    return true;
+}
+
+struct FixedDestination : public jpeg_destination_mgr {
+    uint8_t* buffer;
+    size_t capacity;
+};
+}  // anonymous namespace
+
+size_t getCameraJpegSize(const uint8_t* blob, size_t blobSize) {
+    if (blob == nullptr || blobSize < sizeof(CameraBlobTrailer)) {
+        return 0;
+    }
+    CameraBlobTrailer trailer;
+    memcpy(&trailer, blob + blobSize - sizeof(trailer), sizeof(trailer));
+    if (trailer.blobId == kCameraBlobIdJpeg && trailer.blobSizeBytes > 0 &&
+        trailer.blobSizeBytes <= blobSize - sizeof(trailer)) {
+        return trailer.blobSizeBytes;
+    }
+    // No trailer: the JPEG ends with the last EOI in the buffer.
+    for (size_t i = blobSize; i >= 2; i--) {
+        if (blob[i - 2] == kMarkerPrefix && blob[i - 1] == kMarkerEoi) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+bool parseJpegInfo(const uint8_t* data, size_t size, JpegInfo* info) {
+    if (data == nullptr || !hasSoi(data, size) || !hasEoi(data, size)) {
+        ALOGE("%s: Missing SOI / EOI markers, size %zu", __FUNCTION__, size);
+        return false;
+    }
+    size_t pos = 2;
+    while (pos + 4 <= size) {
+        if (data[pos] != kMarkerPrefix) {
+            ALOGE("%s: Expected a marker at offset %zu", __FUNCTION__, pos);
+            return false;
+        }
+        uint8_t marker = data[pos + 1];
+        if (marker == kMarkerPrefix) {
+            pos++;  // fill byte
+            continue;
+        }
+        if (marker == kMarkerSos || marker == kMarkerEoi) {
+            break;
+        }
+        size_t length = (data[pos + 2] << 8) | data[pos + 3];
+        if (length < 2 || pos + 2 + length > size) {
+            ALOGE("%s: Truncated segment 0x%02x at offset %zu", __FUNCTION__, marker, pos);
+            return false;
+        }
+        if (isSofMarker(marker)) {
+            // length(2) precision(1) height(2) width(2) components(1)
+            if (length < 8) {
+                return false;
+            }
+            const uint8_t* sof = data + pos + 4;
+            info->height = (sof[1] << 8) | sof[2];
+            info->width = (sof[3] << 8) | sof[4];
+            info->numComponents = sof[5];
+            return info->width > 0 && info->height > 0;
+        }
+        pos += 2 + length;
+    }
+    ALOGE("%s: No frame header found", __FUNCTION__);
+    return false;
+}
+
+JpegDecoder::JpegDecoder() {
+    mDecompressInfo.err = jpeg_std_error(&mError.mgr);
+    // libjpeg's default error_exit terminates the process.
+    mError.mgr.error_exit = [](j_common_ptr info) {
+        (*info->err->output_message)(info);
+        longjmp(reinterpret_cast<ErrorManager*>(info->err)->jumpBuffer, 1);
+    };
+    jpeg_create_decompress(&mDecompressInfo);
+    useRecyclingJpegMemory(reinterpret_cast<j_common_ptr>(&mDecompressInfo));
+}
+
+JpegDecoder::~JpegDecoder() {
+    jpeg_destroy_decompress(&mDecompressInfo);
+}
+
+bool JpegDecoder::decodeToI420(const uint8_t* data, size_t size, uint32_t expectedWidth,
+                               uint32_t expectedHeight, uint32_t scaleDenom, uint8_t* y,
+                               uint32_t yRowStride, uint8_t* u, uint32_t uRowStride, uint8_t* v,
+                               uint32_t vRowStride) {
+    j_decompress_ptr dInfo = &mDecompressInfo;
+    if (setjmp(mError.jumpBuffer)) {
+        jpeg_abort_decompress(dInfo);
+        return false;
+    }
+    if (scaleDenom == 0 || scaleDenom > DCTSIZE || (scaleDenom & (scaleDenom - 1)) != 0) {
+        ALOGE("%s: Unsupported scale 1/%u", __FUNCTION__, scaleDenom);
+        return false;
+    }
+
+    jpeg_mem_src(dInfo, const_cast<uint8_t*>(data), size);
+    jpeg_read_header(dInfo, TRUE);
+    const jpeg_component_info* comp = dInfo->comp_info;
+    if (dInfo->num_components != 3 || comp[0].h_samp_factor != 2 ||
+        comp[0].v_samp_factor != 2 || comp[1].h_samp_factor != 1 ||
+        comp[1].v_samp_factor != 1 || comp[2].h_samp_factor != 1 ||
+        comp[2].v_samp_factor != 1) {
+        ALOGE("%s: Only YUV 4:2:0 JPEGs can be decoded", __FUNCTION__);
+        jpeg_abort_decompress(dInfo);
+        return false;
+    }
+    if (dInfo->image_width != expectedWidth || dInfo->image_height != expectedHeight) {
+        ALOGE("%s: JPEG is %ux%u, expected %ux%u", __FUNCTION__, dInfo->image_width,
+              dInfo->image_height, expectedWidth, expectedHeight);
+        jpeg_abort_decompress(dInfo);
+        return false;
+    }
+    dInfo->raw_data_out = TRUE;
+    dInfo->out_color_space = JCS_YCbCr;
+    dInfo->scale_num = 1;
+    dInfo->scale_denom = scaleDenom;
+    jpeg_start_decompress(dInfo);
+
+    // One iMCU row per call. When scaling, libjpeg upsamples chroma to the luma resolution in the
+    // IDCT. Such chroma rows are decoded to mChromaRows and averaged back down to 4:2:0.
+    uint32_t lumaRows = getScaledRowsPerIMcu(comp[0]);
+    uint32_t chromaRows = getScaledRowsPerIMcu(comp[1]);
+    bool fullResChroma = chromaRows == lumaRows;
+    if (lumaRows > kMaxRowsPerIMcu || (!fullResChroma && chromaRows * 2 != lumaRows)) {
+        ALOGE("%s: Unexpected rows per iMCU: %u luma %u chroma", __FUNCTION__, lumaRows,
+              chromaRows);
+        jpeg_abort_decompress(dInfo);
+        return false;
+    }
+    uint32_t chromaRowStride = comp[1].width_in_blocks * chromaRows;
+    if (fullResChroma) {
+        mChromaRows.resize(2 * static_cast<size_t>(chromaRows) * chromaRowStride);
+    }
+    uint32_t chromaWidth = (dInfo->output_width + 1) / 2;
+
+    JSAMPROW yRows[kMaxRowsPerIMcu];
+    JSAMPROW uRows[kMaxRowsPerIMcu];
+    JSAMPROW vRows[kMaxRowsPerIMcu];
+    JSAMPARRAY planes[3]{yRows, uRows, vRows};
+    while (dInfo->output_scanline < dInfo->output_height) {
+        uint32_t line = dInfo->output_scanline;
+        for (uint32_t i = 0; i < lumaRows; i++) {
+            yRows[i] = y + (line + i) * yRowStride;
+        }
+        for (uint32_t i = 0; i < chromaRows; i++) {
+            if (fullResChroma) {
+                uRows[i] = mChromaRows.data() + i * chromaRowStride;
+                vRows[i] = mChromaRows.data() + (chromaRows + i) * chromaRowStride;
+            } else {
+                uRows[i] = u + (line / 2 + i) * uRowStride;
+                vRows[i] = v + (line / 2 + i) * vRowStride;
+            }
+        }
+        if (jpeg_read_raw_data(dInfo, planes, lumaRows) == 0) {
+            ALOGE("%s: Truncated JPEG", __FUNCTION__);
+            jpeg_abort_decompress(dInfo);
+            return false;
+        }
+        if (fullResChroma) {
+            for (uint32_t i = 0; i < chromaRows / 2; i++) {
+                halveRows(uRows[2 * i], uRows[2 * i + 1], u + (line / 2 + i) * uRowStride,
+                          chromaWidth);
+                halveRows(vRows[2 * i], vRows[2 * i + 1], v + (line / 2 + i) * vRowStride,
+                          chromaWidth);
+            }
+        }
+    }
+    jpeg_finish_decompress(dInfo);
+    return true;
+}
+
+bool planJpegTransform(uint32_t srcWidth, uint32_t srcHeight, uint32_t dstWidth,
+                       uint32_t dstHeight, bool rotate180, JpegTransform* transform) {
+    if (dstWidth == 0 || dstHeight == 0) {
+        return false;
+    }
+    for (uint32_t denom : kScaleDenoms) {
+        uint64_t scaledWidth = static_cast<uint64_t>(dstWidth) * denom;
+        uint64_t scaledHeight = static_cast<uint64_t>(dstHeight) * denom;
+        if (scaledWidth > srcWidth || scaledHeight > srcHeight) {
+            continue;
+        }
+        // Smaller scales would crop even more.
+        if (scaledWidth < srcWidth * (1 - kMaxCropFraction) ||
+            scaledHeight < srcHeight * (1 - kMaxCropFraction)) {
+            return false;
+        }
+        transform->scaleDenom = denom;
+        transform->outWidth = dstWidth;
+        transform->outHeight = dstHeight;
+        transform->rotate180 = rotate180;
+        return placeWindow(srcWidth, scaledWidth, rotate180, &transform->cropX) &&
+               placeWindow(srcHeight, scaledHeight, rotate180, &transform->cropY);
+    }
+    return false;
+}
+
+JpegTransformer::JpegTransformer() {
+    mDecompressInfo.err = jpeg_std_error(&mError.mgr);
+    mCompressInfo.err = &mError.mgr;
+    mError.mgr.error_exit = [](j_common_ptr info) {
+        (*info->err->output_message)(info);
+        longjmp(reinterpret_cast<ErrorManager*>(info->err)->jumpBuffer, 1);
+    };
+    jpeg_create_decompress(&mDecompressInfo);
+    jpeg_create_compress(&mCompressInfo);
+    useRecyclingJpegMemory(reinterpret_cast<j_common_ptr>(&mDecompressInfo));
+    useRecyclingJpegMemory(reinterpret_cast<j_common_ptr>(&mCompressInfo));
+
+    // Downscaling by scaleDenom turns each source block into k x k pixels, k = 8 / scaleDenom. The
+    // k x k low frequency coefficients of a block approximate the k point DCT of those pixels
+    // (scaled by sqrt(k / 8) per direction), so an output block is the 8 point DCT of the k point
+    // IDCTs of scaleDenom source blocks. Both are linear, fold them into one matrix per position.
+    for (size_t log2Denom = 1; log2Denom < mScaleMatrices.size(); log2Denom++) {
+        uint32_t denom = 1u << log2Denom;
+        uint32_t k = DCTSIZE / denom;
+        double norm = sqrt(static_cast<double>(k) / DCTSIZE);
+        for (uint32_t i = 0; i < denom; i++) {
+            for (uint32_t u = 0; u < DCTSIZE; u++) {
+                for (uint32_t v = 0; v < k; v++) {
+                    double sum = 0;
+                    for (uint32_t x = 0; x < k; x++) {
+                        sum += dctBasis(DCTSIZE, u, i * k + x) * dctBasis(k, v, x);
+                    }
+                    // Snap rounding noise to 0, exact zeros are skipped when downscaling.
+                    double value = sum * norm;
+                    mScaleMatrices[log2Denom][i][u * k + v] =
+                            fabs(value) < 1e-9 ? 0.f : static_cast<float>(value);
+                }
+            }
+        }
+    }
+}
+
+JpegTransformer::~JpegTransformer() {
+    jpeg_destroy_compress(&mCompressInfo);
+    jpeg_destroy_decompress(&mDecompressInfo);
+}
+
+size_t JpegTransformer::transform(const uint8_t* data, size_t size,
+                                  const JpegTransform& transform, uint8_t* dst,
+                                  size_t dstCapacity) {
+    j_decompress_ptr dInfo = &mDecompressInfo;
+    j_compress_ptr cInfo = &mCompressInfo;
+    FixedDestination dest;
+    if (setjmp(mError.jumpBuffer)) {
+        jpeg_abort_compress(cInfo);
+        jpeg_abort_decompress(dInfo);
+        cInfo->dest = nullptr;
+        return 0;
+    }
+
+    uint32_t denom = transform.scaleDenom;
+    if (denom == 0 || denom > kMaxScaleDenom || (denom & (denom - 1)) != 0) {
+        ALOGE("%s: Unsupported scale 1/%u", __FUNCTION__, denom);
+        return 0;
+    }
+
+    jpeg_mem_src(dInfo, const_cast<uint8_t*>(data), size);
+    jpeg_read_header(dInfo, TRUE);
+    uint32_t mcuWidth = dInfo->max_h_samp_factor * DCTSIZE;
+    uint32_t mcuHeight = dInfo->max_v_samp_factor * DCTSIZE;
+    uint64_t endX = transform.cropX + static_cast<uint64_t>(transform.outWidth) * denom;
+    uint64_t endY = transform.cropY + static_cast<uint64_t>(transform.outHeight) * denom;
+    uint64_t alignedX = transform.rotate180 ? endX : transform.cropX;
+    uint64_t alignedY = transform.rotate180 ? endY : transform.cropY;
+    if (alignedX % mcuWidth != 0 || alignedY % mcuHeight != 0 || endX > dInfo->image_width ||
+        endY > dInfo->image_height) {
+        ALOGE("%s: Can't crop %ux%u at (%u, %u) scaled 1/%u%s from %ux%u JPEG", __FUNCTION__,
+              transform.outWidth, transform.outHeight, transform.cropX, transform.cropY, denom,
+              transform.rotate180 ? " rotated" : "", dInfo->image_width, dInfo->image_height);
+        jpeg_abort_decompress(dInfo);
+        return 0;
+    }
+
+    // The output coefficient arrays have to be requested before the source ones are realized.
+    jvirt_barray_ptr dstCoefs[MAX_COMPONENTS];
+    for (int c = 0; c < dInfo->num_components; c++) {
+        const jpeg_component_info& comp = dInfo->comp_info[c];
+        dstCoefs[c] = dInfo->mem->request_virt_barray(
+                reinterpret_cast<j_common_ptr>(dInfo), JPOOL_IMAGE, /*pre_zero*/ FALSE,
+                getPaddedBlocks(transform.outWidth, comp.h_samp_factor,
+                                dInfo->max_h_samp_factor),
+                getPaddedBlocks(transform.outHeight, comp.v_samp_factor,
+                                dInfo->max_v_samp_factor),
+                comp.v_samp_factor);
+    }
+    jvirt_barray_ptr* srcCoefs = jpeg_read_coefficients(dInfo);
+    for (int c = 0; c < dInfo->num_components; c++) {
+        transformComponent(c, transform, srcCoefs[c], dstCoefs[c]);
+    }
+
+    // Same quantization tables and sampling as the source, standard huffman tables.
+    jpeg_copy_critical_parameters(dInfo, cInfo);
+    cInfo->image_width = transform.outWidth;
+    cInfo->image_height = transform.outHeight;
+    dest.buffer = dst;
+    dest.capacity = dstCapacity;
+    dest.init_destination = [](j_compress_ptr cInfo) {
+        auto& dest = static_cast<FixedDestination&>(*cInfo->dest);
+        dest.next_output_byte = dest.buffer;
+        dest.free_in_buffer = dest.capacity;
+    };
+    dest.empty_output_buffer = [](j_compress_ptr cInfo) -> boolean {
+        ERREXIT(cInfo, JERR_BUFFER_SIZE);
+        return FALSE;
+    };
+    dest.term_destination = [](j_compress_ptr) {};
+    cInfo->dest = &dest;
+    jpeg_write_coefficients(cInfo, dstCoefs);
+    jpeg_finish_compress(cInfo);
+    size_t encodedSize = dest.capacity - dest.free_in_buffer;
+    cInfo->dest = nullptr;
+    jpeg_finish_decompress(dInfo);
+    return encodedSize;
+}
+
+void JpegTransformer::transformComponent(int component, const JpegTransform& transform,
+                                         jvirt_barray_ptr src, jvirt_barray_ptr dst) {
+    j_decompress_ptr dInfo = &mDecompressInfo;
+    auto commonInfo = reinterpret_cast<j_common_ptr>(dInfo);
+    const jpeg_component_info& comp = dInfo->comp_info[component];
+    if (comp.quant_table == nullptr) {
+        ERREXIT1(dInfo, JERR_NO_QUANT_TABLE, comp.quant_tbl_no);
+    }
+    const UINT16* quant = comp.quant_table->quantval;
+    float inverseQuant[DCTSIZE2];
+    for (uint32_t n = 0; n < DCTSIZE2; n++) {
+        inverseQuant[n] = quant[n] == 0 ? 0.f : 1.f / quant[n];
+    }
+
+    uint32_t denom = transform.scaleDenom;
+    const ScaleMatrices& matrices = mScaleMatrices[__builtin_ctz(denom)];
+    int hSamp = comp.h_samp_factor;
+    int vSamp = comp.v_samp_factor;
+    int64_t lastSrcCol = comp.width_in_blocks - 1;
+    int64_t lastSrcRow = comp.height_in_blocks - 1;
+    uint32_t dstCols = getPaddedBlocks(transform.outWidth, hSamp, dInfo->max_h_samp_factor);
+    uint32_t dstRows = getPaddedBlocks(transform.outHeight, vSamp, dInfo->max_v_samp_factor);
+    // Output block b is made of the source blocks [first + b * denom, first + (b + 1) * denom).
+    // Rotated output blocks are counted back from the end of the window instead.
+    auto firstBlock = [&](uint32_t crop, uint32_t outSize, int samp, int maxSamp) -> int64_t {
+        uint64_t start = transform.rotate180 ? crop + static_cast<uint64_t>(outSize) * denom
+                                             : crop;
+        return static_cast<int64_t>(start * samp / maxSamp / DCTSIZE);
+    };
+    int64_t firstCol = firstBlock(transform.cropX, transform.outWidth, hSamp,
+                                  dInfo->max_h_samp_factor);
+    int64_t firstRow = firstBlock(transform.cropY, transform.outHeight, vSamp,
+                                  dInfo->max_v_samp_factor);
+    // Blocks past the edges of the source repeat the nearest one. They only cover padding.
+    auto srcIndex = [&](int64_t first, uint32_t b, uint32_t i, int64_t last) -> uint32_t {
+        int64_t group = transform.rotate180 ? first - (static_cast<int64_t>(b) + 1) * denom
+                                            : first + static_cast<int64_t>(b) * denom;
+        return static_cast<uint32_t>(std::clamp<int64_t>(group + i, 0, last));
+    };
+
+    for (uint32_t by = 0; by < dstRows; by++) {
+        JBLOCKROW dstRow = dInfo->mem->access_virt_barray(commonInfo, dst, by, 1, TRUE)[0];
+        // Coefficient arrays are fully memory resident (there is no backing store on Android), so
+        // rows stay valid across accesses.
+        JBLOCKROW srcRows[kMaxScaleDenom];
+        for (uint32_t i = 0; i < denom; i++) {
+            srcRows[i] = dInfo->mem->access_virt_barray(
+                    commonInfo, src, srcIndex(firstRow, by, i, lastSrcRow), 1, FALSE)[0];
+        }
+
+        for (uint32_t bx = 0; bx < dstCols; bx++) {
+            JCOEF* dstBlock = dstRow[bx];
+            if (denom == 1) {
+                memcpy(dstBlock, srcRows[0][srcIndex(firstCol, bx, 0, lastSrcCol)],
+                       sizeof(JBLOCK));
+            } else {
+                const JCOEF* blocks[kMaxScaleDenom * kMaxScaleDenom];
+                for (uint32_t j = 0; j < denom; j++) {
+                    uint32_t col = srcIndex(firstCol, bx, j, lastSrcCol);
+                    for (uint32_t i = 0; i < denom; i++) {
+                        blocks[i * denom + j] = srcRows[i][col];
+                    }
+                }
+                switch (denom) {
+                    case 2:
+                        downscaleBlock<2>(blocks, matrices, quant, inverseQuant, dstBlock);
+                        break;
+                    case 4:
+                        downscaleBlock<4>(blocks, matrices, quant, inverseQuant, dstBlock);
+                        break;
+                    default:
+                        downscaleBlock<8>(blocks, matrices, quant, inverseQuant, dstBlock);
+                        break;
+                }
+            }
+            if (transform.rotate180) {
+                // Mirroring a block in both directions flips the sign of odd frequencies.
+                for (uint32_t v = 0; v < DCTSIZE; v++) {
+                    for (uint32_t u = (v + 1) % 2; u < DCTSIZE; u += 2) {
+                        JCOEF& coef = dstBlock[v * DCTSIZE + u];
+                        coef = static_cast<JCOEF>(-coef);
+                    }
+                }
+            }
+        }
+    }
+}
+
+template <uint32_t denom>
+void JpegTransformer::downscaleBlock(const JCOEF* const* blocks, const ScaleMatrices& matrices,
+                                     const UINT16* quant, const float* inverseQuant, JCOEF* dst) {
+    // dst = sum over source blocks (i, j) of M_i * dequantized(A_ij) * M_j^T, with only the k x k
+    // low frequency corner of A_ij taken, requantized with the source's table.
+    // Mirrored blocks have mirrored matrices, M_(denom - 1 - i)[u][v] = (-1)^(u + v) M_i[u][v], so
+    // each pair of blocks is summed / differenced first and shares one matrix product: even
+    // output frequencies take the sum, odd ones the difference. The scale is a template parameter
+    // so that the compiler can unroll and vectorize the fixed size loops.
+    constexpr uint32_t k = DCTSIZE / denom;
+    constexpr uint32_t kPairs = denom / 2;
+
+    // Horizontal pass: rows[i] = sum over j of A_ij * M_j^T, k x 8 per row of source blocks.
+    float rows[denom][k][DCTSIZE] = {};
+    for (uint32_t i = 0; i < denom; i++) {
+        for (uint32_t p = 0; p < kPairs; p++) {
+            const JCOEF* block = blocks[i * denom + p];
+            const JCOEF* mirrored = blocks[i * denom + denom - 1 - p];
+            const float* m = matrices[p].data();
+            for (uint32_t v = 0; v < k; v++) {
+                float sum[k];
+                float diff[k];
+                for (uint32_t w = 0; w < k; w++) {
+                    uint32_t n = v * DCTSIZE + w;
+                    float a = static_cast<float>(block[n]) * quant[n];
+                    float b = static_cast<float>(mirrored[n]) * quant[n];
+                    b = w % 2 == 0 ? b : -b;
+                    sum[w] = a + b;
+                    diff[w] = a - b;
+                }
+                for (uint32_t u = 0; u < DCTSIZE; u++) {
+                    const float* in = u % 2 == 0 ? sum : diff;
+                    float acc = 0;
+                    for (uint32_t w = 0; w < k; w++) {
+                        acc += m[u * k + w] * in[w];
+                    }
+                    rows[i][v][u] += acc;
+                }
+            }
+        }
+    }
+
+    // Vertical pass: out = sum over i of M_i * rows[i].
+    float out[DCTSIZE][DCTSIZE] = {};
+    for (uint32_t p = 0; p < kPairs; p++) {
+        float sum[k][DCTSIZE];
+        float diff[k][DCTSIZE];
+        for (uint32_t v = 0; v < k; v++) {
+            for (uint32_t x = 0; x < DCTSIZE; x++) {
+                float b = v % 2 == 0 ? rows[denom - 1 - p][v][x] : -rows[denom - 1 - p][v][x];
+                sum[v][x] = rows[p][v][x] + b;
+                diff[v][x] = rows[p][v][x] - b;
+            }
+        }
+        const float* m = matrices[p].data();
+        for (uint32_t u = 0; u < DCTSIZE; u++) {
+            const auto& in = u % 2 == 0 ? sum : diff;
+            for (uint32_t v = 0; v < k; v++) {
+                float coef = m[u * k + v];
+                if (coef == 0) {
+                    continue;
+                }
+                for (uint32_t x = 0; x < DCTSIZE; x++) {
+                    out[u][x] += coef * in[v][x];
+                }
+            }
+        }
+    }
+
+    for (uint32_t n = 0; n < DCTSIZE2; n++) {
+        float limit = n == 0 ? kMaxDcCoefficient : kMaxAcCoefficient;
+        float value = std::clamp(out[n / DCTSIZE][n % DCTSIZE] * inverseQuant[n], -limit, limit);
+        dst[n] = static_cast<JCOEF>(value < 0 ? value - 0.5f : value + 0.5f);
+    }
+}
+
+}  // namespace webcam
+}  // namespace android
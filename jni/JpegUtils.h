@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <array>
+#include <vector>
+
+#include <jpeglib.h>
+
+namespace android {
+namespace webcam {
+
+struct JpegInfo {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t numComponents = 0;
+};
+
+// Returns the size of the JPEG at the start of a camera BLOB buffer of blobSize bytes, from the
+// CameraBlob trailer the camera HAL writes at the end of the buffer. Falls back to looking for the
+// last EOI marker if there is no trailer. Returns 0 if no JPEG is found.
+size_t getCameraJpegSize(const uint8_t* blob, size_t blobSize);
+
+// Checks that data holds a complete baseline / progressive JPEG (SOI ... SOFn ... EOI) and
+// returns its dimensions. Doesn't decode any entropy coded data.
+bool parseJpegInfo(const uint8_t* data, size_t size, JpegInfo* info);
+
+// Long lived libjpeg decompressor decoding YUV 4:2:0 JPEGs straight to I420 planes (raw data
+// output, no color conversion or upsampling). Decoding errors are returned, not fatal.
+class JpegDecoder {
+  public:
+    JpegDecoder();
+    ~JpegDecoder();
+
+    // Decodes data into the given planes, downscaled by 1 / scaleDenom (1, 2, 4 or 8) with
+    // libjpeg's reduced size IDCTs. The output is the image size divided by scaleDenom, rounded up.
+    // The plane strides must be at least the output width rounded up to 16 (8 for chroma) and the
+    // planes must have room for the output height rounded up to 16 (8 for chroma) rows, since
+    // libjpeg writes whole MCUs.
+    bool decodeToI420(const uint8_t* data, size_t size, uint32_t expectedWidth,
+                      uint32_t expectedHeight, uint32_t scaleDenom, uint8_t* y,
+                      uint32_t yRowStride, uint8_t* u, uint32_t uRowStride, uint8_t* v,
+                      uint32_t vRowStride);
+
+  private:
+    static constexpr uint32_t kMaxRowsPerIMcu = 2 * DCTSIZE;
+
+    struct ErrorManager {
+        jpeg_error_mgr mgr;
+        jmp_buf jumpBuffer;
+    };
+
+    jpeg_decompress_struct mDecompressInfo{};
+    ErrorManager mError{};
+    // One iMCU row of each chroma plane, for scaled decodes. Sized on first use.
+    std::vector<uint8_t> mChromaRows;
+};
+
+// Crop, downscale and rotation applied to a JPEG by JpegTransformer. The output is the window of
+// (outWidth x outHeight) * scaleDenom source pixels starting at (cropX, cropY), scaled by
+// 1 / scaleDenom and optionally rotated by 180 degrees. The window has to start on an MCU
+// boundary, or end on one when rotating, since blocks are moved around whole.
+struct JpegTransform {
+    uint32_t scaleDenom = 1;  // 1, 2, 4 or 8
+    uint32_t cropX = 0;
+    uint32_t cropY = 0;
+    uint32_t outWidth = 0;
+    uint32_t outHeight = 0;
+    bool rotate180 = false;
+};
+
+// Picks the transform turning a srcWidth x srcHeight JPEG into a dstWidth x dstHeight one: the
+// largest scale that still covers the destination, followed by a centered crop. Returns false if
+// that would crop away more than a quarter of the scaled image in either direction, in which case
+// the image should be resampled instead, or if the window can't be aligned to MCUs.
+bool planJpegTransform(uint32_t srcWidth, uint32_t srcHeight, uint32_t dstWidth,
+                       uint32_t dstHeight, bool rotate180, JpegTransform* transform);
+
+// jpegtran style transcoder cropping, downscaling and rotating JPEGs in the DCT domain. The source
+// is entropy decoded to DCT coefficients, each output block is computed from the low frequency
+// coefficients of the scaleDenom x scaleDenom source blocks it covers, and the result is entropy
+// coded again with the source's quantization tables. No IDCT / FDCT or color conversion is run, a
+// plain crop just copies coefficient blocks and a 180 degree rotation reverses the block order and
+// negates odd frequencies. Errors are returned, not fatal.
+class JpegTransformer {
+  public:
+    JpegTransformer();
+    ~JpegTransformer();
+
+    // Writes the transformed JPEG to dst. Returns its size, 0 on failure (including dst being
+    // too small).
+    size_t transform(const uint8_t* data, size_t size, const JpegTransform& transform,
+                     uint8_t* dst, size_t dstCapacity);
+
+  private:
+    static constexpr uint32_t kMaxScaleDenom = 8;
+    // Per scale, the 8 x (8 / scaleDenom) matrices M_i mapping the low frequency coefficients of
+    // the i-th source block along one direction to the coefficients of the output block.
+    using ScaleMatrices = std::array<std::array<float, DCTSIZE2>, kMaxScaleDenom>;
+
+    struct ErrorManager {
+        jpeg_error_mgr mgr;
+        jmp_buf jumpBuffer;
+    };
+
+    void transformComponent(int component, const JpegTransform& transform, jvirt_barray_ptr src,
+                            jvirt_barray_ptr dst);
+    // Computes one output block from denom x denom source blocks (row major).
+    template <uint32_t denom>
+    static void downscaleBlock(const JCOEF* const* blocks, const ScaleMatrices& matrices,
+                               const UINT16* quant, const float* inverseQuant, JCOEF* dst);
+
+    jpeg_decompress_struct mDecompressInfo{};
+    jpeg_compress_struct mCompressInfo{};
+    ErrorManager mError{};
+    std::array<ScaleMatrices, 4> mScaleMatrices{};  // indexed by log2(scaleDenom)
+};
+
+}  // namespace webcam
+}  // namespace android
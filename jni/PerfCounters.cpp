@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+
+#include "PerfCounters.h"
+
+#include <android-base/stringprintf.h>
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <log/log.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace android {
+namespace webcam {
+
+namespace {
+struct EventConfig {
+    uint32_t type;
+    uint64_t config;
+};
+
+constexpr uint64_t cacheConfig(uint64_t cache, uint64_t op, uint64_t result) {
+    return cache | (op << 8) | (result << 16);
+}
+
+constexpr std::array<EventConfig, kPerfEventCount> kEventConfigs = {{
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HW_CACHE, cacheConfig(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+                                         PERF_COUNT_HW_CACHE_RESULT_MISS)},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+}};
+
+// Layout of a PERF_FORMAT_GROUP read with the enabled and running times.
+struct GroupReadFormat {
+    uint64_t nr;
+    uint64_t timeEnabled;
+    uint64_t timeRunning;
+    uint64_t values[kPerfEventCount];
+};
+
+int perfEventOpen(perf_event_attr* attr, int groupFd) {
+    return static_cast<int>(syscall(__NR_perf_event_open, attr, /*pid*/ 0, /*cpu*/ -1, groupFd,
+                                    PERF_FLAG_FD_CLOEXEC));
+}
+}  // anonymous namespace
+
+const char* perfEventToString(PerfEvent event) {
+    switch (event) {
+        case PerfEvent::CYCLES:
+            return "cycles";
+        case PerfEvent::INSTRUCTIONS:
+            return "instructions";
+        case PerfEvent::L1D_MISSES:
+            return "l1d-misses";
+        case PerfEvent::LLC_MISSES:
+            return "llc-misses";
+        case PerfEvent::BRANCH_MISSES:
+            return "branch-misses";
+        default:
+            return "unknown";
+    }
+}
+
+PerfCounts PerfCounts::between(const PerfCounts& start, const PerfCounts& end) {
+    PerfCounts ret;
+    for (size_t i = 0; i < kPerfEventCount; i++) {
+        uint32_t bit = 1u << i;
+        if ((start.validMask & end.validMask & bit) != 0 && end.values[i] >= start.values[i]) {
+            ret.values[i] = end.values[i] - start.values[i];
+            ret.validMask |= bit;
+        }
+    }
+    return ret;
+}
+
+PerfCounts PerfCounts::sum(const PerfCounts& a, const PerfCounts& b) {
+    PerfCounts ret;
+    ret.validMask = a.validMask & b.validMask;
+    for (size_t i = 0; i < kPerfEventCount; i++) {
+        if ((ret.validMask & (1u << i)) != 0) {
+            ret.values[i] = a.values[i] + b.values[i];
+        }
+    }
+    return ret;
+}
+
+void PerfCounts::add(const PerfCounts& counts) {
+    if (counts.validMask == 0) {
+        return;
+    }
+    for (size_t i = 0; i < kPerfEventCount; i++) {
+        values[i] += counts.values[i];
+    }
+    validMask = samples == 0 ? counts.validMask : validMask & counts.validMask;
+    samples++;
+}
+
+std::string PerfCounts::toString(uint64_t pixels) const {
+    if (pixels == 0 || validMask == 0) {
+        return "no counters";
+    }
+    std::string ret;
+    double px = static_cast<double>(pixels);
+    if (has(PerfEvent::CYCLES)) {
+        ret += android::base::StringPrintf("cycles/px %.2f ", get(PerfEvent::CYCLES) / px);
+    }
+    if (has(PerfEvent::CYCLES) && has(PerfEvent::INSTRUCTIONS) && get(PerfEvent::CYCLES) > 0) {
+        ret += android::base::StringPrintf(
+                "ipc %.2f ", static_cast<double>(get(PerfEvent::INSTRUCTIONS)) /
+                                     get(PerfEvent::CYCLES));
+    }
+    // Misses are rare per pixel, count them per thousand.
+    for (PerfEvent event : {PerfEvent::L1D_MISSES, PerfEvent::LLC_MISSES,
+                            PerfEvent::BRANCH_MISSES}) {
+        if (has(event)) {
+            ret += android::base::StringPrintf("%s/kpx %.2f ", perfEventToString(event),
+                                               get(event) * 1000 / px);
+        }
+    }
+    if (!ret.empty()) {
+        ret.pop_back();
+    }
+    return ret;
+}
+
+std::unique_ptr<PerfCounters> PerfCounters::openForCallingThread() {
+    std::unique_ptr<PerfCounters> counters(new PerfCounters());
+    counters->mGroupIndex.fill(-1);
+    for (size_t i = 0; i < kPerfEventCount; i++) {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = kEventConfigs[i].type;
+        attr.config = kEventConfigs[i].config;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        // Counting user space only is what perf_event_paranoid 2 still allows.
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        int fd = perfEventOpen(&attr, counters->mLeaderFd);
+        if (fd < 0) {
+            ALOGV("%s: Can't count %s: %s", __FUNCTION__,
+                  perfEventToString(static_cast<PerfEvent>(i)), strerror(errno));
+            continue;
+        }
+        counters->mFds[i].reset(fd);
+        if (counters->mLeaderFd < 0) {
+            counters->mLeaderFd = fd;
+        }
+        counters->mGroupIndex[i] = static_cast<int>(counters->mGroupSize++);
+    }
+    if (counters->mLeaderFd < 0) {
+        ALOGI("%s: Hardware performance counters are unavailable: %s", __FUNCTION__,
+              strerror(errno));
+        return nullptr;
+    }
+    return counters;
+}
+
+bool PerfCounters::read(PerfCounts* counts) const {
+    GroupReadFormat data{};
+    ssize_t expected = static_cast<ssize_t>((3 + mGroupSize) * sizeof(uint64_t));
+    if (::read(mLeaderFd, &data, sizeof(data)) < expected || data.nr != mGroupSize ||
+        data.timeRunning == 0) {
+        return false;
+    }
+    // Scale up for the time the group wasn't on the PMU.
+    double scale = static_cast<double>(data.timeEnabled) / data.timeRunning;
+    counts->validMask = 0;
+    for (size_t i = 0; i < kPerfEventCount; i++) {
+        if (mGroupIndex[i] < 0) {
+            counts->values[i] = 0;
+            continue;
+        }
+        counts->values[i] = static_cast<uint64_t>(data.values[mGroupIndex[i]] * scale);
+        counts->validMask |= 1u << i;
+    }
+    return true;
+}
+
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <android-base/unique_fd.h>
+
+namespace android {
+namespace webcam {
+
+enum class PerfEvent : uint32_t {
+    CYCLES = 0,
+    INSTRUCTIONS,
+    L1D_MISSES,
+    LLC_MISSES,
+    BRANCH_MISSES,
+    COUNT,
+};
+
+constexpr size_t kPerfEventCount = static_cast<size_t>(PerfEvent::COUNT);
+
+const char* perfEventToString(PerfEvent event);
+
+// Hardware counter values. Events the device couldn't count are left out of validMask.
+struct PerfCounts {
+    std::array<uint64_t, kPerfEventCount> values{};
+    uint32_t validMask = 0;
+    uint64_t samples = 0;  // number of counts add()ed up
+
+    [[nodiscard]] bool has(PerfEvent event) const {
+        return (validMask & (1u << static_cast<uint32_t>(event))) != 0;
+    }
+    [[nodiscard]] uint64_t get(PerfEvent event) const {
+        return values[static_cast<size_t>(event)];
+    }
+    // Counts between start and end, for the events valid in both.
+    static PerfCounts between(const PerfCounts& start, const PerfCounts& end);
+    // Counts of two threads sharing some work, for the events valid in both.
+    static PerfCounts sum(const PerfCounts& a, const PerfCounts& b);
+    // Accumulates counts. Only events valid in all the added counts stay valid.
+    void add(const PerfCounts& counts);
+    // "cycles/px 12.3 ipc 1.45 l1d-miss/kpx 80.1 ...", counts divided by pixels.
+    [[nodiscard]] std::string toString(uint64_t pixels) const;
+};
+
+// perf_event_open counters of the calling thread (user space only), read as a group so that
+// they cover the same instructions. Most devices don't let apps count by default
+// (perf_event_paranoid), so callers must cope with there being none.
+class PerfCounters {
+  public:
+    // Returns null if no counter could be opened.
+    static std::unique_ptr<PerfCounters> openForCallingThread();
+
+    // Current values, scaled up if the kernel had to multiplex the counters. Returns false if the
+    // group isn't being counted.
+    bool read(PerfCounts* counts) const;
+
+  private:
+    PerfCounters() = default;
+
+    std::array<android::base::unique_fd, kPerfEventCount> mFds;
+    int mLeaderFd = -1;  // first event opened, the group is read through it
+    // Position of each event in the group's read buffer, -1 if not opened.
+    std::array<int, kPerfEventCount> mGroupIndex{};
+    size_t mGroupSize = 0;
+};
+
+}  // namespace webcam
+}  // namespace android
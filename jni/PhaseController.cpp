@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "PhaseController.h"
+
+#include <math.h>
+#include <algorithm>
+
+namespace android {
+namespace webcam {
+
+namespace {
+constexpr double kAlpha = 1.0 / 16;
+// An interval this many periods long means frames were dropped, or the rate changed.
+constexpr double kGapPeriods = 3;
+// Margin for the next frame being late, in jitter estimates.
+constexpr double kJitterMargin = 2;
+
+double toNs(std::chrono::steady_clock::duration duration) {
+    return static_cast<double>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+}
+}  // anonymous namespace
+
+void PhaseController::onBufferFilled(Clock::time_point now) {
+    if (mLastFilled != Clock::time_point()) {
+        double intervalNs = toNs(now - mLastFilled);
+        if (mIntervals == 0) {
+            mPeriodNs = intervalNs;
+            mJitterNs = 0;
+            mIntervals++;
+        } else if (intervalNs > kGapPeriods * mPeriodNs) {
+            // Start over rather than drag the estimate along.
+            mIntervals = 0;
+        } else {
+            double error = intervalNs - mPeriodNs;
+            mPeriodNs += kAlpha * error;
+            mJitterNs += kAlpha * (fabs(error) - mJitterNs);
+            mIntervals++;
+        }
+    }
+    mLastFilled = now;
+}
+
+std::chrono::nanoseconds PhaseController::getHold(Clock::time_point now,
+                                                  Clock::time_point newestFilled) const {
+    if (mIntervals < kMinIntervals) {
+        return std::chrono::nanoseconds(0);
+    }
+    double waitedNs = toNs(now - newestFilled);
+    double untilNextNs = mPeriodNs - toNs(now - mLastFilled);
+    double holdNs = std::max(untilNextNs, 0.0) + kJitterMargin * mJitterNs;
+    // The next frame leaves about the margin old, the waiting one waitedNs old. Holding only pays
+    // off if it is shorter than that, and it must not eat into the next frame interval.
+    if (holdNs >= waitedNs || holdNs > kMaxHoldFraction * mPeriodNs) {
+        return std::chrono::nanoseconds(0);
+    }
+    return std::chrono::nanoseconds(static_cast<int64_t>(holdNs));
+}
+
+}  // namespace webcam
+}  // namespace android
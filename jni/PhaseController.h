@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+namespace android {
+namespace webcam {
+
+// The camera fills buffers and the gadget driver picks them up on two unrelated clocks, so a
+// frame may wait up to a whole frame interval before it goes out. PhaseController tracks when
+// filled buffers show up and, at pickup time, decides whether the consumer should hold on for
+// the next frame: if that frame is due soon enough that it would leave fresher than the one that
+// is waiting now. Holding once shifts the phase of every later pickup too, so pickups settle
+// right after the fills. Not thread safe, the BufferManager calls it under its lock.
+class PhaseController {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    // Fill intervals needed before the period estimate is trusted.
+    static constexpr uint32_t kMinIntervals = 8;
+    // Never hold for more than this fraction of a frame interval.
+    static constexpr double kMaxHoldFraction = 0.5;
+
+    void onBufferFilled(Clock::time_point now);
+    // How long to wait for a fresher frame, given the newest filled buffer. Zero means deliver
+    // what is there now.
+    [[nodiscard]] std::chrono::nanoseconds getHold(Clock::time_point now,
+                                                   Clock::time_point newestFilled) const;
+
+    [[nodiscard]] Clock::time_point getLastFilled() const { return mLastFilled; }
+    [[nodiscard]] double getPeriodNs() const { return mPeriodNs; }
+
+  private:
+    Clock::time_point mLastFilled;
+    uint32_t mIntervals = 0;
+    double mPeriodNs = 0;  // exponentially weighted moving averages
+    double mJitterNs = 0;
+};
+
+}  // namespace webcam
+}  // namespace android
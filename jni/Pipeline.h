@@ -0,0 +1,322 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *  Small framework for describing the frame path as a chain of stages.
+ */
+#pragma once
+
+#include <inttypes.h>
+#include <log/log.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "AllocationCheck.h"
+#include "DeviceAsWebcamNative.h"
+#include "Utils.h"
+
+namespace android {
+namespace webcam {
+
+// Lock-free single producer / single consumer ring buffer. The capacity is rounded up to a power of
+// two and fixed at construction, so push() and pop() never allocate.
+template <typename T>
+class BoundedQueue {
+  public:
+    explicit BoundedQueue(size_t capacity) {
+        size_t slots = 1;
+        while (slots < capacity) {
+            slots <<= 1;
+        }
+        mSlots.resize(slots);
+        mMask = slots - 1;
+    }
+
+    // Producer call. Returns false if the queue is full.
+    bool push(const T& item) {
+        size_t tail = mTail.load(std::memory_order_relaxed);
+        if (tail - mHead.load(std::memory_order_acquire) > mMask) {
+            return false;
+        }
+        mSlots[tail & mMask] = item;
+        mTail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer call. Returns false if the queue is empty.
+    bool pop(T* item) {
+        size_t head = mHead.load(std::memory_order_relaxed);
+        if (head == mTail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        *item = mSlots[head & mMask];
+        mHead.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    [[nodiscard]] bool empty() const {
+        return mHead.load(std::memory_order_acquire) == mTail.load(std::memory_order_acquire);
+    }
+
+  private:
+    std::vector<T> mSlots;
+    size_t mMask = 0;
+    alignas(64) std::atomic<size_t> mHead = 0;  // written by the consumer only
+    alignas(64) std::atomic<size_t> mTail = 0;  // written by the producer only
+};
+
+// How a stage is run: INLINE stages run on the thread that ran the previous stage (or the thread
+// calling Pipeline::submit for the first stage). THREAD stages get their own thread fed by a
+// BoundedQueue.
+enum class StageExecution {
+    INLINE = 0,
+    THREAD = 1,
+};
+
+template <typename T>
+class PipelineStage {
+  public:
+    virtual ~PipelineStage() = default;
+    [[nodiscard]] virtual const char* getName() const = 0;
+    // Processes item in place. Returning false stops the item from moving further down the
+    // pipeline and hands it to the pipeline's drop handler.
+    virtual bool process(T& item) = 0;
+};
+
+struct StageStats {
+    std::string name;
+    uint64_t processed = 0;
+    uint64_t failed = 0;
+    uint64_t queueFullDrops = 0;
+    uint64_t totalNs = 0;
+    uint64_t maxNs = 0;
+    uint64_t cpuNs = 0;  // thread CPU time, lower than totalNs when stages block or are preempted
+};
+
+// A linear chain of PipelineStages carrying items of type T. Stages are added before start() and
+// the layout is fixed until stop(). submit() must only be called from one thread at a time: the
+// first threaded stage's BoundedQueue has a single producer. Owners that submit from several
+// threads serialize the calls with a lock of their own, whose hand-off also orders the queue
+// writes (see SdkFrameProvider::mSubmitLock). Overlapping calls abort.
+// Items that fail a stage, or cannot be queued to a threaded stage, or are still queued on stop()
+// are handed to the drop handler so that the owner can return their resources.
+template <typename T>
+class Pipeline {
+  public:
+    using DropHandler = std::function<void(T&)>;
+    static constexpr size_t kDefaultQueueDepth = 4;
+
+    explicit Pipeline(std::string name) : mName(std::move(name)) {}
+    ~Pipeline() { stop(); }
+
+    void addStage(std::shared_ptr<PipelineStage<T>> stage, StageExecution execution,
+                  size_t queueDepth = kDefaultQueueDepth) {
+        if (mRunning) {
+            ALOGE("%s: %s: Stages can't be added to a running pipeline", __FUNCTION__,
+                  mName.c_str());
+            return;
+        }
+        auto node = std::make_unique<Node>();
+        node->pipeline = this;
+        node->index = mNodes.size();
+        node->stage = std::move(stage);
+        node->execution = execution;
+        if (execution == StageExecution::THREAD) {
+            node->queue = std::make_unique<BoundedQueue<T>>(queueDepth);
+        }
+        mNodes.push_back(std::move(node));
+    }
+
+    void setDropHandler(DropHandler handler) { mDropHandler = std::move(handler); }
+
+    void start() {
+        if (mRunning) {
+            return;
+        }
+        mRunning = true;
+        for (auto& node : mNodes) {
+            if (node->execution == StageExecution::THREAD) {
+                // Stages may call back into java (eg: to return images), so attach the threads.
+                node->thread = DeviceAsWebcamNative::createJniAttachedThread(&Node::threadLoop,
+                                                                             node.get());
+            }
+        }
+        ALOGV("%s: Started pipeline %s with %zu stages", __FUNCTION__, mName.c_str(),
+              mNodes.size());
+    }
+
+    // Joins all stage threads. Items still queued are handed to the drop handler.
+    void stop() {
+        if (!mRunning) {
+            return;
+        }
+        mRunning = false;
+        for (auto& node : mNodes) {
+            if (node->thread.joinable()) {
+                node->wakeUp();
+                node->thread.join();
+            }
+        }
+        T item;
+        for (auto& node : mNodes) {
+            while (node->queue != nullptr && node->queue->pop(&item)) {
+                drop(item);
+            }
+        }
+    }
+
+    // Feeds an item into the first stage. Returns false if the item was dropped, in which case the
+    // drop handler has already been called for it.
+    bool submit(T& item) {
+        LOG_ALWAYS_FATAL_IF(mSubmitting.exchange(true, std::memory_order_acquire),
+                            "%s: %s: submit() called from two threads at once", __FUNCTION__,
+                            mName.c_str());
+        bool submitted = false;
+        if (!mRunning || mNodes.empty()) {
+            drop(item);
+        } else {
+            submitted = runFrom(0, item);
+        }
+        mSubmitting.store(false, std::memory_order_release);
+        return submitted;
+    }
+
+    [[nodiscard]] std::vector<StageStats> getStats() const {
+        std::vector<StageStats> ret;
+        for (const auto& node : mNodes) {
+            StageStats stats;
+            stats.name = node->stage->getName();
+            stats.processed = node->processed.load(std::memory_order_relaxed);
+            stats.failed = node->failed.load(std::memory_order_relaxed);
+            stats.queueFullDrops = node->queueFullDrops.load(std::memory_order_relaxed);
+            stats.totalNs = node->totalNs.load(std::memory_order_relaxed);
+            stats.maxNs = node->maxNs.load(std::memory_order_relaxed);
+            stats.cpuNs = node->cpuNs.load(std::memory_order_relaxed);
+            ret.push_back(std::move(stats));
+        }
+        return ret;
+    }
+
+    void dumpStats() const {
+        for (const auto& stats : getStats()) {
+            uint64_t avgUs = stats.processed == 0 ? 0 : stats.totalNs / stats.processed / 1000;
+            uint64_t avgCpuUs = stats.processed == 0 ? 0 : stats.cpuNs / stats.processed / 1000;
+            ALOGI("%s: %s: stage %s processed %" PRIu64 " failed %" PRIu64 " queue drops %" PRIu64
+                  " avg %" PRIu64 "us (cpu %" PRIu64 "us) max %" PRIu64 "us",
+                  __FUNCTION__, mName.c_str(), stats.name.c_str(), stats.processed, stats.failed,
+                  stats.queueFullDrops, avgUs, avgCpuUs, stats.maxNs / 1000);
+        }
+    }
+
+  private:
+    struct Node {
+        Pipeline* pipeline = nullptr;
+        size_t index = 0;
+        std::shared_ptr<PipelineStage<T>> stage;
+        StageExecution execution = StageExecution::INLINE;
+        std::unique_ptr<BoundedQueue<T>> queue;  // only for THREAD stages
+        std::thread thread;
+
+        std::mutex parkLock;  // only used to park / wake the stage thread
+        std::condition_variable parkCondition;
+
+        std::atomic<uint64_t> processed = 0;
+        std::atomic<uint64_t> failed = 0;
+        std::atomic<uint64_t> queueFullDrops = 0;
+        std::atomic<uint64_t> totalNs = 0;
+        std::atomic<uint64_t> maxNs = 0;
+        std::atomic<uint64_t> cpuNs = 0;
+
+        void wakeUp() {
+            { std::lock_guard<std::mutex> l(parkLock); }
+            parkCondition.notify_one();
+        }
+
+        void threadLoop() {
+            using namespace std::chrono_literals;
+            trackFramePathAllocations(stage->getName());
+            T item;
+            while (pipeline->mRunning) {
+                if (!queue->pop(&item)) {
+                    std::unique_lock<std::mutex> l(parkLock);
+                    if (queue->empty() && pipeline->mRunning) {
+                        parkCondition.wait_for(l, 50ms);
+                    }
+                    continue;
+                }
+                pipeline->runFrom(index, item, /*fromQueue*/ true);
+            }
+        }
+    };
+
+    // Runs item through the stages starting at index, until it either leaves the pipeline or has
+    // been handed to a threaded stage's queue.
+    bool runFrom(size_t index, T& item, bool fromQueue = false) {
+        for (size_t i = index; i < mNodes.size(); i++) {
+            Node& node = *mNodes[i];
+            if (node.execution == StageExecution::THREAD && !(fromQueue && i == index)) {
+                if (!node.queue->push(item)) {
+                    node.queueFullDrops.fetch_add(1, std::memory_order_relaxed);
+                    drop(item);
+                    return false;
+                }
+                node.wakeUp();
+                return true;
+            }
+            auto start = std::chrono::steady_clock::now();
+            uint64_t cpuStartNs = getThreadCpuTimeNs();
+            bool success = node.stage->process(item);
+            uint64_t cpuNs = getThreadCpuTimeNs() - cpuStartNs;
+            uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                  std::chrono::steady_clock::now() - start)
+                                  .count();
+            node.processed.fetch_add(1, std::memory_order_relaxed);
+            node.totalNs.fetch_add(ns, std::memory_order_relaxed);
+            node.cpuNs.fetch_add(cpuNs, std::memory_order_relaxed);
+            if (ns > node.maxNs.load(std::memory_order_relaxed)) {
+                node.maxNs.store(ns, std::memory_order_relaxed);
+            }
+            if (!success) {
+                node.failed.fetch_add(1, std::memory_order_relaxed);
+                drop(item);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void drop(T& item) {
+        if (mDropHandler) {
+            mDropHandler(item);
+        }
+    }
+
+    std::string mName;
+    std::vector<std::unique_ptr<Node>> mNodes;  // fixed while running
+    DropHandler mDropHandler;
+    std::atomic<bool> mRunning = false;
+    std::atomic<bool> mSubmitting = false;  // set for the duration of submit()
+};
+
+}  // namespace webcam
+}  // namespace android
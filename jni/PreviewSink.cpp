@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+
+#include "PreviewSink.h"
+
+#include <android-base/properties.h>
+#include <inttypes.h>
+#include <libyuv/convert_argb.h>
+#include <libyuv/scale.h>
+#include <log/log.h>
+#include <algorithm>
+
+#include "I420.h"
+
+namespace android {
+namespace webcam {
+
+PreviewSink& PreviewSink::getInstance() {
+    static PreviewSink sInstance;
+    return sInstance;
+}
+
+bool PreviewSink::isEnabled() {
+    return android::base::GetBoolProperty(kEnableProperty, /*default_value*/ false);
+}
+
+void PreviewSink::setWindow(std::unique_ptr<PreviewWindow> window) {
+    stop();
+    std::lock_guard<InstrumentedMutex> l(mWindowLock);
+    if (mWindow != nullptr) {
+        ALOGI("%s: Preview drew %" PRIu64 " of %" PRIu64 " frames", __FUNCTION__, mPosted.load(),
+              mOffered.load());
+    }
+    mWindow = std::move(window);
+    mOffered = 0;
+    mPosted = 0;
+    if (mWindow == nullptr) {
+        mFrame.clear();
+        mFrame.shrink_to_fit();
+        return;
+    }
+    // Chroma is subsampled by 2, an odd row or column would be left undrawn.
+    mWidth = mWindow->getWidth() & ~1u;
+    mHeight = mWindow->getHeight() & ~1u;
+    if (mWidth == 0 || mHeight == 0) {
+        ALOGE("%s: Window has no size", __FUNCTION__);
+        mWindow = nullptr;
+        return;
+    }
+    size_t lumaSize = static_cast<size_t>(mWidth) * mHeight;
+    mFrame.resize(lumaSize + lumaSize / 2);
+    start();
+}
+
+void PreviewSink::offerFrame(const I420& frame) {
+    if (!mWorker.isIdle()) {
+        return;
+    }
+    // setWindow holds the lock while it replaces the window, this frame is skipped then.
+    InstrumentedMutex::UniqueLock l(mWindowLock, std::try_to_lock);
+    if (!l.owns_lock() || !mWorker.isIdle()) {
+        return;
+    }
+    mOffered.fetch_add(1, std::memory_order_relaxed);
+    // Crop rather than stretch, the preview's aspect ratio may differ from the stream's.
+    I420 crop = cropToAspectRatio(frame, mWidth, mHeight);
+    uint32_t chromaWidth = mWidth / 2;
+    uint8_t* y = mFrame.data();
+    uint8_t* u = y + static_cast<size_t>(mWidth) * mHeight;
+    uint8_t* v = u + static_cast<size_t>(chromaWidth) * (mHeight / 2);
+    if (libyuv::I420Scale(crop.y, crop.yRowStride, crop.u, crop.uRowStride, crop.v,
+                          crop.vRowStride, crop.width, crop.height, y, mWidth, u, chromaWidth, v,
+                          chromaWidth, mWidth, mHeight, libyuv::kFilterBilinear) != 0) {
+        return;
+    }
+    mWorker.submit();
+}
+
+PreviewStats PreviewSink::getStats() const {
+    return {mOffered.load(std::memory_order_relaxed), mPosted.load(std::memory_order_relaxed)};
+}
+
+void PreviewSink::start() {
+    mLastDrawFailed = false;
+    mWorker.start();
+}
+
+void PreviewSink::stop() {
+    mWorker.stop();
+}
+
+void PreviewSink::processFrame() {
+    // mWindow can't change while the thread runs, setWindow stops it first.
+    bool drawn = drawFrame();
+    if (drawn) {
+        mPosted.fetch_add(1, std::memory_order_relaxed);
+    } else if (!mLastDrawFailed) {
+        // Usually the window was abandoned, Java will replace or clear it.
+        ALOGW("%s: Failed to draw the preview", __FUNCTION__);
+    }
+    mLastDrawFailed = !drawn;
+}
+
+bool PreviewSink::drawFrame() {
+    PreviewWindow::Buffer buffer;
+    if (!mWindow->lock(&buffer)) {
+        return false;
+    }
+    // The consumer may have been resized since setWindow, draw what fits.
+    uint32_t width = std::min(buffer.width, mWidth);
+    uint32_t height = std::min(buffer.height, mHeight);
+    uint32_t chromaWidth = mWidth / 2;
+    const uint8_t* y = mFrame.data();
+    const uint8_t* u = y + static_cast<size_t>(mWidth) * mHeight;
+    const uint8_t* v = u + static_cast<size_t>(chromaWidth) * (mHeight / 2);
+    // libyuv's ABGR is R, G, B, A in memory, ie: RGBA 8888.
+    bool converted = libyuv::I420ToABGR(y, mWidth, u, chromaWidth, v, chromaWidth, buffer.pixels,
+                                        buffer.stride * 4, width, height) == 0;
+    return mWindow->unlockAndPost() && converted;
+}
+
+}  // namespace webcam
+}  // namespace android
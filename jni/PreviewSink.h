@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *  Draws the in-app preview from the frames converted for the host, so that the camera doesn't
+ *  need a second output stream for it while the webcam is streaming.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "InstrumentedMutex.h"
+#include "SampledWorker.h"
+
+struct ANativeWindow;
+
+namespace android {
+namespace webcam {
+
+struct I420;
+
+// Consumer the preview is drawn into. Implemented over an ANativeWindow on device, by a stub in
+// host tests.
+class PreviewWindow {
+  public:
+    // RGBA 8888 buffer locked for drawing, stride in pixels.
+    struct Buffer {
+        uint8_t* pixels = nullptr;
+        uint32_t stride = 0;
+        uint32_t width = 0;
+        uint32_t height = 0;
+    };
+
+    virtual ~PreviewWindow() = default;
+
+    // Size of the buffers the window's consumer asked for.
+    [[nodiscard]] virtual uint32_t getWidth() const = 0;
+    [[nodiscard]] virtual uint32_t getHeight() const = 0;
+    // Locks the next buffer to draw into. May block until the consumer releases one.
+    virtual bool lock(Buffer* buffer) = 0;
+    virtual bool unlockAndPost() = 0;
+
+    // Window drawing RGBA buffers into window, null if window doesn't take them.
+    static std::unique_ptr<PreviewWindow> fromNativeWindow(ANativeWindow* window);
+};
+
+struct PreviewStats {
+    uint64_t offered = 0;  // frames the encoder offered
+    uint64_t posted = 0;   // frames drawn into the window
+};
+
+// Process wide, the preview window outlives streams and Encoders.
+//
+// offerFrame is called by the encoder thread with each frame it converts. If the preview thread is
+// idle, the frame is scaled to the window's size right away (the source may be gone once the
+// encoder returns) and handed to the preview thread, which converts it to RGBA and posts it.
+// Otherwise the preview skips the frame: the encoder never waits for the preview.
+class PreviewSink {
+  public:
+    // Off by default: the encoder thread scales every frame it hands over, which adds to its frame
+    // time. The preview then uses a camera output of its own.
+    static constexpr char kEnableProperty[] = "debug.deviceaswebcam.native_preview";
+
+    static PreviewSink& getInstance();
+
+    // Whether the service should draw the preview rather than add a camera output for it.
+    [[nodiscard]] static bool isEnabled();
+
+    // Draws frames into window from now on, replacing the previous window. null stops drawing.
+    // Waits for the frame being drawn, if any.
+    void setWindow(std::unique_ptr<PreviewWindow> window);
+
+    // Lets the encoder skip looking for a frame to offer when there is no window.
+    [[nodiscard]] bool isActive() const { return mWorker.isIdle(); }
+    void offerFrame(const I420& frame);
+
+    [[nodiscard]] PreviewStats getStats() const;
+
+  private:
+    PreviewSink() = default;
+
+    void start();
+    void stop();
+    // Runs on mWorker's thread for each frame offerFrame() handed over.
+    void processFrame();
+    // Converts mFrame to RGBA into the next buffer of mWindow.
+    bool drawFrame();
+
+    // Guards mWindow and mFrame against offerFrame while they are replaced. offerFrame only ever
+    // tries to lock it.
+    InstrumentedMutex mWindowLock{"PreviewSink::mWindowLock"};
+    std::unique_ptr<PreviewWindow> mWindow;  // guarded by mWindowLock
+    uint32_t mWidth = 0;                     // even, guarded by mWindowLock
+    uint32_t mHeight = 0;                    // even, guarded by mWindowLock
+    // I420 frame at mWidth x mHeight. Owned by the encoder thread while mWorker is idle, by
+    // the preview thread otherwise.
+    std::vector<uint8_t> mFrame;
+    bool mLastDrawFailed = false;  // preview thread
+    std::atomic<uint64_t> mOffered = 0;
+    std::atomic<uint64_t> mPosted = 0;
+
+    // Same priority as the encoder thread, a preview that lags behind the stream looks broken.
+    SampledWorker mWorker{/*nice*/ 0, [this] { processFrame(); }};
+};
+
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+
+#include "PreviewSink.h"
+
+#include <android/hardware_buffer.h>
+#include <android/native_window.h>
+#include <log/log.h>
+#include <algorithm>
+
+namespace android {
+namespace webcam {
+
+namespace {
+class NativePreviewWindow : public PreviewWindow {
+  public:
+    explicit NativePreviewWindow(ANativeWindow* window) : mWindow(window) {
+        ANativeWindow_acquire(mWindow);
+    }
+    ~NativePreviewWindow() override { ANativeWindow_release(mWindow); }
+
+    [[nodiscard]] uint32_t getWidth() const override {
+        return static_cast<uint32_t>(std::max(ANativeWindow_getWidth(mWindow), 0));
+    }
+    [[nodiscard]] uint32_t getHeight() const override {
+        return static_cast<uint32_t>(std::max(ANativeWindow_getHeight(mWindow), 0));
+    }
+
+    bool lock(Buffer* buffer) override {
+        ANativeWindow_Buffer windowBuffer;
+        if (ANativeWindow_lock(mWindow, &windowBuffer, /*inOutDirtyBounds*/ nullptr) != 0) {
+            return false;
+        }
+        if (windowBuffer.format != AHARDWAREBUFFER_FORMAT_R8G8B8A8_UNORM &&
+            windowBuffer.format != AHARDWAREBUFFER_FORMAT_R8G8B8X8_UNORM) {
+            ALOGE("%s: Window buffer has format %d, not RGBA", __FUNCTION__, windowBuffer.format);
+            ANativeWindow_unlockAndPost(mWindow);
+            return false;
+        }
+        buffer->pixels = static_cast<uint8_t*>(windowBuffer.bits);
+        buffer->stride = static_cast<uint32_t>(windowBuffer.stride);
+        buffer->width = static_cast<uint32_t>(windowBuffer.width);
+        buffer->height = static_cast<uint32_t>(windowBuffer.height);
+        return true;
+    }
+
+    bool unlockAndPost() override { return ANativeWindow_unlockAndPost(mWindow) == 0; }
+
+  private:
+    ANativeWindow* mWindow = nullptr;
+};
+}  // anonymous namespace
+
+std::unique_ptr<PreviewWindow> PreviewWindow::fromNativeWindow(ANativeWindow* window) {
+    // 0 x 0 keeps the size the consumer asked for (eg: SurfaceTexture's default buffer size).
+    if (ANativeWindow_setBuffersGeometry(window, /*width*/ 0, /*height*/ 0,
+                                         AHARDWAREBUFFER_FORMAT_R8G8B8A8_UNORM) != 0) {
+        ALOGE("%s: Window doesn't take RGBA buffers", __FUNCTION__);
+        return nullptr;
+    }
+    return std::make_unique<NativePreviewWindow>(window);
+}
+
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,353 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+
+#include "QuantTables.h"
+
+#include <android-base/properties.h>
+#include <inttypes.h>
+#include <libyuv/convert.h>
+#include <log/log.h>
+#include <algorithm>
+
+#include "I420.h"
+
+namespace android {
+namespace webcam {
+
+namespace {
+// At quality 50, natural (row major) order.
+constexpr unsigned int kWebcamTable[DCTSIZE2] = {
+        16, 16, 16,  18,  25,  37,  56,  85,   //
+        16, 17, 20,  27,  34,  40,  53,  75,   //
+        16, 20, 24,  31,  43,  62,  91,  135,  //
+        18, 27, 31,  40,  53,  74,  106, 156,  //
+        25, 34, 43,  53,  69,  94,  131, 189,  //
+        37, 40, 62,  74,  94,  124, 169, 238,  //
+        56, 53, 91,  106, 131, 169, 226, 311,  //
+        85, 75, 135, 156, 189, 238, 311, 418,  //
+};
+
+constexpr uint32_t kSsimWindow = 8;
+constexpr uint32_t kSsimStep = 4;
+
+double computePlaneSsim(const uint8_t* a, uint32_t aRowStride, const uint8_t* b,
+                        uint32_t bRowStride, uint32_t width, uint32_t height) {
+    // (0.01 * 255)^2 and (0.03 * 255)^2, scaled to sums over a window.
+    constexpr double kPixels = kSsimWindow * kSsimWindow;
+    constexpr double kC1 = 6.5025 * kPixels * kPixels;
+    constexpr double kC2 = 58.5225 * kPixels * kPixels;
+    double total = 0;
+    uint32_t windows = 0;
+    for (uint32_t y = 0; y + kSsimWindow <= height; y += kSsimStep) {
+        for (uint32_t x = 0; x + kSsimWindow <= width; x += kSsimStep) {
+            int64_t sumA = 0, sumB = 0, sumAA = 0, sumBB = 0, sumAB = 0;
+            for (uint32_t j = 0; j < kSsimWindow; j++) {
+                const uint8_t* rowA = a + static_cast<size_t>(y + j) * aRowStride + x;
+                const uint8_t* rowB = b + static_cast<size_t>(y + j) * bRowStride + x;
+                for (uint32_t i = 0; i < kSsimWindow; i++) {
+                    int32_t pa = rowA[i];
+                    int32_t pb = rowB[i];
+                    sumA += pa;
+                    sumB += pb;
+                    sumAA += pa * pa;
+                    sumBB += pb * pb;
+                    sumAB += pa * pb;
+                }
+            }
+            double meanProduct = static_cast<double>(sumA) * sumB;
+            double meanSquares =
+                    static_cast<double>(sumA) * sumA + static_cast<double>(sumB) * sumB;
+            double covariance = kPixels * sumAB - meanProduct;
+            double variances = kPixels * (sumAA + sumBB) - meanSquares;
+            total += (2 * meanProduct + kC1) * (2 * covariance + kC2) /
+                     ((meanSquares + kC1) * (variances + kC2));
+            windows++;
+        }
+    }
+    return windows == 0 ? 1.0 : total / windows;
+}
+}  // anonymous namespace
+
+const char* quantTablesToString(JpegQuantTables tables) {
+    switch (tables) {
+        case JpegQuantTables::ANNEX_K:
+            return "annex_k";
+        case JpegQuantTables::WEBCAM:
+            return "webcam";
+    }
+    return "unknown";
+}
+
+bool parseQuantTables(const std::string& name, JpegQuantTables* tables) {
+    for (JpegQuantTables candidate : {JpegQuantTables::ANNEX_K, JpegQuantTables::WEBCAM}) {
+        if (name == quantTablesToString(candidate)) {
+            *tables = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+void setQuantTables(j_compress_ptr cInfo, JpegQuantTables tables, int32_t quality) {
+    if (tables == JpegQuantTables::ANNEX_K) {
+        jpeg_set_quality(cInfo, quality, /*force_baseline*/ TRUE);
+        return;
+    }
+    // Same quality scaling as jpeg_set_quality(), quant table 0 is luma's, 1 chroma's.
+    int scale = jpeg_quality_scaling(quality);
+    jpeg_add_quant_table(cInfo, 0, kWebcamTable, scale, /*force_baseline*/ TRUE);
+    jpeg_add_quant_table(cInfo, 1, kWebcamTable, scale, /*force_baseline*/ TRUE);
+}
+
+double computeSsim(const I420& a, const I420& b) {
+    uint32_t chromaWidth = (a.width + 1) / 2;
+    uint32_t chromaHeight = (a.height + 1) / 2;
+    double y = computePlaneSsim(a.y, a.yRowStride, b.y, b.yRowStride, a.width, a.height);
+    double u = computePlaneSsim(a.u, a.uRowStride, b.u, b.uRowStride, chromaWidth, chromaHeight);
+    double v = computePlaneSsim(a.v, a.vRowStride, b.v, b.vRowStride, chromaWidth, chromaHeight);
+    return (4 * y + u + v) / 6;
+}
+
+QuantTablesEvaluator::QuantTablesEvaluator(uint32_t width, uint32_t height)
+    : mWidth(width),
+      mHeight(height),
+      mChromaWidth((width + 1) / 2),
+      mChromaHeight((height + 1) / 2),
+      mWorker(SampledWorker::kBackgroundNice, [this] { processSample(); }) {
+    size_t lumaSize = static_cast<size_t>(mWidth) * mHeight;
+    size_t chromaSize = static_cast<size_t>(mChromaWidth) * mChromaHeight;
+    mSample.resize(lumaSize + 2 * chromaSize);
+
+    // Same padding to whole MCU rows as the Encoder, replicating the last row.
+    const uint32_t mcuV = DCTSIZE * 2;
+    uint32_t paddedHeight = mcuV * ((mHeight + mcuV - 1) / mcuV);
+    mYRows.resize(paddedHeight);
+    mCbRows.resize(paddedHeight / 2);
+    mCrRows.resize(paddedHeight / 2);
+    for (uint32_t i = 0; i < paddedHeight; i++) {
+        mYRows[i] = mSample.data() + std::min(i, mHeight - 1) * mWidth;
+        if (i < paddedHeight / 2) {
+            size_t offset = std::min(i, mChromaHeight - 1) * mChromaWidth;
+            mCbRows[i] = mSample.data() + lumaSize + offset;
+            mCrRows[i] = mSample.data() + lumaSize + chromaSize + offset;
+        }
+    }
+
+    // JpegDecoder writes whole MCUs.
+    mDecodedWidth = mcuV * ((mWidth + mcuV - 1) / mcuV);
+    mDecodedHeight = paddedHeight;
+    mDecoded.resize(static_cast<size_t>(mDecodedWidth) * mDecodedHeight * 3 / 2);
+    mJpeg.resize(lumaSize);
+
+    mCompressInfo.err = jpeg_std_error(&mError.mgr);
+    mError.mgr.error_exit = [](j_common_ptr info) {
+        (*info->err->output_message)(info);
+        longjmp(reinterpret_cast<ErrorManager*>(info->err)->jumpBuffer, 1);
+    };
+    jpeg_create_compress(&mCompressInfo);
+    mCompressInfo.client_data = this;
+
+    mDest.init_destination = [](j_compress_ptr cInfo) {
+        auto* evaluator = static_cast<QuantTablesEvaluator*>(cInfo->client_data);
+        cInfo->dest->next_output_byte = evaluator->mJpeg.data();
+        cInfo->dest->free_in_buffer = evaluator->mJpeg.size();
+    };
+    mDest.empty_output_buffer = [](j_compress_ptr cInfo) -> boolean {
+        auto* evaluator = static_cast<QuantTablesEvaluator*>(cInfo->client_data);
+        size_t used = evaluator->mJpeg.size();
+        evaluator->mJpeg.resize(used * 2);
+        cInfo->dest->next_output_byte = evaluator->mJpeg.data() + used;
+        cInfo->dest->free_in_buffer = evaluator->mJpeg.size() - used;
+        return TRUE;
+    };
+    mDest.term_destination = [](j_compress_ptr cInfo) {
+        auto* evaluator = static_cast<QuantTablesEvaluator*>(cInfo->client_data);
+        evaluator->mJpegSize = evaluator->mJpeg.size() - cInfo->dest->free_in_buffer;
+    };
+    mCompressInfo.dest = &mDest;
+}
+
+QuantTablesEvaluator::~QuantTablesEvaluator() {
+    stop();
+    jpeg_destroy_compress(&mCompressInfo);
+    QuantTablesStats stats = getStats();
+    if (stats.samples != 0 && stats.annexKBytes != 0) {
+        ALOGI("QuantTablesEvaluator: %" PRIu64 " samples, %" PRIu64 " bytes with annex K tables, %"
+              PRIu64 " bytes with webcam tables at the same SSIM (%+.1f%%)",
+              stats.samples, stats.annexKBytes / stats.samples, stats.webcamBytes / stats.samples,
+              100.0 * stats.webcamBytes / stats.annexKBytes - 100.0);
+    }
+}
+
+bool QuantTablesEvaluator::isEnabled() {
+    return android::base::GetBoolProperty(kEnableProperty, /*default_value*/ false);
+}
+
+void QuantTablesEvaluator::start() {
+    mWorker.start();
+}
+
+void QuantTablesEvaluator::stop() {
+    mWorker.stop();
+    // The worker thread is gone, sample the first frame after the next start().
+    mNextSample = {};
+}
+
+void QuantTablesEvaluator::offerFrame(const I420& frame, int32_t quality) {
+    if (!mWorker.isIdle() || std::chrono::steady_clock::now() < mNextSample) {
+        return;
+    }
+    if (frame.width != mWidth || frame.height != mHeight) {
+        return;
+    }
+    I420 sample = getSample();
+    libyuv::I420Copy(frame.y, frame.yRowStride, frame.u, frame.uRowStride, frame.v,
+                     frame.vRowStride, sample.y, sample.yRowStride, sample.u, sample.uRowStride,
+                     sample.v, sample.vRowStride, mWidth, mHeight);
+    mSampleQuality = quality;
+    mWorker.submit();
+}
+
+QuantTablesStats QuantTablesEvaluator::getStats() const {
+    std::lock_guard<std::mutex> l(mLock);
+    return mStats;
+}
+
+void QuantTablesEvaluator::processSample() {
+    evaluateSample(mSampleQuality);
+    mNextSample = std::chrono::steady_clock::now() + kSampleInterval;
+}
+
+void QuantTablesEvaluator::evaluateSample(int32_t quality) {
+    double annexKSsim = compressAndMeasure(JpegQuantTables::ANNEX_K, quality);
+    if (annexKSsim < 0) {
+        return;
+    }
+    size_t annexKBytes = mJpegSize;
+
+    // SSIM grows with quality, search for the lowest one that is good enough.
+    int32_t low = 1;
+    int32_t high = 100;
+    int32_t webcamQuality = 0;
+    size_t webcamBytes = 0;
+    double webcamSsim = 0;
+    while (low <= high) {
+        int32_t mid = (low + high) / 2;
+        double ssim = compressAndMeasure(JpegQuantTables::WEBCAM, mid);
+        if (ssim < 0) {
+            return;
+        }
+        if (ssim >= annexKSsim) {
+            webcamQuality = mid;
+            webcamBytes = mJpegSize;
+            webcamSsim = ssim;
+            high = mid - 1;
+        } else {
+            low = mid + 1;
+        }
+    }
+    if (webcamQuality == 0) {
+        ALOGW("%s: Webcam tables don't reach SSIM %.4f of annex K quality %d", __FUNCTION__,
+              annexKSsim, quality);
+        return;
+    }
+    ALOGV("%s: Annex K quality %d: %zu bytes, SSIM %.4f. Webcam quality %d: %zu bytes (%+.1f%%), "
+          "SSIM %.4f",
+          __FUNCTION__, quality, annexKBytes, annexKSsim, webcamQuality, webcamBytes,
+          100.0 * webcamBytes / annexKBytes - 100.0, webcamSsim);
+
+    std::lock_guard<std::mutex> l(mLock);
+    mStats.samples++;
+    mStats.annexKBytes += annexKBytes;
+    mStats.webcamBytes += webcamBytes;
+}
+
+double QuantTablesEvaluator::compressAndMeasure(JpegQuantTables tables, int32_t quality) {
+    j_compress_ptr cInfo = &mCompressInfo;
+    if (setjmp(mError.jumpBuffer)) {
+        jpeg_abort_compress(cInfo);
+        return -1;
+    }
+
+    // Same parameters as Encoder::i420ToJpeg(), except for the huffman tables: optimize_coding
+    // gives both table sets their best ones.
+    cInfo->image_width = mWidth;
+    cInfo->image_height = mHeight;
+    cInfo->input_components = 3;
+    cInfo->in_color_space = JCS_YCbCr;
+    jpeg_set_defaults(cInfo);
+    jpeg_set_colorspace(cInfo, JCS_YCbCr);
+    setQuantTables(cInfo, tables, quality);
+    cInfo->dct_method = Tunables::getInstance().getDctMethod() == JpegDctMethod::FAST
+                                ? JDCT_IFAST
+                                : JDCT_ISLOW;
+    cInfo->raw_data_in = 1;
+    cInfo->optimize_coding = TRUE;
+    cInfo->comp_info[0].h_samp_factor = 2;
+    cInfo->comp_info[0].v_samp_factor = 2;
+    for (int i = 1; i < 3; i++) {
+        cInfo->comp_info[i].h_samp_factor = 1;
+        cInfo->comp_info[i].v_samp_factor = 1;
+    }
+
+    jpeg_start_compress(cInfo, TRUE);
+    const uint32_t batchSize = DCTSIZE * 2;
+    while (cInfo->next_scanline < cInfo->image_height) {
+        JSAMPARRAY planes[3]{&mYRows[cInfo->next_scanline], &mCbRows[cInfo->next_scanline / 2],
+                             &mCrRows[cInfo->next_scanline / 2]};
+        jpeg_write_raw_data(cInfo, planes, batchSize);
+    }
+    jpeg_finish_compress(cInfo);
+
+    I420 decoded = getDecoded();
+    if (!mDecoder.decodeToI420(mJpeg.data(), mJpegSize, mWidth, mHeight, /*scaleDenom*/ 1,
+                               decoded.y, decoded.yRowStride, decoded.u, decoded.uRowStride,
+                               decoded.v, decoded.vRowStride)) {
+        return -1;
+    }
+    return computeSsim(getSample(), decoded);
+}
+
+I420 QuantTablesEvaluator::getSample() {
+    I420 sample;
+    sample.y = mSample.data();
+    sample.u = sample.y + static_cast<size_t>(mWidth) * mHeight;
+    sample.v = sample.u + static_cast<size_t>(mChromaWidth) * mChromaHeight;
+    sample.yRowStride = mWidth;
+    sample.uRowStride = mChromaWidth;
+    sample.vRowStride = mChromaWidth;
+    sample.width = mWidth;
+    sample.height = mHeight;
+    return sample;
+}
+
+I420 QuantTablesEvaluator::getDecoded() {
+    I420 decoded;
+    decoded.y = mDecoded.data();
+    decoded.u = decoded.y + static_cast<size_t>(mDecodedWidth) * mDecodedHeight;
+    decoded.v = decoded.u + static_cast<size_t>(mDecodedWidth / 2) * (mDecodedHeight / 2);
+    decoded.yRowStride = mDecodedWidth;
+    decoded.uRowStride = mDecodedWidth / 2;
+    decoded.vRowStride = mDecodedWidth / 2;
+    decoded.width = mWidth;
+    decoded.height = mHeight;
+    return decoded;
+}
+
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *  Alternative JPEG quantization tables for webcam frames, and an on-device comparison of them
+ *  with libjpeg's default ones at equal SSIM.
+ */
+#pragma once
+
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <jpeglib.h>
+
+#include "JpegUtils.h"
+#include "SampledWorker.h"
+#include "Tunables.h"
+
+namespace android {
+namespace webcam {
+
+struct I420;
+
+// ANNEX_K: the example tables of Annex K of the JPEG spec, which jpeg_set_quality() scales.
+// WEBCAM: N. Robidoux's table (ImageMagick, mozjpeg's default) for both luma and chroma. Compared
+// to Annex K it is finer at low frequencies, where the smooth gradients of faces and walls band,
+// coarser at high ones, which the host mostly throws away when it downscales the stream into a
+// call tile, and much finer for chroma. It needs a lower quality than Annex K for the same SSIM,
+// run the QuantTablesEvaluator on a stream to find how much lower and what that saves.
+const char* quantTablesToString(JpegQuantTables tables);
+bool parseQuantTables(const std::string& name, JpegQuantTables* tables);
+
+// Sets the quantization tables of cInfo to the given set scaled to quality, in place of
+// jpeg_set_quality(). Call after jpeg_set_defaults(). Baseline: scaled entries are limited to 255.
+void setQuantTables(j_compress_ptr cInfo, JpegQuantTables tables, int32_t quality);
+
+// SSIM of b against a, over 8x8 windows every 4 pixels like libvpx. Planes are weighted by their
+// pixel count (4:1:1), like ffmpeg's overall SSIM. Both images must have the same size.
+double computeSsim(const I420& a, const I420& b);
+
+// Totals over the evaluated samples: bytes of the Annex K JPEG at the stream's quality and of the
+// smallest WEBCAM JPEG with at least its SSIM.
+struct QuantTablesStats {
+    uint64_t samples = 0;
+    uint64_t annexKBytes = 0;
+    uint64_t webcamBytes = 0;
+};
+
+// Measures how the WEBCAM tables do on the frames of a running MJPEG stream, whichever set the
+// stream uses. Every kSampleInterval it copies the frame being compressed, and a low priority
+// thread compresses the copy with the Annex K tables at the stream's quality, then searches the
+// lowest quality at which the WEBCAM tables reach the same SSIM. The results are logged per
+// sample (verbose) and in total when the evaluator is destroyed.
+class QuantTablesEvaluator {
+  public:
+    static constexpr char kEnableProperty[] = "debug.deviceaswebcam.quant_tables_eval";
+    static constexpr std::chrono::seconds kSampleInterval{10};
+
+    QuantTablesEvaluator(uint32_t width, uint32_t height);
+    ~QuantTablesEvaluator();
+
+    [[nodiscard]] static bool isEnabled();
+
+    // Starts / stops the background thread.
+    void start();
+    void stop();
+
+    // Called by the encoder thread with each frame it compresses at the given quality. Copies the
+    // frame if a sample is due and the background thread is idle, returns right away otherwise.
+    void offerFrame(const I420& frame, int32_t quality);
+    [[nodiscard]] QuantTablesStats getStats() const;
+
+  private:
+    struct ErrorManager {
+        jpeg_error_mgr mgr;
+        jmp_buf jumpBuffer;
+    };
+
+    // Runs on mWorker's thread for each sample offerFrame() handed over.
+    void processSample();
+    void evaluateSample(int32_t quality);
+    // Compresses the sample into mJpeg, decodes it into mDecoded and returns its SSIM against the
+    // sample, negative on failure.
+    double compressAndMeasure(JpegQuantTables tables, int32_t quality);
+    I420 getSample();
+    I420 getDecoded();
+
+    uint32_t mWidth = 0;
+    uint32_t mHeight = 0;
+    uint32_t mChromaWidth = 0;
+    uint32_t mChromaHeight = 0;
+    // Sample frame, planes at stride mWidth / mChromaWidth. Owned by the encoder thread while
+    // mWorker is idle, by its thread otherwise.
+    std::vector<uint8_t> mSample;
+    std::vector<JSAMPROW> mYRows;
+    std::vector<JSAMPROW> mCbRows;
+    std::vector<JSAMPROW> mCrRows;
+    int32_t mSampleQuality = 0;
+    std::chrono::steady_clock::time_point mNextSample;
+
+    jpeg_compress_struct mCompressInfo{};
+    ErrorManager mError{};
+    jpeg_destination_mgr mDest{};
+    std::vector<JOCTET> mJpeg;  // grows to fit
+    size_t mJpegSize = 0;
+    JpegDecoder mDecoder;
+    // The sample decoded, padded to whole MCUs like JpegDecoder needs.
+    std::vector<uint8_t> mDecoded;
+    uint32_t mDecodedWidth = 0;
+    uint32_t mDecodedHeight = 0;
+
+    mutable std::mutex mLock;
+    QuantTablesStats mStats;  // guarded by mLock
+
+    SampledWorker mWorker;
+};
+
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+
+#include "ResidentMemory.h"
+
+#include <android-base/properties.h>
+#include <errno.h>
+#include <log/log.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace android {
+namespace webcam {
+
+namespace {
+constexpr char kResidentBuffersProperty[] = "debug.deviceaswebcam.resident_buffers";
+}  // anonymous namespace
+
+bool residentBuffersEnabled() {
+    static const bool enabled =
+            android::base::GetBoolProperty(kResidentBuffersProperty, /*default_value*/ false);
+    return enabled;
+}
+
+int residentMmapFlags() {
+    return residentBuffersEnabled() ? MAP_POPULATE : 0;
+}
+
+void makeResident(void* addr, size_t length, bool writable) {
+    if (!residentBuffersEnabled() || addr == nullptr || length == 0) {
+        return;
+    }
+    if (madvise(addr, length, MADV_WILLNEED) != 0) {
+        ALOGV("%s: madvise(MADV_WILLNEED) failed for %p: %s", __FUNCTION__, addr, strerror(errno));
+    }
+    // MAP_POPULATE only populates what the mapping allows; touch every page so that anonymous
+    // memory gets real (not zero-page) backing before the first frame.
+    size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    volatile uint8_t* mem = static_cast<uint8_t*>(addr);
+    for (size_t offset = 0; offset < length; offset += pageSize) {
+        if (writable) {
+            mem[offset] = mem[offset];
+        } else {
+            (void)mem[offset];
+        }
+    }
+    if (mlock(addr, length) != 0) {
+        // Typically RLIMIT_MEMLOCK. Pages stay faulted in until there is memory pressure.
+        ALOGW("%s: Unable to lock %zu bytes at %p: %s", __FUNCTION__, length, addr,
+              strerror(errno));
+    }
+}
+
+void releaseResident(void* addr, size_t length) {
+    if (!residentBuffersEnabled() || addr == nullptr || length == 0) {
+        return;
+    }
+    munlock(addr, length);
+}
+
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *  Helpers for keeping frame path memory resident, so that the first frames of a stream don't
+ *  take page faults.
+ */
+#pragma once
+
+#include <stddef.h>
+
+namespace android {
+namespace webcam {
+
+// Returns true if frame path memory should be pre-faulted and locked. Opt in through the
+// debug.deviceaswebcam.resident_buffers system property (defaults to false), read once.
+bool residentBuffersEnabled();
+
+// Extra mmap flags to use for frame path mappings: MAP_POPULATE if resident buffers are enabled.
+// Mappings that take madvise() advice which affects how pages are faulted in (eg: MADV_HUGEPAGE)
+// should leave it out and rely on makeResident, which faults them in after the advice.
+int residentMmapFlags();
+
+// Pre-faults [addr, addr + length) (writing to each page if writable is true), hints the kernel
+// that the range is going to be used and locks it in memory. Failing to lock is logged but not
+// fatal, the pages are still faulted in.
+void makeResident(void* addr, size_t length, bool writable);
+
+// Undoes the lock taken by makeResident. Must be called before the range is unmapped.
+void releaseResident(void* addr, size_t length);
+
+}  // namespace webcam
+}  // namespace android
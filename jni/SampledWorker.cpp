@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+
+#include "SampledWorker.h"
+
+#include <log/log.h>
+#include <sys/resource.h>
+#include <utility>
+
+namespace android {
+namespace webcam {
+
+SampledWorker::SampledWorker(int nice, std::function<void()> work)
+    : mNice(nice), mWork(std::move(work)) {}
+
+SampledWorker::~SampledWorker() {
+    stop();
+}
+
+void SampledWorker::start() {
+    std::lock_guard<std::mutex> l(mLock);
+    if (mRunning) {
+        return;
+    }
+    mRunning = true;
+    mSampleReady = false;
+    mIdle.store(true, std::memory_order_release);
+    mThread = std::thread(&SampledWorker::threadLoop, this);
+}
+
+void SampledWorker::stop() {
+    {
+        std::lock_guard<std::mutex> l(mLock);
+        if (!mRunning) {
+            return;
+        }
+        mRunning = false;
+    }
+    mIdle.store(false, std::memory_order_release);
+    mCondition.notify_one();
+    if (mThread.joinable()) {
+        mThread.join();
+    }
+}
+
+void SampledWorker::submit() {
+    mIdle.store(false, std::memory_order_release);
+    {
+        std::lock_guard<std::mutex> l(mLock);
+        mSampleReady = true;
+    }
+    mCondition.notify_one();
+}
+
+void SampledWorker::threadLoop() {
+    if (mNice != 0 && setpriority(PRIO_PROCESS, 0, mNice) != 0) {
+        ALOGW("%s: Failed to lower thread priority", __FUNCTION__);
+    }
+    while (true) {
+        {
+            std::unique_lock<std::mutex> l(mLock);
+            mCondition.wait(l, [this] { return !mRunning || mSampleReady; });
+            if (!mRunning) {
+                return;
+            }
+            mSampleReady = false;
+        }
+
+        mWork();
+
+        std::lock_guard<std::mutex> l(mLock);
+        if (mRunning) {
+            mIdle.store(true, std::memory_order_release);
+        }
+    }
+}
+
+}  // namespace webcam
+}  // namespace android
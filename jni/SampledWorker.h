@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *  Background thread for work sampled off the frame path, like building huffman tables or drawing
+ *  the preview. The frame path thread hands over a sample only while the worker is idle and
+ *  never waits for it.
+ */
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace android {
+namespace webcam {
+
+// The sample buffers belong to the producer while isIdle() is true, and to the worker from
+// submit() until the work callback returns. The producer checks isIdle(), fills the buffers and
+// calls submit(); the worker thread runs the callback and goes idle again.
+class SampledWorker {
+  public:
+    // ANDROID_PRIORITY_BACKGROUND, for work that must not slow down the frame path.
+    static constexpr int kBackgroundNice = 10;
+
+    // work runs on the worker thread once per submitted sample. The thread runs at nice, 0 keeps
+    // the priority of the thread that calls start().
+    SampledWorker(int nice, std::function<void()> work);
+    ~SampledWorker();
+
+    // Starts / stops the thread, waiting for the sample being worked on. Both are no-ops if the
+    // thread is already running / stopped.
+    void start();
+    void stop();
+
+    [[nodiscard]] bool isIdle() const { return mIdle.load(std::memory_order_acquire); }
+    // Hands the filled sample buffers to the worker. Only after isIdle() returned true.
+    void submit();
+
+  private:
+    void threadLoop();
+
+    const int mNice;
+    const std::function<void()> mWork;
+    std::atomic<bool> mIdle = false;
+
+    std::mutex mLock;
+    std::condition_variable mCondition;  // guarded by mLock
+    bool mRunning = false;               // guarded by mLock
+    bool mSampleReady = false;           // guarded by mLock
+    std::thread mThread;
+};
+
+}  // namespace webcam
+}  // namespace android
@@ -17,29 +17,95 @@
 #include <DeviceAsWebcamServiceManager.h>
 #include <linux/videodev2.h>
 #include <log/log.h>
+#include <algorithm>
+#include <atomic>
 #include <utility>
 #include <vector>
 
 #include "Buffer.h"
+#include "JpegUtils.h"
 #include "SdkFrameProvider.h"
+#include "StallWatchdog.h"
+#include "Tunables.h"
 #include "Utils.h"
 
 namespace android {
 namespace webcam {
 
-SdkFrameProvider::SdkFrameProvider(std::shared_ptr<BufferProducer> producer, CameraConfig config)
-    : FrameProvider(std::move(producer), config) {
-    // Set stream configuration in java service.
-    mEncoder = std::make_shared<Encoder>(config, this);
-    if (!(mEncoder->isInited())) {
-        ALOGE("%s: Encoder initialization failed", __FUNCTION__);
+namespace {
+constexpr double kPullAlpha = 1.0 / 8;
+// Pull mode conversions should be done this long before the pickup they are for.
+constexpr double kPullMarginNs = 3'000'000;
+
+std::atomic<uint32_t> gHeldHardwareBuffers = 0;
+
+double nsBetween(std::chrono::steady_clock::time_point from,
+                 std::chrono::steady_clock::time_point to) {
+    return static_cast<double>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count());
+}
+
+void updateAverage(double* average, double sample) {
+    *average = *average == 0 ? sample : *average + kPullAlpha * (sample - *average);
+}
+}  // anonymous namespace
+
+void SdkFrameProvider::PullTiming::onRequest(Clock::time_point now) {
+    if (lastRequest != Clock::time_point()) {
+        updateAverage(&requestPeriodNs, nsBetween(lastRequest, now));
+    }
+    lastRequest = now;
+}
+
+void SdkFrameProvider::PullTiming::onFrame(Clock::time_point now) {
+    if (lastFrame != Clock::time_point()) {
+        updateAverage(&framePeriodNs, nsBetween(lastFrame, now));
+    }
+    lastFrame = now;
+}
+
+void SdkFrameProvider::PullTiming::onEncoded(Clock::time_point now) {
+    updateAverage(&encodeNs, nsBetween(lastSubmit, now));
+}
+
+bool SdkFrameProvider::PullTiming::shouldWaitForNextFrame() const {
+    if (requestPeriodNs == 0 || framePeriodNs == 0) {
+        return false;
+    }
+    // Both relative to the last request, which is roughly the last pickup.
+    double latestStartNs = requestPeriodNs - encodeNs - kPullMarginNs;
+    double nextFrameNs = nsBetween(lastRequest, lastFrame) + framePeriodNs;
+    return nextFrameNs <= latestStartNs;
+}
+
+SdkFrameProvider::SdkFrameProvider(std::shared_ptr<BufferProducer> producer, CameraConfig config,
+                                   std::shared_ptr<EncoderArena> encoderArena)
+    : FrameProvider(std::move(producer), config), mEncoderArena(std::move(encoderArena)) {
+    if (buildPipeline() != Status::OK) {
+        ALOGE("%s: Frame pipeline initialization failed", __FUNCTION__);
         return;
     }
-    mEncoder->startEncoderThread();
+    mPipeline->start();
 
     mInited = true;
 }
 
+Status SdkFrameProvider::buildPipeline() {
+    // camera frame -> Encoder (own thread) -> BufferProducer
+    mEncoder = std::make_shared<Encoder>(mConfig, mEncoderArena);
+    if (!(mEncoder->isInited())) {
+        ALOGE("%s: Encoder initialization failed", __FUNCTION__);
+        return Status::ERROR;
+    }
+    mPipeline = std::make_unique<Pipeline<EncodeRequest>>("SdkFrameProvider");
+    mPipeline->addStage(mEncoder, StageExecution::THREAD);
+    mPipeline->addStage(std::make_shared<EncodedFrameSink>(this), StageExecution::INLINE);
+    mPipeline->setDropHandler([this](EncodeRequest& request) {
+        onEncoded(request.dstBuffer, request.srcBuffer, /*success*/ false);
+    });
+    return Status::OK;
+}
+
 void SdkFrameProvider::setStreamConfig() {
     DeviceAsWebcamServiceManager::kInstance->setStreamConfig(
             mConfig.fcc == V4L2_PIX_FMT_MJPEG, mConfig.width, mConfig.height, mConfig.fps);
@@ -55,16 +121,96 @@ Status SdkFrameProvider::stopStreaming() {
     return Status::OK;
 }
 
+bool SdkFrameProvider::shouldSkipFrame() {
+    // Bresenham style: keeps frameRatePercent out of every 100 frames, spread as evenly as
+    // possible so that the host sees a steady (if lower) cadence in the same UVC format.
+    mFrameRateAccumulator += Tunables::getInstance().getFrameRatePercent();
+    if (mFrameRateAccumulator < Tunables::kFullFrameRatePercent) {
+        return true;
+    }
+    mFrameRateAccumulator -= Tunables::kFullFrameRatePercent;
+    return false;
+}
+
 Status SdkFrameProvider::encodeImage(AHardwareBuffer* hardwareBuffer, long timestamp,
                                      int rotation) {
+    if (shouldSkipFrame()) {
+        ALOGV("%s: Skipping frame %ld to reduce frame rate", __FUNCTION__, timestamp);
+        return Status::ERROR;
+    }
     HardwareBufferDesc desc;
     if (getHardwareBufferDescFromHardwareBuffer(hardwareBuffer, desc) != Status::OK) {
         ALOGE("%s Couldn't get hardware buffer descriptor", __FUNCTION__);
         return Status::ERROR;
     }
+    if (mConfig.pullMode) {
+        return offerFrame(desc, timestamp, rotation);
+    }
     return encodeImage(desc, timestamp, rotation);
 }
 
+Status SdkFrameProvider::offerFrame(const HardwareBufferDesc& desc, jlong timestamp,
+                                    jint rotation) {
+    std::optional<PendingFrame> replaced;
+    std::optional<PendingFrame> frame;
+    {
+        std::lock_guard<InstrumentedMutex> l(mPullLock);
+        auto now = PullTiming::Clock::now();
+        mPullTiming.onFrame(now);
+        replaced = std::move(mPendingFrame);
+        mPendingFrame = PendingFrame{desc, timestamp, rotation};
+        frame = takePendingFrameLocked(now);
+    }
+    if (replaced.has_value()) {
+        returnUnconvertedFrame(*replaced);
+    }
+    if (frame.has_value() &&
+        encodeImage(frame->desc, frame->timestamp, frame->rotation) != Status::OK) {
+        // Java returns this frame itself. The request still stands.
+        std::lock_guard<InstrumentedMutex> l(mPullLock);
+        mFrameRequested = true;
+        return Status::ERROR;
+    }
+    return Status::OK;
+}
+
+void SdkFrameProvider::requestFrame() {
+    if (!mConfig.pullMode) {
+        return;
+    }
+    std::optional<PendingFrame> frame;
+    {
+        std::lock_guard<InstrumentedMutex> l(mPullLock);
+        auto now = PullTiming::Clock::now();
+        mPullTiming.onRequest(now);
+        mFrameRequested = true;
+        frame = takePendingFrameLocked(now);
+    }
+    if (frame.has_value() &&
+        encodeImage(frame->desc, frame->timestamp, frame->rotation) != Status::OK) {
+        DeviceAsWebcamServiceManager::kInstance->returnImage(static_cast<long>(frame->timestamp));
+        std::lock_guard<InstrumentedMutex> l(mPullLock);
+        mFrameRequested = true;
+    }
+}
+
+std::optional<SdkFrameProvider::PendingFrame> SdkFrameProvider::takePendingFrameLocked(
+        PullTiming::Clock::time_point now) {
+    if (!mFrameRequested || !mPendingFrame.has_value() || mPullTiming.shouldWaitForNextFrame()) {
+        return std::nullopt;
+    }
+    mFrameRequested = false;
+    mPullTiming.lastSubmit = now;
+    std::optional<PendingFrame> frame = std::move(mPendingFrame);
+    mPendingFrame.reset();
+    return frame;
+}
+
+void SdkFrameProvider::returnUnconvertedFrame(const PendingFrame& frame) {
+    releaseHardwareBuffer(frame.desc);
+    DeviceAsWebcamServiceManager::kInstance->returnImage(static_cast<long>(frame.timestamp));
+}
+
 Status SdkFrameProvider::getHardwareBufferDescFromHardwareBuffer(AHardwareBuffer* hardwareBuffer,
                                                                  HardwareBufferDesc& ret) {
     if (hardwareBuffer == nullptr) {
@@ -76,6 +222,12 @@ Status SdkFrameProvider::getHardwareBufferDescFromHardwareBuffer(AHardwareBuffer
     // use by SdkFrameProvider.
     AHardwareBuffer_acquire(hardwareBuffer);
 
+    AHardwareBuffer_Desc desc{};
+    AHardwareBuffer_describe(hardwareBuffer, &desc);
+    if (desc.format == AHARDWAREBUFFER_FORMAT_BLOB) {
+        return getJpegDescFromHardwareBuffer(hardwareBuffer, desc, ret);
+    }
+
     AHardwareBuffer_Planes planes{};
     if (AHardwareBuffer_lockPlanes(hardwareBuffer, AHARDWAREBUFFER_USAGE_CPU_READ_OFTEN,
                                    /*fence*/ -1, /*rect*/ nullptr, &planes) != 0) {
@@ -83,8 +235,6 @@ Status SdkFrameProvider::getHardwareBufferDescFromHardwareBuffer(AHardwareBuffer
         AHardwareBuffer_release(hardwareBuffer);
         return Status::ERROR;
     }
-    AHardwareBuffer_Desc desc{};
-    AHardwareBuffer_describe(hardwareBuffer, &desc);
 
     uint32_t height = desc.height;
     uint32_t width = desc.width;
@@ -117,19 +267,74 @@ Status SdkFrameProvider::getHardwareBufferDescFromHardwareBuffer(AHardwareBuffer
         argbDesc.rowStride =   planes.planes[0].rowStride;
         ret.bufferDesc = argbDesc;
     }
-    {
-        std::lock_guard<std::mutex> l(mMapLock);
-        ret.bufferId = mNextBufferId++;
-        mBufferIdToAHardwareBuffer[ret.bufferId] = hardwareBuffer;
+    if (trackHardwareBuffer(hardwareBuffer, ret) != Status::OK) {
+        AHardwareBuffer_unlock(hardwareBuffer, /*fence*/ nullptr);
+        AHardwareBuffer_release(hardwareBuffer);
+        return Status::ERROR;
     }
     return Status::OK;
 }
 
+Status SdkFrameProvider::getJpegDescFromHardwareBuffer(AHardwareBuffer* hardwareBuffer,
+                                                       const AHardwareBuffer_Desc& desc,
+                                                       HardwareBufferDesc& ret) {
+    // BLOB buffers are one row of desc.width bytes: the JPEG followed by the camera's trailer.
+    void* data = nullptr;
+    if (AHardwareBuffer_lock(hardwareBuffer, AHARDWAREBUFFER_USAGE_CPU_READ_OFTEN, /*fence*/ -1,
+                             /*rect*/ nullptr, &data) != 0) {
+        ALOGE("%s: Couldn't lock BLOB hardware buffer", __FUNCTION__);
+        AHardwareBuffer_release(hardwareBuffer);
+        return Status::ERROR;
+    }
+    auto* blob = static_cast<uint8_t*>(data);
+    size_t jpegSize = getCameraJpegSize(blob, desc.width);
+    JpegInfo info;
+    if (jpegSize == 0 || !parseJpegInfo(blob, jpegSize, &info)) {
+        ALOGE("%s: Camera BLOB of %u bytes doesn't hold a valid JPEG", __FUNCTION__, desc.width);
+        AHardwareBuffer_unlock(hardwareBuffer, /*fence*/ nullptr);
+        AHardwareBuffer_release(hardwareBuffer);
+        return Status::ERROR;
+    }
+
+    ret.format = desc.format;
+    ret.width = info.width;
+    ret.height = info.height;
+    JpegHardwareBufferDesc jpegDesc;
+    jpegDesc.data = blob;
+    jpegDesc.size = static_cast<uint32_t>(jpegSize);
+    ret.bufferDesc = jpegDesc;
+    if (trackHardwareBuffer(hardwareBuffer, ret) != Status::OK) {
+        AHardwareBuffer_unlock(hardwareBuffer, /*fence*/ nullptr);
+        AHardwareBuffer_release(hardwareBuffer);
+        return Status::ERROR;
+    }
+    return Status::OK;
+}
+
+Status SdkFrameProvider::trackHardwareBuffer(AHardwareBuffer* hardwareBuffer,
+                                             HardwareBufferDesc& desc) {
+    std::lock_guard<InstrumentedMutex> l(mMapLock);
+    for (TrackedBuffer& tracked : mTrackedBuffers) {
+        if (tracked.hardwareBuffer == nullptr) {
+            desc.bufferId = mNextBufferId++;
+            tracked.bufferId = desc.bufferId;
+            tracked.hardwareBuffer = hardwareBuffer;
+            gHeldHardwareBuffers.fetch_add(1, std::memory_order_relaxed);
+            return Status::OK;
+        }
+    }
+    ALOGE("%s: More than %zu camera buffers in flight", __FUNCTION__, kMaxTrackedBuffers);
+    return Status::ERROR;
+}
+
 Status SdkFrameProvider::encodeImage(HardwareBufferDesc desc, jlong timestamp, jint rotation) {
+    std::lock_guard<InstrumentedMutex> l(mSubmitLock);
     Buffer* producerBuffer = mBufferProducer->getFreeBufferIfAvailable();
     if (producerBuffer == nullptr) {
         // Not available so don't compress
         ALOGV("%s: Producer buffer not available, returning", __FUNCTION__);
+        FlightRecorder::getInstance().record(FrameEvent::NO_FREE_BUFFER, /*bufferIndex*/ -1,
+                                             timestamp);
         releaseHardwareBuffer(desc);
         return Status::ERROR;
     }
@@ -137,45 +342,78 @@ Status SdkFrameProvider::encodeImage(HardwareBufferDesc desc, jlong timestamp, j
     producerBuffer->setTimestamp(static_cast<uint64_t>(timestamp));
     // send to the Encoder.
     EncodeRequest encodeRequest(desc, producerBuffer, rotation);
-    mEncoder->queueRequest(encodeRequest);
+    // Dropped requests have already been returned through onEncoded.
+    mPipeline->submit(encodeRequest);
     return Status::OK;
 }
 
 void SdkFrameProvider::onEncoded(Buffer* producerBuffer, HardwareBufferDesc& desc, bool success) {
+    if (mConfig.pullMode) {
+        std::lock_guard<InstrumentedMutex> l(mPullLock);
+        mPullTiming.onEncoded(PullTiming::Clock::now());
+    }
     releaseHardwareBuffer(desc);
     // Let Java know that HardwareBuffer is free to be cleaned up
     DeviceAsWebcamServiceManager::kInstance->returnImage(
             static_cast<long>(producerBuffer->getTimestamp()));
 
+    auto timestamp = static_cast<int64_t>(producerBuffer->getTimestamp());
+    auto bufferIndex = static_cast<int32_t>(producerBuffer->getIndex());
     if (!success) {
         ALOGE("%s Encoding was unsuccessful", __FUNCTION__);
+        FlightRecorder::getInstance().record(FrameEvent::ENCODE_FAILED, bufferIndex, timestamp);
         mBufferProducer->cancelBuffer(producerBuffer);
         return;
     }
+    FlightRecorder::getInstance().record(FrameEvent::ENCODED, bufferIndex, timestamp);
     if (mBufferProducer->queueFilledBuffer(producerBuffer) != Status::OK) {
         ALOGE("%s Queueing filled buffer failed, something is wrong", __FUNCTION__);
         return;
     }
 }
 
+uint32_t SdkFrameProvider::getHeldHardwareBufferCount() {
+    return gHeldHardwareBuffers.load(std::memory_order_relaxed);
+}
+
 void SdkFrameProvider::releaseHardwareBuffer(const HardwareBufferDesc& desc) {
     // Unlock and release
     {
-        std::lock_guard<std::mutex> l(mMapLock);
-        auto it = mBufferIdToAHardwareBuffer.find(desc.bufferId);
-        if (it == mBufferIdToAHardwareBuffer.end()) {
+        std::lock_guard<InstrumentedMutex> l(mMapLock);
+        auto it = std::find_if(mTrackedBuffers.begin(), mTrackedBuffers.end(),
+                               [&desc](const TrackedBuffer& tracked) {
+                                   return tracked.hardwareBuffer != nullptr &&
+                                          tracked.bufferId == desc.bufferId;
+                               });
+        if (it == mTrackedBuffers.end()) {
             // Continue anyway to let java call HardwareBuffer.close();
             ALOGE("Couldn't find AHardwareBuffer for buffer id %u, what ?", desc.bufferId);
         } else {
-            AHardwareBuffer_unlock(it->second, /*fence*/ nullptr);
-            AHardwareBuffer_release(it->second);
-            mBufferIdToAHardwareBuffer.erase(it->first);
+            AHardwareBuffer_unlock(it->hardwareBuffer, /*fence*/ nullptr);
+            AHardwareBuffer_release(it->hardwareBuffer);
+            gHeldHardwareBuffers.fetch_sub(1, std::memory_order_relaxed);
+            *it = {};
         }
     }
 }
 
 SdkFrameProvider::~SdkFrameProvider() {
+    std::optional<PendingFrame> frame;
+    {
+        std::lock_guard<InstrumentedMutex> l(mPullLock);
+        frame = std::move(mPendingFrame);
+        mPendingFrame.reset();
+    }
+    if (frame.has_value()) {
+        returnUnconvertedFrame(*frame);
+    }
     stopStreaming();
+    if (mPipeline != nullptr) {
+        // Returns any pending buffers with encode failure callbacks.
+        mPipeline->stop();
+        mPipeline->dumpStats();
+    }
+    mPipeline.reset();
     mEncoder.reset();
 }
 
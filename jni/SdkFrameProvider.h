@@ -15,11 +15,15 @@
  */
 
 #pragma once
+#include <array>
+#include <chrono>
 #include <mutex>
-#include <unordered_map>
+#include <optional>
 
 #include "Encoder.h"
 #include "FrameProvider.h"
+#include "InstrumentedMutex.h"
+#include "Pipeline.h"
 
 namespace android {
 namespace webcam {
@@ -29,7 +33,8 @@ class SdkFrameProvider : public FrameProvider,
                          public EncoderCallback,
                          public std::enable_shared_from_this<SdkFrameProvider> {
   public:
-    SdkFrameProvider(std::shared_ptr<BufferProducer> producer, CameraConfig config);
+    SdkFrameProvider(std::shared_ptr<BufferProducer> producer, CameraConfig config,
+                     std::shared_ptr<EncoderArena> encoderArena);
     ~SdkFrameProvider() override;
 
     void setStreamConfig() override;
@@ -37,22 +42,92 @@ class SdkFrameProvider : public FrameProvider,
     Status stopStreaming() final ;
 
     Status encodeImage(AHardwareBuffer* hardwareBuffer, long timestamp, int rotation) override;
+    void requestFrame() override;
+
+    // Camera buffers acquired and not released yet, over all SdkFrameProviders of the process.
+    // Should be back to 0 once streaming stops, anything else is a leak.
+    [[nodiscard]] static uint32_t getHeldHardwareBufferCount();
 
     // EncoderCallback overrides
     void onEncoded(Buffer* producerBuffer, HardwareBufferDesc& hardwareBufferDesc,
                            bool success) override;
 
   private:
+    static constexpr size_t kMaxTrackedBuffers = 8;
+
+    // A camera frame held back in pull mode, waiting for a request.
+    struct PendingFrame {
+        HardwareBufferDesc desc;
+        jlong timestamp = 0;
+        jint rotation = 0;
+    };
+
+    // Decides, in pull mode, whether a requested frame should be converted now or whether a newer
+    // camera frame will still be ready in time for the next pickup. Periods and the conversion
+    // time are exponentially weighted moving averages.
+    struct PullTiming {
+        using Clock = std::chrono::steady_clock;
+        Clock::time_point lastRequest;
+        Clock::time_point lastFrame;
+        Clock::time_point lastSubmit;
+        double requestPeriodNs = 0;
+        double framePeriodNs = 0;
+        double encodeNs = 0;
+
+        void onRequest(Clock::time_point now);
+        void onFrame(Clock::time_point now);
+        void onEncoded(Clock::time_point now);
+        [[nodiscard]] bool shouldWaitForNextFrame() const;
+    };
+
+    // Pull mode counterpart of encodeImage: the frame is converted if it was requested and no
+    // better frame is coming, parked otherwise. A parked frame that is replaced goes back to java
+    // unconverted.
+    Status offerFrame(const HardwareBufferDesc& desc, jlong timestamp, jint rotation);
+    // Takes the frame to convert out of mPendingFrame if the time is right.
+    std::optional<PendingFrame> takePendingFrameLocked(PullTiming::Clock::time_point now);
+    void returnUnconvertedFrame(const PendingFrame& frame);
+
+    // Sets up the stages frames go through between encodeImage and the BufferProducer.
+    Status buildPipeline();
+    // Returns true if the frame should be dropped to honor Tunables' frame rate percentage.
+    bool shouldSkipFrame();
     Status getHardwareBufferDescFromHardwareBuffer(AHardwareBuffer* hardwareBuffer,
                                                    HardwareBufferDesc& ret);
+    // Locks a camera BLOB buffer and validates the JPEG in it.
+    Status getJpegDescFromHardwareBuffer(AHardwareBuffer* hardwareBuffer,
+                                         const AHardwareBuffer_Desc& desc,
+                                         HardwareBufferDesc& ret);
+    // Assigns desc a buffer id, hardwareBuffer is released when desc is. Fails if too many buffers
+    // are in flight.
+    Status trackHardwareBuffer(AHardwareBuffer* hardwareBuffer, HardwareBufferDesc& desc);
     Status encodeImage(HardwareBufferDesc desc, jlong timestamp, jint rotation);
     void releaseHardwareBuffer(const HardwareBufferDesc& desc);
 
-    std::mutex mMapLock;
-    std::unordered_map<uint32_t, AHardwareBuffer*>
-            mBufferIdToAHardwareBuffer;  // guarded by mMapLock
-    uint32_t mNextBufferId = 0;          // guarded by mMapLock
+    // A camera buffer held between encodeImage and onEncoded.
+    struct TrackedBuffer {
+        uint32_t bufferId = 0;
+        AHardwareBuffer* hardwareBuffer = nullptr;  // null if the slot is free
+    };
+
+    InstrumentedMutex mMapLock{"SdkFrameProvider::mMapLock"};
+    // Java holds at most CameraController.MAX_BUFFERS (4) images at once. A fixed table keeps
+    // the frame path free of allocations.
+    std::array<TrackedBuffer, kMaxTrackedBuffers> mTrackedBuffers{};  // guarded by mMapLock
+    uint32_t mNextBufferId = 0;                                       // guarded by mMapLock
+    std::shared_ptr<EncoderArena> mEncoderArena;
     std::shared_ptr<Encoder> mEncoder;
+    // In pull mode frames are submitted by the java thread delivering camera frames (offerFrame)
+    // and by the UVC thread asking for one (requestFrame). Serializes them, as the pipeline takes
+    // one submitter at a time. Taken before mPullLock and mMapLock, through the drop handler.
+    InstrumentedMutex mSubmitLock{"SdkFrameProvider::mSubmitLock"};
+    std::unique_ptr<Pipeline<EncodeRequest>> mPipeline;  // submitted to under mSubmitLock
+    uint32_t mFrameRateAccumulator = 0;
+
+    InstrumentedMutex mPullLock{"SdkFrameProvider::mPullLock"};
+    bool mFrameRequested = false;               // guarded by mPullLock
+    std::optional<PendingFrame> mPendingFrame;  // guarded by mPullLock
+    PullTiming mPullTiming;                     // guarded by mPullLock
 };
 
 }  // namespace webcam
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *  Sequence lock: publishes snapshots of a small struct that any thread can read without taking a
+ *  lock or slowing down the writer.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <array>
+#include <atomic>
+#include <thread>
+#include <type_traits>
+
+namespace android {
+namespace webcam {
+
+// Writes must be serialized by the caller: a single writer thread, or writers holding the same
+// lock. Readers retry while a write is in progress, so T should be a handful of words. The words
+// are atomics, a torn read is thrown away rather than being a data race.
+template <typename T>
+class SeqLock {
+    static_assert(std::is_trivially_copyable_v<T>, "T must be trivially copyable");
+
+  public:
+    SeqLock() { write(T{}); }
+
+    void write(const T& value) {
+        std::array<uint64_t, kWords> words{};
+        memcpy(words.data(), &value, sizeof(T));
+        uint32_t sequence = mSequence.load(std::memory_order_relaxed);
+        // Odd while the words change.
+        mSequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < kWords; i++) {
+            mWords[i].store(words[i], std::memory_order_relaxed);
+        }
+        mSequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    [[nodiscard]] T read() const {
+        std::array<uint64_t, kWords> words{};
+        while (true) {
+            uint32_t before = mSequence.load(std::memory_order_acquire);
+            if ((before & 1) != 0) {
+                std::this_thread::yield();
+                continue;
+            }
+            for (size_t i = 0; i < kWords; i++) {
+                words[i] = mWords[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (mSequence.load(std::memory_order_relaxed) == before) {
+                break;
+            }
+        }
+        T value;
+        memcpy(static_cast<void*>(&value), words.data(), sizeof(T));
+        return value;
+    }
+
+  private:
+    static constexpr size_t kWords = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    std::atomic<uint32_t> mSequence = 0;
+    std::array<std::atomic<uint64_t>, kWords> mWords{};
+};
+
+}  // namespace webcam
+}  // namespace android
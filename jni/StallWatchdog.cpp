@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+
+#include "StallWatchdog.h"
+
+#include <inttypes.h>
+#include <log/log.h>
+#include <algorithm>
+
+#include "Tunables.h"
+
+namespace android {
+namespace webcam {
+
+namespace {
+int64_t toNs(std::chrono::steady_clock::time_point time) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+}
+}  // anonymous namespace
+
+const char* frameEventToString(FrameEvent event) {
+    switch (event) {
+        case FrameEvent::STREAM_ON:
+            return "StreamOn";
+        case FrameEvent::STREAM_OFF:
+            return "StreamOff";
+        case FrameEvent::CAMERA_FRAME:
+            return "CameraFrame";
+        case FrameEvent::NO_FREE_BUFFER:
+            return "NoFreeBuffer";
+        case FrameEvent::ENCODED:
+            return "Encoded";
+        case FrameEvent::ENCODE_FAILED:
+            return "EncodeFailed";
+        case FrameEvent::DELIVERED:
+            return "Delivered";
+        case FrameEvent::RETURNED:
+            return "Returned";
+        case FrameEvent::USB_ERROR:
+            return "UsbError";
+        case FrameEvent::STARVED:
+            return "Starved";
+        case FrameEvent::STALL:
+            return "Stall";
+        case FrameEvent::RESTART:
+            return "Restart";
+        case FrameEvent::COUNT:
+            break;
+    }
+    return "unknown";
+}
+
+const char* stallSourceToString(StallSource source) {
+    switch (source) {
+        case StallSource::NONE:
+            return "none";
+        case StallSource::CAMERA:
+            return "camera";
+        case StallSource::ENCODER:
+            return "encoder";
+        case StallSource::GADGET:
+            return "gadget";
+    }
+    return "unknown";
+}
+
+FlightRecorder& FlightRecorder::getInstance() {
+    static FlightRecorder sInstance;
+    return sInstance;
+}
+
+void FlightRecorder::record(FrameEvent event, int32_t bufferIndex, int64_t value) {
+    if (event == FrameEvent::COUNT) {
+        return;
+    }
+    int64_t nowNs = toNs(std::chrono::steady_clock::now());
+    {
+        std::lock_guard<InstrumentedMutex> l(mLock);
+        Entry& entry = mEntries[mNextEntry % kCapacity];
+        entry.timeNs = nowNs;
+        entry.event = event;
+        entry.bufferIndex = bufferIndex;
+        entry.value = value;
+        mNextEntry++;
+    }
+    mLastEventNs[static_cast<size_t>(event)].store(nowNs, std::memory_order_relaxed);
+}
+
+int64_t FlightRecorder::getLastEventNs(FrameEvent event) const {
+    if (event == FrameEvent::COUNT) {
+        return 0;
+    }
+    return mLastEventNs[static_cast<size_t>(event)].load(std::memory_order_relaxed);
+}
+
+size_t FlightRecorder::getEntries(Entries* entries) const {
+    std::lock_guard<InstrumentedMutex> l(mLock);
+    uint64_t count = std::min<uint64_t>(mNextEntry, kCapacity);
+    for (uint64_t i = 0; i < count; i++) {
+        (*entries)[i] = mEntries[(mNextEntry - count + i) % kCapacity];
+    }
+    return count;
+}
+
+void FlightRecorder::dump() const {
+    // Logging is slow, it shouldn't hold up the recording threads.
+    Entries entries;
+    size_t count = getEntries(&entries);
+    if (count == 0) {
+        return;
+    }
+    // Times are relative to the newest event.
+    int64_t newestNs = entries[count - 1].timeNs;
+    ALOGI("%s: Last %zu frame events:", __FUNCTION__, count);
+    for (size_t i = 0; i < count; i++) {
+        const Entry& entry = entries[i];
+        ALOGI("%s: %8" PRId64 "us %-12s buffer %d value %" PRId64, __FUNCTION__,
+              (entry.timeNs - newestNs) / 1000, frameEventToString(entry.event),
+              entry.bufferIndex, entry.value);
+    }
+}
+
+void StallWatchdog::start(uint32_t fps, std::chrono::steady_clock::time_point now) {
+    mRunning = true;
+    mFps = fps;
+    mBaselineNs = toNs(now);
+    mFrameDelivered = false;
+    mBackoff = 1;
+    mStallCount = 0;
+}
+
+void StallWatchdog::stop() {
+    mRunning = false;
+}
+
+int64_t StallWatchdog::getTimeoutNs() const {
+    // Frames skipped to honor the frame rate percentage stretch the expected interval.
+    uint32_t percent = Tunables::getInstance().getFrameRatePercent();
+    int64_t intervalNs = 1'000'000'000LL / mFps * Tunables::kFullFrameRatePercent / percent;
+    int64_t timeoutNs = std::max<int64_t>(
+            intervalNs * kStallFrameIntervals,
+            std::chrono::duration_cast<std::chrono::nanoseconds>(kMinStallTimeout).count());
+    if (!mFrameDelivered) {
+        timeoutNs = std::max<int64_t>(
+                timeoutNs,
+                std::chrono::duration_cast<std::chrono::nanoseconds>(kFirstFrameTimeout).count());
+    }
+    return timeoutNs * mBackoff;
+}
+
+StallSource StallWatchdog::check(std::chrono::steady_clock::time_point now) {
+    if (!mRunning || mFps == 0) {
+        return StallSource::NONE;
+    }
+    const FlightRecorder& recorder = FlightRecorder::getInstance();
+    int64_t lastDeliveredNs = recorder.getLastEventNs(FrameEvent::DELIVERED);
+    if (lastDeliveredNs > mBaselineNs) {
+        // Frames are flowing again since the last stall.
+        mFrameDelivered = true;
+        mBackoff = 1;
+        mBaselineNs = lastDeliveredNs;
+    }
+    int64_t nowNs = toNs(now);
+    if (nowNs - mBaselineNs < getTimeoutNs()) {
+        return StallSource::NONE;
+    }
+
+    // The first stage of the frame path that made no progress since the last delivered frame.
+    StallSource source = StallSource::GADGET;
+    if (recorder.getLastEventNs(FrameEvent::CAMERA_FRAME) <= mBaselineNs) {
+        source = StallSource::CAMERA;
+    } else if (recorder.getLastEventNs(FrameEvent::ENCODED) <= mBaselineNs) {
+        source = StallSource::ENCODER;
+    }
+    ALOGW("%s: No frame delivered for %" PRId64 "ms, %s stalled", __FUNCTION__,
+          (nowNs - mBaselineNs) / 1'000'000, stallSourceToString(source));
+    mStallCount++;
+    // Recovery restarts the camera, so the next frame is a first frame again.
+    mFrameDelivered = false;
+    mBaselineNs = nowNs;
+    mBackoff = std::min(mBackoff * 2, kMaxBackoff);
+    return source;
+}
+
+}  // namespace webcam
+}  // namespace android
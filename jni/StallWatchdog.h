@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "InstrumentedMutex.h"
+
+namespace android {
+namespace webcam {
+
+enum class FrameEvent : uint32_t {
+    STREAM_ON = 0,
+    STREAM_OFF,
+    CAMERA_FRAME,    // Java handed a camera frame to the native side
+    NO_FREE_BUFFER,  // camera frame dropped, every producer buffer was busy
+    ENCODED,         // producer buffer filled and queued to the BufferManager
+    ENCODE_FAILED,
+    DELIVERED,       // buffer queued to the UVC gadget driver
+    RETURNED,        // buffer handed back by the gadget driver, value: its sequence number
+    USB_ERROR,       // buffer handed back flagged as not (fully) sent, value: its sequence number
+    STARVED,         // gadget driver was ready but no filled buffer showed up in time
+    STALL,
+    RESTART,
+    COUNT,
+};
+
+constexpr size_t kFrameEventCount = static_cast<size_t>(FrameEvent::COUNT);
+
+const char* frameEventToString(FrameEvent event);
+
+// Keeps the last kCapacity frame events of the process, so that a stall can be explained after
+// the fact, and the time of the latest event of each type, so that progress can be checked
+// cheaply. Events are recorded from the camera, encoder and UVC threads.
+class FlightRecorder {
+  public:
+    static constexpr size_t kCapacity = 256;
+
+    static FlightRecorder& getInstance();
+
+    struct Entry {
+        int64_t timeNs = 0;
+        FrameEvent event = FrameEvent::COUNT;
+        int32_t bufferIndex = -1;
+        int64_t value = 0;
+    };
+    using Entries = std::array<Entry, kCapacity>;
+
+    // bufferIndex is the V4L2 buffer index, if any. value is event specific, usually the camera
+    // timestamp of the frame.
+    void record(FrameEvent event, int32_t bufferIndex = -1, int64_t value = 0);
+    // Steady clock time of the latest event of the given type, 0 if there was none.
+    [[nodiscard]] int64_t getLastEventNs(FrameEvent event) const;
+    // Copies the recorded events to entries, oldest first. Returns how many there are.
+    size_t getEntries(Entries* entries) const;
+    // Logs the recorded events, oldest first.
+    void dump() const;
+
+  private:
+    FlightRecorder() = default;
+
+    // A handful of events per frame, so a lock is cheap enough and keeps entries consistent.
+    mutable InstrumentedMutex mLock{"FlightRecorder::mLock"};
+    Entries mEntries;         // guarded by mLock
+    uint64_t mNextEntry = 0;  // guarded by mLock
+    std::array<std::atomic<int64_t>, kFrameEventCount> mLastEventNs{};
+};
+
+enum class StallSource {
+    NONE = 0,
+    CAMERA,   // no camera frames are arriving
+    ENCODER,  // camera frames arrive but none get encoded
+    GADGET,   // frames get encoded but the gadget driver doesn't take them
+};
+
+const char* stallSourceToString(StallSource source);
+
+// Declares the stream stalled when no frame has been delivered to the gadget driver for
+// kStallFrameIntervals frame intervals, and works out which part of the frame path stopped
+// making progress from the FlightRecorder. Not thread safe, it is driven by the UVC thread.
+class StallWatchdog {
+  public:
+    static constexpr uint32_t kStallFrameIntervals = 15;
+    // Floor for high frame rates, where kStallFrameIntervals is shorter than a camera hiccup
+    // (eg: an exposure change) that recovers on its own.
+    static constexpr std::chrono::milliseconds kMinStallTimeout{500};
+    // Opening the camera takes a while, the first frame of a stream gets more time.
+    static constexpr std::chrono::milliseconds kFirstFrameTimeout{3000};
+    // Consecutive recoveries that don't bring frames back double the timeout, up to this factor,
+    // so that a camera that is gone for good isn't restarted in a tight loop.
+    static constexpr uint32_t kMaxBackoff = 8;
+
+    void start(uint32_t fps, std::chrono::steady_clock::time_point now);
+    void stop();
+
+    // Returns what stalled, or NONE. A stall is only reported once, the timeout starts over from
+    // now (with backoff) after that.
+    StallSource check(std::chrono::steady_clock::time_point now);
+
+    [[nodiscard]] uint32_t getStallCount() const { return mStallCount; }
+
+  private:
+    [[nodiscard]] int64_t getTimeoutNs() const;
+
+    bool mRunning = false;
+    uint32_t mFps = 0;
+    int64_t mBaselineNs = 0;  // progress before this doesn't count
+    bool mFrameDelivered = false;  // since start or the last stall
+    uint32_t mBackoff = 1;
+    uint32_t mStallCount = 0;
+};
+
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+
+#include "TelemetryUnit.h"
+
+#include <android-base/properties.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <linux/usb/video.h>
+#include <log/log.h>
+#include <string.h>
+#include <algorithm>
+
+#include "Encoder.h"
+#include "Tunables.h"
+
+namespace android {
+namespace webcam {
+
+namespace {
+// UVC 1.5 spec section 4.1.2, GET_INFO: D0 supports GET, D1 supports SET.
+constexpr uint8_t kInfoGet = 0x1;
+constexpr uint8_t kInfoSet = 0x2;
+// A negative length makes the gadget driver stall the control endpoint.
+constexpr int32_t kStall = -EL2HLT;
+
+static_assert(sizeof(TelemetryStats) <= sizeof(uvc_request_data::data),
+              "STATS doesn't fit a control transfer");
+static_assert(sizeof(TelemetryTunables) <= sizeof(uvc_request_data::data),
+              "TUNABLES doesn't fit a control transfer");
+
+uint16_t getControlSize(uint8_t control) {
+    switch (control) {
+        case TelemetryUnit::STATS:
+            return sizeof(TelemetryStats);
+        case TelemetryUnit::TUNABLES:
+            return sizeof(TelemetryTunables);
+        default:
+            return 0;
+    }
+}
+}  // anonymous namespace
+
+std::unique_ptr<TelemetryUnit> TelemetryUnit::create(Listener* listener) {
+    // bUnitID 0 is reserved, it means undefined.
+    uint8_t unitId = android::base::GetUintProperty<uint8_t>(kUnitIdProperty, /*default_value*/ 0);
+    if (unitId == 0) {
+        return nullptr;
+    }
+    ALOGI("%s: Serving telemetry on extension unit %u", __FUNCTION__, unitId);
+    return std::unique_ptr<TelemetryUnit>(new TelemetryUnit(unitId, listener));
+}
+
+bool TelemetryUnit::processSetup(const struct usb_ctrlrequest* request,
+                                 struct uvc_request_data* response) {
+    uint8_t control = request->wValue >> 8;
+    uint16_t size = getControlSize(control);
+    if (size == 0) {
+        ALOGW("%s: Unknown control %u", __FUNCTION__, control);
+        response->length = kStall;
+        return false;
+    }
+    switch (request->bRequest) {
+        case UVC_SET_CUR:
+            if (control != TUNABLES || request->wLength != size) {
+                ALOGW("%s: Can't set control %u with %u bytes", __FUNCTION__, control,
+                      request->wLength);
+                response->length = kStall;
+                return false;
+            }
+            response->length = size;
+            return true;
+        case UVC_GET_CUR:
+        case UVC_GET_MIN:
+        case UVC_GET_MAX:
+        case UVC_GET_DEF:
+        case UVC_GET_RES:
+            if (control == STATS) {
+                // Only the current value means anything for the stats.
+                TelemetryStats stats;
+                if (request->bRequest == UVC_GET_CUR) {
+                    stats = getStats();
+                }
+                memcpy(response->data, &stats, sizeof(stats));
+            } else {
+                TelemetryTunables tunables = getTunables(request->bRequest);
+                memcpy(response->data, &tunables, sizeof(tunables));
+            }
+            response->length = size;
+            break;
+        case UVC_GET_LEN:
+            response->data[0] = size & 0xff;
+            response->data[1] = size >> 8;
+            response->length = 2;
+            break;
+        case UVC_GET_INFO:
+            response->data[0] = control == TUNABLES ? kInfoGet | kInfoSet : kInfoGet;
+            response->length = 1;
+            break;
+        default:
+            ALOGW("%s: Request %u not supported", __FUNCTION__, request->bRequest);
+            response->length = kStall;
+            return false;
+    }
+    // The host may ask for less than the whole control.
+    response->length = std::min<int32_t>(response->length, request->wLength);
+    return false;
+}
+
+void TelemetryUnit::processData(const struct uvc_request_data* data) {
+    TelemetryTunables tunables;
+    if (data->length != static_cast<int32_t>(sizeof(tunables))) {
+        ALOGE("%s: Got %d bytes for the tunables, expected %zu", __FUNCTION__, data->length,
+              sizeof(tunables));
+        return;
+    }
+    memcpy(&tunables, data->data, sizeof(tunables));
+    if (!applyTunables(tunables)) {
+        ALOGE("%s: Invalid tunables from the host, ignored", __FUNCTION__);
+    }
+}
+
+TelemetryStats TelemetryUnit::getStats() {
+    TelemetryStats stats;
+    mListener->getStreamTelemetry(&stats);
+    stats.version = kStatsVersion;
+    EncoderTelemetry encoder = Encoder::getTelemetry();
+    stats.framesEncoded = encoder.frames;
+    stats.encodeFailures = encoder.failures;
+    stats.lastEncodeUs = encoder.lastEncodeUs;
+    stats.avgEncodeUs = encoder.avgEncodeUs;
+    stats.maxEncodeUs = encoder.maxEncodeUs;
+    return stats;
+}
+
+TelemetryTunables TelemetryUnit::getTunables(uint8_t request) {
+    TelemetryTunables ret;
+    const Tunables& tunables = Tunables::getInstance();
+    switch (request) {
+        case UVC_GET_CUR:
+            ret.jpegQuality = tunables.getJpegQuality();
+            ret.dctMethod = static_cast<uint32_t>(tunables.getDctMethod());
+            ret.quantTables = static_cast<uint32_t>(tunables.getQuantTables());
+            ret.maxEncoderWorkers = tunables.getMaxEncoderWorkers();
+            ret.frameRatePercent = tunables.getFrameRatePercent();
+            ret.encoderCpuMask = tunables.getEncoderCpuMask();
+            break;
+        case UVC_GET_DEF:
+            ret.jpegQuality = tunables.getDefaultJpegQuality();
+            ret.dctMethod = static_cast<uint32_t>(tunables.getDefaultDctMethod());
+            ret.quantTables = static_cast<uint32_t>(tunables.getDefaultQuantTables());
+            ret.maxEncoderWorkers = tunables.getDefaultMaxEncoderWorkers();
+            ret.frameRatePercent = Tunables::kFullFrameRatePercent;
+            break;
+        case UVC_GET_MIN:
+            ret.jpegQuality = 1;
+            ret.maxEncoderWorkers = 1;
+            ret.frameRatePercent = 1;
+            break;
+        case UVC_GET_MAX:
+            ret.jpegQuality = 100;
+            ret.dctMethod = static_cast<uint32_t>(JpegDctMethod::FAST);
+            ret.quantTables = static_cast<uint32_t>(JpegQuantTables::WEBCAM);
+            ret.maxEncoderWorkers = UINT32_MAX;
+            ret.frameRatePercent = Tunables::kFullFrameRatePercent;
+            ret.encoderCpuMask = UINT64_MAX;
+            break;
+        case UVC_GET_RES:
+            ret.jpegQuality = 1;
+            ret.dctMethod = 1;
+            ret.quantTables = 1;
+            ret.maxEncoderWorkers = 1;
+            ret.frameRatePercent = 1;
+            ret.encoderCpuMask = 1;
+            break;
+    }
+    return ret;
+}
+
+bool TelemetryUnit::applyTunables(const TelemetryTunables& tunables) {
+    // All or nothing, the host writes the whole control.
+    if (tunables.jpegQuality < 1 || tunables.jpegQuality > 100 ||
+        tunables.dctMethod > static_cast<uint32_t>(JpegDctMethod::FAST) ||
+        tunables.quantTables > static_cast<uint32_t>(JpegQuantTables::WEBCAM) ||
+        tunables.maxEncoderWorkers < 1 || tunables.frameRatePercent < 1 ||
+        tunables.frameRatePercent > Tunables::kFullFrameRatePercent) {
+        return false;
+    }
+    ALOGI("%s: quality %u dct %u quant tables %u workers %u frame rate %u%% cpus 0x%" PRIx64,
+          __FUNCTION__, tunables.jpegQuality, tunables.dctMethod, tunables.quantTables,
+          tunables.maxEncoderWorkers, tunables.frameRatePercent, tunables.encoderCpuMask);
+    Tunables& current = Tunables::getInstance();
+    current.setJpegQuality(static_cast<int32_t>(tunables.jpegQuality));
+    current.setDctMethod(static_cast<JpegDctMethod>(tunables.dctMethod));
+    current.setQuantTables(static_cast<JpegQuantTables>(tunables.quantTables));
+    current.setMaxEncoderWorkers(tunables.maxEncoderWorkers);
+    current.setFrameRatePercent(tunables.frameRatePercent);
+    current.setEncoderCpuMask(tunables.encoderCpuMask);
+    return true;
+}
+
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *  Vendor specific UVC extension unit through which a host tool can read the frame path's
+ *  telemetry and change its Tunables while streaming, eg: to look into laggy video on the host
+ *  the user reported it on.
+ */
+#pragma once
+
+#include <linux/usb/ch9.h>
+#include <linux/usb/g_uvc.h>
+#include <stdint.h>
+#include <memory>
+
+namespace android {
+namespace webcam {
+
+// Payload of TelemetryUnit::STATS. Little endian, like all UVC controls.
+struct TelemetryStats {
+    uint32_t version = 0;  // TelemetryUnit::kStatsVersion, changes with the layout
+    // Of the latest stream's Encoder, see EncoderTelemetry.
+    uint32_t framesEncoded = 0;
+    uint32_t encodeFailures = 0;
+    uint32_t lastEncodeUs = 0;
+    uint32_t avgEncodeUs = 0;
+    uint32_t maxEncodeUs = 0;
+    // Of the current stream, 0 if there is none.
+    uint32_t framesQueued = 0;  // to the gadget driver
+    uint32_t measuredFpsX100 = 0;
+    uint32_t superseded = 0;  // see DeliveryStats
+    uint32_t expired = 0;
+    uint32_t waiting = 0;  // encoded frames waiting for the gadget driver
+    uint32_t avgWaitUs = 0;
+    uint32_t gadgetErrors = 0;  // buffers the gadget driver returned with an error
+    uint32_t gadgetSequenceGaps = 0;
+    uint32_t stalls = 0;
+};
+
+// Payload of TelemetryUnit::TUNABLES, see Tunables.
+struct TelemetryTunables {
+    uint32_t jpegQuality = 0;        // 1-100
+    uint32_t dctMethod = 0;          // JpegDctMethod
+    uint32_t quantTables = 0;        // JpegQuantTables
+    uint32_t maxEncoderWorkers = 0;  // >= 1
+    uint32_t frameRatePercent = 0;   // 1-100
+    uint32_t reserved = 0;
+    uint64_t encoderCpuMask = 0;  // 0 for the encoder profile's
+};
+
+// Serves the class requests the host sends to the extension unit getUnitId() of the control
+// interface. The unit has to be in the UVC function's descriptors, which the device's USB gadget
+// configuration sets up (configfs control/extensions on kernel 6.5 and up) with guidExtensionCode
+// kGuid, kControlCount controls and bmControls 0x03. Disabled unless kUnitIdProperty gives the
+// unit's bUnitID.
+//
+// Driven by the UVC thread. Stats are read from lock free snapshots (see SeqLock): a host polling
+// them never waits on, or makes wait, the frame path. Tunables written take effect at the next
+// frame, like the ControlSocket's.
+class TelemetryUnit {
+  public:
+    static constexpr char kUnitIdProperty[] = "debug.deviceaswebcam.telemetry_unit_id";
+    // {a7e9d5c2-3b14-4f6e-8d21-6c0f9b4e7a35}, in the byte order of guidExtensionCode.
+    static constexpr uint8_t kGuid[16] = {0xc2, 0xd5, 0xe9, 0xa7, 0x14, 0x3b, 0x6e, 0x4f,
+                                          0x8d, 0x21, 0x6c, 0x0f, 0x9b, 0x4e, 0x7a, 0x35};
+    static constexpr uint32_t kStatsVersion = 1;
+
+    // Control selectors.
+    enum Control : uint8_t {
+        STATS = 1,     // TelemetryStats, read only
+        TUNABLES = 2,  // TelemetryTunables
+    };
+    static constexpr uint8_t kControlCount = 2;
+
+    class Listener {
+      public:
+        virtual ~Listener() = default;
+        // Fills the fields of stats that belong to the current stream.
+        virtual void getStreamTelemetry(TelemetryStats* stats) = 0;
+    };
+
+    // null unless kUnitIdProperty is set. listener must outlive the unit.
+    static std::unique_ptr<TelemetryUnit> create(Listener* listener);
+
+    [[nodiscard]] uint8_t getUnitId() const { return mUnitId; }
+    // Answers a request addressed to the unit, stalling the ones it doesn't support. Returns true
+    // if a SET_CUR data stage follows, which is then handed to processData.
+    bool processSetup(const struct usb_ctrlrequest* request, struct uvc_request_data* response);
+    void processData(const struct uvc_request_data* data);
+
+  private:
+    TelemetryUnit(uint8_t unitId, Listener* listener) : mListener(listener), mUnitId(unitId) {}
+
+    TelemetryStats getStats();
+    static TelemetryTunables getTunables(uint8_t request);
+    static bool applyTunables(const TelemetryTunables& tunables);
+
+    Listener* mListener = nullptr;
+    uint8_t mUnitId = 0;
+};
+
+}  // namespace webcam
+}  // namespace android
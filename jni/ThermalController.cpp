@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+
+#include "ThermalController.h"
+
+#include <android-base/file.h>
+#include <android-base/strings.h>
+#include <dirent.h>
+#include <log/log.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <array>
+#include <utility>
+
+#include "Tunables.h"
+
+namespace android {
+namespace webcam {
+
+namespace {
+using namespace std::chrono_literals;
+
+constexpr auto kPollInterval = 1s;
+// Minimum time between two steps, longer for recovering so that the stream doesn't oscillate.
+constexpr auto kDegradeDwell = 5s;
+constexpr auto kRecoverDwell = 15s;
+constexpr float kTemperatureHysteresisC = 2.0f;
+constexpr float kFrequencyHysteresis = 0.05f;
+
+// Frequency cap ratios below which each level (1 .. kMaxLevel) is entered.
+constexpr std::array<float, ThermalController::kMaxLevel> kFrequencyCapThresholds = {
+        0.9f, 0.75f, 0.6f, 0.45f, 0.3f};
+
+// Each step caps the stream's defaults (see Tunables::setDefaults), level 0 leaves them alone.
+struct LadderStep {
+    int32_t jpegQuality;
+    JpegDctMethod dctMethod;
+    uint32_t maxEncoderWorkers;  // 0: default
+    uint32_t frameRatePercent;
+};
+
+constexpr std::array<LadderStep, ThermalController::kMaxLevel + 1> kLadder = {{
+        {100, JpegDctMethod::ACCURATE, 0, 100},
+        {65, JpegDctMethod::ACCURATE, 0, 100},
+        {65, JpegDctMethod::FAST, 0, 100},
+        {65, JpegDctMethod::FAST, 1, 100},
+        {65, JpegDctMethod::FAST, 1, 75},
+        {65, JpegDctMethod::FAST, 1, 50},
+}};
+
+std::vector<std::string> listDirectory(const std::string& path, const std::string& prefix) {
+    std::vector<std::string> ret;
+    DIR* dir = opendir(path.c_str());
+    if (dir == nullptr) {
+        return ret;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (android::base::StartsWith(entry->d_name, prefix)) {
+            ret.emplace_back(path + "/" + entry->d_name);
+        }
+    }
+    closedir(dir);
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+bool readInt(const std::string& path, int64_t* value) {
+    std::string contents;
+    if (!android::base::ReadFileToString(path, &contents)) {
+        return false;
+    }
+    char* end = nullptr;
+    *value = strtoll(contents.c_str(), &end, /*base*/ 10);
+    return end != contents.c_str();
+}
+}  // anonymous namespace
+
+ThermalController::ThermalController(std::string sysfsRoot) : mSysfsRoot(std::move(sysfsRoot)) {
+    discoverSensors();
+}
+
+ThermalController::~ThermalController() {
+    stop();
+}
+
+void ThermalController::discoverSensors() {
+    std::vector<std::string> skinZones;
+    std::vector<std::string> dieZones;
+    for (const auto& zone : listDirectory(mSysfsRoot + "/class/thermal", "thermal_zone")) {
+        std::string type;
+        if (!android::base::ReadFileToString(zone + "/type", &type)) {
+            continue;
+        }
+        type = android::base::Trim(type);
+        if (type.find("skin") != std::string::npos) {
+            skinZones.push_back(zone + "/temp");
+        } else if (type.find("cpu") != std::string::npos ||
+                   type.find("soc") != std::string::npos) {
+            dieZones.push_back(zone + "/temp");
+        }
+    }
+    // Prefer skin sensors, the framework's own throttling decisions are based on them.
+    if (!skinZones.empty()) {
+        mTemperaturePaths = std::move(skinZones);
+        mFirstLevelC = 39.0f;
+        mLevelStepC = 2.0f;
+    } else {
+        mTemperaturePaths = std::move(dieZones);
+        mFirstLevelC = 70.0f;
+        mLevelStepC = 5.0f;
+    }
+
+    for (const auto& policy :
+         listDirectory(mSysfsRoot + "/devices/system/cpu/cpufreq", "policy")) {
+        mFrequencyPaths.push_back(policy + "/scaling_max_freq");
+    }
+    mFrequencyBaselines.assign(mFrequencyPaths.size(), 0);
+    ALOGI("%s: Watching %zu thermal zones and %zu cpufreq policies under %s", __FUNCTION__,
+          mTemperaturePaths.size(), mFrequencyPaths.size(), mSysfsRoot.c_str());
+}
+
+bool ThermalController::readSensors(ThermalReading* reading) {
+    bool found = false;
+    reading->maxTemperatureC = 0;
+    reading->minFrequencyCapRatio = 1;
+    for (const auto& path : mTemperaturePaths) {
+        int64_t milliC = 0;
+        if (readInt(path, &milliC)) {
+            reading->maxTemperatureC = std::max(reading->maxTemperatureC, milliC / 1000.0f);
+            found = true;
+        }
+    }
+    for (size_t i = 0; i < mFrequencyPaths.size(); i++) {
+        int64_t cap = 0;
+        if (readInt(mFrequencyPaths[i], &cap) && cap > 0) {
+            int64_t& baseline = mFrequencyBaselines[i];
+            baseline = std::max(baseline, cap);
+            reading->minFrequencyCapRatio =
+                    std::min(reading->minFrequencyCapRatio, static_cast<float>(cap) / baseline);
+            found = true;
+        }
+    }
+    return found;
+}
+
+int ThermalController::getTargetLevel(const ThermalReading& reading, float temperatureBiasC,
+                                      float ratioBias) const {
+    int temperatureLevel = 0;
+    if (!mTemperaturePaths.empty()) {
+        float overC = reading.maxTemperatureC + temperatureBiasC - mFirstLevelC;
+        if (overC >= 0) {
+            temperatureLevel = 1 + static_cast<int>(overC / mLevelStepC);
+        }
+    }
+    int frequencyLevel = 0;
+    for (float threshold : kFrequencyCapThresholds) {
+        if (reading.minFrequencyCapRatio + ratioBias < threshold) {
+            frequencyLevel++;
+        }
+    }
+    return std::min(std::max(temperatureLevel, frequencyLevel), kMaxLevel);
+}
+
+int ThermalController::poll(std::chrono::steady_clock::time_point now) {
+    ThermalReading reading;
+    bool valid = readSensors(&reading);
+
+    std::lock_guard<std::mutex> l(mLock);
+    if (!valid) {
+        return mLevel;
+    }
+    int level = mLevel;
+    if (getTargetLevel(reading, 0, 0) > mLevel) {
+        if (now - mLastChange >= kDegradeDwell) {
+            level = mLevel + 1;
+        }
+    } else if (getTargetLevel(reading, kTemperatureHysteresisC, -kFrequencyHysteresis) < mLevel) {
+        // Only recover once the readings are comfortably below the current level's threshold.
+        if (now - mLastChange >= kRecoverDwell) {
+            level = mLevel - 1;
+        }
+    }
+    if (level != mLevel) {
+        ALOGI("%s: Thermal level %d -> %d (temperature %.1fC, frequency cap %.2f)", __FUNCTION__,
+              mLevel, level, reading.maxTemperatureC, reading.minFrequencyCapRatio);
+        mLevel = level;
+        mLastChange = now;
+        applyLevel(level);
+    }
+    return mLevel;
+}
+
+int ThermalController::getLevel() const {
+    std::lock_guard<std::mutex> l(mLock);
+    return mLevel;
+}
+
+void ThermalController::applyLevel(int level) {
+    const LadderStep& step = kLadder[std::clamp(level, 0, kMaxLevel)];
+    Tunables& tunables = Tunables::getInstance();
+    tunables.setJpegQuality(std::min(step.jpegQuality, tunables.getDefaultJpegQuality()));
+    tunables.setDctMethod(step.dctMethod == JpegDctMethod::FAST ? JpegDctMethod::FAST
+                                                                : tunables.getDefaultDctMethod());
+    uint32_t defaultWorkers = tunables.getDefaultMaxEncoderWorkers();
+    tunables.setMaxEncoderWorkers(step.maxEncoderWorkers == 0
+                                          ? defaultWorkers
+                                          : std::min(step.maxEncoderWorkers, defaultWorkers));
+    tunables.setFrameRatePercent(step.frameRatePercent);
+}
+
+void ThermalController::start() {
+    std::lock_guard<std::mutex> l(mLock);
+    if (mRunning) {
+        return;
+    }
+    if (mTemperaturePaths.empty() && mFrequencyPaths.empty()) {
+        ALOGW("%s: No readable thermal sensors, thermal degradation disabled", __FUNCTION__);
+        return;
+    }
+    mRunning = true;
+    // Caps set before the stream, by the power HAL or battery saver, aren't thermal pressure.
+    mFrequencyBaselines.assign(mFrequencyPaths.size(), 0);
+    // The stream's defaults may have changed since the level was last applied.
+    applyLevel(mLevel);
+    mThread = std::thread(&ThermalController::threadLoop, this);
+}
+
+void ThermalController::stop() {
+    {
+        std::lock_guard<std::mutex> l(mLock);
+        if (!mRunning) {
+            return;
+        }
+        mRunning = false;
+    }
+    mStopCondition.notify_one();
+    if (mThread.joinable()) {
+        mThread.join();
+    }
+}
+
+void ThermalController::threadLoop() {
+    while (true) {
+        poll(std::chrono::steady_clock::now());
+        std::unique_lock<std::mutex> l(mLock);
+        if (mStopCondition.wait_for(l, kPollInterval, [this] { return !mRunning; })) {
+            return;
+        }
+    }
+}
+
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace android {
+namespace webcam {
+
+struct ThermalReading {
+    // Hottest of the thermal zones being watched, in degrees Celsius.
+    float maxTemperatureC = 0;
+    // Lowest scaling_max_freq over all cpufreq policies, relative to the highest it was since the
+    // controller started. 1 means no new cap: many devices cap some cpus below cpuinfo_max_freq
+    // from boot, or in battery saver, which isn't thermal pressure.
+    float minFrequencyCapRatio = 1;
+};
+
+// Watches thermal zone temperatures and CPU frequency caps, and walks the frame path down a fixed
+// degradation ladder as the device heats up: JPEG quality, then DCT method, then encoder worker
+// count, then (evenly spaced) frame dropping. The negotiated UVC format is never touched. Levels
+// change one step at a time, with hysteresis and a minimum dwell time, so that the stream degrades
+// predictably instead of oscillating.
+class ThermalController {
+  public:
+    static constexpr char kSysfsRootProperty[] = "debug.deviceaswebcam.thermal_sysfs_root";
+    static constexpr int kMaxLevel = 5;
+
+    // sysfsRoot is normally "/sys". Tests point it at a directory laid out the same way
+    // (class/thermal/thermal_zone*/{type,temp} and
+    // devices/system/cpu/cpufreq/policy*/scaling_max_freq).
+    explicit ThermalController(std::string sysfsRoot);
+    ~ThermalController();
+
+    // Starts / stops the polling thread. The ladder level is kept across restarts, the frequency
+    // caps are measured against the ones at start.
+    void start();
+    void stop();
+
+    // Takes one reading and moves at most one ladder step. Called by the polling thread, and
+    // directly by tests. Returns the new level.
+    int poll(std::chrono::steady_clock::time_point now);
+    [[nodiscard]] int getLevel() const;
+
+  private:
+    void discoverSensors();
+    bool readSensors(ThermalReading* reading);
+    // The biases make the reading look worse than it is, for hysteresis when recovering.
+    [[nodiscard]] int getTargetLevel(const ThermalReading& reading, float temperatureBiasC,
+                                     float ratioBias) const;
+    static void applyLevel(int level);
+    void threadLoop();
+
+    std::string mSysfsRoot;
+    std::vector<std::string> mTemperaturePaths;
+    // scaling_max_freq per cpufreq policy
+    std::vector<std::string> mFrequencyPaths;
+    // Highest scaling_max_freq read per policy since start(), 0 until read. Polling thread.
+    std::vector<int64_t> mFrequencyBaselines;
+    // Skin sensors trip much earlier than die sensors.
+    float mFirstLevelC = 0;
+    float mLevelStepC = 0;
+
+    mutable std::mutex mLock;
+    std::condition_variable mStopCondition;  // guarded by mLock
+    bool mRunning = false;                   // guarded by mLock
+    int mLevel = 0;                          // guarded by mLock
+    std::chrono::steady_clock::time_point mLastChange;  // guarded by mLock
+    std::thread mThread;
+};
+
+}  // namespace webcam
+}  // namespace android
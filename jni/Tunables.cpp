@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Tunables.h"
+
+#include <algorithm>
+#include <thread>
+
+namespace android {
+namespace webcam {
+
+Tunables& Tunables::getInstance() {
+    static Tunables sInstance;
+    return sInstance;
+}
+
+Tunables::Tunables()
+    : mDefaultJpegQuality(kDefaultJpegQuality),
+      mDefaultDctMethod(JpegDctMethod::ACCURATE),
+      mDefaultMaxEncoderWorkers(getDefaultEncoderWorkers()),
+      mDefaultQuantTables(JpegQuantTables::ANNEX_K) {
+    resetToDefaults();
+}
+
+void Tunables::setDefaults(int32_t jpegQuality, JpegDctMethod dctMethod,
+                           uint32_t maxEncoderWorkers) {
+    mDefaultJpegQuality.store(std::clamp(jpegQuality, 1, 100), std::memory_order_relaxed);
+    mDefaultDctMethod.store(dctMethod, std::memory_order_relaxed);
+    mDefaultMaxEncoderWorkers.store(std::max(maxEncoderWorkers, 1u), std::memory_order_relaxed);
+}
+
+int32_t Tunables::getDefaultJpegQuality() const {
+    return mDefaultJpegQuality.load(std::memory_order_relaxed);
+}
+
+JpegDctMethod Tunables::getDefaultDctMethod() const {
+    return mDefaultDctMethod.load(std::memory_order_relaxed);
+}
+
+uint32_t Tunables::getDefaultMaxEncoderWorkers() const {
+    return mDefaultMaxEncoderWorkers.load(std::memory_order_relaxed);
+}
+
+void Tunables::setDefaultQuantTables(JpegQuantTables tables) {
+    mDefaultQuantTables.store(tables, std::memory_order_relaxed);
+}
+
+JpegQuantTables Tunables::getDefaultQuantTables() const {
+    return mDefaultQuantTables.load(std::memory_order_relaxed);
+}
+
+void Tunables::resetToDefaults() {
+    mJpegQuality = getDefaultJpegQuality();
+    mDctMethod = getDefaultDctMethod();
+    mQuantTables = getDefaultQuantTables();
+    mMaxEncoderWorkers = getDefaultMaxEncoderWorkers();
+    mFrameRatePercent = kFullFrameRatePercent;
+    mEncoderCpuMask = 0;
+}
+
+int32_t Tunables::getJpegQuality() const {
+    return mJpegQuality.load(std::memory_order_relaxed);
+}
+
+void Tunables::setJpegQuality(int32_t quality) {
+    mJpegQuality.store(std::clamp(quality, 1, 100), std::memory_order_relaxed);
+}
+
+JpegDctMethod Tunables::getDctMethod() const {
+    return mDctMethod.load(std::memory_order_relaxed);
+}
+
+void Tunables::setDctMethod(JpegDctMethod method) {
+    mDctMethod.store(method, std::memory_order_relaxed);
+}
+
+JpegQuantTables Tunables::getQuantTables() const {
+    return mQuantTables.load(std::memory_order_relaxed);
+}
+
+void Tunables::setQuantTables(JpegQuantTables tables) {
+    mQuantTables.store(tables, std::memory_order_relaxed);
+}
+
+uint32_t Tunables::getMaxEncoderWorkers() const {
+    return mMaxEncoderWorkers.load(std::memory_order_relaxed);
+}
+
+void Tunables::setMaxEncoderWorkers(uint32_t workers) {
+    mMaxEncoderWorkers.store(std::max(workers, 1u), std::memory_order_relaxed);
+}
+
+uint32_t Tunables::getDefaultEncoderWorkers() {
+    // Leave half the cores to the camera pipeline and the rest of the system.
+    return std::max(std::thread::hardware_concurrency() / 2, 1u);
+}
+
+uint32_t Tunables::getFrameRatePercent() const {
+    return mFrameRatePercent.load(std::memory_order_relaxed);
+}
+
+void Tunables::setFrameRatePercent(uint32_t percent) {
+    mFrameRatePercent.store(std::clamp(percent, 1u, kFullFrameRatePercent),
+                            std::memory_order_relaxed);
+}
+
+uint64_t Tunables::getEncoderCpuMask() const {
+    return mEncoderCpuMask.load(std::memory_order_relaxed);
+}
+
+void Tunables::setEncoderCpuMask(uint64_t cpuMask) {
+    mEncoderCpuMask.store(cpuMask, std::memory_order_relaxed);
+}
+
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace android {
+namespace webcam {
+
+enum class JpegDctMethod : uint32_t {
+    ACCURATE = 0,  // JDCT_ISLOW
+    FAST = 1,      // JDCT_IFAST
+};
+
+// Quantization table sets, see QuantTables.h.
+enum class JpegQuantTables : uint32_t {
+    ANNEX_K = 0,  // libjpeg's defaults
+    WEBCAM = 1,
+};
+
+// Knobs of the frame path that may change while streaming. Controllers (eg: ThermalController,
+// ControlSocket) write them and the frame path reads them once per frame, so changes take effect
+// at frame boundaries. None of them change the format negotiated with the host. All accessors are
+// lock free.
+class Tunables {
+  public:
+    static constexpr int32_t kDefaultJpegQuality = 75;  // libjpeg's default
+    static constexpr uint32_t kFullFrameRatePercent = 100;
+
+    static Tunables& getInstance();
+
+    [[nodiscard]] int32_t getJpegQuality() const;
+    void setJpegQuality(int32_t quality);
+
+    [[nodiscard]] JpegDctMethod getDctMethod() const;
+    void setDctMethod(JpegDctMethod method);
+
+    [[nodiscard]] JpegQuantTables getQuantTables() const;
+    void setQuantTables(JpegQuantTables tables);
+
+    // Upper bound on the number of threads converting a single frame.
+    [[nodiscard]] uint32_t getMaxEncoderWorkers() const;
+    void setMaxEncoderWorkers(uint32_t workers);
+    [[nodiscard]] static uint32_t getDefaultEncoderWorkers();
+
+    // Percentage of the camera's frames that are converted and sent to the host. Skipped frames
+    // are spread evenly over the stream.
+    [[nodiscard]] uint32_t getFrameRatePercent() const;
+    void setFrameRatePercent(uint32_t percent);
+
+    // Cpus the encoder thread runs on, one bit per cpu, overriding the encoder profile's.
+    // 0 leaves the choice to the profile.
+    [[nodiscard]] uint64_t getEncoderCpuMask() const;
+    void setEncoderCpuMask(uint64_t cpuMask);
+
+    // Settings resetToDefaults() goes back to. The encoder profile of the stream being started
+    // sets them, controllers degrade from there.
+    void setDefaults(int32_t jpegQuality, JpegDctMethod dctMethod, uint32_t maxEncoderWorkers);
+    [[nodiscard]] int32_t getDefaultJpegQuality() const;
+    [[nodiscard]] JpegDctMethod getDefaultDctMethod() const;
+    [[nodiscard]] uint32_t getDefaultMaxEncoderWorkers() const;
+    // Comes from a property rather than the encoder profile, the calibration doesn't pick tables.
+    void setDefaultQuantTables(JpegQuantTables tables);
+    [[nodiscard]] JpegQuantTables getDefaultQuantTables() const;
+
+    void resetToDefaults();
+
+  private:
+    Tunables();
+
+    std::atomic<int32_t> mDefaultJpegQuality;
+    std::atomic<JpegDctMethod> mDefaultDctMethod;
+    std::atomic<uint32_t> mDefaultMaxEncoderWorkers;
+    std::atomic<JpegQuantTables> mDefaultQuantTables;
+
+    std::atomic<int32_t> mJpegQuality;
+    std::atomic<JpegDctMethod> mDctMethod;
+    std::atomic<JpegQuantTables> mQuantTables;
+    std::atomic<uint32_t> mMaxEncoderWorkers;
+    std::atomic<uint32_t> mFrameRatePercent;
+    std::atomic<uint64_t> mEncoderCpuMask;
+};
+
+}  // namespace webcam
+}  // namespace android
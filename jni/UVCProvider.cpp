@@ -16,7 +16,11 @@
 
 //#define LOG_NDEBUG 0
 
+#include <inttypes.h>
 #include <jni.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <fstream>
 #include <iostream>
 #include <utility>
@@ -26,17 +30,29 @@
 #include <linux/usb/g_uvc.h>
 #include <linux/usb/video.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/inotify.h>
 #include <sys/mman.h>
 
+#include <AllocationCheck.h>
 #include <DeviceAsWebcamNative.h>
+#include <EncoderProfile.h>
+#include <FrameRanges.h>
+#include <QuantTables.h>
+#include <ResidentMemory.h>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
 #include <SdkFrameProvider.h>
+#include <Tunables.h>
 #include <UVCProvider.h>
 #include <Utils.h>
 #include <log/log.h>
 
 constexpr int MAX_EVENTS = 10;
 constexpr uint32_t NUM_BUFFERS_ALLOC = 4;
+// High frame rate streams get more buffers, so that the producer side can absorb about as much
+// jitter in time as at normal rates.
+constexpr uint32_t kHighFrameRateBuffers = 6;
 constexpr uint32_t USB_PAYLOAD_TRANSFER_SIZE = 3072;
 constexpr char kDeviceGlobPattern[] = "/dev/video*";
 
@@ -45,11 +61,44 @@ constexpr char kDeviceGlobPattern[] = "/dev/video*";
 constexpr uint32_t CONTROL_INTERFACE_IDX = 0;
 constexpr uint32_t STREAMING_INTERFACE_IDX = 1;
 
-constexpr uint32_t FRAME_INTERVAL_NUM = 10'000'000;
+// Frame intervals to wait for a filled buffer before leaving the gadget driver waiting.
+constexpr uint32_t kFrameWaitIntervals = 2;
+// Longest wait for UVC events, so that onTick runs even if the stream has stalled. 15 fps.
+constexpr std::chrono::milliseconds kTickInterval(66);
 
 namespace android {
 namespace webcam {
 
+namespace {
+constexpr char kDeliveryPolicyProperty[] = "debug.deviceaswebcam.delivery_policy";
+constexpr char kDeliveryDepthProperty[] = "debug.deviceaswebcam.delivery_depth";
+constexpr char kDeliveryMaxAgeProperty[] = "debug.deviceaswebcam.delivery_max_age_ms";
+constexpr char kPhaseAlignmentProperty[] = "debug.deviceaswebcam.phase_alignment";
+constexpr char kPullModeProperty[] = "debug.deviceaswebcam.pull_mode";
+constexpr char kHuffmanOptimizationProperty[] = "debug.deviceaswebcam.huffman_optimization";
+constexpr char kPerfCountersProperty[] = "debug.deviceaswebcam.perf_counters";
+constexpr char kQuantTablesProperty[] = "debug.deviceaswebcam.quant_tables";
+
+// The default of every stream configuration, see UVCDevice::getStreamDeliveryPolicy.
+DeliveryPolicy readDeliveryPolicy() {
+    DeliveryPolicy policy;
+    std::string mode = android::base::GetProperty(kDeliveryPolicyProperty, "latest");
+    if (mode == "fifo") {
+        policy.mode = DeliveryMode::FIFO;
+    } else if (mode == "hybrid") {
+        policy.mode = DeliveryMode::HYBRID;
+    } else if (mode != "latest") {
+        ALOGW("%s: Unknown delivery policy %s, using latest", __FUNCTION__, mode.c_str());
+    }
+    policy.maxDepth = android::base::GetUintProperty<uint32_t>(kDeliveryDepthProperty,
+                                                               policy.maxDepth);
+    policy.maxAge = std::chrono::milliseconds(android::base::GetUintProperty<uint32_t>(
+            kDeliveryMaxAgeProperty, static_cast<uint32_t>(policy.maxAge.count())));
+    policy.alignPhase = android::base::GetBoolProperty(kPhaseAlignmentProperty, policy.alignPhase);
+    return policy;
+}
+}  // anonymous namespace
+
 Status EpollW::init() {
     int fd = epoll_create1(EPOLL_CLOEXEC);
     if (fd < 0) {
@@ -96,19 +145,16 @@ Status EpollW::remove(int fd) {
     return Status::OK;
 }
 
-Events EpollW::waitForEvents() {
-    struct epoll_event events[MAX_EVENTS];
-    Events eventsVec;
-    int nFds = epoll_wait(mEpollFd.get(), events, MAX_EVENTS, /*msWait for 15 fps*/ 66);
+void EpollW::waitForEvents(Events* events, std::chrono::milliseconds timeout) {
+    events->resize(MAX_EVENTS);
+    int nFds = epoll_wait(mEpollFd.get(), events->data(), MAX_EVENTS,
+                          static_cast<int>(timeout.count()));
 
     if (nFds < 0) {
         ALOGE("%s nFds was < 0 %s", __FUNCTION__, strerror(errno));
-        return eventsVec;
-    }
-    for (int i = 0; i < nFds; i++) {
-        eventsVec.emplace_back(events[i]);
+        nFds = 0;
     }
-    return eventsVec;
+    events->resize(nFds);
 }
 
 Status UVCProvider::UVCDevice::openV4L2DeviceAndSubscribe(const std::string& videoNode) {
@@ -131,6 +177,13 @@ Status UVCProvider::UVCDevice::openV4L2DeviceAndSubscribe(const std::string& vid
         return Status::ERROR;
     }
     mINotifyFd.reset(inotifyFd);
+    int frameReadyFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (frameReadyFd < 0) {
+        ALOGE("%s: Couldn't create an eventfd. Error(%d): %s", __FUNCTION__, errno,
+              strerror(errno));
+        return Status::ERROR;
+    }
+    mFrameReadyFd.reset(frameReadyFd);
     // Watch for IN_ATTRIB which is returned on link/unlink among other things.
     // As the videoNode is already linked, this should only be called during unlink.
     // NOTE: We don't watch for IN_DELETE_SELF because it isn't triggered when the
@@ -197,8 +250,7 @@ static bool isVideoOutputDevice(const char* dev) {
 }
 
 void UVCProvider::UVCDevice::getFrameIntervals(ConfigFrame* frame, ConfigFormat* format) {
-    uint32_t index = 0;
-    while (true) {
+    for (uint32_t index = 0; true; index++) {
         struct v4l2_frmivalenum intervalDesc {};
         intervalDesc.index = index;
         intervalDesc.pixel_format = format->fcc;
@@ -206,34 +258,59 @@ void UVCProvider::UVCDevice::getFrameIntervals(ConfigFrame* frame, ConfigFormat*
         intervalDesc.height = frame->height;
         int ret = ioctl(mUVCFd.get(), VIDIOC_ENUM_FRAMEINTERVALS, &intervalDesc);
         if (ret != 0) {
-            return;
+            break;
         }
         if (intervalDesc.index != index) {
             ALOGE("%s V4L2 api returned different index %u from expected %u", __FUNCTION__,
                   intervalDesc.index, index);
         }
-        uint32_t ival = 0;
-        switch (intervalDesc.type) {
-            case V4L2_FRMIVAL_TYPE_DISCRETE:
-                ival = (intervalDesc.discrete.numerator * FRAME_INTERVAL_NUM) /
-                       intervalDesc.discrete.denominator;
-                break;
-            case V4L2_FRMIVAL_TYPE_STEPWISE:
-                // We only take the min here
-                ival = intervalDesc.stepwise.min.numerator / intervalDesc.stepwise.min.denominator;
-                break;
-            default:
-                ALOGE("%s frame type %u invalid", __FUNCTION__, intervalDesc.type);
-                break;
+        if (intervalDesc.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+            uint32_t interval = toFrameInterval(intervalDesc.discrete);
+            if (interval != 0) {
+                frame->intervals.push_back(interval);
+            }
+            continue;
+        }
+        if (intervalDesc.type != V4L2_FRMIVAL_TYPE_STEPWISE &&
+            intervalDesc.type != V4L2_FRMIVAL_TYPE_CONTINUOUS) {
+            ALOGE("%s frame type %u invalid", __FUNCTION__, intervalDesc.type);
+            continue;
         }
-        frame->intervals.emplace_back(ival);
-        index++;
+        // A range is the only entry.
+        uint32_t step = intervalDesc.type == V4L2_FRMIVAL_TYPE_STEPWISE
+                                ? toFrameInterval(intervalDesc.stepwise.step)
+                                : 0;
+        frame->intervals = expandIntervalRange(toFrameInterval(intervalDesc.stepwise.min),
+                                               toFrameInterval(intervalDesc.stepwise.max), step);
+        break;
+    }
+    // setStreamingControl() expects them in ascending order.
+    std::sort(frame->intervals.begin(), frame->intervals.end());
+    frame->intervals.erase(std::unique(frame->intervals.begin(), frame->intervals.end()),
+                           frame->intervals.end());
+    // Typically 90 and 120 fps, unless the camera has AE target fps ranges for them.
+    limitFrameRate(&frame->intervals, mMaxCameraFps);
+    if (frame->intervals.empty()) {
+        ALOGE("%s: No frame intervals for %ux%u", __FUNCTION__, frame->width, frame->height);
     }
 }
 
+void UVCProvider::UVCDevice::addFormatFrame(uint32_t width, uint32_t height,
+                                            ConfigFormat* format) {
+    ConfigFrame configFrame{};
+    configFrame.index = format->frames.size();
+    configFrame.width = width;
+    configFrame.height = height;
+    getFrameIntervals(&configFrame, format);
+    ALOGV("%s: %ux%u, %zu frame intervals, %u - %u fps", __FUNCTION__, width, height,
+          configFrame.intervals.size(),
+          configFrame.intervals.empty() ? 0 : toFps(configFrame.intervals.back()),
+          configFrame.intervals.empty() ? 0 : toFps(configFrame.intervals.front()));
+    format->frames.emplace_back(configFrame);
+}
+
 void UVCProvider::UVCDevice::getFormatFrames(ConfigFormat* format) {
-    uint32_t index = 0;
-    while (true) {
+    for (uint32_t index = 0; true; index++) {
         struct v4l2_frmsizeenum frameDesc {};
         frameDesc.index = index;
         frameDesc.pixel_format = format->fcc;
@@ -246,25 +323,21 @@ void UVCProvider::UVCDevice::getFormatFrames(ConfigFormat* format) {
             ALOGE("%s V4L2 api returned different index %u from expected %u", __FUNCTION__,
                   frameDesc.index, index);
         }
-        ConfigFrame configFrame{};
-        configFrame.index = index;
         switch (frameDesc.type) {
             case V4L2_FRMSIZE_TYPE_DISCRETE:
-                configFrame.width = frameDesc.discrete.width;
-                configFrame.height = frameDesc.discrete.height;
+                addFormatFrame(frameDesc.discrete.width, frameDesc.discrete.height, format);
                 break;
             case V4L2_FRMSIZE_TYPE_STEPWISE:
-                // We only take the min here
-                configFrame.width = frameDesc.stepwise.min_width;
-                configFrame.height = frameDesc.stepwise.min_height;
-                break;
+            case V4L2_FRMSIZE_TYPE_CONTINUOUS:
+                // A range is the only entry.
+                for (const FrameSize& size : expandSizeRange(frameDesc.stepwise)) {
+                    addFormatFrame(size.width, size.height, format);
+                }
+                return;
             default:
                 ALOGE("%s frame type %u invalid", __FUNCTION__, frameDesc.type);
                 break;
         }
-        getFrameIntervals(&configFrame, format);
-        format->frames.emplace_back(configFrame);
-        index++;
     }
 }
 
@@ -302,8 +375,10 @@ std::shared_ptr<UVCProperties> UVCProvider::UVCDevice::parseUvcProperties() {
 }
 
 UVCProvider::UVCDevice::UVCDevice(std::weak_ptr<UVCProvider> parent,
-                                  const std::unordered_set<std::string>& ignoredNodes) {
+                                  const std::unordered_set<std::string>& ignoredNodes,
+                                  uint32_t maxCameraFps) {
     mParent = std::move(parent);
+    mMaxCameraFps = maxCameraFps;
 
     // Initialize probe and commit controls with default values
     FormatTriplet defaultFormatTriplet(/*formatIndex*/ 1, /*frameSizeIndex*/ 1,
@@ -322,11 +397,90 @@ UVCProvider::UVCDevice::UVCDevice(std::weak_ptr<UVCProvider> parent,
         return;
     }
     setStreamingControl(&mCommit, &defaultFormatTriplet);
+    createEncoderArena();
+    mDefaultDeliveryPolicy = readDeliveryPolicy();
+    std::string sysfsRoot =
+            android::base::GetProperty(ThermalController::kSysfsRootProperty, "/sys");
+    mThermalController = std::make_unique<ThermalController>(sysfsRoot);
+    if (android::base::GetBoolProperty(EncoderCalibrator::kCalibrateProperty,
+                                       /*default_value*/ false)) {
+        EncoderProfileStore::getInstance().clear();
+    }
+    mEncoderCalibrator = std::make_unique<EncoderCalibrator>(sysfsRoot, mEncoderArena);
+    startEncoderCalibration();
+    mTelemetryUnit = TelemetryUnit::create(this);
     mInited = true;
 }
 
+void UVCProvider::UVCDevice::startEncoderCalibration() {
+    std::vector<EncoderCalibrator::StreamSize> sizes;
+    for (const auto& format : mUVCProperties->streaming.formats) {
+        for (const auto& frame : format.frames) {
+            EncoderCalibrator::StreamSize size;
+            size.fcc = format.fcc;
+            size.width = frame.width;
+            size.height = frame.height;
+            for (uint32_t interval : frame.intervals) {
+                size.fps.push_back(toFps(interval));
+            }
+            sizes.push_back(std::move(size));
+        }
+    }
+    mEncoderCalibrator->start(std::move(sizes));
+}
+
+void UVCProvider::UVCDevice::applyEncoderProfile() {
+    uint32_t fcc = mV4l2Format.fmt.pix.pixelformat;
+    uint32_t width = mV4l2Format.fmt.pix.width;
+    uint32_t height = mV4l2Format.fmt.pix.height;
+    Tunables& tunables = Tunables::getInstance();
+    EncoderProfile profile;
+    if (EncoderProfileStore::getInstance().find(fcc, width, height, mFps, &profile)) {
+        ALOGI("%s: %ux%u@%u: jpeg quality %d, dct %u, cpus 0x%" PRIx64, __FUNCTION__, width,
+              height, mFps, profile.jpegQuality, static_cast<uint32_t>(profile.dctMethod),
+              profile.cpuMask);
+        tunables.setDefaults(profile.jpegQuality, profile.dctMethod,
+                             profile.maxEncoderWorkers != 0
+                                     ? profile.maxEncoderWorkers
+                                     : Tunables::getDefaultEncoderWorkers());
+        mEncoderCpuMask = profile.cpuMask;
+    } else {
+        tunables.setDefaults(Tunables::kDefaultJpegQuality, JpegDctMethod::ACCURATE,
+                             Tunables::getDefaultEncoderWorkers());
+        mEncoderCpuMask = 0;
+    }
+    JpegQuantTables quantTables = JpegQuantTables::ANNEX_K;
+    std::string quantTablesName = android::base::GetProperty(
+            kQuantTablesProperty, quantTablesToString(JpegQuantTables::ANNEX_K));
+    if (!parseQuantTables(quantTablesName, &quantTables)) {
+        ALOGW("%s: Unknown quantization tables %s, using annex K ones", __FUNCTION__,
+              quantTablesName.c_str());
+    }
+    tunables.setDefaultQuantTables(quantTables);
+    tunables.resetToDefaults();
+}
+
+void UVCProvider::UVCDevice::createEncoderArena() {
+    uint32_t maxWidth = 0;
+    uint32_t maxHeight = 0;
+    size_t maxScratchSize = 0;
+    for (const auto& format : mUVCProperties->streaming.formats) {
+        for (const auto& frame : format.frames) {
+            size_t scratchSize = EncoderArena::getScratchSize(frame.width, frame.height);
+            if (scratchSize > maxScratchSize) {
+                maxScratchSize = scratchSize;
+                maxWidth = frame.width;
+                maxHeight = frame.height;
+            }
+        }
+    }
+    // Not fatal: Encoders map their own arena if there is no shared one.
+    mEncoderArena = EncoderArena::create(maxWidth, maxHeight);
+}
+
 void UVCProvider::UVCDevice::closeUVCFd() {
     mINotifyFd.reset(); // No need to inotify_rm_watch as closing the fd frees up resources
+    mFrameReadyFd.reset();
 
     if (mUVCFd.get() >= 0) {
         struct v4l2_event_subscription subscription {};
@@ -367,6 +521,11 @@ bool UVCProvider::UVCDevice::isInited() const {
 
 void UVCProvider::UVCDevice::processSetupControlEvent(const struct usb_ctrlrequest* control,
                                                       struct uvc_request_data* resp) {
+    uint8_t entity = control->wIndex >> 8;
+    if (mTelemetryUnit != nullptr && entity == mTelemetryUnit->getUnitId()) {
+        mTelemetryDataPending = mTelemetryUnit->processSetup(control, resp);
+        return;
+    }
     // TODO(b/267794640): Support control requests
     resp->data[0] = 0x3;
     resp->length = control->wLength;
@@ -456,6 +615,7 @@ void UVCProvider::UVCDevice::processSetupEvent(const struct usb_ctrlrequest* req
     uint16_t value = request->wValue;
     ALOGV("%s: type %u requestCode %u length %u index %u value %u", __FUNCTION__, type, requestCode,
           length, index, value);
+    mTelemetryDataPending = false;
     switch (type & USB_TYPE_MASK) {
         case USB_TYPE_STANDARD:
             ALOGW("USB_TYPE_STANDARD request not being handled");
@@ -487,6 +647,9 @@ void UVCProvider::UVCDevice::setStreamingControl(struct uvc_streaming_control* s
     ALOGV("%s: chosenFormatIndex %d chosenFrameIndex: %d", __FUNCTION__, chosenFormatIndex,
             chosenFrameIndex);
     const ConfigFrame& chosenFrame = chosenFormat.frames[chosenFrameIndex - 1];
+    if (chosenFrame.intervals.empty()) {
+        return;
+    }
     uint32_t reqFrameInterval = req->frameInterval;
     bool largerFound = false;
     // Choose the first frame interval >= requested. Frame intervals are expected to be in
@@ -526,7 +689,7 @@ void UVCProvider::UVCDevice::setStreamingControl(struct uvc_streaming_control* s
 void UVCProvider::UVCDevice::commitControls() {
     const ConfigFormat& commitFormat = mUVCProperties->streaming.formats[mCommit.bFormatIndex - 1];
     const ConfigFrame& commitFrame = commitFormat.frames[mCommit.bFrameIndex - 1];
-    mFps = FRAME_INTERVAL_NUM / mCommit.dwFrameInterval;
+    mFps = toFps(mCommit.dwFrameInterval);
 
     memset(&mV4l2Format, 0, sizeof(mV4l2Format));
     mV4l2Format.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
@@ -549,6 +712,11 @@ void UVCProvider::UVCDevice::commitControls() {
 }
 
 void UVCProvider::UVCDevice::processDataEvent(const struct uvc_request_data* data) {
+    if (mTelemetryDataPending) {
+        mTelemetryDataPending = false;
+        mTelemetryUnit->processData(data);
+        return;
+    }
     const struct uvc_streaming_control* controlReq =
             reinterpret_cast<const struct uvc_streaming_control*>(&data->data);
 
@@ -562,6 +730,9 @@ void UVCProvider::UVCDevice::processDataEvent(const struct uvc_request_data* dat
         case UVC_VS_COMMIT_CONTROL:
             setStreamingControl(&mCommit, &triplet);
             commitControls();
+            // STREAMON follows, cancel the calibration now so that it doesn't have to wait for
+            // the frame being encoded.
+            mEncoderCalibrator->requestStop();
             break;
         default:
             ALOGE("mCurrentControlState is UNDEFINED");
@@ -569,42 +740,46 @@ void UVCProvider::UVCDevice::processDataEvent(const struct uvc_request_data* dat
     }
 }
 
-std::shared_ptr<Buffer> UVCProvider::UVCDevice::mapBuffer(uint32_t i) {
-    struct v4l2_buffer buffer {};
+Status UVCProvider::UVCDevice::mapBuffer(uint32_t i, V4L2Buffer* buffer) {
+    struct v4l2_buffer v4l2Buffer {};
 
-    buffer.index = i;
-    buffer.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-    buffer.memory = V4L2_MEMORY_MMAP;
+    v4l2Buffer.index = i;
+    v4l2Buffer.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    v4l2Buffer.memory = V4L2_MEMORY_MMAP;
 
-    if (ioctl(mUVCFd.get(), VIDIOC_QUERYBUF, &buffer) < 0) {
+    if (ioctl(mUVCFd.get(), VIDIOC_QUERYBUF, &v4l2Buffer) < 0) {
         ALOGE("%s: Unable to query V4L2 buffer index %u from gadget driver: %s", __FUNCTION__, i,
               strerror(errno));
-        return nullptr;
+        return Status::ERROR;
     }
 
-    void* mem = mmap(/*addr*/ nullptr, buffer.length, PROT_READ | PROT_WRITE, MAP_SHARED,
-                     mUVCFd.get(), buffer.m.offset);
+    void* mem = mmap(/*addr*/ nullptr, v4l2Buffer.length, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | residentMmapFlags(), mUVCFd.get(), v4l2Buffer.m.offset);
     if (mem == MAP_FAILED) {
         ALOGE("%s: Unable to map V4L2 buffer index %u from gadget driver: %s", __FUNCTION__, i,
               strerror(errno));
-        return nullptr;
+        return Status::ERROR;
     }
-    ALOGV("%s: Allocated and mapped buffer at %p of size %u", __FUNCTION__, mem, buffer.length);
-    return std::make_shared<V4L2Buffer>(mem, &buffer);
+    // Avoid page faults on the first frames written into the buffer after STREAMON.
+    makeResident(mem, v4l2Buffer.length, /*writable*/ true);
+    ALOGV("%s: Allocated and mapped buffer at %p of size %u", __FUNCTION__, mem,
+          v4l2Buffer.length);
+    *buffer = V4L2Buffer(mem, &v4l2Buffer);
+    return Status::OK;
 }
 
-Status UVCProvider::UVCDevice::allocateAndMapBuffers(
-        std::shared_ptr<Buffer>* consumerBuffer,
-        std::vector<std::shared_ptr<Buffer>>* producerBuffers) {
+Status UVCProvider::UVCDevice::allocateAndMapBuffers(V4L2Buffer* consumerBuffer,
+                                                     std::vector<V4L2Buffer>* producerBuffers) {
     if (consumerBuffer == nullptr || producerBuffers == nullptr) {
         ALOGE("%s: ConsumerBuffer / producerBuffers are null", __FUNCTION__);
         return Status::ERROR;
     }
-    *consumerBuffer = nullptr;
+    *consumerBuffer = V4L2Buffer();
     producerBuffers->clear();
     struct v4l2_requestbuffers requestBuffers {};
 
-    requestBuffers.count = NUM_BUFFERS_ALLOC;
+    uint32_t bufferCount = mFps >= kHighFrameRate ? kHighFrameRateBuffers : NUM_BUFFERS_ALLOC;
+    requestBuffers.count = bufferCount;
     requestBuffers.memory = V4L2_MEMORY_MMAP;
     requestBuffers.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
 
@@ -615,46 +790,45 @@ Status UVCProvider::UVCDevice::allocateAndMapBuffers(
         return Status::ERROR;
     }
 
-    if (requestBuffers.count != NUM_BUFFERS_ALLOC) {
+    if (requestBuffers.count != bufferCount) {
         ALOGE("%s: Gadget driver could only allocate %u buffers instead of %u", __FUNCTION__,
-              requestBuffers.count, NUM_BUFFERS_ALLOC);
+              requestBuffers.count, bufferCount);
         // TODO: We should probably be freeing buffers here
         return Status::ERROR;
     }
 
     // First buffer is consumer buffer
-    *consumerBuffer = mapBuffer(0);
-    if (*consumerBuffer == nullptr) {
+    if (mapBuffer(0, consumerBuffer) != Status::OK) {
         ALOGE("%s: Mapping consumer buffer failed", __FUNCTION__);
         return Status::ERROR;
     }
 
     // The rest are producer buffers
-    for (uint32_t i = 1; i < NUM_BUFFERS_ALLOC; i++) {
-        std::shared_ptr<Buffer> buffer = mapBuffer(i);
-        if (buffer == nullptr) {
+    producerBuffers->resize(bufferCount - 1);
+    for (uint32_t i = 1; i < bufferCount; i++) {
+        if (mapBuffer(i, &(*producerBuffers)[i - 1]) != Status::OK) {
             ALOGE("%s: Mapping producer buffer index %u failed", __FUNCTION__, i);
-            *consumerBuffer = nullptr;
+            *consumerBuffer = V4L2Buffer();
             producerBuffers->clear();
             return Status::ERROR;
         }
-        producerBuffers->push_back(buffer);
     }
     return Status::OK;
 }
 
-Status UVCProvider::UVCDevice::unmapBuffer(std::shared_ptr<Buffer>& buffer) {
-    if (buffer->getMem() != nullptr) {
-        if (munmap(buffer->getMem(), buffer->getLength()) < 0) {
-            ALOGE("%s: munmap failed for buffer with pointer %p", __FUNCTION__, buffer->getMem());
+Status UVCProvider::UVCDevice::unmapBuffer(V4L2Buffer& buffer) {
+    if (buffer.getMem() != nullptr) {
+        releaseResident(buffer.getMem(), buffer.getLength());
+        if (munmap(buffer.getMem(), buffer.getLength()) < 0) {
+            ALOGE("%s: munmap failed for buffer with pointer %p", __FUNCTION__, buffer.getMem());
             return Status::ERROR;
         }
     }
     return Status::OK;
 }
 
-void UVCProvider::UVCDevice::destroyBuffers(std::shared_ptr<Buffer>& consumerBuffer,
-                                            std::vector<std::shared_ptr<Buffer>>& producerBuffers) {
+void UVCProvider::UVCDevice::destroyBuffers(V4L2Buffer& consumerBuffer,
+                                            std::vector<V4L2Buffer>& producerBuffers) {
     if (unmapBuffer(consumerBuffer) != Status::OK) {
         ALOGE("%s: Failed to unmap consumer buffer, continuing producer buffer cleanup anyway",
               __FUNCTION__);
@@ -676,7 +850,8 @@ void UVCProvider::UVCDevice::destroyBuffers(std::shared_ptr<Buffer>& consumerBuf
     }
 }
 
-Status UVCProvider::UVCDevice::getFrameAndQueueBufferToGadgetDriver(bool firstBuffer) {
+Status UVCProvider::UVCDevice::getFrameAndQueueBufferToGadgetDriver(
+        std::chrono::milliseconds waitTimeout, bool firstBuffer) {
     // If first buffer, also call the STREAMON ioctl on uvc device
     ALOGV("%s: E", __FUNCTION__);
     if (firstBuffer) {
@@ -686,19 +861,232 @@ Status UVCProvider::UVCDevice::getFrameAndQueueBufferToGadgetDriver(bool firstBu
             return Status::ERROR;
         }
     }
-    Buffer* buffer = mBufferManager->getFilledBufferAndSwap();
-    struct v4l2_buffer v4L2Buffer = *(static_cast<V4L2Buffer*>(buffer)->getV4L2Buffer());
+    V4L2Buffer* buffer = mBufferManager->getFilledBufferAndSwap(waitTimeout);
+    if (buffer == nullptr) {
+        // Don't block the UVC thread on the frame path, onTick queues the next filled buffer.
+        if (!mWaitingForFrame) {
+            FlightRecorder::getInstance().record(FrameEvent::STARVED);
+        }
+        mWaitingForFrame = true;
+        return Status::OK;
+    }
+    mWaitingForFrame = false;
+    struct v4l2_buffer v4L2Buffer = *buffer->getV4L2Buffer();
+    // The driver copies it back unless it stamps the completion, see GadgetStats::onReturned.
+    v4L2Buffer.timestamp = {};
     ALOGV("%s: got buffer, queueing it with index %u", __FUNCTION__, v4L2Buffer.index);
 
     if (ioctl(mUVCFd.get(), VIDIOC_QBUF, &v4L2Buffer) < 0) {
         ALOGE("%s: VIDIOC_QBUF failed on gadget driver: %s", __FUNCTION__, strerror(errno));
         return Status::ERROR;
     }
+    mGadgetStats.onQueued(v4L2Buffer.index, std::chrono::steady_clock::now());
+    FlightRecorder::getInstance().record(FrameEvent::DELIVERED, v4L2Buffer.index,
+                                         static_cast<int64_t>(buffer->getTimestamp()));
+    onFramePathFrameDelivered();
+    requestFrame();
+    mStartupStats.onFrameQueued(mFps);
+    mRateStats.onFrameQueued(mFps);
     ALOGV("%s: X", __FUNCTION__);
     return Status::OK;
 }
 
+std::chrono::milliseconds UVCProvider::UVCDevice::getFrameWaitTimeout() const {
+    uint32_t fps = std::max(mFps, 1u);
+    return std::chrono::milliseconds(kFrameWaitIntervals * 1000 / fps);
+}
+
+void UVCProvider::UVCDevice::startFrameProvider() {
+    CameraConfig config;
+    config.width = mV4l2Format.fmt.pix.width;
+    config.height = mV4l2Format.fmt.pix.height;
+    config.fcc = mV4l2Format.fmt.pix.pixelformat;
+    config.fps = mFps;
+    config.pullMode = android::base::GetBoolProperty(kPullModeProperty, /*default_value*/ false);
+    config.optimizeHuffmanTables =
+            android::base::GetBoolProperty(kHuffmanOptimizationProperty, /*default_value*/ false);
+    config.evaluateQuantTables = QuantTablesEvaluator::isEnabled();
+    config.cpuMask = mEncoderCpuMask;
+    config.perfCounters =
+            android::base::GetBoolProperty(kPerfCountersProperty, /*default_value*/ false);
+
+    auto frameProvider =
+            std::make_shared<SdkFrameProvider>(mBufferManager, config, mEncoderArena);
+    frameProvider->setStreamConfig();
+    frameProvider->startStreaming();
+    std::lock_guard<InstrumentedMutex> l(mFrameProviderLock);
+    mFrameProvider = std::move(frameProvider);
+    // Pull mode: ask for the first frame, every pickup asks for the next one.
+    mFrameProvider->requestFrame();
+}
+
+void UVCProvider::UVCDevice::requestFrame() {
+    std::lock_guard<InstrumentedMutex> l(mFrameProviderLock);
+    if (mFrameProvider != nullptr) {
+        mFrameProvider->requestFrame();
+    }
+}
+
+void UVCProvider::UVCDevice::stopFrameProvider() {
+    std::shared_ptr<FrameProvider> frameProvider;
+    {
+        std::lock_guard<InstrumentedMutex> l(mFrameProviderLock);
+        frameProvider = std::move(mFrameProvider);
+    }
+    // Destroyed outside the lock: this stops the camera stream and hands pending frames back to
+    // java, which must not wait on encodeImage.
+    frameProvider.reset();
+}
+
+void UVCProvider::UVCDevice::recoverFromStall(StallSource source) {
+    FlightRecorder::getInstance().record(FrameEvent::STALL, /*bufferIndex*/ -1,
+                                         static_cast<int64_t>(source));
+    FlightRecorder::getInstance().dump();
+    mBufferManager->dumpState();
+    if (source == StallSource::GADGET) {
+        // Frames are ready, a new camera stream won't help a host that doesn't take them.
+        ALOGW("%s: Gadget driver isn't taking frames, waiting for the host", __FUNCTION__);
+        return;
+    }
+    ALOGW("%s: Restarting the camera stream", __FUNCTION__);
+    FlightRecorder::getInstance().record(FrameEvent::RESTART);
+    // A new camera stream allocates, it gets a warm-up of its own.
+    onFramePathStreamOn();
+    stopFrameProvider();
+    // Nothing produces into the buffers anymore, so buffers that were stuck in flight can go.
+    mBufferManager->cancelInFlightBuffers();
+    startFrameProvider();
+}
+
+void UVCProvider::UVCDevice::onTick() {
+    if (mBufferManager == nullptr) {
+        return;
+    }
+    if (mPhaseHoldUntil != std::chrono::steady_clock::time_point() &&
+        std::chrono::steady_clock::now() >= mPhaseHoldUntil) {
+        mPhaseHoldUntil = {};
+        getFrameAndQueueBufferToGadgetDriver(getFrameWaitTimeout());
+    } else if (mWaitingForFrame) {
+        getFrameAndQueueBufferToGadgetDriver(std::chrono::milliseconds(0));
+    }
+    StallSource source = mStallWatchdog.check(std::chrono::steady_clock::now());
+    if (source != StallSource::NONE) {
+        recoverFromStall(source);
+    }
+}
+
+void UVCProvider::UVCDevice::processFrameReadyEvent() {
+    eventfd_t count = 0;
+    // Non blocking, only fails if a pickup already drained it.
+    eventfd_read(mFrameReadyFd.get(), &count);
+    // Unless phase alignment holds the pickup, that one is onTick's.
+    if (mBufferManager != nullptr && mWaitingForFrame &&
+        mPhaseHoldUntil == std::chrono::steady_clock::time_point()) {
+        getFrameAndQueueBufferToGadgetDriver(std::chrono::milliseconds(0));
+    }
+}
+
+std::chrono::milliseconds UVCProvider::UVCDevice::getTickTimeout() const {
+    if (mPhaseHoldUntil == std::chrono::steady_clock::time_point()) {
+        return kTickInterval;
+    }
+    // Rounded up, waking up early would only spin.
+    auto remaining = std::chrono::ceil<std::chrono::milliseconds>(
+            mPhaseHoldUntil - std::chrono::steady_clock::now());
+    return std::clamp(remaining, std::chrono::milliseconds(0), kTickInterval);
+}
+
+bool UVCProvider::UVCDevice::getDeliveryPolicy(DeliveryPolicy* policy) {
+    if (mBufferManager == nullptr) {
+        return false;
+    }
+    *policy = mBufferManager->getDeliveryPolicy();
+    return true;
+}
+
+bool UVCProvider::UVCDevice::setDeliveryPolicy(const DeliveryPolicy& policy) {
+    if (mBufferManager == nullptr) {
+        return false;
+    }
+    getStreamDeliveryPolicy().policy = policy;
+    mBufferManager->setDeliveryPolicy(policy);
+    return true;
+}
+
+void UVCProvider::UVCDevice::resetDeliveryPolicy() {
+    if (mBufferManager != nullptr) {
+        getStreamDeliveryPolicy().policy = mDefaultDeliveryPolicy;
+        mBufferManager->setDeliveryPolicy(mDefaultDeliveryPolicy);
+    }
+}
+
+UVCProvider::UVCDevice::StreamDeliveryPolicy& UVCProvider::UVCDevice::getStreamDeliveryPolicy() {
+    uint32_t fcc = mV4l2Format.fmt.pix.pixelformat;
+    uint32_t width = mV4l2Format.fmt.pix.width;
+    uint32_t height = mV4l2Format.fmt.pix.height;
+    for (auto& entry : mDeliveryPolicies) {
+        if (entry.fcc == fcc && entry.width == width && entry.height == height &&
+            entry.fps == mFps) {
+            return entry;
+        }
+    }
+    StreamDeliveryPolicy entry;
+    entry.fcc = fcc;
+    entry.width = width;
+    entry.height = height;
+    entry.fps = mFps;
+    entry.policy = mDefaultDeliveryPolicy;
+    mDeliveryPolicies.push_back(entry);
+    return mDeliveryPolicies.back();
+}
+
+void UVCProvider::UVCDevice::dumpStats(std::string* out) {
+    if (mBufferManager == nullptr) {
+        *out += "streaming false\n";
+        return;
+    }
+    DeliveryStats delivery = mBufferManager->getDeliveryStats();
+    android::base::StringAppendF(
+            out,
+            "streaming true\nfourcc 0x%08x\nwidth %u\nheight %u\nfps %u\n"
+            "frames_queued %" PRIu64 "\nmeasured_fps %.1f\nlate_intervals %" PRIu64 "\n",
+            mV4l2Format.fmt.pix.pixelformat, mV4l2Format.fmt.pix.width,
+            mV4l2Format.fmt.pix.height, mFps, mRateStats.framesQueued, mRateStats.getMeasuredFps(),
+            mRateStats.lateIntervals);
+    android::base::StringAppendF(
+            out,
+            "delivered %" PRIu64 "\nsuperseded %" PRIu64 "\nexpired %" PRIu64
+            "\nno_free_buffer %" PRIu64 "\navg_wait_us %" PRIu64 "\nmax_wait_us %" PRIu64
+            "\nheld %" PRIu64 "\nwaiting %" PRIu64 "\n",
+            delivery.delivered, delivery.superseded, delivery.expired, delivery.noFreeBuffer,
+            delivery.delivered == 0 ? 0 : delivery.totalWaitNs / delivery.delivered / 1000,
+            delivery.maxWaitNs / 1000, delivery.held, delivery.waiting);
+    android::base::StringAppendF(out, "stalls %u\nthermal_level %d\nwaiting_for_frame %s\n",
+                                 mStallWatchdog.getStallCount(), mThermalController->getLevel(),
+                                 mWaitingForFrame ? "true" : "false");
+    mGadgetStats.dump(out);
+}
+
+void UVCProvider::UVCDevice::getStreamTelemetry(TelemetryStats* stats) {
+    if (mBufferManager == nullptr) {
+        return;
+    }
+    DeliveryStats delivery = mBufferManager->getDeliveryStats();
+    stats->framesQueued = static_cast<uint32_t>(mRateStats.framesQueued);
+    stats->measuredFpsX100 = static_cast<uint32_t>(mRateStats.getMeasuredFps() * 100);
+    stats->superseded = static_cast<uint32_t>(delivery.superseded);
+    stats->expired = static_cast<uint32_t>(delivery.expired);
+    stats->waiting = static_cast<uint32_t>(delivery.waiting);
+    stats->avgWaitUs = static_cast<uint32_t>(
+            delivery.delivered == 0 ? 0 : delivery.totalWaitNs / delivery.delivered / 1000);
+    stats->gadgetErrors = static_cast<uint32_t>(mGadgetStats.getErrors());
+    stats->gadgetSequenceGaps = static_cast<uint32_t>(mGadgetStats.getSequenceGaps());
+    stats->stalls = mStallWatchdog.getStallCount();
+}
+
 void UVCProvider::UVCDevice::processStreamOffEvent() {
+    mThermalController->stop();
+    mStallWatchdog.stop();
     int type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
     if (ioctl(mUVCFd.get(), VIDIOC_STREAMOFF, &type) < 0) {
         ALOGE("%s: uvc gadget driver request to switch stream off failed %s", __FUNCTION__,
@@ -706,29 +1094,113 @@ void UVCProvider::UVCDevice::processStreamOffEvent() {
         return;
     }
 
-    mFrameProvider.reset();
+    FlightRecorder::getInstance().record(FrameEvent::STREAM_OFF);
+    if (mStallWatchdog.getStallCount() > 0) {
+        ALOGW("%s: Stream recovered from %u stalls", __FUNCTION__,
+              mStallWatchdog.getStallCount());
+    }
+    mRateStats.log(mFps);
+    mGadgetStats.log();
+    dumpLockStats();
+    checkFramePathAllocations();
+    stopFrameProvider();
     mBufferManager.reset();
+    mWaitingForFrame = false;
+    mPhaseHoldUntil = {};
     memset(&mCommit, 0, sizeof(mCommit));
     memset(&mProbe, 0, sizeof(mProbe));
     memset(&mV4l2Format, 0, sizeof(mV4l2Format));
     mFps = 0;
+    startEncoderCalibration();
+}
+
+void UVCProvider::UVCDevice::StartupStats::onStreamOn() {
+    *this = {};
+    streamOnTime = std::chrono::steady_clock::now();
+}
+
+void UVCProvider::UVCDevice::StartupStats::onFrameQueued(uint32_t fps) {
+    if (framesQueued >= kStartupFrames) {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (framesQueued == 0) {
+        timeToFirstFrameUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                                     now - streamOnTime).count();
+    } else {
+        double intervalUs =
+                std::chrono::duration_cast<std::chrono::microseconds>(now - lastQueueTime).count();
+        intervalSumUs += intervalUs;
+        intervalSquareSumUs += intervalUs * intervalUs;
+        maxIntervalUs = std::max(maxIntervalUs, intervalUs);
+    }
+    lastQueueTime = now;
+    framesQueued++;
+    if (framesQueued == kStartupFrames) {
+        // Jitter: standard deviation of the frame intervals over the first kStartupFrames frames.
+        double n = kStartupFrames - 1;
+        double mean = intervalSumUs / n;
+        double jitter = std::sqrt(std::max(0.0, intervalSquareSumUs / n - mean * mean));
+        ALOGI("Stream startup: resident buffers %d, time to first frame %" PRId64
+              "us, first %u frames: mean interval %.0fus (expected %uus) jitter %.0fus max "
+              "%.0fus",
+              residentBuffersEnabled(), timeToFirstFrameUs, kStartupFrames, mean,
+              fps == 0 ? 0 : 1'000'000 / fps, jitter, maxIntervalUs);
+    }
+}
+
+void UVCProvider::UVCDevice::RateStats::onFrameQueued(uint32_t fps) {
+    auto now = std::chrono::steady_clock::now();
+    if (framesQueued == 0) {
+        firstQueueTime = now;
+    } else if (fps != 0 && std::chrono::duration<double>(now - lastQueueTime).count() * fps >=
+                                   kLateIntervals) {
+        lateIntervals++;
+    }
+    lastQueueTime = now;
+    framesQueued++;
+}
+
+double UVCProvider::UVCDevice::RateStats::getMeasuredFps() const {
+    double seconds = std::chrono::duration<double>(lastQueueTime - firstQueueTime).count();
+    return framesQueued < 2 || seconds <= 0 ? 0.0 : (framesQueued - 1) / seconds;
+}
+
+void UVCProvider::UVCDevice::RateStats::log(uint32_t fps) const {
+    if (framesQueued < 2) {
+        return;
+    }
+    double seconds = std::chrono::duration<double>(lastQueueTime - firstQueueTime).count();
+    ALOGI("Stream rate: %" PRIu64 " frames in %.1fs, %.1f fps (negotiated %u), %" PRIu64
+          " intervals over %.1f frame intervals (%.1f%%)",
+          framesQueued, seconds, (framesQueued - 1) / seconds, fps, lateIntervals, kLateIntervals,
+          100.0 * lateIntervals / (framesQueued - 1));
 }
 
 void UVCProvider::UVCDevice::processStreamOnEvent() {
+    mStartupStats.onStreamOn();
+    mRateStats = {};
+    mGadgetStats = {};
+    onFramePathStreamOn();
+    // The previous stream's Encoder must be gone before the next one takes over the encoder arena,
+    // and so must the calibrator's.
+    stopFrameProvider();
+    mEncoderCalibrator->stop();
+    applyEncoderProfile();
     // Allocate V4L2 and map buffers for circulation between camera and UVCDevice
-    mBufferManager = std::make_shared<BufferManager>(this);
-    CameraConfig config;
-    config.width = mV4l2Format.fmt.pix.width;
-    config.height = mV4l2Format.fmt.pix.height;
-    config.fcc = mV4l2Format.fmt.pix.pixelformat;
-    config.fps = mFps;
-
-    mFrameProvider = std::make_shared<SdkFrameProvider>(mBufferManager, config);
-    mFrameProvider->setStreamConfig();
-    mFrameProvider->startStreaming();
+    mBufferManager =
+            std::make_shared<V4L2BufferManager>(this, getStreamDeliveryPolicy().policy);
+    mBufferManager->setConsumerWakeFd(mFrameReadyFd.get());
+    mWaitingForFrame = false;
+    mPhaseHoldUntil = {};
+    FlightRecorder::getInstance().record(FrameEvent::STREAM_ON, /*bufferIndex*/ -1, mFps);
+    startFrameProvider();
+    mThermalController->start();
+    mStallWatchdog.start(mFps, std::chrono::steady_clock::now());
 
     // Queue first buffer to start the stream
-    if (getFrameAndQueueBufferToGadgetDriver(true) != Status::OK) {
+    if (getFrameAndQueueBufferToGadgetDriver(getFrameWaitTimeout(), /*firstBuffer*/ true) !=
+        Status::OK) {
         ALOGE("%s: Queueing first buffer to gadget driver failed, stream not started",
               __FUNCTION__);
         return;
@@ -750,6 +1222,9 @@ UVCProvider::~UVCProvider() {
         if (mUVCDevice->getINotifyFd() >= 0) {
             mEpollW.remove(mUVCDevice->getINotifyFd());
         }
+        if (mUVCDevice->getFrameReadyFd() >= 0) {
+            mEpollW.remove(mUVCDevice->getFrameReadyFd());
+        }
     }
     mUVCDevice = nullptr;
 }
@@ -769,16 +1244,29 @@ void UVCProvider::UVCDevice::processStreamEvent() {
         ALOGE("%s: VIDIOC_DQBUF failed %s", __FUNCTION__, strerror(errno));
         return;
     }
+    mGadgetStats.onReturned(v4L2Buffer, std::chrono::steady_clock::now());
+    bool error = (v4L2Buffer.flags & V4L2_BUF_FLAG_ERROR) != 0;
+    FlightRecorder::getInstance().record(error ? FrameEvent::USB_ERROR : FrameEvent::RETURNED,
+                                         v4L2Buffer.index, v4L2Buffer.sequence);
+    // Holding on for a fresher frame leaves the gadget driver without a buffer, so put the pickup
+    // off rather than wait for it here: the UVC thread keeps serving events meanwhile.
+    std::chrono::nanoseconds hold = mBufferManager->getPhaseHold();
+    if (hold.count() > 0) {
+        mPhaseHoldUntil = std::chrono::steady_clock::now() + hold;
+        return;
+    }
     // Get camera frame and queue it to gadget driver
-    if (getFrameAndQueueBufferToGadgetDriver() != Status::OK) {
+    if (getFrameAndQueueBufferToGadgetDriver(getFrameWaitTimeout()) != Status::OK) {
         return;
     }
 }
 Status UVCProvider::UVCDevice::encodeImage(AHardwareBuffer* buffer, long timestamp, int rotation) {
+    std::lock_guard<InstrumentedMutex> l(mFrameProviderLock);
     if (mFrameProvider == nullptr) {
         ALOGE("%s: encodeImage called but there is no frame provider active", __FUNCTION__);
         return Status::ERROR;
     }
+    FlightRecorder::getInstance().record(FrameEvent::CAMERA_FRAME, /*bufferIndex*/ -1, timestamp);
     return mFrameProvider->encodeImage(buffer, timestamp, rotation);
 }
 
@@ -837,19 +1325,33 @@ void UVCProvider::ListenToUVCFds() {
     ALOGI("%s Start to listen to device fd %d and inotify_fd %d", __FUNCTION__,
           mUVCDevice->getUVCFd(), mUVCDevice->getINotifyFd());
 
+    trackFramePathAllocations("uvc");
     // Listen to inotify events for node removal
     mEpollW.add(mUVCDevice->getINotifyFd(), EPOLLIN);
     // Listen to V4L2 events
     mEpollW.add(mUVCDevice->getUVCFd(), EPOLLPRI);
+    // Frames filled while the gadget driver has none
+    mEpollW.add(mUVCDevice->getFrameReadyFd(), EPOLLIN);
+    if (mControlSocket != nullptr) {
+        mEpollW.add(mControlSocket->getFd(), EPOLLIN);
+    }
     // For stream events : dequeue and queue buffers
+    Events events;
+    events.reserve(MAX_EVENTS);
     while (mListenToUVCFds) {
-        Events events = mEpollW.waitForEvents();
+        mEpollW.waitForEvents(&events, mUVCDevice != nullptr ? mUVCDevice->getTickTimeout()
+                                                              : kTickInterval);
         for (auto event : events) {
             if (mUVCDevice->getINotifyFd() == event.data.fd && (event.events & EPOLLIN)) {
                 // File system event on the V4L2 node
                 if (processINotifyEvent()) {
                     break; // Stop handling current events if the service was stopped.
                 }
+            } else if (mUVCDevice->getFrameReadyFd() == event.data.fd) {
+                mUVCDevice->processFrameReadyEvent();
+            } else if (mControlSocket != nullptr && mControlSocket->getFd() == event.data.fd) {
+                // Between frames, like everything else on this thread.
+                mControlSocket->processEvents();
             } else {
                 // V4L2 event
                 // Priority event might come with regular events, so one event could have both
@@ -868,6 +1370,11 @@ void UVCProvider::ListenToUVCFds() {
                 }
             }
         }
+        // epoll_wait times out at least every kTickInterval, so this runs even if the stream has
+        // stalled. Starved pickups don't wait for it, mFrameReadyFd wakes the loop.
+        if (mUVCDevice != nullptr) {
+            mUVCDevice->onTick();
+        }
     }
 }
 
@@ -907,9 +1414,36 @@ int UVCProvider::encodeImage(AHardwareBuffer* buffer, long timestamp, int rotati
         ALOGE("%s: Request to encode Image without UVCDevice Running.", __FUNCTION__);
         return -1;
     }
+    // Called on the camera's image reader thread.
+    trackFramePathAllocations("camera");
     return mUVCDevice->encodeImage(buffer, timestamp, rotation) == Status::OK ? 0 : -1;
 }
 
+bool UVCProvider::getDeliveryPolicy(DeliveryPolicy* policy) {
+    return mUVCDevice != nullptr && mUVCDevice->getDeliveryPolicy(policy);
+}
+
+bool UVCProvider::setDeliveryPolicy(const DeliveryPolicy& policy) {
+    return mUVCDevice != nullptr && mUVCDevice->setDeliveryPolicy(policy);
+}
+
+void UVCProvider::resetDeliveryPolicy() {
+    if (mUVCDevice != nullptr) {
+        mUVCDevice->resetDeliveryPolicy();
+    }
+}
+
+void UVCProvider::dumpStats(std::string* out) {
+    if (mUVCDevice == nullptr) {
+        *out += "streaming false\n";
+    } else {
+        mUVCDevice->dumpStats(out);
+    }
+    // Process wide, a soak test checks that it drops back to 0 between streams.
+    android::base::StringAppendF(out, "camera_buffers_held %u\n",
+                                 SdkFrameProvider::getHeldHardwareBufferCount());
+}
+
 void UVCProvider::startUVCListenerThread() {
     mListenToUVCFds = true;
     mUVCListenerThread =
@@ -925,17 +1459,25 @@ void UVCProvider::stopAndWaitForUVCListenerThread() {
     }
 }
 
-Status UVCProvider::startService(const std::unordered_set<std::string>& ignoredNodes) {
+Status UVCProvider::startService(const std::unordered_set<std::string>& ignoredNodes,
+                                 uint32_t maxCameraFps) {
     // Resets old state for epoll since this is a new start for the service.
     mEpollW.init();
     if (mUVCDevice != nullptr) {
         mUVCDevice->closeUVCFd();
     }
-    mUVCDevice = std::make_shared<UVCDevice>(shared_from_this(), ignoredNodes);
+    mUVCDevice = std::make_shared<UVCDevice>(shared_from_this(), ignoredNodes, maxCameraFps);
     if (!mUVCDevice->isInited()) {
         return Status::ERROR;
     }
     stopAndWaitForUVCListenerThread();  // Just in case it is already running
+    // Kept across service restarts, the socket name stays bound while it's open.
+    if (mControlSocket == nullptr && ControlSocket::isEnabled()) {
+        mControlSocket = std::make_unique<ControlSocket>(this);
+        if (mControlSocket->init() != Status::OK) {
+            mControlSocket.reset();
+        }
+    }
     startUVCListenerThread();
     return Status::OK;
 }
@@ -945,6 +1487,7 @@ void UVCProvider::stopService() {
     mUVCDevice->processStreamOffEvent();
     mEpollW.remove(mUVCDevice->getUVCFd());
     mEpollW.remove(mUVCDevice->getINotifyFd());
+    mEpollW.remove(mUVCDevice->getFrameReadyFd());
     // Signal the service to stop.
     // UVC Provider will get destructed when the Java Service is destroyed.
     DeviceAsWebcamServiceManager::kInstance->stopService();
@@ -17,14 +17,26 @@
 #pragma once
 
 #include <Buffer.h>
+#include <ControlSocket.h>
 #include <DeviceAsWebcamServiceManager.h>
+#include <EncoderArena.h>
+#include <EncoderCalibrator.h>
 #include <FrameProvider.h>
+#include <GadgetStats.h>
+#include <InstrumentedMutex.h>
+#include <StallWatchdog.h>
+#include <TelemetryUnit.h>
+#include <ThermalController.h>
 #include <Utils.h>
 #include <android-base/unique_fd.h>
 #include <android/hardware_buffer.h>
 #include <linux/usb/g_uvc.h>
 #include <linux/usb/video.h>
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
 #include <thread>
 #include <vector>
 #include <unordered_set>
@@ -42,7 +54,9 @@ class EpollW {
     Status add(int fd, uint32_t events);
     Status modify(int fd, uint32_t events);
     Status remove(int fd);
-    Events waitForEvents();
+    // Replaces the contents of events with the ready events, waiting up to timeout for them.
+    // Doesn't allocate once events has room for MAX_EVENTS.
+    void waitForEvents(Events* events, std::chrono::milliseconds timeout);
 
   private:
     unique_fd mEpollFd;
@@ -94,7 +108,8 @@ struct FormatTriplet {
 };
 
 // This class manages all things related to UVC event handling.
-class UVCProvider : public std::enable_shared_from_this<UVCProvider> {
+class UVCProvider : public std::enable_shared_from_this<UVCProvider>,
+                    public ControlSocket::Listener {
   public:
     static std::string getVideoNode(const std::unordered_set<std::string>& ignoredNodes);
 
@@ -102,8 +117,10 @@ class UVCProvider : public std::enable_shared_from_this<UVCProvider> {
     ~UVCProvider();
 
     Status init();
-    // Start listening for UVC events
-    Status startService(const std::unordered_set<std::string>& ignoredNodes);
+    // Start listening for UVC events. maxCameraFps is the camera's fastest rate in a regular
+    // capture session, faster ones aren't negotiated with the host. 0 if unknown.
+    Status startService(const std::unordered_set<std::string>& ignoredNodes,
+                        uint32_t maxCameraFps);
 
     void stopService();
 
@@ -115,15 +132,16 @@ class UVCProvider : public std::enable_shared_from_this<UVCProvider> {
     // Created after a UVC_SETUP event has been received and processed by UVCProvider
     // This class manages stream related events UVC_STREAMON / STREAMOFF and queries by the host
     // for probing and committing controls.
-    class UVCDevice : public BufferCreatorAndDestroyer {
+    class UVCDevice : public BufferCreatorAndDestroyer<V4L2Buffer>, public TelemetryUnit::Listener {
       public:
-        explicit UVCDevice(std::weak_ptr<UVCProvider> parent,
-                           const std::unordered_set<std::string>& ignoredNodes);
+        UVCDevice(std::weak_ptr<UVCProvider> parent,
+                  const std::unordered_set<std::string>& ignoredNodes, uint32_t maxCameraFps);
         ~UVCDevice() override = default;
         void closeUVCFd();
         [[nodiscard]] bool isInited() const;
         int getUVCFd() { return mUVCFd.get(); }
         int getINotifyFd() { return mINotifyFd.get(); }
+        int getFrameReadyFd() { return mFrameReadyFd.get(); }
         const char* getCurrentVideoNode() { return mVideoNode.c_str(); }
         void processSetupEvent(const struct usb_ctrlrequest* request,
                                struct uvc_request_data* response);
@@ -138,47 +156,158 @@ class UVCProvider : public std::enable_shared_from_this<UVCProvider> {
         void processStreamOnEvent();
         void processStreamOffEvent();
         void processStreamEvent();
+        // Called by the UVC thread on every pass of its event loop: hands the gadget driver a
+        // frame if it ran out of them, and recovers from frame path stalls.
+        void onTick();
+        // How long the UVC thread may wait for events before onTick is due.
+        [[nodiscard]] std::chrono::milliseconds getTickTimeout() const;
+        // mFrameReadyFd fired: a frame was filled while the gadget driver had none.
+        void processFrameReadyEvent();
         Status encodeImage(AHardwareBuffer* buffer, long timestamp, int rotation);
 
+        // For the ControlSocket, see ControlSocket::Listener.
+        bool getDeliveryPolicy(DeliveryPolicy* policy);
+        bool setDeliveryPolicy(const DeliveryPolicy& policy);
+        void resetDeliveryPolicy();
+        void dumpStats(std::string* out);
+
+        // TelemetryUnit::Listener overrides
+        void getStreamTelemetry(TelemetryStats* stats) override;
+
         // BufferCreatorAndDestroyer overrides
-        Status allocateAndMapBuffers(
-                std::shared_ptr<Buffer>* consumerBuffer,
-                std::vector<std::shared_ptr<Buffer>>* producerBuffers) override;
-        void destroyBuffers(std::shared_ptr<Buffer>& consumerBuffer,
-                            std::vector<std::shared_ptr<Buffer>>& producerBuffers) override;
+        Status allocateAndMapBuffers(V4L2Buffer* consumerBuffer,
+                                     std::vector<V4L2Buffer>* producerBuffers) override;
+        void destroyBuffers(V4L2Buffer& consumerBuffer,
+                            std::vector<V4L2Buffer>& producerBuffers) override;
 
       private:
         std::shared_ptr<UVCProperties> parseUvcProperties();
         std::vector<ConfigFormat> getFormats();
+        void createEncoderArena();
+        // Calibrates the advertised stream configurations that have no encoder profile yet, in
+        // the background until the next STREAMON.
+        void startEncoderCalibration();
+        // Sets the encoder defaults from the profile of the committed stream configuration.
+        void applyEncoderProfile();
 
         void getFrameIntervals(ConfigFrame* frame, ConfigFormat* format);
         void getFormatFrames(ConfigFormat* format);
+        // Appends a frame of the given size, with its intervals, to format.
+        void addFormatFrame(uint32_t width, uint32_t height, ConfigFormat* format);
 
         Status openV4L2DeviceAndSubscribe(const std::string& videoNode);
         void setStreamingControl(struct uvc_streaming_control* streamingControl,
                                  const FormatTriplet* req);
         void commitControls();
 
-        std::shared_ptr<Buffer> mapBuffer(uint32_t i);
-        static Status unmapBuffer(std::shared_ptr<Buffer>& buffer);
-
-        Status getFrameAndQueueBufferToGadgetDriver(bool firstBuffer = false);
+        Status mapBuffer(uint32_t i, V4L2Buffer* buffer);
+        static Status unmapBuffer(V4L2Buffer& buffer);
+
+        // Waits up to waitTimeout for a filled buffer. If there is none the gadget driver is left
+        // without frames until onTick finds one.
+        Status getFrameAndQueueBufferToGadgetDriver(std::chrono::milliseconds waitTimeout,
+                                                    bool firstBuffer = false);
+        [[nodiscard]] std::chrono::milliseconds getFrameWaitTimeout() const;
+
+        // Delivery policy of one stream configuration: format, frame size and rate.
+        struct StreamDeliveryPolicy {
+            uint32_t fcc = 0;
+            uint32_t width = 0;
+            uint32_t height = 0;
+            uint32_t fps = 0;
+            DeliveryPolicy policy;
+        };
+        // The committed stream configuration's entry of mDeliveryPolicies, added with
+        // mDefaultDeliveryPolicy if it has none yet.
+        StreamDeliveryPolicy& getStreamDeliveryPolicy();
+
+        // Creates the frame provider for the committed format and starts the camera stream.
+        void startFrameProvider();
+        void stopFrameProvider();
+        // Lets a pull mode frame provider convert the frame for the next pickup.
+        void requestFrame();
+        // Dumps the flight recorder and, unless the gadget driver is the one stuck, restarts the
+        // camera stream without touching the USB side.
+        void recoverFromStall(StallSource source);
+
+        // Time to first frame and frame interval jitter right after STREAMON, logged once per
+        // stream. Used to judge the effect of resident buffers.
+        struct StartupStats {
+            static constexpr uint32_t kStartupFrames = 30;
+            std::chrono::steady_clock::time_point streamOnTime;
+            std::chrono::steady_clock::time_point lastQueueTime;
+            uint32_t framesQueued = 0;
+            int64_t timeToFirstFrameUs = 0;
+            double intervalSumUs = 0;
+            double intervalSquareSumUs = 0;
+            double maxIntervalUs = 0;
+
+            void onStreamOn();
+            void onFrameQueued(uint32_t fps);
+        };
+
+        // Frame rate delivered to the gadget driver over a whole stream, logged at STREAMOFF to
+        // check that the negotiated rate is sustained.
+        struct RateStats {
+            // Intervals this many frame intervals long or longer count as late.
+            static constexpr double kLateIntervals = 1.5;
+            std::chrono::steady_clock::time_point firstQueueTime;
+            std::chrono::steady_clock::time_point lastQueueTime;
+            uint64_t framesQueued = 0;
+            uint64_t lateIntervals = 0;
+
+            void onFrameQueued(uint32_t fps);
+            [[nodiscard]] double getMeasuredFps() const;
+            void log(uint32_t fps) const;
+        };
 
         struct uvc_streaming_control mProbe {};
         struct uvc_streaming_control mCommit {};
         uint8_t mCurrentControlState = UVC_VS_CONTROL_UNDEFINED;
+        // Null unless TelemetryUnit::kUnitIdProperty is set.
+        std::unique_ptr<TelemetryUnit> mTelemetryUnit;
+        // The data stage of the last setup request goes to mTelemetryUnit.
+        bool mTelemetryDataPending = false;
         std::weak_ptr<UVCProvider> mParent;
         std::shared_ptr<UVCProperties> mUVCProperties;
-        std::shared_ptr<BufferManager> mBufferManager;
-        std::shared_ptr<FrameProvider> mFrameProvider;
+        std::shared_ptr<V4L2BufferManager> mBufferManager;
+        // Java calls encodeImage on its own thread, the UVC thread replaces the frame provider.
+        InstrumentedMutex mFrameProviderLock{"UVCDevice::mFrameProviderLock"};
+        std::shared_ptr<FrameProvider> mFrameProvider;  // guarded by mFrameProviderLock
+        // Sized for the largest advertised frame and shared by all streams of this device.
+        std::shared_ptr<EncoderArena> mEncoderArena;
+        // Degrades the frame path while streaming if the device heats up.
+        std::unique_ptr<ThermalController> mThermalController;
+        // Uses mEncoderArena, so it only runs while not streaming.
+        std::unique_ptr<EncoderCalibrator> mEncoderCalibrator;
+        // Cpus of the committed stream's encoder profile, 0 for no restriction.
+        uint64_t mEncoderCpuMask = 0;
+        // Read from the properties once, what every stream configuration starts with.
+        DeliveryPolicy mDefaultDeliveryPolicy;
+        // One entry per stream configuration that streamed. A policy set through the ControlSocket
+        // stays with the configuration it was set for, across STREAMON.
+        std::vector<StreamDeliveryPolicy> mDeliveryPolicies;
 
         unique_fd mUVCFd;
         unique_fd mINotifyFd;
+        // eventfd mBufferManager signals when it gets a frame while mWaitingForFrame.
+        unique_fd mFrameReadyFd;
 
         // Path to /dev/video*, this is the node we open up and poll the fd for uvc / v4l2 events.
         std::string mVideoNode;
         struct v4l2_format mV4l2Format {};
         uint32_t mFps = 0;
+        // See startService, caps the frame intervals of every format.
+        uint32_t mMaxCameraFps = 0;
+        StartupStats mStartupStats;
+        RateStats mRateStats;
+        GadgetStats mGadgetStats;
+        StallWatchdog mStallWatchdog;
+        // The gadget driver has no buffer queued, waiting on the frame path.
+        bool mWaitingForFrame = false;
+        // Pickup put off by phase alignment (see BufferManager::getPhaseHold), onTick picks up
+        // once this time has passed. Default constructed when there is none.
+        std::chrono::steady_clock::time_point mPhaseHoldUntil;
         bool mInited = false;
     };
 
@@ -190,10 +319,18 @@ class UVCProvider : public std::enable_shared_from_this<UVCProvider> {
     // returns true if service is stopped. false otherwise.
     bool processINotifyEvent();
 
+    // ControlSocket::Listener overrides, called on the UVC thread.
+    bool getDeliveryPolicy(DeliveryPolicy* policy) override;
+    bool setDeliveryPolicy(const DeliveryPolicy& policy) override;
+    void resetDeliveryPolicy() override;
+    void dumpStats(std::string* out) override;
+
     std::shared_ptr<UVCDevice> mUVCDevice;
     std::thread mUVCListenerThread;
     volatile bool mListenToUVCFds = true;
     EpollW mEpollW;
+    // Served by the UVC thread, null unless ControlSocket::kEnableProperty is set.
+    std::unique_ptr<ControlSocket> mControlSocket;
 };
 
 }  // namespace webcam
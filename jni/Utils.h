@@ -18,6 +18,10 @@
  *  Manage the remote camera service native functions.
  */
 #pragma once
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+
 namespace android {
 namespace webcam {
 
@@ -26,5 +30,47 @@ enum Status {
     ERROR = 1,
 };
 
+// Streams at this frame rate and above count as high frame rate: the frame interval is short
+// enough that they get deeper buffering, a larger encode budget and a stall timeout floor. They
+// still run in a regular capture session, UVCDevice only negotiates rates the camera offers in
+// one.
+constexpr uint32_t kHighFrameRate = 60;
+
+// CPU time consumed so far by the calling thread.
+inline uint64_t getThreadCpuTimeNs() {
+    struct timespec ts {};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+}
+
+// Restricts the calling thread to the cpus set in cpuMask, one bit per cpu. errno is set on
+// failure.
+inline bool setThreadCpuMask(uint64_t cpuMask) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (uint32_t cpu = 0; cpu < 64; cpu++) {
+        if ((cpuMask >> cpu) & 1) {
+            CPU_SET(cpu, &cpus);
+        }
+    }
+    return sched_setaffinity(/*pid*/ 0, sizeof(cpus), &cpus) == 0;
+}
+
+// Cpus the calling thread may run on, 0 if unknown.
+inline uint64_t getThreadCpuMask() {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (sched_getaffinity(/*pid*/ 0, sizeof(cpus), &cpus) != 0) {
+        return 0;
+    }
+    uint64_t cpuMask = 0;
+    for (uint32_t cpu = 0; cpu < 64; cpu++) {
+        if (CPU_ISSET(cpu, &cpus)) {
+            cpuMask |= uint64_t{1} << cpu;
+        }
+    }
+    return cpuMask;
+}
+
 }  // namespace webcam
 }  // namespace android
@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <linux/videodev2.h>
+#include <math.h>
+#include <stdint.h>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include "AllocationCheck.h"
+#include "Encoder.h"
+
+// Built with WEBCAM_ALLOCATION_CHECK only, see libjni_deviceAsWebcam_allocation_check_tests.
+
+namespace android {
+namespace webcam {
+namespace {
+
+constexpr uint32_t kWidth = 640;
+constexpr uint32_t kHeight = 480;
+// Frames encoded after warm-up.
+constexpr uint32_t kCheckedFrames = 30;
+
+// Camera frame in the layouts the Encoder takes.
+class TestFrame {
+  public:
+    TestFrame()
+        : mPlanar(kWidth * kHeight * 3 / 2),
+          mSemiPlanar(mPlanar.size()),
+          mRgba(kWidth * kHeight * 4) {
+        for (uint32_t y = 0; y < kHeight; y++) {
+            for (uint32_t x = 0; x < kWidth; x++) {
+                uint8_t luma = static_cast<uint8_t>(128 + 60 * sin(x / 37.0) + 50 * cos(y / 23.0));
+                mPlanar[y * kWidth + x] = luma;
+                mSemiPlanar[y * kWidth + x] = luma;
+                uint8_t* rgba = &mRgba[(y * kWidth + x) * 4];
+                rgba[0] = luma;
+                rgba[1] = static_cast<uint8_t>(x);
+                rgba[2] = static_cast<uint8_t>(y);
+                rgba[3] = 255;
+            }
+        }
+        size_t lumaSize = kWidth * kHeight;
+        size_t chromaSize = lumaSize / 4;
+        for (size_t i = 0; i < chromaSize; i++) {
+            uint8_t u = static_cast<uint8_t>(128 + 40 * sin(i / 50.0));
+            uint8_t v = static_cast<uint8_t>(128 + 40 * cos(i / 70.0));
+            mPlanar[lumaSize + i] = u;
+            mPlanar[lumaSize + chromaSize + i] = v;
+            mSemiPlanar[lumaSize + 2 * i] = u;
+            mSemiPlanar[lumaSize + 2 * i + 1] = v;
+        }
+    }
+
+    HardwareBufferDesc getPlanarDesc() {
+        YuvHardwareBufferDesc yuv;
+        yuv.yData = mPlanar.data();
+        yuv.yDataLength = kWidth * kHeight;
+        yuv.yRowStride = kWidth;
+        yuv.uData = yuv.yData + yuv.yDataLength;
+        yuv.vData = yuv.uData + yuv.yDataLength / 4;
+        yuv.uDataLength = yuv.vDataLength = yuv.yDataLength / 4;
+        yuv.uRowStride = yuv.vRowStride = kWidth / 2;
+        yuv.uvPixelStride = 1;
+        return makeDesc(AHARDWAREBUFFER_FORMAT_Y8Cb8Cr8_420, yuv);
+    }
+
+    HardwareBufferDesc getSemiPlanarDesc() {
+        YuvHardwareBufferDesc yuv;
+        yuv.yData = mSemiPlanar.data();
+        yuv.yDataLength = kWidth * kHeight;
+        yuv.yRowStride = kWidth;
+        yuv.uData = yuv.yData + yuv.yDataLength;
+        yuv.vData = yuv.uData + 1;
+        yuv.uDataLength = yuv.vDataLength = yuv.yDataLength / 2 - 1;
+        yuv.uRowStride = yuv.vRowStride = kWidth;
+        yuv.uvPixelStride = 2;
+        return makeDesc(AHARDWAREBUFFER_FORMAT_Y8Cb8Cr8_420, yuv);
+    }
+
+    HardwareBufferDesc getRgbaDesc() {
+        ARGBHardwareBufferDesc argb;
+        argb.buf = mRgba.data();
+        argb.rowStride = kWidth * 4;
+        return makeDesc(AHARDWAREBUFFER_FORMAT_R8G8B8A8_UNORM, argb);
+    }
+
+  private:
+    template <typename T>
+    static HardwareBufferDesc makeDesc(uint32_t format, const T& bufferDesc) {
+        HardwareBufferDesc ret;
+        ret.width = kWidth;
+        ret.height = kHeight;
+        ret.format = format;
+        ret.bufferDesc = bufferDesc;
+        return ret;
+    }
+
+    std::vector<uint8_t> mPlanar;
+    std::vector<uint8_t> mSemiPlanar;
+    std::vector<uint8_t> mRgba;
+};
+
+// The test thread stands in for the encoder stage thread.
+class AllocationCheckTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        trackFramePathAllocations("test");
+        onFramePathStreamOn();
+        mDstMem.resize(kWidth * kHeight * 2);
+        struct v4l2_buffer desc {};
+        desc.length = mDstMem.size();
+        mDst = V4L2Buffer(mDstMem.data(), &desc);
+    }
+
+    // Resets the counts, so that allocations don't leak into the next test.
+    void TearDown() override { onFramePathStreamOn(); }
+
+    // Streams src through encoder, warm-up first. Returns the allocations counted after it.
+    uint64_t stream(Encoder& encoder, HardwareBufferDesc src, uint32_t rotation) {
+        for (uint32_t i = 0; i < kAllocationCheckWarmupFrames + kCheckedFrames; i++) {
+            EncodeRequest request(src, &mDst, rotation);
+            EXPECT_TRUE(encoder.process(request)) << i;
+            onFramePathFrameDelivered();
+        }
+        return getFramePathAllocations();
+    }
+
+    static CameraConfig makeConfig(uint32_t fcc) {
+        CameraConfig config;
+        config.width = kWidth;
+        config.height = kHeight;
+        config.fps = 30;
+        config.fcc = fcc;
+        return config;
+    }
+
+    TestFrame mFrame;
+    std::vector<uint8_t> mDstMem;
+    V4L2Buffer mDst;
+};
+
+TEST_F(AllocationCheckTest, CountsAllocationsAfterWarmUpOnly) {
+    ::operator delete(::operator new(64));
+    for (uint32_t i = 0; i < kAllocationCheckWarmupFrames; i++) {
+        onFramePathFrameDelivered();
+    }
+    EXPECT_EQ(getFramePathAllocations(), 0u);
+    ::operator delete(::operator new(64));
+    EXPECT_EQ(getFramePathAllocations(), 1u);
+    {
+        ScopedFramePathAllocationsAllowed allowed;
+        ::operator delete(::operator new(64));
+    }
+    EXPECT_EQ(getFramePathAllocations(), 1u);
+}
+
+TEST_F(AllocationCheckTest, MjpegFromSemiPlanar) {
+    CameraConfig config = makeConfig(V4L2_PIX_FMT_MJPEG);
+    Encoder encoder(config, EncoderArena::create(kWidth, kHeight));
+    ASSERT_TRUE(encoder.isInited());
+    EXPECT_EQ(stream(encoder, mFrame.getSemiPlanarDesc(), /*rotation*/ 0), 0u);
+}
+
+TEST_F(AllocationCheckTest, MjpegRotated) {
+    CameraConfig config = makeConfig(V4L2_PIX_FMT_MJPEG);
+    Encoder encoder(config, EncoderArena::create(kWidth, kHeight));
+    ASSERT_TRUE(encoder.isInited());
+    EXPECT_EQ(stream(encoder, mFrame.getSemiPlanarDesc(), /*rotation*/ 180), 0u);
+}
+
+TEST_F(AllocationCheckTest, MjpegWithOptimizedHuffmanTables) {
+    CameraConfig config = makeConfig(V4L2_PIX_FMT_MJPEG);
+    config.optimizeHuffmanTables = true;
+    Encoder encoder(config, EncoderArena::create(kWidth, kHeight));
+    ASSERT_TRUE(encoder.isInited());
+    EXPECT_EQ(stream(encoder, mFrame.getPlanarDesc(), /*rotation*/ 0), 0u);
+}
+
+TEST_F(AllocationCheckTest, YuyvFromPlanar) {
+    CameraConfig config = makeConfig(V4L2_PIX_FMT_YUYV);
+    Encoder encoder(config, EncoderArena::create(kWidth, kHeight));
+    ASSERT_TRUE(encoder.isInited());
+    EXPECT_EQ(stream(encoder, mFrame.getPlanarDesc(), /*rotation*/ 0), 0u);
+}
+
+TEST_F(AllocationCheckTest, YuyvFromRgba) {
+    CameraConfig config = makeConfig(V4L2_PIX_FMT_YUYV);
+    Encoder encoder(config, EncoderArena::create(kWidth, kHeight));
+    ASSERT_TRUE(encoder.isInited());
+    EXPECT_EQ(stream(encoder, mFrame.getRgbaDesc(), /*rotation*/ 0), 0u);
+}
+
+}  // anonymous namespace
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <gtest/gtest.h>
+
+#include <libyuv/rotate.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "BandWorkers.h"
+#include "Utils.h"
+
+namespace android {
+namespace webcam {
+namespace {
+
+using Band = std::pair<uint32_t, uint32_t>;
+
+// Runs a conversion that only records its bands, returns them sorted.
+std::vector<Band> runBands(BandWorkers* workers, uint32_t rows, uint32_t bandCount,
+                           BandUsage* usage) {
+    std::mutex lock;
+    std::vector<Band> bands;
+    auto convert = [&](uint32_t begin, uint32_t end) {
+        std::lock_guard<std::mutex> l(lock);
+        bands.emplace_back(begin, end);
+        return true;
+    };
+    EXPECT_TRUE(workers->run(rows, bandCount, /*cpuMask*/ 0, convert, usage));
+    std::sort(bands.begin(), bands.end());
+    return bands;
+}
+
+TEST(BandWorkersTest, BandsCoverEveryRowOnce) {
+    BandWorkers workers(BandWorkers::kMaxWorkers, /*perfCounters*/ false);
+    ASSERT_EQ(workers.getMaxWorkers(), BandWorkers::kMaxWorkers);
+    for (uint32_t rows : {2u, 6u, 14u, 100u, 720u, 1080u, 2160u}) {
+        for (uint32_t bandCount = 1; bandCount <= BandWorkers::kMaxWorkers + 1; bandCount++) {
+            BandUsage usage;
+            std::vector<Band> bands = runBands(&workers, rows, bandCount, &usage);
+            ASSERT_FALSE(bands.empty());
+            EXPECT_LE(bands.size(), std::min(bandCount, BandWorkers::kMaxWorkers));
+            EXPECT_EQ(usage.bands, bands.size() - 1) << rows << " rows, " << bandCount;
+            uint32_t next = 0;
+            for (const Band& band : bands) {
+                // Bands start on a chroma row, without gaps or overlaps.
+                EXPECT_EQ(band.first, next) << rows << " rows, " << bandCount;
+                EXPECT_EQ(band.first % 2, 0u);
+                EXPECT_LT(band.first, band.second);
+                next = band.second;
+            }
+            EXPECT_EQ(next, rows) << rows << " rows, " << bandCount;
+        }
+    }
+}
+
+TEST(BandWorkersTest, FailsIfAnyBandFails) {
+    BandWorkers workers(4, /*perfCounters*/ false);
+    BandUsage usage;
+    for (uint32_t failing = 0; failing < 4; failing++) {
+        auto convert = [failing](uint32_t begin, uint32_t /*end*/) {
+            return begin / 100 != failing;
+        };
+        EXPECT_FALSE(workers.run(400, 4, /*cpuMask*/ 0, convert, &usage)) << failing;
+    }
+    // And succeeds again afterwards.
+    auto convert = [](uint32_t /*begin*/, uint32_t /*end*/) { return true; };
+    EXPECT_TRUE(workers.run(400, 4, /*cpuMask*/ 0, convert, &usage));
+    EXPECT_EQ(usage.bands, 5u * 3);
+}
+
+// Rotated by 180 degrees, as the Encoder does it: each band lands at the mirrored rows of the
+// output. The result must match rotating the whole image at once.
+TEST(BandWorkersTest, MirroredBandsMatchAWholeRotation) {
+    constexpr uint32_t kWidth = 64;
+    constexpr uint32_t kChromaWidth = kWidth / 2;
+    BandWorkers workers(BandWorkers::kMaxWorkers, /*perfCounters*/ false);
+    // Heights whose bands are rounded up to even rows, leaving a shorter last band.
+    for (uint32_t height : {40u, 98u, 102u}) {
+        uint32_t chromaHeight = height / 2;
+        std::vector<uint8_t> src(kWidth * height + 2 * kChromaWidth * chromaHeight);
+        for (size_t i = 0; i < src.size(); i++) {
+            src[i] = static_cast<uint8_t>(i * 7 + i / kWidth);
+        }
+        const uint8_t* srcY = src.data();
+        const uint8_t* srcU = srcY + kWidth * height;
+        const uint8_t* srcV = srcU + kChromaWidth * chromaHeight;
+        std::vector<uint8_t> expected(src.size());
+        std::vector<uint8_t> banded(src.size());
+        auto rotate = [&](uint8_t* dst, uint32_t begin, uint32_t end) {
+            uint8_t* dstY = dst;
+            uint8_t* dstU = dstY + kWidth * height;
+            uint8_t* dstV = dstU + kChromaWidth * chromaHeight;
+            uint32_t outBegin = height - end;
+            return libyuv::I420Rotate(srcY + begin * kWidth, kWidth,
+                                      srcU + begin / 2 * kChromaWidth, kChromaWidth,
+                                      srcV + begin / 2 * kChromaWidth, kChromaWidth,
+                                      dstY + outBegin * kWidth, kWidth,
+                                      dstU + outBegin / 2 * kChromaWidth, kChromaWidth,
+                                      dstV + outBegin / 2 * kChromaWidth, kChromaWidth, kWidth,
+                                      end - begin, libyuv::kRotate180) == 0;
+        };
+        ASSERT_TRUE(rotate(expected.data(), 0, height));
+        for (uint32_t bandCount = 2; bandCount <= BandWorkers::kMaxWorkers; bandCount++) {
+            std::fill(banded.begin(), banded.end(), 0);
+            auto convert = [&](uint32_t begin, uint32_t end) {
+                return rotate(banded.data(), begin, end);
+            };
+            BandUsage usage;
+            ASSERT_TRUE(workers.run(height, bandCount, /*cpuMask*/ 0, convert, &usage));
+            EXPECT_GT(usage.bands, 0u);
+            EXPECT_EQ(banded, expected) << height << " rows, " << bandCount << " bands";
+        }
+    }
+}
+
+// Helpers follow the encoder thread's cpus, and go back to their own when it has none.
+TEST(BandWorkersTest, HelpersFollowTheCpuMask) {
+    uint64_t allCpus = getThreadCpuMask();
+    if (std::bitset<64>(allCpus).count() < 2) {
+        GTEST_SKIP() << "Needs two cpus";
+    }
+    uint64_t firstCpu = allCpus & -allCpus;
+    BandWorkers workers(2, /*perfCounters*/ false);
+    std::atomic<uint64_t> helperCpuMask = 0;
+    auto convert = [&helperCpuMask](uint32_t begin, uint32_t /*end*/) {
+        if (begin != 0) {
+            helperCpuMask = getThreadCpuMask();
+        }
+        return true;
+    };
+    BandUsage usage;
+    ASSERT_TRUE(workers.run(100, 2, firstCpu, convert, &usage));
+    EXPECT_EQ(helperCpuMask.load(), firstCpu);
+    ASSERT_TRUE(workers.run(100, 2, /*cpuMask*/ 0, convert, &usage));
+    EXPECT_EQ(helperCpuMask.load(), allCpus);
+    EXPECT_EQ(usage.bands, 2u);
+}
+
+TEST(BandWorkersTest, UsageAddsUpPerfCountsValidInAllBands) {
+    PerfCounts cycles;
+    cycles.values[static_cast<size_t>(PerfEvent::CYCLES)] = 100;
+    cycles.values[static_cast<size_t>(PerfEvent::INSTRUCTIONS)] = 50;
+    cycles.validMask = (1u << static_cast<uint32_t>(PerfEvent::CYCLES)) |
+                       (1u << static_cast<uint32_t>(PerfEvent::INSTRUCTIONS));
+    PerfCounts cyclesOnly;
+    cyclesOnly.values[static_cast<size_t>(PerfEvent::CYCLES)] = 10;
+    cyclesOnly.validMask = 1u << static_cast<uint32_t>(PerfEvent::CYCLES);
+
+    BandUsage usage;
+    EXPECT_EQ(usage.addPerfTo(cycles).get(PerfEvent::CYCLES), 100u);
+    usage.add({/*bands*/ 1, /*cpuNs*/ 5, cycles});
+    usage.add({/*bands*/ 2, /*cpuNs*/ 7, cyclesOnly});
+    EXPECT_EQ(usage.bands, 3u);
+    EXPECT_EQ(usage.cpuNs, 12u);
+    EXPECT_TRUE(usage.perf.has(PerfEvent::CYCLES));
+    EXPECT_FALSE(usage.perf.has(PerfEvent::INSTRUCTIONS));
+    EXPECT_EQ(usage.perf.get(PerfEvent::CYCLES), 110u);
+    // The caller's counts are added to the helpers'.
+    PerfCounts total = usage.addPerfTo(cycles);
+    EXPECT_EQ(total.get(PerfEvent::CYCLES), 210u);
+    EXPECT_FALSE(total.has(PerfEvent::INSTRUCTIONS));
+    // Helpers without counters leave none.
+    EXPECT_EQ(usage.addPerfTo(PerfCounts{}).validMask, 0u);
+}
+
+}  // anonymous namespace
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <stdint.h>
+#include <thread>
+
+#include "Pipeline.h"
+
+namespace android {
+namespace webcam {
+namespace {
+
+TEST(BoundedQueueTest, CapacityIsRoundedUpToAPowerOfTwo) {
+    BoundedQueue<int> queue(3);
+    for (int i = 0; i < 4; i++) {
+        EXPECT_TRUE(queue.push(i)) << i;
+    }
+    EXPECT_FALSE(queue.push(4));
+}
+
+TEST(BoundedQueueTest, PopsInOrder) {
+    BoundedQueue<int> queue(4);
+    int item = -1;
+    EXPECT_TRUE(queue.empty());
+    EXPECT_FALSE(queue.pop(&item));
+    // Wrap around the ring a few times.
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 4; i++) {
+            ASSERT_TRUE(queue.push(round * 4 + i));
+        }
+        EXPECT_FALSE(queue.empty());
+        for (int i = 0; i < 4; i++) {
+            ASSERT_TRUE(queue.pop(&item));
+            EXPECT_EQ(item, round * 4 + i);
+        }
+        EXPECT_TRUE(queue.empty());
+    }
+}
+
+TEST(BoundedQueueTest, FullQueueKeepsItsItems) {
+    BoundedQueue<int> queue(2);
+    ASSERT_TRUE(queue.push(1));
+    ASSERT_TRUE(queue.push(2));
+    EXPECT_FALSE(queue.push(3));
+    int item = 0;
+    ASSERT_TRUE(queue.pop(&item));
+    EXPECT_EQ(item, 1);
+    EXPECT_TRUE(queue.push(3));
+    ASSERT_TRUE(queue.pop(&item));
+    EXPECT_EQ(item, 2);
+    ASSERT_TRUE(queue.pop(&item));
+    EXPECT_EQ(item, 3);
+}
+
+// One producer and one consumer thread, like a threaded pipeline stage.
+TEST(BoundedQueueTest, SingleProducerSingleConsumer) {
+    constexpr uint64_t kItems = 200000;
+    BoundedQueue<uint64_t> queue(8);
+    std::thread producer([&queue] {
+        for (uint64_t i = 0; i < kItems;) {
+            if (queue.push(i)) {
+                i++;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    });
+    uint64_t expected = 0;
+    uint64_t item = 0;
+    while (expected < kItems) {
+        if (!queue.pop(&item)) {
+            std::this_thread::yield();
+            continue;
+        }
+        ASSERT_EQ(item, expected);
+        expected++;
+    }
+    producer.join();
+    EXPECT_TRUE(queue.empty());
+}
+
+}  // anonymous namespace
+}  // namespace webcam
+}  // namespace android
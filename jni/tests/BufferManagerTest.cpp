@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <sys/eventfd.h>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+
+#include "Buffer.h"
+
+namespace android {
+namespace webcam {
+namespace {
+
+using std::chrono::milliseconds;
+
+// Buffers without memory, indexed like the gadget driver's.
+class FakeBufferCreator : public BufferCreatorAndDestroyer<V4L2Buffer> {
+  public:
+    explicit FakeBufferCreator(uint32_t producerBuffers) : mProducerBuffers(producerBuffers) {}
+
+    Status allocateAndMapBuffers(V4L2Buffer* consumerBuffer,
+                                 std::vector<V4L2Buffer>* producerBuffers) override {
+        struct v4l2_buffer buffer {};
+        buffer.index = mProducerBuffers;
+        *consumerBuffer = V4L2Buffer(/*mem*/ nullptr, &buffer);
+        for (uint32_t i = 0; i < mProducerBuffers; i++) {
+            buffer.index = i;
+            producerBuffers->emplace_back(/*mem*/ nullptr, &buffer);
+        }
+        return Status::OK;
+    }
+
+    void destroyBuffers(V4L2Buffer&, std::vector<V4L2Buffer>&) override { mDestroyed++; }
+
+    uint32_t mDestroyed = 0;
+
+  private:
+    uint32_t mProducerBuffers;
+};
+
+class BufferManagerTest : public ::testing::Test {
+  protected:
+    void create(DeliveryPolicy policy, uint32_t producerBuffers = 3) {
+        mCreator = std::make_unique<FakeBufferCreator>(producerBuffers);
+        mBufferManager = std::make_unique<V4L2BufferManager>(mCreator.get(), policy);
+        ASSERT_TRUE(mBufferManager->isInited());
+    }
+
+    // Fills a free buffer with the frame of the given timestamp, as the Encoder does.
+    bool fill(uint64_t timestamp) {
+        Buffer* buffer = mBufferManager->getFreeBufferIfAvailable();
+        if (buffer == nullptr) {
+            return false;
+        }
+        buffer->setTimestamp(timestamp);
+        return mBufferManager->queueFilledBuffer(buffer) == Status::OK;
+    }
+
+    // Timestamp of the frame the consumer gets, 0 for none.
+    uint64_t take(milliseconds timeout = milliseconds(0)) {
+        V4L2Buffer* buffer = mBufferManager->getFilledBufferAndSwap(timeout);
+        return buffer == nullptr ? 0 : buffer->getTimestamp();
+    }
+
+    std::unique_ptr<FakeBufferCreator> mCreator;
+    std::unique_ptr<V4L2BufferManager> mBufferManager;
+};
+
+DeliveryPolicy fifo(uint32_t maxDepth) {
+    DeliveryPolicy policy;
+    policy.mode = DeliveryMode::FIFO;
+    policy.maxDepth = maxDepth;
+    return policy;
+}
+
+TEST_F(BufferManagerTest, LatestDeliversTheNewestFrame) {
+    create(DeliveryPolicy{});
+    ASSERT_TRUE(fill(1));
+    ASSERT_TRUE(fill(2));
+    ASSERT_TRUE(fill(3));
+    EXPECT_EQ(take(), 3u);
+    EXPECT_EQ(take(), 0u);
+    DeliveryStats stats = mBufferManager->getDeliveryStats();
+    EXPECT_EQ(stats.delivered, 1u);
+    EXPECT_EQ(stats.superseded, 2u);
+    EXPECT_EQ(stats.waiting, 0u);
+}
+
+TEST_F(BufferManagerTest, FifoDeliversTheOldestFrame) {
+    create(fifo(/*maxDepth*/ 3));
+    ASSERT_TRUE(fill(1));
+    ASSERT_TRUE(fill(2));
+    ASSERT_TRUE(fill(3));
+    EXPECT_EQ(take(), 1u);
+    EXPECT_EQ(take(), 2u);
+    EXPECT_EQ(take(), 3u);
+    EXPECT_EQ(take(), 0u);
+    DeliveryStats stats = mBufferManager->getDeliveryStats();
+    EXPECT_EQ(stats.delivered, 3u);
+    EXPECT_EQ(stats.superseded, 0u);
+}
+
+TEST_F(BufferManagerTest, FifoDropsTheOldestBeyondItsDepth) {
+    create(fifo(/*maxDepth*/ 2));
+    ASSERT_TRUE(fill(1));
+    ASSERT_TRUE(fill(2));
+    EXPECT_EQ(mBufferManager->getDeliveryStats().waiting, 2u);
+    ASSERT_TRUE(fill(3));
+    DeliveryStats stats = mBufferManager->getDeliveryStats();
+    EXPECT_EQ(stats.superseded, 1u);
+    EXPECT_EQ(stats.waiting, 2u);
+    EXPECT_EQ(take(), 2u);
+    EXPECT_EQ(take(), 3u);
+}
+
+TEST_F(BufferManagerTest, HybridExpiresFramesOlderThanMaxAge) {
+    DeliveryPolicy policy = fifo(/*maxDepth*/ 3);
+    policy.mode = DeliveryMode::HYBRID;
+    policy.maxAge = milliseconds(20);
+    create(policy);
+    ASSERT_TRUE(fill(1));
+    std::this_thread::sleep_for(milliseconds(30));
+    ASSERT_TRUE(fill(2));
+    EXPECT_EQ(take(), 2u);
+    DeliveryStats stats = mBufferManager->getDeliveryStats();
+    EXPECT_EQ(stats.expired, 1u);
+    EXPECT_EQ(stats.delivered, 1u);
+}
+
+TEST_F(BufferManagerTest, TimesOutWithoutFilledBuffers) {
+    create(DeliveryPolicy{});
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_EQ(mBufferManager->getFilledBufferAndSwap(milliseconds(20)), nullptr);
+    EXPECT_GE(std::chrono::steady_clock::now() - start, milliseconds(20));
+    // A frame filled while the consumer waits is taken right away.
+    std::thread producer([this]() {
+        std::this_thread::sleep_for(milliseconds(10));
+        fill(1);
+    });
+    EXPECT_EQ(take(/*timeout*/ milliseconds(5000)), 1u);
+    producer.join();
+}
+
+TEST_F(BufferManagerTest, SetDeliveryPolicyKeepsWaitingFrames) {
+    create(DeliveryPolicy{});
+    ASSERT_TRUE(fill(1));
+    ASSERT_TRUE(fill(2));
+    mBufferManager->setDeliveryPolicy(fifo(/*maxDepth*/ 3));
+    EXPECT_EQ(mBufferManager->getDeliveryPolicy().mode, DeliveryMode::FIFO);
+    EXPECT_EQ(take(), 1u);
+    EXPECT_EQ(take(), 2u);
+    EXPECT_EQ(mBufferManager->getDeliveryStats().superseded, 0u);
+}
+
+TEST_F(BufferManagerTest, CountsFramesWithoutFreeBuffers) {
+    create(fifo(/*maxDepth*/ 3), /*producerBuffers*/ 2);
+    ASSERT_TRUE(fill(1));
+    ASSERT_TRUE(fill(2));
+    EXPECT_FALSE(fill(3));
+    DeliveryStats stats = mBufferManager->getDeliveryStats();
+    EXPECT_EQ(stats.noFreeBuffer, 1u);
+    EXPECT_EQ(stats.waiting, 2u);
+
+    std::this_thread::sleep_for(milliseconds(5));
+    EXPECT_EQ(take(), 1u);
+    // The consumer's previous buffer is free for the producer now.
+    EXPECT_TRUE(fill(3));
+    stats = mBufferManager->getDeliveryStats();
+    EXPECT_EQ(stats.delivered, 1u);
+    EXPECT_EQ(stats.waiting, 2u);
+    EXPECT_GE(stats.maxWaitNs, 5'000'000u);
+    EXPECT_EQ(stats.totalWaitNs, stats.maxWaitNs);
+}
+
+TEST_F(BufferManagerTest, CancelledBuffersAreFreeAgain) {
+    create(DeliveryPolicy{}, /*producerBuffers*/ 1);
+    Buffer* buffer = mBufferManager->getFreeBufferIfAvailable();
+    ASSERT_NE(buffer, nullptr);
+    EXPECT_EQ(mBufferManager->getFreeBufferIfAvailable(), nullptr);
+    EXPECT_EQ(mBufferManager->cancelBuffer(buffer), Status::OK);
+    EXPECT_TRUE(fill(1));
+    mBufferManager->cancelInFlightBuffers();
+    EXPECT_EQ(take(), 0u);
+    EXPECT_TRUE(fill(2));
+}
+
+TEST_F(BufferManagerTest, WakesTheConsumerOnceAfterItStarved) {
+    create(DeliveryPolicy{});
+    base::unique_fd wakeFd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+    ASSERT_GE(wakeFd.get(), 0);
+    mBufferManager->setConsumerWakeFd(wakeFd.get());
+    eventfd_t count = 0;
+
+    // Not starved, no wake up.
+    ASSERT_TRUE(fill(1));
+    EXPECT_NE(eventfd_read(wakeFd.get(), &count), 0);
+    EXPECT_EQ(take(), 1u);
+
+    EXPECT_EQ(take(), 0u);
+    ASSERT_TRUE(fill(2));
+    ASSERT_TRUE(fill(3));
+    ASSERT_EQ(eventfd_read(wakeFd.get(), &count), 0);
+    EXPECT_EQ(count, 1u);
+}
+
+TEST_F(BufferManagerTest, DestroysItsBuffers) {
+    create(DeliveryPolicy{});
+    mBufferManager.reset();
+    EXPECT_EQ(mCreator->mDestroyed, 1u);
+}
+
+}  // namespace
+}  // namespace webcam
+}  // namespace android
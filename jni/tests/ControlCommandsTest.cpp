@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "ControlCommands.h"
+#include "Tunables.h"
+
+namespace android {
+namespace webcam {
+namespace {
+
+class FakeListener : public ControlCommands::Listener {
+  public:
+    bool getDeliveryPolicy(DeliveryPolicy* policy) override {
+        *policy = mPolicy;
+        return mStreaming;
+    }
+    bool setDeliveryPolicy(const DeliveryPolicy& policy) override {
+        if (mStreaming) {
+            mPolicy = policy;
+        }
+        return mStreaming;
+    }
+    void resetDeliveryPolicy() override {
+        mPolicy = {};
+        mResets++;
+    }
+    void dumpStats(std::string* out) override { *out += "delivered 42\n"; }
+
+    bool mStreaming = true;
+    DeliveryPolicy mPolicy;
+    uint32_t mResets = 0;
+};
+
+struct SettingCase {
+    const char* name;
+    const char* value;
+    // What get prints for value, which differs from the default.
+    const char* printed;
+    std::vector<const char*> invalidValues;
+};
+
+const SettingCase kSettingCases[] = {
+        {"jpeg_quality", "42", "42", {"0", "101", "-5", "high", ""}},
+        {"dct", "fast", "fast", {"slow", "FAST", "1"}},
+        {"quant_tables", "webcam", "webcam", {"annex", "jpeg"}},
+        {"encoder_workers", "3", "3", {"0", "-1", "two"}},
+        {"frame_rate_percent", "50", "50", {"0", "101", "50%"}},
+        {"encoder_cpus", "0x30", "0x30", {"-1", "cpu4", "0x"}},
+        {"delivery_policy", "hybrid", "hybrid", {"lifo", "LATEST"}},
+        {"delivery_depth", "4", "4", {"0", "-2", "deep"}},
+        {"delivery_max_age_ms", "250", "250", {"0", "1.5", "-100"}},
+        {"phase_alignment", "true", "true", {"maybe", "2"}},
+};
+
+class ControlCommandsTest : public ::testing::Test {
+  protected:
+    void TearDown() override { Tunables::getInstance().resetToDefaults(); }
+
+    std::string run(const std::string& line) {
+        std::string out;
+        mCommands.runCommand(line, &out);
+        return out;
+    }
+
+    FakeListener mListener;
+    ControlCommands mCommands{&mListener};
+};
+
+TEST_F(ControlCommandsTest, SetsEverySetting) {
+    for (const SettingCase& setting : kSettingCases) {
+        std::string name = setting.name;
+        EXPECT_EQ(run("set " + name + " " + setting.value), "ok\n") << name;
+        EXPECT_EQ(run("get " + name), name + " " + setting.printed + "\nok\n");
+    }
+    const Tunables& tunables = Tunables::getInstance();
+    EXPECT_EQ(tunables.getJpegQuality(), 42);
+    EXPECT_EQ(tunables.getDctMethod(), JpegDctMethod::FAST);
+    EXPECT_EQ(tunables.getQuantTables(), JpegQuantTables::WEBCAM);
+    EXPECT_EQ(tunables.getMaxEncoderWorkers(), 3u);
+    EXPECT_EQ(tunables.getFrameRatePercent(), 50u);
+    EXPECT_EQ(tunables.getEncoderCpuMask(), 0x30u);
+    EXPECT_EQ(mListener.mPolicy.mode, DeliveryMode::HYBRID);
+    EXPECT_EQ(mListener.mPolicy.maxDepth, 4u);
+    EXPECT_EQ(mListener.mPolicy.maxAge, std::chrono::milliseconds(250));
+    EXPECT_TRUE(mListener.mPolicy.alignPhase);
+}
+
+TEST_F(ControlCommandsTest, RejectsInvalidValues) {
+    for (const SettingCase& setting : kSettingCases) {
+        std::string name = setting.name;
+        std::string before = run("get " + name);
+        for (const char* value : setting.invalidValues) {
+            std::string out = run("set " + name + " " + value);
+            if (std::string(value).empty()) {
+                // Not a set command without a value.
+                EXPECT_EQ(out, "error unknown command, try help\n");
+                continue;
+            }
+            EXPECT_EQ(out.rfind("error invalid value " + std::string(value) + " for " + name, 0),
+                      0u)
+                    << out;
+            EXPECT_EQ(run("get " + name), before) << name << " " << value;
+        }
+    }
+}
+
+TEST_F(ControlCommandsTest, DeliverySettingsNeedAStream) {
+    mListener.mStreaming = false;
+    for (const char* name : {"delivery_policy", "delivery_depth", "delivery_max_age_ms",
+                             "phase_alignment"}) {
+        EXPECT_EQ(run(std::string("get ") + name), "error no stream\n") << name;
+        EXPECT_EQ(run(std::string("set ") + name + " 1"), "error no stream\n") << name;
+    }
+    // Left out of the full listing.
+    std::string out = run("get");
+    EXPECT_NE(out.find("jpeg_quality "), std::string::npos);
+    EXPECT_EQ(out.find("delivery_"), std::string::npos);
+    EXPECT_EQ(out.find("phase_alignment"), std::string::npos);
+    EXPECT_EQ(out.substr(out.size() - 3), "ok\n");
+    // Stream independent settings still work.
+    EXPECT_EQ(run("set jpeg_quality 60"), "ok\n");
+}
+
+TEST_F(ControlCommandsTest, GetListsEverySettingWhileStreaming) {
+    std::string out = run("get");
+    for (const SettingCase& setting : kSettingCases) {
+        EXPECT_NE(out.find(std::string(setting.name) + " "), std::string::npos) << setting.name;
+    }
+}
+
+TEST_F(ControlCommandsTest, ResetGoesBackToTheDefaults) {
+    Tunables& tunables = Tunables::getInstance();
+    for (const SettingCase& setting : kSettingCases) {
+        ASSERT_EQ(run(std::string("set ") + setting.name + " " + setting.value), "ok\n");
+    }
+    EXPECT_EQ(run("reset"), "ok\n");
+    EXPECT_EQ(tunables.getJpegQuality(), tunables.getDefaultJpegQuality());
+    EXPECT_EQ(tunables.getDctMethod(), tunables.getDefaultDctMethod());
+    EXPECT_EQ(tunables.getQuantTables(), tunables.getDefaultQuantTables());
+    EXPECT_EQ(tunables.getMaxEncoderWorkers(), tunables.getDefaultMaxEncoderWorkers());
+    EXPECT_EQ(tunables.getFrameRatePercent(), Tunables::kFullFrameRatePercent);
+    EXPECT_EQ(tunables.getEncoderCpuMask(), 0u);
+    EXPECT_EQ(mListener.mResets, 1u);
+    EXPECT_EQ(mListener.mPolicy.mode, DeliveryMode::LATEST);
+}
+
+TEST_F(ControlCommandsTest, UnknownCommandsAndSettings) {
+    EXPECT_EQ(run("frobnicate"), "error unknown command, try help\n");
+    EXPECT_EQ(run("reset now"), "error unknown command, try help\n");
+    EXPECT_EQ(run("get jpeg_quality dct"), "error unknown command, try help\n");
+    EXPECT_EQ(run("get fps"), "error unknown setting fps\n");
+    EXPECT_EQ(run("set fps 30"), "error unknown setting fps\n");
+    // Blank lines get no reply.
+    EXPECT_EQ(run(" \t"), "");
+}
+
+TEST_F(ControlCommandsTest, StatsAndHelp) {
+    EXPECT_EQ(run("stats"), "delivered 42\nok\n");
+    std::string out = run("help");
+    for (const SettingCase& setting : kSettingCases) {
+        EXPECT_NE(out.find(std::string("  ") + setting.name + ": "), std::string::npos);
+    }
+}
+
+TEST_F(ControlCommandsTest, RunsCompleteLinesOnly) {
+    std::string input = "set jpeg_quality 30\r\nget jpeg_quality\nget dc";
+    std::string out;
+    EXPECT_TRUE(mCommands.processInput(&input, &out));
+    EXPECT_EQ(out, "ok\njpeg_quality 30\nok\n");
+    EXPECT_EQ(input, "get dc");
+
+    input += "t\n";
+    out.clear();
+    EXPECT_TRUE(mCommands.processInput(&input, &out));
+    EXPECT_EQ(out.substr(0, 4), "dct ");
+    EXPECT_TRUE(input.empty());
+}
+
+TEST_F(ControlCommandsTest, CommandTooLong) {
+    std::string input(ControlCommands::kMaxCommandLength, 'x');
+    std::string out;
+    EXPECT_TRUE(mCommands.processInput(&input, &out));
+    EXPECT_TRUE(out.empty());
+
+    input += "x";
+    EXPECT_FALSE(mCommands.processInput(&input, &out));
+    EXPECT_EQ(out, "error command too long\n");
+
+    // Complete commands before it still run.
+    input = "stats\n" + std::string(ControlCommands::kMaxCommandLength + 1, 'x');
+    out.clear();
+    EXPECT_FALSE(mCommands.processInput(&input, &out));
+    EXPECT_EQ(out, "delivered 42\nok\nerror command too long\n");
+}
+
+}  // namespace
+}  // namespace webcam
+}  // namespace android
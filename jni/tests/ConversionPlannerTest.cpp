@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <linux/videodev2.h>
+#include <vector>
+
+#include "ConversionPlanner.h"
+
+namespace android {
+namespace webcam {
+namespace {
+
+class ConversionPlannerTest : public ::testing::Test {
+  protected:
+    void TearDown() override { KernelCostTable::getInstance().resetToDefaults(); }
+
+    static ConversionKey makeKey(SourceLayout layout, uint32_t srcWidth, uint32_t srcHeight,
+                                 uint32_t fourcc, uint32_t dstWidth, uint32_t dstHeight,
+                                 uint32_t rotationDegrees = 0) {
+        ConversionKey key;
+        key.layout = layout;
+        key.srcWidth = srcWidth;
+        key.srcHeight = srcHeight;
+        key.dstFourcc = fourcc;
+        key.dstWidth = dstWidth;
+        key.dstHeight = dstHeight;
+        key.rotationDegrees = rotationDegrees;
+        return key;
+    }
+
+    static std::vector<ConversionKernel> kernels(const ConversionPlan* plan) {
+        std::vector<ConversionKernel> ret;
+        for (size_t i = 0; plan != nullptr && i < plan->numSteps; i++) {
+            ret.push_back(plan->steps[i].kernel);
+        }
+        return ret;
+    }
+
+    // Every plan reads the source first, writes the destination last and only passes I420
+    // images through scratch buffers in between.
+    static void expectWellFormed(const ConversionPlan* plan, const ConversionKey& key) {
+        ASSERT_NE(plan, nullptr);
+        ASSERT_GT(plan->numSteps, 0u);
+        EXPECT_EQ(plan->steps[0].input, PlanBuffer::SOURCE);
+        const ConversionStep& last = plan->steps[plan->numSteps - 1];
+        EXPECT_EQ(last.output, PlanBuffer::DESTINATION);
+        EXPECT_EQ(last.outWidth, key.dstWidth);
+        EXPECT_EQ(last.outHeight, key.dstHeight);
+        for (size_t i = 1; i < plan->numSteps; i++) {
+            EXPECT_EQ(plan->steps[i].input, plan->steps[i - 1].output) << i;
+            EXPECT_NE(plan->steps[i].input, plan->steps[i].output) << i;
+        }
+    }
+};
+
+TEST_F(ConversionPlannerTest, PlanarSourceConvertsStraightToYuyv) {
+    ConversionPlanner planner(1280, 720);
+    ConversionKey key =
+            makeKey(SourceLayout::YUV420_PLANAR, 1280, 720, V4L2_PIX_FMT_YUYV, 1280, 720);
+    const ConversionPlan* plan = planner.getPlan(key);
+    expectWellFormed(plan, key);
+    EXPECT_EQ(kernels(plan), std::vector<ConversionKernel>{ConversionKernel::I420_TO_YUY2});
+}
+
+TEST_F(ConversionPlannerTest, SemiPlanarSourceGoesThroughScratch) {
+    ConversionPlanner planner(1280, 720);
+    ConversionKey key =
+            makeKey(SourceLayout::YUV420_SEMI_PLANAR, 1280, 720, V4L2_PIX_FMT_MJPEG, 1280, 720);
+    const ConversionPlan* plan = planner.getPlan(key);
+    expectWellFormed(plan, key);
+    EXPECT_EQ(kernels(plan), (std::vector<ConversionKernel>{ConversionKernel::ANDROID420_TO_I420,
+                                                             ConversionKernel::I420_TO_JPEG}));
+    EXPECT_EQ(plan->steps[0].output, PlanBuffer::SCRATCH_0);
+}
+
+TEST_F(ConversionPlannerTest, RotationIsFoldedIntoTheFirstConversion) {
+    ConversionPlanner planner(1280, 720);
+    ConversionKey key = makeKey(SourceLayout::YUV420_SEMI_PLANAR, 1280, 720, V4L2_PIX_FMT_YUYV,
+                                1280, 720, /*rotationDegrees*/ 180);
+    const ConversionPlan* plan = planner.getPlan(key);
+    expectWellFormed(plan, key);
+    EXPECT_EQ(kernels(plan),
+              (std::vector<ConversionKernel>{ConversionKernel::ANDROID420_TO_I420_ROTATE_180,
+                                             ConversionKernel::I420_TO_YUY2}));
+}
+
+TEST_F(ConversionPlannerTest, UnsupportedRotationHasNoPlan) {
+    ConversionPlanner planner(1280, 720);
+    EXPECT_EQ(planner.getPlan(makeKey(SourceLayout::YUV420_PLANAR, 1280, 720, V4L2_PIX_FMT_YUYV,
+                                      1280, 720, /*rotationDegrees*/ 90)),
+              nullptr);
+}
+
+TEST_F(ConversionPlannerTest, CheaperSingleKernelWins) {
+    ConversionPlanner planner(640, 480);
+    ConversionKey key = makeKey(SourceLayout::ARGB, 640, 480, V4L2_PIX_FMT_YUYV, 640, 480);
+    EXPECT_EQ(kernels(planner.getPlan(key)),
+              std::vector<ConversionKernel>{ConversionKernel::ARGB_TO_YUY2});
+
+    // Costs are read when planning, a new planner picks up the change.
+    KernelCostTable::getInstance().setCost(ConversionKernel::ARGB_TO_YUY2, 100);
+    ConversionPlanner replanner(640, 480);
+    EXPECT_EQ(kernels(replanner.getPlan(key)),
+              (std::vector<ConversionKernel>{ConversionKernel::ARGB_TO_I420,
+                                             ConversionKernel::I420_TO_YUY2}));
+}
+
+// A source larger than the stream is converted at its own size before it is scaled, so the
+// scratch images have to hold it.
+TEST_F(ConversionPlannerTest, LargerSourceNeedsScratchOfItsSize) {
+    ConversionKey key = makeKey(SourceLayout::ARGB, 1920, 1080, V4L2_PIX_FMT_YUYV, 1280, 720);
+    ConversionPlanner planner(1280, 720);
+    EXPECT_EQ(planner.getPlan(key), nullptr);
+
+    planner.setScratchSize(1920, 1080);
+    const ConversionPlan* plan = planner.getPlan(key);
+    expectWellFormed(plan, key);
+    EXPECT_EQ(kernels(plan), (std::vector<ConversionKernel>{ConversionKernel::ARGB_TO_I420,
+                                                             ConversionKernel::I420_SCALE,
+                                                             ConversionKernel::I420_TO_YUY2}));
+    EXPECT_EQ(plan->steps[0].outWidth, 1920u);
+    EXPECT_EQ(plan->steps[1].outWidth, 1280u);
+}
+
+TEST_F(ConversionPlannerTest, MatchingJpegIsPassedThrough) {
+    ConversionPlanner planner(1920, 1080);
+    ConversionKey key = makeKey(SourceLayout::JPEG, 1920, 1080, V4L2_PIX_FMT_MJPEG, 1920, 1080);
+    EXPECT_EQ(kernels(planner.getPlan(key)),
+              std::vector<ConversionKernel>{ConversionKernel::JPEG_PASSTHROUGH});
+}
+
+TEST_F(ConversionPlannerTest, LargerJpegIsTransformed) {
+    // The default costs favor decoding at half size and compressing again. Make the DCT domain
+    // downscale the cheaper one, as the encoder benchmark may find it to be.
+    KernelCostTable::getInstance().setCost(ConversionKernel::JPEG_DOWNSCALE, 1.0);
+    ConversionPlanner planner(3840, 2160);
+    // Half the size in both directions: a DCT domain downscale, no decode.
+    ConversionKey key = makeKey(SourceLayout::JPEG, 3840, 2160, V4L2_PIX_FMT_MJPEG, 1920, 1080);
+    EXPECT_EQ(kernels(planner.getPlan(key)),
+              std::vector<ConversionKernel>{ConversionKernel::JPEG_DOWNSCALE});
+    // Same scale, slightly smaller: a crop.
+    key = makeKey(SourceLayout::JPEG, 1920, 1088, V4L2_PIX_FMT_MJPEG, 1920, 1080);
+    EXPECT_EQ(kernels(planner.getPlan(key)),
+              std::vector<ConversionKernel>{ConversionKernel::JPEG_CROP});
+}
+
+TEST_F(ConversionPlannerTest, JpegIsDecodedForYuyv) {
+    ConversionPlanner planner(3840, 2160);
+    ConversionKey key = makeKey(SourceLayout::JPEG, 3840, 2160, V4L2_PIX_FMT_YUYV, 1920, 1080);
+    const ConversionPlan* plan = planner.getPlan(key);
+    expectWellFormed(plan, key);
+    // Scaled by the IDCT while decoding.
+    EXPECT_EQ(kernels(plan), (std::vector<ConversionKernel>{ConversionKernel::JPEG_TO_I420,
+                                                             ConversionKernel::I420_TO_YUY2}));
+    EXPECT_EQ(plan->steps[0].outWidth, 1920u);
+}
+
+TEST_F(ConversionPlannerTest, PlansAreCachedAndBounded) {
+    ConversionPlanner planner(1280, 720);
+    ConversionKey key =
+            makeKey(SourceLayout::YUV420_PLANAR, 1280, 720, V4L2_PIX_FMT_YUYV, 1280, 720);
+    const ConversionPlan* plan = planner.getPlan(key);
+    ASSERT_NE(plan, nullptr);
+    EXPECT_EQ(planner.getPlan(key), plan);
+
+    // More keys than are cached: the oldest plans are replaced, results stay correct.
+    for (uint32_t i = 0; i < 3 * ConversionPlanner::kMaxCachedPlans; i++) {
+        ConversionKey other = makeKey(SourceLayout::YUV420_PLANAR, 1280 - 16 * i, 720,
+                                      V4L2_PIX_FMT_YUYV, 640, 360);
+        const ConversionPlan* otherPlan = planner.getPlan(other);
+        expectWellFormed(otherPlan, other);
+    }
+    plan = planner.getPlan(key);
+    expectWellFormed(plan, key);
+    EXPECT_EQ(kernels(plan), std::vector<ConversionKernel>{ConversionKernel::I420_TO_YUY2});
+}
+
+}  // anonymous namespace
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "EncoderArena.h"
+
+namespace android {
+namespace webcam {
+namespace {
+
+constexpr uint32_t kWidth = 640;
+constexpr uint32_t kHeight = 480;
+
+struct VectorDestination : public jpeg_destination_mgr {
+    std::vector<uint8_t> buffer;
+    size_t encodedSize = 0;
+};
+
+// Compresses an I420 image from arena scratch memory with the arena's compressor, the way
+// Encoder::i420ToJpeg does. Returns the JPEG, empty on failure.
+std::vector<uint8_t> compressI420(EncoderArena* arena, uint8_t luma, uint8_t chroma) {
+    arena->reset();
+    uint32_t stride = EncoderArena::getScratchLumaStride(kWidth);
+    uint32_t rows = EncoderArena::getScratchLumaRows(kHeight);
+    auto* y = static_cast<uint8_t*>(arena->allocate(stride * rows));
+    auto* u = static_cast<uint8_t*>(arena->allocate(stride * rows / 4));
+    auto* v = static_cast<uint8_t*>(arena->allocate(stride * rows / 4));
+    auto* yRows = static_cast<JSAMPROW*>(arena->allocate(rows * sizeof(JSAMPROW)));
+    auto* uRows = static_cast<JSAMPROW*>(arena->allocate(rows / 2 * sizeof(JSAMPROW)));
+    auto* vRows = static_cast<JSAMPROW*>(arena->allocate(rows / 2 * sizeof(JSAMPROW)));
+    if (y == nullptr || u == nullptr || v == nullptr || yRows == nullptr || uRows == nullptr ||
+        vRows == nullptr) {
+        return {};
+    }
+    memset(y, luma, stride * rows);
+    memset(u, chroma, stride * rows / 4);
+    memset(v, chroma, stride * rows / 4);
+    for (uint32_t i = 0; i < rows; i++) {
+        yRows[i] = y + i * stride;
+        if (i < rows / 2) {
+            uRows[i] = u + i * stride / 2;
+            vRows[i] = v + i * stride / 2;
+        }
+    }
+
+    VectorDestination dest;
+    dest.buffer.resize(kWidth * kHeight);
+    dest.init_destination = [](j_compress_ptr cinfo) {
+        auto* dest = static_cast<VectorDestination*>(cinfo->dest);
+        dest->next_output_byte = dest->buffer.data();
+        dest->free_in_buffer = dest->buffer.size();
+    };
+    dest.empty_output_buffer = [](j_compress_ptr) -> boolean { return FALSE; };
+    dest.term_destination = [](j_compress_ptr cinfo) {
+        auto* dest = static_cast<VectorDestination*>(cinfo->dest);
+        dest->encodedSize = dest->buffer.size() - dest->free_in_buffer;
+    };
+
+    j_compress_ptr cinfo = arena->getJpegCompressor();
+    cinfo->dest = &dest;
+    cinfo->image_width = kWidth;
+    cinfo->image_height = kHeight;
+    cinfo->input_components = 3;
+    cinfo->in_color_space = JCS_YCbCr;
+    jpeg_set_defaults(cinfo);
+    jpeg_set_colorspace(cinfo, JCS_YCbCr);
+    jpeg_set_quality(cinfo, 90, TRUE);
+    cinfo->raw_data_in = TRUE;
+    cinfo->comp_info[0].h_samp_factor = 2;
+    cinfo->comp_info[0].v_samp_factor = 2;
+    for (int i = 1; i < 3; i++) {
+        cinfo->comp_info[i].h_samp_factor = 1;
+        cinfo->comp_info[i].v_samp_factor = 1;
+    }
+    jpeg_start_compress(cinfo, TRUE);
+    while (cinfo->next_scanline < cinfo->image_height) {
+        JSAMPARRAY planes[3]{&yRows[cinfo->next_scanline], &uRows[cinfo->next_scanline / 2],
+                             &vRows[cinfo->next_scanline / 2]};
+        jpeg_write_raw_data(cinfo, planes, 2 * DCTSIZE);
+    }
+    jpeg_finish_compress(cinfo);
+    cinfo->dest = nullptr;
+    dest.buffer.resize(dest.encodedSize);
+    return std::move(dest.buffer);
+}
+
+struct Decoded {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    std::vector<uint8_t> luma;
+};
+
+Decoded decodeLuma(const std::vector<uint8_t>& jpeg, bool recyclingMemory) {
+    jpeg_decompress_struct dinfo{};
+    jpeg_error_mgr error{};
+    dinfo.err = jpeg_std_error(&error);
+    jpeg_create_decompress(&dinfo);
+    if (recyclingMemory) {
+        useRecyclingJpegMemory(reinterpret_cast<j_common_ptr>(&dinfo));
+    }
+    Decoded ret;
+    for (int image = 0; image < (recyclingMemory ? 2 : 1); image++) {
+        jpeg_mem_src(&dinfo, jpeg.data(), jpeg.size());
+        jpeg_read_header(&dinfo, TRUE);
+        dinfo.out_color_space = JCS_GRAYSCALE;
+        jpeg_start_decompress(&dinfo);
+        ret.width = dinfo.output_width;
+        ret.height = dinfo.output_height;
+        ret.luma.resize(ret.width * ret.height);
+        while (dinfo.output_scanline < dinfo.output_height) {
+            JSAMPROW row = ret.luma.data() + dinfo.output_scanline * ret.width;
+            jpeg_read_scanlines(&dinfo, &row, 1);
+        }
+        jpeg_finish_decompress(&dinfo);
+    }
+    jpeg_destroy_decompress(&dinfo);
+    return ret;
+}
+
+TEST(EncoderArenaTest, ScratchFitsTheFrameSize) {
+    std::shared_ptr<EncoderArena> arena = EncoderArena::create(kWidth, kHeight);
+    ASSERT_NE(arena, nullptr);
+    EXPECT_TRUE(arena->canFit(kWidth, kHeight));
+    EXPECT_TRUE(arena->canFit(kWidth / 2, kHeight / 2));
+    EXPECT_FALSE(arena->canFit(kWidth * 2, kHeight * 2));
+    EXPECT_GE(arena->getCapacity(), EncoderArena::getScratchSize(kWidth, kHeight));
+}
+
+TEST(EncoderArenaTest, AllocationsAreAlignedAndBounded) {
+    std::shared_ptr<EncoderArena> arena = EncoderArena::create(kWidth, kHeight);
+    ASSERT_NE(arena, nullptr);
+    void* first = arena->allocate(3);
+    void* second = arena->allocate(5);
+    ASSERT_NE(first, nullptr);
+    ASSERT_NE(second, nullptr);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(first) % EncoderArena::kAlignment, 0u);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(second) % EncoderArena::kAlignment, 0u);
+    EXPECT_EQ(arena->allocate(arena->getCapacity()), nullptr);
+    arena->reset();
+    EXPECT_EQ(arena->getUsed(), 0u);
+    EXPECT_EQ(arena->allocate(3), first);
+}
+
+// Several frames through the long lived compressor, then its destruction: the memory libjpeg
+// allocated while creating it must stay valid throughout.
+TEST(EncoderArenaTest, EncodesFramesThroughTheArena) {
+    std::shared_ptr<EncoderArena> arena = EncoderArena::create(kWidth, kHeight);
+    ASSERT_NE(arena, nullptr);
+    for (uint8_t luma : {16, 128, 235}) {
+        std::vector<uint8_t> jpeg = compressI420(arena.get(), luma, /*chroma*/ 128);
+        ASSERT_GT(jpeg.size(), 4u);
+        EXPECT_EQ(jpeg[0], 0xff);
+        EXPECT_EQ(jpeg[1], 0xd8);
+
+        Decoded decoded = decodeLuma(jpeg, /*recyclingMemory*/ false);
+        ASSERT_EQ(decoded.width, kWidth);
+        ASSERT_EQ(decoded.height, kHeight);
+        for (uint32_t i = 0; i < decoded.luma.size(); i += 997) {
+            EXPECT_NEAR(decoded.luma[i], luma, 2) << i;
+        }
+    }
+    arena.reset();
+}
+
+TEST(EncoderArenaTest, RecyclingMemoryDecodesRepeatedly) {
+    std::shared_ptr<EncoderArena> arena = EncoderArena::create(kWidth, kHeight);
+    ASSERT_NE(arena, nullptr);
+    std::vector<uint8_t> jpeg = compressI420(arena.get(), /*luma*/ 100, /*chroma*/ 128);
+    ASSERT_FALSE(jpeg.empty());
+    Decoded decoded = decodeLuma(jpeg, /*recyclingMemory*/ true);
+    ASSERT_EQ(decoded.width, kWidth);
+    EXPECT_NEAR(decoded.luma[kWidth * kHeight / 2], 100, 2);
+}
+
+}  // anonymous namespace
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "FrameRanges.h"
+
+namespace android {
+namespace webcam {
+namespace {
+
+constexpr uint32_t kInterval30Fps = FRAME_INTERVAL_NUM / 30;
+
+std::vector<uint32_t> toRates(const std::vector<uint32_t>& intervals) {
+    std::vector<uint32_t> ret;
+    for (uint32_t interval : intervals) {
+        ret.push_back(toFps(interval));
+    }
+    return ret;
+}
+
+bool containsSize(const std::vector<FrameSize>& sizes, uint32_t width, uint32_t height) {
+    return std::any_of(sizes.begin(), sizes.end(), [&](const FrameSize& size) {
+        return size.width == width && size.height == height;
+    });
+}
+
+TEST(FrameRangesTest, IntervalsAreRounded) {
+    EXPECT_EQ(toFrameInterval({1001, 30000}), 333667u);
+    EXPECT_EQ(toFps(333667), 30u);
+    EXPECT_EQ(toFrameInterval({1, 0}), 0u);
+    EXPECT_EQ(toFps(0), 0u);
+}
+
+TEST(FrameRangesTest, ShortStepwiseRangeIsOfferedInFull) {
+    // 50 fps down to 10 fps, in 20ms steps.
+    std::vector<uint32_t> intervals = expandIntervalRange(200'000, 1'000'000, 200'000);
+    EXPECT_EQ(intervals, (std::vector<uint32_t>{200'000, 400'000, 600'000, 800'000, 1'000'000}));
+    // The last step may fall short of the maximum.
+    intervals = expandIntervalRange(200'000, 900'000, 200'000);
+    EXPECT_EQ(intervals, (std::vector<uint32_t>{200'000, 400'000, 600'000, 800'000}));
+}
+
+TEST(FrameRangesTest, ContinuousRangeOffersTheStandardRates) {
+    std::vector<uint32_t> intervals =
+            expandIntervalRange(FRAME_INTERVAL_NUM / 120, FRAME_INTERVAL_NUM / 5, /*step*/ 0);
+    EXPECT_EQ(toRates(intervals),
+              (std::vector<uint32_t>{120, 90, 60, 50, 30, 25, 24, 20, 15, 10, 5}));
+
+    // Only the rates inside the range, along with its ends.
+    intervals = expandIntervalRange(FRAME_INTERVAL_NUM / 40, FRAME_INTERVAL_NUM / 12, /*step*/ 0);
+    EXPECT_EQ(toRates(intervals), (std::vector<uint32_t>{40, 30, 25, 24, 20, 15, 12}));
+}
+
+TEST(FrameRangesTest, LongStepwiseRangeIsSnappedToItsGrid) {
+    constexpr uint32_t kMin = 100'000;
+    constexpr uint32_t kMax = 2'000'000;
+    constexpr uint32_t kStep = 100'000;
+    std::vector<uint32_t> intervals = expandIntervalRange(kMin, kMax, kStep);
+    ASSERT_FALSE(intervals.empty());
+    EXPECT_EQ(intervals.front(), kMin);
+    EXPECT_EQ(intervals.back(), kMax);
+    EXPECT_TRUE(std::is_sorted(intervals.begin(), intervals.end()));
+    for (uint32_t interval : intervals) {
+        EXPECT_EQ((interval - kMin) % kStep, 0u) << interval;
+    }
+    // 30 fps is 333333, the nearest step is 300000.
+    EXPECT_NE(std::find(intervals.begin(), intervals.end(), 300'000u), intervals.end());
+}
+
+TEST(FrameRangesTest, InvalidIntervalRangeIsEmpty) {
+    EXPECT_TRUE(expandIntervalRange(0, kInterval30Fps, /*step*/ 0).empty());
+    EXPECT_TRUE(expandIntervalRange(2 * kInterval30Fps, kInterval30Fps, /*step*/ 0).empty());
+}
+
+TEST(FrameRangesTest, RatesAboveTheCameraMaximumAreDropped) {
+    std::vector<uint32_t> all =
+            expandIntervalRange(FRAME_INTERVAL_NUM / 120, FRAME_INTERVAL_NUM / 5, /*step*/ 0);
+    std::vector<uint32_t> intervals = all;
+    limitFrameRate(&intervals, /*maxFps*/ 60);
+    EXPECT_EQ(toRates(intervals), (std::vector<uint32_t>{60, 50, 30, 25, 24, 20, 15, 10, 5}));
+
+    // 29.97 fps counts as 30.
+    intervals = {333'667, 400'000};
+    limitFrameRate(&intervals, /*maxFps*/ 30);
+    EXPECT_EQ(intervals, (std::vector<uint32_t>{333'667, 400'000}));
+
+    intervals = all;
+    limitFrameRate(&intervals, /*maxFps*/ 0);
+    EXPECT_EQ(intervals, all);
+}
+
+TEST(FrameRangesTest, SlowestRateIsKeptIfAllAreTooFast) {
+    std::vector<uint32_t> intervals{FRAME_INTERVAL_NUM / 120, FRAME_INTERVAL_NUM / 90};
+    limitFrameRate(&intervals, /*maxFps*/ 30);
+    EXPECT_EQ(toRates(intervals), (std::vector<uint32_t>{90}));
+
+    intervals.clear();
+    limitFrameRate(&intervals, /*maxFps*/ 30);
+    EXPECT_TRUE(intervals.empty());
+}
+
+TEST(FrameRangesTest, SizeRangeOffersTheStandardSizesOnItsGrid) {
+    struct v4l2_frmsize_stepwise range {};
+    range.min_width = 160;
+    range.max_width = 1920;
+    range.step_width = 16;
+    range.min_height = 120;
+    range.max_height = 1080;
+    range.step_height = 8;
+    std::vector<FrameSize> sizes = expandSizeRange(range);
+    ASSERT_GE(sizes.size(), 2u);
+    EXPECT_EQ(sizes.front().width, 160u);
+    EXPECT_EQ(sizes.front().height, 120u);
+    EXPECT_EQ(sizes.back().width, 1920u);
+    EXPECT_EQ(sizes.back().height, 1080u);
+    for (const FrameSize& size : sizes) {
+        EXPECT_EQ((size.width - range.min_width) % range.step_width, 0u) << size.width;
+        EXPECT_EQ((size.height - range.min_height) % range.step_height, 0u) << size.height;
+    }
+    EXPECT_TRUE(containsSize(sizes, 640, 480));
+    EXPECT_TRUE(containsSize(sizes, 1280, 720));
+    // Off the grid: 180 - 120 isn't a multiple of 8.
+    EXPECT_FALSE(containsSize(sizes, 320, 180));
+    // Too large.
+    EXPECT_FALSE(containsSize(sizes, 3840, 2160));
+    // The maximum is a standard size, offered once.
+    EXPECT_EQ(std::count_if(sizes.begin(), sizes.end(),
+                            [](const FrameSize& size) {
+                                return size.width == 1920 && size.height == 1080;
+                            }),
+              1);
+}
+
+TEST(FrameRangesTest, ContinuousSizeRange) {
+    struct v4l2_frmsize_stepwise range {};
+    range.min_width = 300;
+    range.max_width = 1000;
+    range.step_width = 1;
+    range.min_height = 200;
+    range.max_height = 700;
+    range.step_height = 1;
+    std::vector<FrameSize> sizes = expandSizeRange(range);
+    std::vector<std::pair<uint32_t, uint32_t>> expected = {
+            {300, 200}, {320, 240}, {640, 360}, {640, 480}, {800, 600}, {960, 540}, {1000, 700}};
+    ASSERT_EQ(sizes.size(), expected.size());
+    for (size_t i = 0; i < sizes.size(); i++) {
+        EXPECT_EQ(sizes[i].width, expected[i].first) << i;
+        EXPECT_EQ(sizes[i].height, expected[i].second) << i;
+    }
+}
+
+}  // anonymous namespace
+}  // namespace webcam
+}  // namespace android
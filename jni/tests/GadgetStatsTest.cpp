@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include "GadgetStats.h"
+
+namespace android {
+namespace webcam {
+namespace {
+
+using Clock = GadgetStats::Clock;
+using std::chrono::hours;
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+
+const Clock::time_point kStart = Clock::time_point() + hours(1);
+
+struct v4l2_buffer returnedBuffer(uint32_t index, uint32_t sequence, uint32_t flags = 0) {
+    struct v4l2_buffer buffer {};
+    buffer.index = index;
+    buffer.sequence = sequence;
+    buffer.flags = flags;
+    return buffer;
+}
+
+void setTimestamp(struct v4l2_buffer* buffer, Clock::time_point time) {
+    int64_t us = std::chrono::duration_cast<microseconds>(time.time_since_epoch()).count();
+    buffer->timestamp.tv_sec = us / 1'000'000;
+    buffer->timestamp.tv_usec = us % 1'000'000;
+}
+
+// Buffer 0 queued at kStart, sent at sentTime if the driver stamped it, dequeued 10ms later.
+GadgetStats sendOneBuffer(uint32_t timestampFlags, Clock::time_point sentTime) {
+    GadgetStats stats;
+    stats.onQueued(/*index*/ 0, kStart);
+    struct v4l2_buffer buffer = returnedBuffer(/*index*/ 0, /*sequence*/ 0, timestampFlags);
+    if (sentTime != Clock::time_point()) {
+        setTimestamp(&buffer, sentTime);
+    }
+    stats.onReturned(buffer, kStart + milliseconds(10));
+    return stats;
+}
+
+GadgetStats::TimeHistogram histogramWith(size_t bucket) {
+    GadgetStats::TimeHistogram histogram{};
+    histogram[bucket] = 1;
+    return histogram;
+}
+
+TEST(GadgetStatsTest, CountsErrors) {
+    GadgetStats stats;
+    stats.onReturned(returnedBuffer(0, 0), kStart);
+    stats.onReturned(returnedBuffer(1, 1, V4L2_BUF_FLAG_ERROR), kStart);
+    stats.onReturned(returnedBuffer(2, 2, V4L2_BUF_FLAG_ERROR | V4L2_BUF_FLAG_DONE), kStart);
+    stats.onReturned(returnedBuffer(3, 3, V4L2_BUF_FLAG_DONE), kStart);
+    EXPECT_EQ(stats.getReturned(), 4u);
+    EXPECT_EQ(stats.getErrors(), 2u);
+}
+
+TEST(GadgetStatsTest, CountsSequenceGaps) {
+    GadgetStats stats;
+    // The first sequence number doesn't have to be 0.
+    for (uint32_t sequence : {7, 8, 9, 12, 13, 17}) {
+        stats.onReturned(returnedBuffer(sequence % 4, sequence), kStart);
+    }
+    EXPECT_EQ(stats.getSequenceGaps(), 5u);
+    // The driver starts over from 0 on a new stream, not a gap.
+    stats.onReturned(returnedBuffer(0, 0), kStart);
+    stats.onReturned(returnedBuffer(1, 1), kStart);
+    EXPECT_EQ(stats.getSequenceGaps(), 5u);
+}
+
+TEST(GadgetStatsTest, TimeBucketEdges) {
+    EXPECT_EQ(GadgetStats::getTimeBucket(-5), 0u);
+    EXPECT_EQ(GadgetStats::getTimeBucket(0), 0u);
+    EXPECT_EQ(GadgetStats::getTimeBucket(999), 0u);
+    EXPECT_EQ(GadgetStats::getTimeBucket(1000), 1u);
+    EXPECT_EQ(GadgetStats::getTimeBucket(1999), 1u);
+    EXPECT_EQ(GadgetStats::getTimeBucket(2000), 2u);
+    EXPECT_EQ(GadgetStats::getTimeBucket(3999), 2u);
+    EXPECT_EQ(GadgetStats::getTimeBucket(4000), 3u);
+    EXPECT_EQ(GadgetStats::getTimeBucket(63'999), 6u);
+    EXPECT_EQ(GadgetStats::getTimeBucket(64'000), GadgetStats::kTimeBuckets - 1);
+    EXPECT_EQ(GadgetStats::getTimeBucket(3'600'000'000), GadgetStats::kTimeBuckets - 1);
+}
+
+TEST(GadgetStatsTest, MonotonicTimestampSplitsSendAndPickup) {
+    GadgetStats stats = sendOneBuffer(V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC, kStart + milliseconds(3));
+    EXPECT_EQ(stats.getSendTimes(), histogramWith(2));    // 3ms
+    EXPECT_EQ(stats.getPickupTimes(), histogramWith(3));  // 7ms
+    EXPECT_EQ(stats.getMaxSendTimeUs(), 3000u);
+}
+
+TEST(GadgetStatsTest, CopyTimestampIsTheCompletionTime) {
+    // What f_uvc reports.
+    GadgetStats stats = sendOneBuffer(V4L2_BUF_FLAG_TIMESTAMP_COPY, kStart + milliseconds(3));
+    EXPECT_EQ(stats.getSendTimes(), histogramWith(2));
+    EXPECT_EQ(stats.getPickupTimes(), histogramWith(3));
+    EXPECT_EQ(stats.getMaxSendTimeUs(), 3000u);
+}
+
+TEST(GadgetStatsTest, UnstampedBuffersCountUpToTheDequeue) {
+    for (uint32_t flags : {V4L2_BUF_FLAG_TIMESTAMP_COPY, V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC}) {
+        GadgetStats stats = sendOneBuffer(flags, /*sentTime*/ Clock::time_point());
+        EXPECT_EQ(stats.getSendTimes(), histogramWith(4)) << flags;  // 10ms
+        EXPECT_EQ(stats.getPickupTimes(), GadgetStats::TimeHistogram{}) << flags;
+        EXPECT_EQ(stats.getMaxSendTimeUs(), 10'000u) << flags;
+    }
+}
+
+TEST(GadgetStatsTest, UnknownTimestampTypeIsIgnored) {
+    GadgetStats stats = sendOneBuffer(V4L2_BUF_FLAG_TIMESTAMP_UNKNOWN, kStart + milliseconds(3));
+    EXPECT_EQ(stats.getSendTimes(), histogramWith(4));
+    EXPECT_EQ(stats.getPickupTimes(), GadgetStats::TimeHistogram{});
+}
+
+TEST(GadgetStatsTest, TimestampIsClampedToQueueAndDequeue) {
+    GadgetStats stats =
+            sendOneBuffer(V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC, kStart - milliseconds(100));
+    EXPECT_EQ(stats.getSendTimes(), histogramWith(0));
+    EXPECT_EQ(stats.getPickupTimes(), histogramWith(4));
+    EXPECT_EQ(stats.getMaxSendTimeUs(), 0u);
+
+    stats = sendOneBuffer(V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC, kStart + milliseconds(100));
+    EXPECT_EQ(stats.getSendTimes(), histogramWith(4));
+    EXPECT_EQ(stats.getPickupTimes(), histogramWith(0));
+}
+
+TEST(GadgetStatsTest, OnlyQueuedBuffersAreTimed) {
+    GadgetStats stats;
+    stats.onQueued(/*index*/ 1, kStart);
+    // Never queued, out of range, and queued but returned twice.
+    stats.onReturned(returnedBuffer(0, 0), kStart + milliseconds(1));
+    stats.onReturned(returnedBuffer(GadgetStats::kMaxBuffers, 1), kStart + milliseconds(1));
+    stats.onReturned(returnedBuffer(1, 2), kStart + milliseconds(1));
+    stats.onReturned(returnedBuffer(1, 3), kStart + milliseconds(1));
+    EXPECT_EQ(stats.getReturned(), 4u);
+    EXPECT_EQ(stats.getSendTimes(), histogramWith(1));
+}
+
+TEST(GadgetStatsTest, FormatsHistograms) {
+    GadgetStats::TimeHistogram histogram{};
+    EXPECT_EQ(GadgetStats::formatTimeHistogram(histogram), "-");
+    histogram[0] = 120;
+    histogram[1] = 3;
+    histogram[GadgetStats::kTimeBuckets - 1] = 1;
+    EXPECT_EQ(GadgetStats::formatTimeHistogram(histogram), "<1ms:120 <2ms:3 >=64ms:1");
+
+    GadgetStats stats = sendOneBuffer(V4L2_BUF_FLAG_TIMESTAMP_COPY, kStart + milliseconds(3));
+    std::string out;
+    stats.dump(&out);
+    EXPECT_EQ(out,
+              "gadget_returned 1\ngadget_errors 0\ngadget_sequence_gaps 0\n"
+              "gadget_max_send_us 3000\ngadget_send_times <4ms:1\ngadget_pickup_times <8ms:1\n");
+}
+
+}  // namespace
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <math.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <set>
+#include <vector>
+
+#include "HuffmanOptimizer.h"
+
+namespace android {
+namespace webcam {
+namespace {
+
+constexpr uint32_t kWidth = 320;
+constexpr uint32_t kHeight = 240;
+constexpr size_t kDcSymbols = 12;
+constexpr size_t kAcSymbols = 162;
+
+struct ErrorManager {
+    jpeg_error_mgr mgr;
+    jmp_buf jumpBuffer;
+};
+
+// RGB frames: smooth gradients, or noise that uses many more AC symbols.
+std::vector<uint8_t> makeFrame(bool noisy) {
+    std::vector<uint8_t> rgb(kWidth * kHeight * 3);
+    uint32_t seed = 1;
+    for (uint32_t y = 0; y < kHeight; y++) {
+        for (uint32_t x = 0; x < kWidth; x++) {
+            uint8_t* pixel = &rgb[(y * kWidth + x) * 3];
+            if (noisy) {
+                for (int c = 0; c < 3; c++) {
+                    seed = seed * 1103515245 + 12345;
+                    pixel[c] = static_cast<uint8_t>(seed >> 16);
+                }
+            } else {
+                pixel[0] = static_cast<uint8_t>(128 + 100 * sin(x / 50.0));
+                pixel[1] = static_cast<uint8_t>(128 + 100 * cos(y / 40.0));
+                pixel[2] = static_cast<uint8_t>((x + y) / 3);
+            }
+        }
+    }
+    return rgb;
+}
+
+// Compresses rgb with tables, or with optimize_coding, in which case the optimal tables are
+// returned in optimal. Returns the size of the JPEG, 0 if libjpeg failed.
+size_t compress(const std::vector<uint8_t>& rgb, const HuffmanTables* tables,
+                HuffmanTables* optimal = nullptr) {
+    jpeg_compress_struct cInfo{};
+    ErrorManager error{};
+    cInfo.err = jpeg_std_error(&error.mgr);
+    error.mgr.error_exit = [](j_common_ptr info) {
+        longjmp(reinterpret_cast<ErrorManager*>(info->err)->jumpBuffer, 1);
+    };
+    unsigned char* out = nullptr;
+    unsigned long outSize = 0;
+    if (setjmp(error.jumpBuffer)) {
+        jpeg_destroy_compress(&cInfo);
+        free(out);
+        return 0;
+    }
+    jpeg_create_compress(&cInfo);
+    jpeg_mem_dest(&cInfo, &out, &outSize);
+    cInfo.image_width = kWidth;
+    cInfo.image_height = kHeight;
+    cInfo.input_components = 3;
+    cInfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cInfo);
+    jpeg_set_quality(&cInfo, 85, TRUE);
+    if (tables != nullptr) {
+        HuffmanOptimizer::applyTables(*tables, &cInfo);
+    } else {
+        cInfo.optimize_coding = TRUE;
+    }
+    jpeg_start_compress(&cInfo, TRUE);
+    while (cInfo.next_scanline < kHeight) {
+        JSAMPROW row = const_cast<uint8_t*>(&rgb[cInfo.next_scanline * kWidth * 3]);
+        jpeg_write_scanlines(&cInfo, &row, 1);
+    }
+    jpeg_finish_compress(&cInfo);
+    if (optimal != nullptr) {
+        for (size_t i = 0; i < optimal->dc.size(); i++) {
+            optimal->dc[i] = *cInfo.dc_huff_tbl_ptrs[i];
+            optimal->ac[i] = *cInfo.ac_huff_tbl_ptrs[i];
+        }
+    }
+    jpeg_destroy_compress(&cInfo);
+    free(out);
+    return outSize;
+}
+
+HuffmanTables completeTables(const HuffmanTables& optimal) {
+    HuffmanTables tables;
+    for (size_t i = 0; i < tables.dc.size(); i++) {
+        HuffmanOptimizer::completeTable(optimal.dc[i], /*dc*/ true, &tables.dc[i]);
+        HuffmanOptimizer::completeTable(optimal.ac[i], /*dc*/ false, &tables.ac[i]);
+    }
+    return tables;
+}
+
+// Every symbol once, no code longer than 16 bits and the all ones code left unused, as libjpeg
+// requires.
+void expectComplete(const JHUFF_TBL& table, size_t symbols) {
+    size_t count = 0;
+    double kraft = 0;
+    EXPECT_EQ(table.bits[0], 0);
+    for (int length = 1; length <= 16; length++) {
+        count += table.bits[length];
+        kraft += table.bits[length] / static_cast<double>(1 << length);
+    }
+    ASSERT_EQ(count, symbols);
+    EXPECT_LT(kraft, 1.0);
+    std::set<uint8_t> seen(table.huffval, table.huffval + count);
+    EXPECT_EQ(seen.size(), symbols);
+}
+
+TEST(HuffmanOptimizerTest, StandardTablesCanBeCompleted) {
+    HuffmanTables tables = completeTables(HuffmanOptimizer::getStandardTables());
+    for (size_t i = 0; i < tables.dc.size(); i++) {
+        expectComplete(tables.dc[i], kDcSymbols);
+        expectComplete(tables.ac[i], kAcSymbols);
+    }
+}
+
+// A smooth frame uses few symbols, the completed tables still have codes for all of them.
+TEST(HuffmanOptimizerTest, CompletedTablesCodeEverySymbol) {
+    HuffmanTables optimal;
+    ASSERT_GT(compress(makeFrame(/*noisy*/ false), /*tables*/ nullptr, &optimal), 0u);
+    HuffmanTables tables = completeTables(optimal);
+    for (size_t i = 0; i < tables.dc.size(); i++) {
+        expectComplete(tables.dc[i], kDcSymbols);
+        expectComplete(tables.ac[i], kAcSymbols);
+    }
+}
+
+TEST(HuffmanOptimizerTest, CompletedTablesAreCloseToOptimal) {
+    std::vector<uint8_t> frame = makeFrame(/*noisy*/ false);
+    HuffmanTables optimal;
+    size_t optimalBytes = compress(frame, /*tables*/ nullptr, &optimal);
+    ASSERT_GT(optimalBytes, 0u);
+    size_t standardBytes = compress(frame, &HuffmanOptimizer::getStandardTables());
+    HuffmanTables tables = completeTables(optimal);
+    size_t completedBytes = compress(frame, &tables);
+    ASSERT_GT(completedBytes, 0u);
+    EXPECT_LT(completedBytes, standardBytes);
+    // Codes for the unused symbols cost a little, and so do the longer DHT segments that carry
+    // them: up to one byte per symbol of the two AC tables.
+    EXPECT_LT(completedBytes, optimalBytes * 102 / 100 + 2 * kAcSymbols);
+}
+
+// Tables fitted to one frame are used for the frames after it, which may look nothing alike.
+TEST(HuffmanOptimizerTest, CompletedTablesEncodeOtherFrames) {
+    HuffmanTables optimal;
+    ASSERT_GT(compress(makeFrame(/*noisy*/ false), /*tables*/ nullptr, &optimal), 0u);
+    HuffmanTables tables = completeTables(optimal);
+    EXPECT_GT(compress(makeFrame(/*noisy*/ true), &tables), 0u);
+}
+
+}  // anonymous namespace
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "JpegUtils.h"
+
+namespace android {
+namespace webcam {
+namespace {
+
+struct Gray {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    std::vector<uint8_t> pixels;
+
+    [[nodiscard]] uint8_t at(uint32_t x, uint32_t y) const { return pixels[y * width + x]; }
+};
+
+// Smooth content, so that a downscaled JPEG can be compared with a box filtered source.
+uint8_t patternLuma(uint32_t x, uint32_t y) {
+    return static_cast<uint8_t>(128 + 60 * sin(x / 37.0) + 50 * cos(y / 23.0));
+}
+
+// 4:2:0 JPEG of the pattern, with libjpeg's default settings.
+std::vector<uint8_t> encodePattern(uint32_t width, uint32_t height) {
+    jpeg_compress_struct cinfo{};
+    jpeg_error_mgr error{};
+    cinfo.err = jpeg_std_error(&error);
+    jpeg_create_compress(&cinfo);
+    unsigned char* out = nullptr;
+    unsigned long outSize = 0;
+    jpeg_mem_dest(&cinfo, &out, &outSize);
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 95, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    std::vector<uint8_t> row(width * 3);
+    while (cinfo.next_scanline < height) {
+        for (uint32_t x = 0; x < width; x++) {
+            uint8_t luma = patternLuma(x, cinfo.next_scanline);
+            row[3 * x] = luma;
+            row[3 * x + 1] = luma;
+            row[3 * x + 2] = static_cast<uint8_t>(255 - luma);
+        }
+        JSAMPROW rowPtr = row.data();
+        jpeg_write_scanlines(&cinfo, &rowPtr, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    std::vector<uint8_t> ret(out, out + outSize);
+    free(out);
+    return ret;
+}
+
+Gray decodeGray(const uint8_t* data, size_t size) {
+    jpeg_decompress_struct dinfo{};
+    jpeg_error_mgr error{};
+    dinfo.err = jpeg_std_error(&error);
+    jpeg_create_decompress(&dinfo);
+    jpeg_mem_src(&dinfo, data, size);
+    jpeg_read_header(&dinfo, TRUE);
+    dinfo.out_color_space = JCS_GRAYSCALE;
+    jpeg_start_decompress(&dinfo);
+    Gray ret;
+    ret.width = dinfo.output_width;
+    ret.height = dinfo.output_height;
+    ret.pixels.resize(ret.width * ret.height);
+    while (dinfo.output_scanline < dinfo.output_height) {
+        JSAMPROW row = ret.pixels.data() + dinfo.output_scanline * ret.width;
+        jpeg_read_scanlines(&dinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&dinfo);
+    jpeg_destroy_decompress(&dinfo);
+    return ret;
+}
+
+// Mean absolute difference between out and the denom x denom box filtered window of src at
+// (cropX, cropY), optionally rotated by 180 degrees. Skips a border of 8 output pixels, where
+// block edges differ.
+double meanDifference(const Gray& src, const Gray& out, const JpegTransform& transform) {
+    uint32_t denom = transform.scaleDenom;
+    double sum = 0;
+    uint64_t count = 0;
+    for (uint32_t y = 8; y + 8 < out.height; y++) {
+        for (uint32_t x = 8; x + 8 < out.width; x++) {
+            uint32_t ox = transform.rotate180 ? out.width - 1 - x : x;
+            uint32_t oy = transform.rotate180 ? out.height - 1 - y : y;
+            uint32_t box = 0;
+            for (uint32_t dy = 0; dy < denom; dy++) {
+                for (uint32_t dx = 0; dx < denom; dx++) {
+                    box += src.at(transform.cropX + ox * denom + dx,
+                                  transform.cropY + oy * denom + dy);
+                }
+            }
+            sum += fabs(static_cast<double>(box) / (denom * denom) - out.at(x, y));
+            count++;
+        }
+    }
+    return count == 0 ? 1e9 : sum / count;
+}
+
+class JpegTransformerTest : public ::testing::Test {
+  protected:
+    // Plans and runs the transform, checks the output against the source and returns it.
+    Gray transformAndCompare(uint32_t srcWidth, uint32_t srcHeight, uint32_t dstWidth,
+                             uint32_t dstHeight, bool rotate180, uint32_t expectedScaleDenom,
+                             double maxMeanDifference) {
+        std::vector<uint8_t> jpeg = encodePattern(srcWidth, srcHeight);
+        JpegTransform transform;
+        EXPECT_TRUE(planJpegTransform(srcWidth, srcHeight, dstWidth, dstHeight, rotate180,
+                                      &transform));
+        EXPECT_EQ(transform.scaleDenom, expectedScaleDenom);
+        std::vector<uint8_t> dst(dstWidth * dstHeight * 2);
+        size_t size = mTransformer.transform(jpeg.data(), jpeg.size(), transform, dst.data(),
+                                             dst.size());
+        EXPECT_GT(size, 0u);
+        if (size == 0) {
+            return {};
+        }
+        Gray src = decodeGray(jpeg.data(), jpeg.size());
+        Gray out = decodeGray(dst.data(), size);
+        EXPECT_EQ(out.width, dstWidth);
+        EXPECT_EQ(out.height, dstHeight);
+        if (out.width == dstWidth && out.height == dstHeight) {
+            EXPECT_LT(meanDifference(src, out, transform), maxMeanDifference);
+        }
+        return out;
+    }
+
+    JpegTransformer mTransformer;
+};
+
+TEST_F(JpegTransformerTest, PlanPicksTheLargestCoveringScale) {
+    JpegTransform transform;
+    ASSERT_TRUE(planJpegTransform(3840, 2160, 1920, 1080, /*rotate180*/ false, &transform));
+    EXPECT_EQ(transform.scaleDenom, 2u);
+    EXPECT_EQ(transform.cropX, 0u);
+    EXPECT_EQ(transform.cropY, 0u);
+    ASSERT_TRUE(planJpegTransform(1920, 1088, 1920, 1080, /*rotate180*/ false, &transform));
+    EXPECT_EQ(transform.scaleDenom, 1u);
+    EXPECT_EQ(transform.cropY % 16, 0u);
+    // Cropping away more than a quarter should be resampled instead.
+    EXPECT_FALSE(planJpegTransform(1920, 1080, 640, 640, /*rotate180*/ false, &transform));
+    EXPECT_FALSE(planJpegTransform(640, 480, 1280, 720, /*rotate180*/ false, &transform));
+}
+
+TEST_F(JpegTransformerTest, CropCopiesBlocks) {
+    transformAndCompare(640, 512, 640, 480, /*rotate180*/ false, 1, 1.0);
+}
+
+TEST_F(JpegTransformerTest, DownscaleByTwo) {
+    transformAndCompare(1280, 960, 640, 480, /*rotate180*/ false, 2, 3.0);
+}
+
+TEST_F(JpegTransformerTest, DownscaleByFour) {
+    transformAndCompare(1280, 960, 320, 240, /*rotate180*/ false, 4, 4.0);
+}
+
+TEST_F(JpegTransformerTest, Rotate180) {
+    transformAndCompare(640, 480, 640, 480, /*rotate180*/ true, 1, 1.0);
+}
+
+TEST_F(JpegTransformerTest, DownscaleAndRotate180) {
+    transformAndCompare(1280, 960, 640, 480, /*rotate180*/ true, 2, 3.0);
+}
+
+// The transformer is long lived, frames of different sizes go through the same instance.
+TEST_F(JpegTransformerTest, ReusedAcrossSizes) {
+    for (int i = 0; i < 2; i++) {
+        transformAndCompare(1280, 960, 640, 480, /*rotate180*/ false, 2, 3.0);
+        transformAndCompare(640, 512, 640, 480, /*rotate180*/ true, 1, 1.0);
+    }
+}
+
+TEST_F(JpegTransformerTest, FailsIfTheOutputDoesntFit) {
+    std::vector<uint8_t> jpeg = encodePattern(1280, 960);
+    JpegTransform transform;
+    ASSERT_TRUE(planJpegTransform(1280, 960, 640, 480, /*rotate180*/ false, &transform));
+    std::vector<uint8_t> dst(256);
+    EXPECT_EQ(mTransformer.transform(jpeg.data(), jpeg.size(), transform, dst.data(), dst.size()),
+              0u);
+    // And recovers for the next frame.
+    transformAndCompare(1280, 960, 640, 480, /*rotate180*/ false, 2, 3.0);
+}
+
+TEST_F(JpegTransformerTest, FailsOnATruncatedHeader) {
+    std::vector<uint8_t> jpeg = encodePattern(640, 480);
+    jpeg.resize(64);
+    JpegTransform transform;
+    ASSERT_TRUE(planJpegTransform(640, 480, 640, 480, /*rotate180*/ true, &transform));
+    std::vector<uint8_t> dst(640 * 480 * 2);
+    EXPECT_EQ(mTransformer.transform(jpeg.data(), jpeg.size(), transform, dst.data(), dst.size()),
+              0u);
+    // And recovers for the next frame.
+    transformAndCompare(640, 480, 640, 480, /*rotate180*/ true, 1, 1.0);
+}
+
+}  // anonymous namespace
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <gtest/gtest.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <initializer_list>
+#include <vector>
+
+#include "JpegUtils.h"
+
+namespace android {
+namespace webcam {
+namespace {
+
+using Bytes = std::vector<uint8_t>;
+
+constexpr uint16_t kCameraBlobIdJpeg = 0x00FF;
+
+void append(Bytes* bytes, std::initializer_list<uint8_t> values) {
+    bytes->insert(bytes->end(), values);
+}
+
+// Marker segment with a payload of payloadSize bytes.
+void appendSegment(Bytes* bytes, uint8_t marker, size_t payloadSize) {
+    size_t length = payloadSize + 2;
+    append(bytes, {0xFF, marker, static_cast<uint8_t>(length >> 8),
+                   static_cast<uint8_t>(length & 0xFF)});
+    bytes->insert(bytes->end(), payloadSize, 0x11);
+}
+
+void appendSof(Bytes* bytes, uint8_t marker, uint16_t width, uint16_t height) {
+    append(bytes, {0xFF, marker, 0x00, 17, /*precision*/ 8, static_cast<uint8_t>(height >> 8),
+                   static_cast<uint8_t>(height & 0xFF), static_cast<uint8_t>(width >> 8),
+                   static_cast<uint8_t>(width & 0xFF), /*components*/ 3});
+    // id, sampling factors, quantization table of each component
+    append(bytes, {1, 0x22, 0, 2, 0x11, 1, 3, 0x11, 1});
+}
+
+// Headers like a camera writes them, entropy coded data that is just filler.
+Bytes makeJpeg(uint16_t width, uint16_t height) {
+    Bytes jpeg = {0xFF, 0xD8};
+    appendSegment(&jpeg, 0xE0, 14);   // APP0 (JFIF)
+    appendSegment(&jpeg, 0xE1, 200);  // APP1 (EXIF)
+    appendSegment(&jpeg, 0xDB, 130);  // DQT
+    appendSof(&jpeg, 0xC0, width, height);
+    appendSegment(&jpeg, 0xC4, 30);  // DHT
+    appendSegment(&jpeg, 0xDA, 10);  // SOS
+    jpeg.insert(jpeg.end(), 500, 0x5A);
+    append(&jpeg, {0xFF, 0xD9});
+    return jpeg;
+}
+
+// jpeg at the start of a BLOB buffer of blobSize bytes, ending with a CameraBlob trailer of
+// trailerSize if it is set.
+Bytes makeBlob(const Bytes& jpeg, size_t blobSize, bool trailer, uint32_t trailerSize) {
+    Bytes blob(blobSize, 0);
+    memcpy(blob.data(), jpeg.data(), jpeg.size());
+    if (trailer) {
+        struct {
+            uint16_t blobId;
+            uint16_t reserved;
+            uint32_t blobSizeBytes;
+        } camerablob = {kCameraBlobIdJpeg, 0, trailerSize};
+        memcpy(blob.data() + blobSize - sizeof(camerablob), &camerablob, sizeof(camerablob));
+    }
+    return blob;
+}
+
+TEST(JpegUtilsTest, CameraJpegSizeFromTheTrailer) {
+    Bytes jpeg = makeJpeg(640, 480);
+    Bytes blob = makeBlob(jpeg, 4096, /*trailer*/ true, jpeg.size());
+    // Left over EOI of an earlier, larger frame: the trailer wins.
+    blob[3000] = 0xFF;
+    blob[3001] = 0xD9;
+    EXPECT_EQ(getCameraJpegSize(blob.data(), blob.size()), jpeg.size());
+}
+
+TEST(JpegUtilsTest, CameraJpegSizeFromTheLastEoiWithoutATrailer) {
+    Bytes jpeg = makeJpeg(640, 480);
+    Bytes blob = makeBlob(jpeg, 4096, /*trailer*/ false, 0);
+    EXPECT_EQ(getCameraJpegSize(blob.data(), blob.size()), jpeg.size());
+    // Exactly the size of the JPEG.
+    EXPECT_EQ(getCameraJpegSize(jpeg.data(), jpeg.size()), jpeg.size());
+    // The last EOI is taken, even past the JPEG: parseJpegInfo checks what it ends up with.
+    blob[3000] = 0xFF;
+    blob[3001] = 0xD9;
+    EXPECT_EQ(getCameraJpegSize(blob.data(), blob.size()), 3002u);
+}
+
+TEST(JpegUtilsTest, CameraJpegSizeIgnoresABadTrailer) {
+    Bytes jpeg = makeJpeg(640, 480);
+    for (uint32_t trailerSize : {0u, 4096u - 7, 4096u, 100000u}) {
+        Bytes blob = makeBlob(jpeg, 4096, /*trailer*/ true, trailerSize);
+        EXPECT_EQ(getCameraJpegSize(blob.data(), blob.size()), jpeg.size()) << trailerSize;
+    }
+}
+
+TEST(JpegUtilsTest, CameraJpegSizeWithoutAJpeg) {
+    Bytes blob(4096, 0);
+    EXPECT_EQ(getCameraJpegSize(blob.data(), blob.size()), 0u);
+    EXPECT_EQ(getCameraJpegSize(blob.data(), 4), 0u);
+    EXPECT_EQ(getCameraJpegSize(nullptr, 4096), 0u);
+}
+
+TEST(JpegUtilsTest, ParsesTheFrameHeaderAfterAppSegments) {
+    Bytes jpeg = makeJpeg(1920, 1080);
+    JpegInfo info;
+    ASSERT_TRUE(parseJpegInfo(jpeg.data(), jpeg.size(), &info));
+    EXPECT_EQ(info.width, 1920u);
+    EXPECT_EQ(info.height, 1080u);
+    EXPECT_EQ(info.numComponents, 3u);
+}
+
+TEST(JpegUtilsTest, ParsesProgressiveFrameHeadersAndFillBytes) {
+    Bytes jpeg = {0xFF, 0xD8};
+    appendSegment(&jpeg, 0xE0, 14);
+    // Fill bytes may precede any marker.
+    append(&jpeg, {0xFF, 0xFF});
+    appendSof(&jpeg, 0xC2, 320, 240);
+    appendSegment(&jpeg, 0xDA, 10);
+    append(&jpeg, {0x12, 0x34, 0xFF, 0xD9});
+    JpegInfo info;
+    ASSERT_TRUE(parseJpegInfo(jpeg.data(), jpeg.size(), &info));
+    EXPECT_EQ(info.width, 320u);
+    EXPECT_EQ(info.height, 240u);
+}
+
+TEST(JpegUtilsTest, RejectsMissingSoiOrEoi) {
+    Bytes jpeg = makeJpeg(640, 480);
+    JpegInfo info;
+    Bytes noSoi = jpeg;
+    noSoi[1] = 0xE0;
+    EXPECT_FALSE(parseJpegInfo(noSoi.data(), noSoi.size(), &info));
+    // Cut short, like a frame the camera didn't finish.
+    EXPECT_FALSE(parseJpegInfo(jpeg.data(), jpeg.size() - 1, &info));
+    EXPECT_FALSE(parseJpegInfo(jpeg.data(), 1, &info));
+    EXPECT_FALSE(parseJpegInfo(nullptr, jpeg.size(), &info));
+}
+
+TEST(JpegUtilsTest, RejectsTruncatedSegments) {
+    JpegInfo info;
+    // APP1 claims more bytes than there are before EOI.
+    Bytes truncated = {0xFF, 0xD8, 0xFF, 0xE1, 0x10, 0x00, 0x11, 0x11, 0xFF, 0xD9};
+    EXPECT_FALSE(parseJpegInfo(truncated.data(), truncated.size(), &info));
+    // A length shorter than the length field itself.
+    Bytes shortLength = {0xFF, 0xD8, 0xFF, 0xE0, 0x00, 0x01, 0xFF, 0xD9};
+    EXPECT_FALSE(parseJpegInfo(shortLength.data(), shortLength.size(), &info));
+    // A frame header too short for the dimensions.
+    Bytes shortSof = {0xFF, 0xD8, 0xFF, 0xC0, 0x00, 0x04, 0x08, 0x01, 0xFF, 0xD9};
+    EXPECT_FALSE(parseJpegInfo(shortSof.data(), shortSof.size(), &info));
+    // Garbage where a marker should be.
+    Bytes noMarker = {0xFF, 0xD8, 0x12, 0x34, 0x00, 0x04, 0xFF, 0xD9};
+    EXPECT_FALSE(parseJpegInfo(noMarker.data(), noMarker.size(), &info));
+}
+
+TEST(JpegUtilsTest, RejectsScansWithoutAFrameHeader) {
+    Bytes jpeg = {0xFF, 0xD8};
+    appendSegment(&jpeg, 0xE0, 14);
+    appendSegment(&jpeg, 0xDA, 10);
+    append(&jpeg, {0x12, 0x34, 0xFF, 0xD9});
+    JpegInfo info;
+    EXPECT_FALSE(parseJpegInfo(jpeg.data(), jpeg.size(), &info));
+    // Zero dimensions.
+    Bytes empty = {0xFF, 0xD8};
+    appendSof(&empty, 0xC0, 0, 480);
+    append(&empty, {0xFF, 0xD9});
+    EXPECT_FALSE(parseJpegInfo(empty.data(), empty.size(), &info));
+}
+
+}  // anonymous namespace
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdint>
+
+#include "PhaseController.h"
+
+namespace android {
+namespace webcam {
+namespace {
+
+using Clock = PhaseController::Clock;
+using std::chrono::microseconds;
+using std::chrono::nanoseconds;
+
+constexpr microseconds kPeriod(33'333);
+
+// Simulates a 30 fps camera, with alternating early and late fills, and a consumer picking up at
+// the same rate, consumerOffset later. A pickup with a hold is put off by it, as the UVC thread
+// does, which shifts the later ones too. Returns the average age of the delivered frames.
+microseconds simulate(microseconds consumerOffset, microseconds jitter, bool alignPhase,
+                      uint32_t frames) {
+    PhaseController controller;
+    Clock::time_point start;
+    uint32_t fills = 0;
+    Clock::time_point newestFilled;
+    auto fillUntil = [&](Clock::time_point now) {
+        for (;;) {
+            Clock::time_point fill =
+                    start + kPeriod * (fills + 1) + (fills % 2 == 0 ? jitter : -jitter);
+            if (fill > now) {
+                return;
+            }
+            controller.onBufferFilled(fill);
+            newestFilled = fill;
+            fills++;
+        }
+    };
+
+    Clock::time_point pickup = start + kPeriod + consumerOffset + jitter;
+    microseconds totalAge(0);
+    for (uint32_t i = 0; i < frames; i++) {
+        fillUntil(pickup);
+        if (alignPhase) {
+            pickup += controller.getHold(pickup, newestFilled);
+            fillUntil(pickup);
+        }
+        totalAge += std::chrono::duration_cast<microseconds>(pickup - newestFilled);
+        pickup += kPeriod;
+    }
+    return totalAge / frames;
+}
+
+TEST(PhaseControllerTest, NoHoldUntilThePeriodIsKnown) {
+    PhaseController controller;
+    Clock::time_point now;
+    for (uint32_t i = 0; i < PhaseController::kMinIntervals; i++) {
+        now += kPeriod;
+        controller.onBufferFilled(now);
+        EXPECT_EQ(controller.getHold(now + kPeriod - microseconds(2000), now).count(), 0) << i;
+    }
+}
+
+TEST(PhaseControllerTest, HoldsForTheNextFrameIfItIsDueSoon) {
+    PhaseController controller;
+    Clock::time_point now;
+    for (uint32_t i = 0; i <= PhaseController::kMinIntervals; i++) {
+        now += kPeriod;
+        controller.onBufferFilled(now);
+    }
+    EXPECT_NEAR(controller.getPeriodNs(), nanoseconds(kPeriod).count(), 1000);
+    // The waiting frame is 30ms old, the next one is due in 3.3ms.
+    nanoseconds hold = controller.getHold(now + microseconds(30'000), now);
+    EXPECT_GT(hold, microseconds(3000));
+    EXPECT_LT(hold, microseconds(4000));
+    // Too far away: more than half a frame interval.
+    EXPECT_EQ(controller.getHold(now + microseconds(10'000), now).count(), 0);
+}
+
+TEST(PhaseControllerTest, StartsOverAfterAGap) {
+    PhaseController controller;
+    Clock::time_point now;
+    for (uint32_t i = 0; i <= PhaseController::kMinIntervals; i++) {
+        now += kPeriod;
+        controller.onBufferFilled(now);
+    }
+    // Frames dropped, or the rate changed: no holds until the new period is known.
+    now += 5 * kPeriod;
+    controller.onBufferFilled(now);
+    EXPECT_EQ(controller.getHold(now + microseconds(30'000), now).count(), 0);
+}
+
+// A consumer 25ms out of phase with a 30 fps camera, as in the change that added phase
+// alignment.
+TEST(PhaseControllerTest, AlignedPickupsDeliverFresherFrames) {
+    microseconds offset(25'000);
+    microseconds unaligned = simulate(offset, microseconds(0), /*alignPhase*/ false, 300);
+    microseconds aligned = simulate(offset, microseconds(0), /*alignPhase*/ true, 300);
+    EXPECT_GT(unaligned, microseconds(20'000));
+    EXPECT_LT(aligned, microseconds(3'000));
+
+    microseconds jitter(1'000);
+    unaligned = simulate(offset, jitter, /*alignPhase*/ false, 300);
+    aligned = simulate(offset, jitter, /*alignPhase*/ true, 300);
+    EXPECT_LT(aligned * 2, unaligned);
+}
+
+}  // anonymous namespace
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "I420.h"
+#include "PreviewSink.h"
+
+namespace android {
+namespace webcam {
+namespace {
+
+constexpr std::chrono::seconds kTimeout(5);
+
+// Window over a plain RGBA buffer. lock() blocks while the test holds it, like a consumer that
+// hasn't released a buffer yet.
+class StubPreviewWindow : public PreviewWindow {
+  public:
+    StubPreviewWindow(uint32_t width, uint32_t height)
+        : mWidth(width), mHeight(height), mPixels(static_cast<size_t>(width) * height * 4) {}
+
+    [[nodiscard]] uint32_t getWidth() const override { return mWidth; }
+    [[nodiscard]] uint32_t getHeight() const override { return mHeight; }
+
+    bool lock(Buffer* buffer) override {
+        std::unique_lock<std::mutex> l(mLock);
+        mCondition.wait(l, [this] { return !mBlocked; });
+        buffer->pixels = mPixels.data();
+        buffer->stride = mWidth;
+        buffer->width = mWidth;
+        buffer->height = mHeight;
+        return true;
+    }
+
+    bool unlockAndPost() override {
+        std::lock_guard<std::mutex> l(mLock);
+        mPosted++;
+        mCondition.notify_all();
+        return true;
+    }
+
+    void setBlocked(bool blocked) {
+        std::lock_guard<std::mutex> l(mLock);
+        mBlocked = blocked;
+        mCondition.notify_all();
+    }
+
+    bool waitForPosts(uint32_t posts) {
+        std::unique_lock<std::mutex> l(mLock);
+        return mCondition.wait_for(l, kTimeout, [&] { return mPosted >= posts; });
+    }
+
+    // RGBA of a pixel, only valid after a post.
+    const uint8_t* at(uint32_t x, uint32_t y) {
+        std::lock_guard<std::mutex> l(mLock);
+        return &mPixels[(static_cast<size_t>(y) * mWidth + x) * 4];
+    }
+
+  private:
+    const uint32_t mWidth;
+    const uint32_t mHeight;
+    std::vector<uint8_t> mPixels;
+    std::mutex mLock;
+    std::condition_variable mCondition;  // guarded by mLock
+    bool mBlocked = false;               // guarded by mLock
+    uint32_t mPosted = 0;                // guarded by mLock
+};
+
+// I420 frame with neutral chroma, luma from lumaAt(x, y).
+class TestFrame {
+  public:
+    template <typename LumaFn>
+    TestFrame(uint32_t width, uint32_t height, LumaFn lumaAt)
+        : mData(static_cast<size_t>(width) * height * 3 / 2, 128) {
+        for (uint32_t y = 0; y < height; y++) {
+            for (uint32_t x = 0; x < width; x++) {
+                mData[static_cast<size_t>(y) * width + x] = lumaAt(x, y);
+            }
+        }
+        mI420.y = mData.data();
+        mI420.u = mI420.y + static_cast<size_t>(width) * height;
+        mI420.v = mI420.u + static_cast<size_t>(width / 2) * (height / 2);
+        mI420.yRowStride = width;
+        mI420.uRowStride = mI420.vRowStride = width / 2;
+        mI420.width = width;
+        mI420.height = height;
+    }
+
+    [[nodiscard]] const I420& get() const { return mI420; }
+
+  private:
+    std::vector<uint8_t> mData;
+    I420 mI420;
+};
+
+class PreviewSinkTest : public ::testing::Test {
+  protected:
+    void TearDown() override { mSink.setWindow(nullptr); }
+
+    // The sink owns the window, the test keeps a pointer to it until TearDown.
+    StubPreviewWindow* setWindow(uint32_t width, uint32_t height) {
+        auto window = std::make_unique<StubPreviewWindow>(width, height);
+        StubPreviewWindow* ret = window.get();
+        mSink.setWindow(std::move(window));
+        return ret;
+    }
+
+    // The preview thread goes idle right after it posts.
+    void waitUntilActive() {
+        auto deadline = std::chrono::steady_clock::now() + kTimeout;
+        while (!mSink.isActive() && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    PreviewSink& mSink = PreviewSink::getInstance();
+};
+
+TEST_F(PreviewSinkTest, InactiveWithoutAWindow) {
+    EXPECT_FALSE(mSink.isActive());
+    TestFrame frame(64, 48, [](uint32_t, uint32_t) { return 128; });
+    mSink.offerFrame(frame.get());
+    EXPECT_EQ(mSink.getStats().offered, 0u);
+}
+
+TEST_F(PreviewSinkTest, DrawsScaledFrames) {
+    StubPreviewWindow* window = setWindow(320, 240);
+    ASSERT_TRUE(mSink.isActive());
+    TestFrame frame(640, 480, [](uint32_t, uint32_t) { return 200; });
+    mSink.offerFrame(frame.get());
+    ASSERT_TRUE(window->waitForPosts(1));
+    for (uint32_t y : {0u, 120u, 239u}) {
+        for (uint32_t x : {0u, 160u, 319u}) {
+            const uint8_t* rgba = window->at(x, y);
+            // Video range luma 200 is about 215 in full range.
+            EXPECT_NEAR(rgba[0], 215, 4) << x << "," << y;
+            EXPECT_NEAR(rgba[1], 215, 4) << x << "," << y;
+            EXPECT_NEAR(rgba[2], 215, 4) << x << "," << y;
+            EXPECT_EQ(rgba[3], 255) << x << "," << y;
+        }
+    }
+    waitUntilActive();
+    EXPECT_EQ(mSink.getStats().offered, 1u);
+    EXPECT_EQ(mSink.getStats().posted, 1u);
+}
+
+TEST_F(PreviewSinkTest, CropsToTheWindowAspectRatio) {
+    // 16:9 frame with dark bars left and right of its centered square, into a square window.
+    StubPreviewWindow* window = setWindow(90, 90);
+    TestFrame frame(640, 360, [](uint32_t x, uint32_t) { return x < 140 || x >= 500 ? 16 : 235; });
+    mSink.offerFrame(frame.get());
+    ASSERT_TRUE(window->waitForPosts(1));
+    for (uint32_t x : {0u, 45u, 89u}) {
+        EXPECT_GT(window->at(x, 45)[0], 240) << x;
+    }
+}
+
+TEST_F(PreviewSinkTest, SkipsFramesWhileDrawing) {
+    StubPreviewWindow* window = setWindow(64, 48);
+    window->setBlocked(true);
+    TestFrame frame(128, 96, [](uint32_t x, uint32_t y) { return (x + y) % 256; });
+    mSink.offerFrame(frame.get());
+    // The preview thread waits for a buffer, the encoder must not.
+    for (int i = 0; i < 3; i++) {
+        mSink.offerFrame(frame.get());
+    }
+    EXPECT_EQ(mSink.getStats().offered, 1u);
+    window->setBlocked(false);
+    ASSERT_TRUE(window->waitForPosts(1));
+
+    waitUntilActive();
+    mSink.offerFrame(frame.get());
+    ASSERT_TRUE(window->waitForPosts(2));
+    EXPECT_EQ(mSink.getStats().offered, 2u);
+}
+
+TEST(I420Test, CropToAspectRatioCentersOnEvenPixels) {
+    uint8_t planes[3] = {};
+    I420 in;
+    in.y = &planes[0];
+    in.u = &planes[1];
+    in.v = &planes[2];
+    in.yRowStride = 1920;
+    in.uRowStride = in.vRowStride = 960;
+    in.width = 1920;
+    in.height = 1080;
+
+    I420 crop = cropToAspectRatio(in, 4, 3);
+    EXPECT_EQ(crop.width, 1440u);
+    EXPECT_EQ(crop.height, 1080u);
+    EXPECT_EQ(crop.y - in.y, 240);
+    EXPECT_EQ(crop.u - in.u, 120);
+
+    crop = cropToAspectRatio(in, 1, 1);
+    EXPECT_EQ(crop.width, 1080u);
+    EXPECT_EQ(crop.y - in.y, 420);
+
+    // Taller: rows are cropped, at an even row.
+    in.width = in.yRowStride = 640;
+    in.height = 640;
+    in.uRowStride = in.vRowStride = 320;
+    crop = cropToAspectRatio(in, 16, 9);
+    EXPECT_EQ(crop.width, 640u);
+    EXPECT_EQ(crop.height, 360u);
+    EXPECT_EQ(crop.y - in.y, 140 * 640);
+    EXPECT_EQ(crop.u - in.u, 70 * 320);
+
+    // Same aspect ratio: untouched.
+    crop = cropToAspectRatio(in, 320, 320);
+    EXPECT_EQ(crop.width, 640u);
+    EXPECT_EQ(crop.height, 640u);
+    EXPECT_EQ(crop.y, in.y);
+}
+
+}  // anonymous namespace
+}  // namespace webcam
+}  // namespace android
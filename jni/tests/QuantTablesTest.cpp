@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <gtest/gtest.h>
+
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+#include "I420.h"
+#include "QuantTables.h"
+
+namespace android {
+namespace webcam {
+namespace {
+
+constexpr uint32_t kWidth = 160;
+constexpr uint32_t kHeight = 120;
+
+uint8_t clampPixel(int value) {
+    return static_cast<uint8_t>(std::min(std::max(value, 0), 255));
+}
+
+// Uniform in [-amplitude, amplitude].
+int noise(int amplitude, uint32_t* seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return static_cast<int>((*seed >> 16) % (2 * amplitude + 1)) - amplitude;
+}
+
+// I420 image with padded rows, so that the strides differ from the widths.
+struct Image {
+    explicit Image(uint32_t padding = 0) {
+        view.width = kWidth;
+        view.height = kHeight;
+        view.yRowStride = kWidth + padding;
+        view.uRowStride = view.vRowStride = kWidth / 2 + padding;
+        size_t lumaSize = static_cast<size_t>(view.yRowStride) * kHeight;
+        size_t chromaSize = static_cast<size_t>(view.uRowStride) * (kHeight / 2);
+        pixels.assign(lumaSize + 2 * chromaSize, 0);
+        view.y = pixels.data();
+        view.u = view.y + lumaSize;
+        view.v = view.u + chromaSize;
+    }
+
+    // Smooth content, plus noise of up to +-lumaNoise / chromaNoise.
+    void fill(int lumaNoise, int chromaNoise) {
+        uint32_t seed = 1;
+        for (uint32_t row = 0; row < kHeight; row++) {
+            for (uint32_t col = 0; col < kWidth; col++) {
+                int luma = static_cast<int>(128 + 60 * sin(col / 13.0) + 40 * cos(row / 7.0));
+                view.y[row * view.yRowStride + col] = clampPixel(luma + noise(lumaNoise, &seed));
+            }
+        }
+        for (uint32_t row = 0; row < kHeight / 2; row++) {
+            for (uint32_t col = 0; col < kWidth / 2; col++) {
+                int u = static_cast<int>(100 + col);
+                int v = static_cast<int>(160 - row);
+                view.u[row * view.uRowStride + col] = clampPixel(u + noise(chromaNoise, &seed));
+                view.v[row * view.vRowStride + col] = clampPixel(v + noise(chromaNoise, &seed));
+            }
+        }
+    }
+
+    I420 view;
+    std::vector<uint8_t> pixels;
+};
+
+TEST(QuantTablesTest, SsimOfIdenticalImagesIsOne) {
+    Image a;
+    a.fill(/*lumaNoise*/ 0, /*chromaNoise*/ 0);
+    EXPECT_NEAR(computeSsim(a.view, a.view), 1.0, 1e-9);
+    // Only the pixels count, not the row padding.
+    Image b(/*padding*/ 24);
+    b.fill(/*lumaNoise*/ 0, /*chromaNoise*/ 0);
+    EXPECT_NEAR(computeSsim(a.view, b.view), 1.0, 1e-9);
+}
+
+TEST(QuantTablesTest, SsimIsSymmetric) {
+    Image a;
+    a.fill(/*lumaNoise*/ 0, /*chromaNoise*/ 0);
+    Image b(/*padding*/ 8);
+    b.fill(/*lumaNoise*/ 10, /*chromaNoise*/ 10);
+    EXPECT_NEAR(computeSsim(a.view, b.view), computeSsim(b.view, a.view), 1e-9);
+}
+
+TEST(QuantTablesTest, SsimDropsWithMoreNoise) {
+    Image reference;
+    reference.fill(/*lumaNoise*/ 0, /*chromaNoise*/ 0);
+    double previous = 1.0;
+    for (int noise : {2, 8, 32}) {
+        Image noisy;
+        noisy.fill(noise, noise);
+        double ssim = computeSsim(reference.view, noisy.view);
+        EXPECT_LT(ssim, previous) << noise;
+        EXPECT_GT(ssim, 0.0) << noise;
+        previous = ssim;
+    }
+}
+
+// Luma has four times the pixels of each chroma plane and weighs as much more: however bad the
+// chroma is, an exact luma plane keeps the SSIM above 4/6.
+TEST(QuantTablesTest, SsimWeighsPlanesByPixelCount) {
+    Image reference;
+    reference.fill(/*lumaNoise*/ 0, /*chromaNoise*/ 0);
+    Image noisyChroma;
+    noisyChroma.fill(/*lumaNoise*/ 0, /*chromaNoise*/ 64);
+    double chromaSsim = computeSsim(reference.view, noisyChroma.view);
+    EXPECT_GT(chromaSsim, 4.0 / 6);
+    EXPECT_LT(chromaSsim, 1.0);
+    Image noisyLuma;
+    noisyLuma.fill(/*lumaNoise*/ 64, /*chromaNoise*/ 0);
+    double lumaSsim = computeSsim(reference.view, noisyLuma.view);
+    EXPECT_GT(lumaSsim, 2.0 / 6);
+    EXPECT_LT(lumaSsim, chromaSsim);
+}
+
+}  // anonymous namespace
+}  // namespace webcam
+}  // namespace android
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <gtest/gtest.h>
+
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "SeqLock.h"
+
+namespace android {
+namespace webcam {
+namespace {
+
+// Not a multiple of the 8 byte words the lock copies through.
+struct Small {
+    uint32_t a = 0;
+    uint16_t b = 0;
+};
+
+// Several words, all derived from count, so that a torn read shows.
+struct Snapshot {
+    uint64_t count = 0;
+    uint64_t twice = 0;
+    uint64_t inverted = ~0ull;
+    uint32_t low = 0;
+};
+
+Snapshot makeSnapshot(uint64_t count) {
+    return {count, count * 2, ~count, static_cast<uint32_t>(count)};
+}
+
+TEST(SeqLockTest, StartsValueInitialized) {
+    SeqLock<Small> lock;
+    Small value = lock.read();
+    EXPECT_EQ(value.a, 0u);
+    EXPECT_EQ(value.b, 0u);
+}
+
+TEST(SeqLockTest, ReadsTheLastWrite) {
+    SeqLock<Small> small;
+    small.write({7, 3});
+    small.write({0xdeadbeef, 0xffff});
+    Small value = small.read();
+    EXPECT_EQ(value.a, 0xdeadbeef);
+    EXPECT_EQ(value.b, 0xffff);
+
+    SeqLock<Snapshot> snapshot;
+    snapshot.write(makeSnapshot(42));
+    Snapshot read = snapshot.read();
+    EXPECT_EQ(read.count, 42u);
+    EXPECT_EQ(read.twice, 84u);
+    EXPECT_EQ(read.inverted, ~42ull);
+    EXPECT_EQ(read.low, 42u);
+}
+
+// One writer publishing as fast as it can, like the encoder thread, and readers polling it, like
+// the control socket. Readers never see a mix of two writes, nor go back in time.
+TEST(SeqLockTest, ConcurrentReadsAreNeverTorn) {
+    constexpr uint64_t kWrites = 200000;
+    constexpr int kReaders = 3;
+    SeqLock<Snapshot> lock;
+    std::atomic<int> started = 0;
+    std::atomic<bool> done = false;
+    std::atomic<uint64_t> torn = 0;
+    std::atomic<uint64_t> backwards = 0;
+    std::vector<std::thread> readers;
+    for (int i = 0; i < kReaders; i++) {
+        readers.emplace_back([&] {
+            uint64_t last = 0;
+            started++;
+            while (!done.load(std::memory_order_relaxed)) {
+                Snapshot value = lock.read();
+                Snapshot expected = makeSnapshot(value.count);
+                if (value.twice != expected.twice || value.inverted != expected.inverted ||
+                    value.low != expected.low) {
+                    torn++;
+                }
+                if (value.count < last) {
+                    backwards++;
+                }
+                last = value.count;
+            }
+        });
+    }
+    while (started.load() < kReaders) {
+        std::this_thread::yield();
+    }
+    for (uint64_t i = 1; i <= kWrites; i++) {
+        lock.write(makeSnapshot(i));
+    }
+    done = true;
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+    EXPECT_EQ(torn.load(), 0u);
+    EXPECT_EQ(backwards.load(), 0u);
+    EXPECT_EQ(lock.read().count, kWrites);
+}
+
+}  // anonymous namespace
+}  // namespace webcam
+}  // namespace android
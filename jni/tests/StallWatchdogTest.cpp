@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+#include "StallWatchdog.h"
+#include "Tunables.h"
+
+namespace android {
+namespace webcam {
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+
+// FlightRecorder is process wide and stamps events with the real time, so the timelines below
+// start at the time of the last recorded event.
+Clock::time_point lastEventTime(FrameEvent event) {
+    return Clock::time_point(
+            std::chrono::nanoseconds(FlightRecorder::getInstance().getLastEventNs(event)));
+}
+
+// One frame through the whole frame path, returns when it was delivered.
+Clock::time_point deliverFrame() {
+    FlightRecorder& recorder = FlightRecorder::getInstance();
+    recorder.record(FrameEvent::CAMERA_FRAME);
+    recorder.record(FrameEvent::ENCODED, /*bufferIndex*/ 0);
+    recorder.record(FrameEvent::DELIVERED, /*bufferIndex*/ 0);
+    return lastEventTime(FrameEvent::DELIVERED);
+}
+
+class StallWatchdogTest : public ::testing::Test {
+  protected:
+    void TearDown() override { Tunables::getInstance().resetToDefaults(); }
+
+    StallWatchdog mWatchdog;
+};
+
+TEST_F(StallWatchdogTest, FirstFrameGetsMoreTime) {
+    Clock::time_point start = Clock::now();
+    mWatchdog.start(/*fps*/ 30, start);
+    EXPECT_EQ(mWatchdog.check(start + StallWatchdog::kFirstFrameTimeout - milliseconds(1)),
+              StallSource::NONE);
+    EXPECT_EQ(mWatchdog.check(start + StallWatchdog::kFirstFrameTimeout), StallSource::CAMERA);
+    EXPECT_EQ(mWatchdog.getStallCount(), 1u);
+}
+
+TEST_F(StallWatchdogTest, TimesOutAfterStallFrameIntervals) {
+    mWatchdog.start(/*fps*/ 30, Clock::now());
+    Clock::time_point delivered = deliverFrame();
+    // 15 intervals of 33.3ms
+    EXPECT_EQ(mWatchdog.check(delivered + milliseconds(499)), StallSource::NONE);
+    EXPECT_EQ(mWatchdog.check(delivered + milliseconds(500)), StallSource::CAMERA);
+}
+
+TEST_F(StallWatchdogTest, TimeoutScalesWithFrameRatePercent) {
+    Tunables::getInstance().setFrameRatePercent(50);
+    mWatchdog.start(/*fps*/ 30, Clock::now());
+    Clock::time_point delivered = deliverFrame();
+    EXPECT_EQ(mWatchdog.check(delivered + milliseconds(999)), StallSource::NONE);
+    EXPECT_EQ(mWatchdog.check(delivered + milliseconds(1000)), StallSource::CAMERA);
+}
+
+TEST_F(StallWatchdogTest, NotRunning) {
+    Clock::time_point start = Clock::now();
+    EXPECT_EQ(mWatchdog.check(start + seconds(10)), StallSource::NONE);
+    mWatchdog.start(/*fps*/ 30, start);
+    mWatchdog.stop();
+    EXPECT_EQ(mWatchdog.check(start + seconds(10)), StallSource::NONE);
+    EXPECT_EQ(mWatchdog.getStallCount(), 0u);
+}
+
+TEST_F(StallWatchdogTest, AttributesStallToCamera) {
+    mWatchdog.start(/*fps*/ 30, Clock::now());
+    Clock::time_point delivered = deliverFrame();
+    EXPECT_EQ(mWatchdog.check(delivered + seconds(1)), StallSource::CAMERA);
+}
+
+TEST_F(StallWatchdogTest, AttributesStallToEncoder) {
+    mWatchdog.start(/*fps*/ 30, Clock::now());
+    Clock::time_point delivered = deliverFrame();
+    EXPECT_EQ(mWatchdog.check(delivered), StallSource::NONE);
+    FlightRecorder::getInstance().record(FrameEvent::CAMERA_FRAME);
+    EXPECT_EQ(mWatchdog.check(delivered + seconds(1)), StallSource::ENCODER);
+}
+
+TEST_F(StallWatchdogTest, AttributesStallToGadget) {
+    mWatchdog.start(/*fps*/ 30, Clock::now());
+    Clock::time_point delivered = deliverFrame();
+    EXPECT_EQ(mWatchdog.check(delivered), StallSource::NONE);
+    FlightRecorder::getInstance().record(FrameEvent::CAMERA_FRAME);
+    FlightRecorder::getInstance().record(FrameEvent::ENCODED, /*bufferIndex*/ 1);
+    EXPECT_EQ(mWatchdog.check(delivered + seconds(1)), StallSource::GADGET);
+}
+
+TEST_F(StallWatchdogTest, BackoffDoublesUpToMax) {
+    Clock::time_point now = Clock::now();
+    mWatchdog.start(/*fps*/ 30, now);
+    // Without frames every timeout is the first frame one, times the backoff.
+    milliseconds timeout = StallWatchdog::kFirstFrameTimeout;
+    for (uint32_t backoff : {1, 2, 4, 8, 8, 8}) {
+        EXPECT_EQ(mWatchdog.check(now + timeout * backoff - milliseconds(1)), StallSource::NONE)
+                << "backoff " << backoff;
+        now += timeout * backoff;
+        EXPECT_EQ(mWatchdog.check(now), StallSource::CAMERA) << "backoff " << backoff;
+        EXPECT_LE(backoff, StallWatchdog::kMaxBackoff);
+    }
+    EXPECT_EQ(mWatchdog.getStallCount(), 6u);
+}
+
+TEST_F(StallWatchdogTest, BackoffResetsOnceFramesFlow) {
+    mWatchdog.start(/*fps*/ 30, Clock::now());
+    Clock::time_point delivered = deliverFrame();
+    Clock::time_point stalled = delivered + StallWatchdog::kMinStallTimeout;
+    EXPECT_EQ(mWatchdog.check(stalled), StallSource::CAMERA);
+
+    // Frames only count once they are past the stall.
+    std::this_thread::sleep_until(stalled + milliseconds(1));
+    delivered = deliverFrame();
+    // Back to 15 intervals, rather than twice the first frame timeout.
+    EXPECT_EQ(mWatchdog.check(delivered + milliseconds(499)), StallSource::NONE);
+    EXPECT_EQ(mWatchdog.check(delivered + milliseconds(500)), StallSource::CAMERA);
+    EXPECT_EQ(mWatchdog.getStallCount(), 2u);
+}
+
+TEST_F(StallWatchdogTest, HighFrameRatesHaveATimeoutFloor) {
+    mWatchdog.start(/*fps*/ 120, Clock::now());
+    Clock::time_point delivered = deliverFrame();
+    // 15 intervals are 125ms.
+    EXPECT_EQ(mWatchdog.check(delivered + StallWatchdog::kMinStallTimeout - milliseconds(1)),
+              StallSource::NONE);
+    EXPECT_EQ(mWatchdog.check(delivered + StallWatchdog::kMinStallTimeout), StallSource::CAMERA);
+}
+
+TEST(FlightRecorderTest, RingKeepsTheNewestEvents) {
+    FlightRecorder& recorder = FlightRecorder::getInstance();
+    constexpr int64_t kExtra = 10;
+    for (int64_t i = 0; i < static_cast<int64_t>(FlightRecorder::kCapacity) + kExtra; i++) {
+        recorder.record(i % 2 == 0 ? FrameEvent::RETURNED : FrameEvent::USB_ERROR,
+                        static_cast<int32_t>(i % 4), i);
+    }
+    FlightRecorder::Entries entries;
+    ASSERT_EQ(recorder.getEntries(&entries), FlightRecorder::kCapacity);
+    for (size_t i = 0; i < FlightRecorder::kCapacity; i++) {
+        int64_t expected = static_cast<int64_t>(i) + kExtra;
+        EXPECT_EQ(entries[i].value, expected);
+        EXPECT_EQ(entries[i].bufferIndex, expected % 4);
+        EXPECT_EQ(entries[i].event,
+                  expected % 2 == 0 ? FrameEvent::RETURNED : FrameEvent::USB_ERROR);
+        if (i > 0) {
+            EXPECT_GE(entries[i].timeNs, entries[i - 1].timeNs);
+        }
+    }
+    EXPECT_EQ(recorder.getLastEventNs(FrameEvent::USB_ERROR), entries.back().timeNs);
+}
+
+}  // namespace
+}  // namespace webcam
+}  // namespace android
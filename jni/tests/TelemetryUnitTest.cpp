@@ -0,0 +1,288 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <gtest/gtest.h>
+
+#include <android-base/properties.h>
+#include <linux/usb/video.h>
+#include <string.h>
+#include <memory>
+#include <vector>
+
+#include "TelemetryUnit.h"
+#include "Tunables.h"
+
+namespace android {
+namespace webcam {
+namespace {
+
+constexpr uint8_t kUnitId = 9;
+
+class FakeListener : public TelemetryUnit::Listener {
+  public:
+    void getStreamTelemetry(TelemetryStats* stats) override {
+        stats->framesQueued = 42;
+        stats->gadgetSequenceGaps = 3;
+    }
+};
+
+class TelemetryUnitTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        ASSERT_TRUE(android::base::SetProperty(TelemetryUnit::kUnitIdProperty,
+                                               std::to_string(kUnitId)));
+        mUnit = TelemetryUnit::create(&mListener);
+        ASSERT_NE(mUnit, nullptr);
+        ASSERT_EQ(mUnit->getUnitId(), kUnitId);
+        Tunables::getInstance().resetToDefaults();
+    }
+
+    void TearDown() override {
+        android::base::SetProperty(TelemetryUnit::kUnitIdProperty, "");
+        Tunables::getInstance().resetToDefaults();
+    }
+
+    // Sends the setup stage of a class request to control of the unit, as the UVC thread does.
+    bool setup(uint8_t bRequest, uint8_t control, uint16_t wLength,
+               struct uvc_request_data* response) {
+        struct usb_ctrlrequest request {};
+        request.bRequestType = USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE;
+        if (bRequest == UVC_SET_CUR) {
+            request.bRequestType = USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE;
+        }
+        request.bRequest = bRequest;
+        request.wValue = control << 8;
+        request.wIndex = kUnitId << 8;
+        request.wLength = wLength;
+        memset(response, 0xaa, sizeof(*response));
+        return mUnit->processSetup(&request, response);
+    }
+
+    // SET_CUR of TUNABLES with both stages.
+    void setTunables(const TelemetryTunables& tunables) {
+        struct uvc_request_data response;
+        ASSERT_TRUE(setup(UVC_SET_CUR, TelemetryUnit::TUNABLES, sizeof(tunables), &response));
+        ASSERT_EQ(response.length, static_cast<int32_t>(sizeof(tunables)));
+        struct uvc_request_data data {};
+        data.length = sizeof(tunables);
+        memcpy(data.data, &tunables, sizeof(tunables));
+        mUnit->processData(&data);
+    }
+
+    TelemetryTunables getTunables(uint8_t bRequest) {
+        struct uvc_request_data response;
+        TelemetryTunables tunables;
+        EXPECT_FALSE(setup(bRequest, TelemetryUnit::TUNABLES, sizeof(tunables), &response));
+        EXPECT_EQ(response.length, static_cast<int32_t>(sizeof(tunables)));
+        memcpy(&tunables, response.data, sizeof(tunables));
+        return tunables;
+    }
+
+    FakeListener mListener;
+    std::unique_ptr<TelemetryUnit> mUnit;
+};
+
+// Valid, and different from the defaults in every field.
+TelemetryTunables validTunables() {
+    TelemetryTunables tunables;
+    tunables.jpegQuality = 42;
+    tunables.dctMethod = static_cast<uint32_t>(JpegDctMethod::FAST);
+    tunables.quantTables = static_cast<uint32_t>(JpegQuantTables::WEBCAM);
+    tunables.maxEncoderWorkers = 3;
+    tunables.frameRatePercent = 50;
+    tunables.encoderCpuMask = 0xf0;
+    return tunables;
+}
+
+TEST(TelemetryUnitCreateTest, DisabledWithoutTheProperty) {
+    FakeListener listener;
+    android::base::SetProperty(TelemetryUnit::kUnitIdProperty, "");
+    EXPECT_EQ(TelemetryUnit::create(&listener), nullptr);
+    android::base::SetProperty(TelemetryUnit::kUnitIdProperty, "0");
+    EXPECT_EQ(TelemetryUnit::create(&listener), nullptr);
+    android::base::SetProperty(TelemetryUnit::kUnitIdProperty, "");
+}
+
+TEST_F(TelemetryUnitTest, StallsUnknownControls) {
+    struct uvc_request_data response;
+    for (uint8_t control : {0, TelemetryUnit::kControlCount + 1, 0xff}) {
+        for (uint8_t bRequest : {UVC_GET_CUR, UVC_GET_LEN, UVC_GET_INFO, UVC_SET_CUR}) {
+            EXPECT_FALSE(setup(bRequest, control, 64, &response));
+            EXPECT_LT(response.length, 0) << int(control) << " " << int(bRequest);
+        }
+    }
+}
+
+TEST_F(TelemetryUnitTest, StallsUnsupportedRequests) {
+    struct uvc_request_data response;
+    EXPECT_FALSE(setup(UVC_RC_UNDEFINED, TelemetryUnit::STATS, 64, &response));
+    EXPECT_LT(response.length, 0);
+    // GET_CUR_ALL, UVC 1.5 spec section 4.1.2.
+    EXPECT_FALSE(setup(0x91, TelemetryUnit::TUNABLES, 64, &response));
+    EXPECT_LT(response.length, 0);
+}
+
+TEST_F(TelemetryUnitTest, SetCurNeedsTheWholeTunables) {
+    struct uvc_request_data response;
+    for (uint16_t wLength : {0ul, sizeof(TelemetryTunables) - 1, sizeof(TelemetryTunables) + 1}) {
+        EXPECT_FALSE(setup(UVC_SET_CUR, TelemetryUnit::TUNABLES, wLength, &response));
+        EXPECT_LT(response.length, 0) << wLength;
+    }
+    EXPECT_TRUE(setup(UVC_SET_CUR, TelemetryUnit::TUNABLES, sizeof(TelemetryTunables),
+                      &response));
+    EXPECT_EQ(response.length, static_cast<int32_t>(sizeof(TelemetryTunables)));
+}
+
+TEST_F(TelemetryUnitTest, StatsAreReadOnly) {
+    struct uvc_request_data response;
+    EXPECT_FALSE(setup(UVC_SET_CUR, TelemetryUnit::STATS, sizeof(TelemetryStats), &response));
+    EXPECT_LT(response.length, 0);
+}
+
+TEST_F(TelemetryUnitTest, GetCurReportsStats) {
+    struct uvc_request_data response;
+    EXPECT_FALSE(setup(UVC_GET_CUR, TelemetryUnit::STATS, sizeof(TelemetryStats), &response));
+    ASSERT_EQ(response.length, static_cast<int32_t>(sizeof(TelemetryStats)));
+    TelemetryStats stats;
+    memcpy(&stats, response.data, sizeof(stats));
+    EXPECT_EQ(stats.version, TelemetryUnit::kStatsVersion);
+    EXPECT_EQ(stats.framesQueued, 42u);
+    EXPECT_EQ(stats.gadgetSequenceGaps, 3u);
+
+    // Only the current value means anything.
+    EXPECT_FALSE(setup(UVC_GET_MAX, TelemetryUnit::STATS, sizeof(TelemetryStats), &response));
+    ASSERT_EQ(response.length, static_cast<int32_t>(sizeof(TelemetryStats)));
+    std::vector<uint8_t> zeros(sizeof(TelemetryStats));
+    EXPECT_EQ(memcmp(response.data, zeros.data(), zeros.size()), 0);
+}
+
+TEST_F(TelemetryUnitTest, GetCurIsTruncatedToWLength) {
+    struct uvc_request_data response;
+    EXPECT_FALSE(setup(UVC_GET_CUR, TelemetryUnit::STATS, sizeof(uint32_t), &response));
+    ASSERT_EQ(response.length, static_cast<int32_t>(sizeof(uint32_t)));
+    uint32_t version;
+    memcpy(&version, response.data, sizeof(version));
+    EXPECT_EQ(version, TelemetryUnit::kStatsVersion);
+
+    EXPECT_FALSE(setup(UVC_GET_CUR, TelemetryUnit::TUNABLES, 1, &response));
+    EXPECT_EQ(response.length, 1);
+    EXPECT_EQ(response.data[0], Tunables::getInstance().getJpegQuality());
+
+    EXPECT_FALSE(setup(UVC_GET_CUR, TelemetryUnit::TUNABLES, 0, &response));
+    EXPECT_EQ(response.length, 0);
+}
+
+TEST_F(TelemetryUnitTest, GetLen) {
+    struct uvc_request_data response;
+    EXPECT_FALSE(setup(UVC_GET_LEN, TelemetryUnit::STATS, 2, &response));
+    ASSERT_EQ(response.length, 2);
+    EXPECT_EQ(response.data[0] | response.data[1] << 8, sizeof(TelemetryStats));
+    EXPECT_FALSE(setup(UVC_GET_LEN, TelemetryUnit::TUNABLES, 2, &response));
+    ASSERT_EQ(response.length, 2);
+    EXPECT_EQ(response.data[0] | response.data[1] << 8, sizeof(TelemetryTunables));
+}
+
+TEST_F(TelemetryUnitTest, GetInfo) {
+    struct uvc_request_data response;
+    EXPECT_FALSE(setup(UVC_GET_INFO, TelemetryUnit::STATS, 1, &response));
+    ASSERT_EQ(response.length, 1);
+    EXPECT_EQ(response.data[0], 0x1);  // GET only
+    EXPECT_FALSE(setup(UVC_GET_INFO, TelemetryUnit::TUNABLES, 1, &response));
+    ASSERT_EQ(response.length, 1);
+    EXPECT_EQ(response.data[0], 0x3);  // GET and SET
+}
+
+TEST_F(TelemetryUnitTest, SetCurAppliesTunables) {
+    TelemetryTunables tunables = validTunables();
+    setTunables(tunables);
+    Tunables& current = Tunables::getInstance();
+    EXPECT_EQ(current.getJpegQuality(), 42);
+    EXPECT_EQ(current.getDctMethod(), JpegDctMethod::FAST);
+    EXPECT_EQ(current.getQuantTables(), JpegQuantTables::WEBCAM);
+    EXPECT_EQ(current.getMaxEncoderWorkers(), 3u);
+    EXPECT_EQ(current.getFrameRatePercent(), 50u);
+    EXPECT_EQ(current.getEncoderCpuMask(), 0xf0u);
+
+    TelemetryTunables read = getTunables(UVC_GET_CUR);
+    EXPECT_EQ(memcmp(&read, &tunables, sizeof(read)), 0);
+}
+
+TEST_F(TelemetryUnitTest, InvalidTunablesChangeNothing) {
+    std::vector<TelemetryTunables> invalid(9, validTunables());
+    invalid[0].jpegQuality = 0;
+    invalid[1].jpegQuality = 101;
+    invalid[2].dctMethod = 2;
+    invalid[3].quantTables = 2;
+    invalid[4].maxEncoderWorkers = 0;
+    invalid[5].frameRatePercent = 0;
+    invalid[6].frameRatePercent = 101;
+    invalid[7].dctMethod = UINT32_MAX;
+    invalid[8].jpegQuality = UINT32_MAX;
+
+    TelemetryTunables before = getTunables(UVC_GET_CUR);
+    for (size_t i = 0; i < invalid.size(); i++) {
+        setTunables(invalid[i]);
+        TelemetryTunables after = getTunables(UVC_GET_CUR);
+        // The valid fields, the CPU mask among them, aren't applied either.
+        EXPECT_EQ(memcmp(&after, &before, sizeof(after)), 0) << i;
+        EXPECT_EQ(Tunables::getInstance().getEncoderCpuMask(), 0u) << i;
+    }
+}
+
+TEST_F(TelemetryUnitTest, AnyCpuMaskIsValid) {
+    for (uint64_t cpuMask : {uint64_t{0xf0}, UINT64_MAX, uint64_t{0}}) {
+        TelemetryTunables tunables = validTunables();
+        tunables.encoderCpuMask = cpuMask;
+        setTunables(tunables);
+        EXPECT_EQ(Tunables::getInstance().getEncoderCpuMask(), cpuMask);
+    }
+}
+
+TEST_F(TelemetryUnitTest, DataOfTheWrongLengthIsIgnored) {
+    TelemetryTunables tunables = validTunables();
+    struct uvc_request_data data {};
+    data.length = sizeof(tunables) - 1;
+    memcpy(data.data, &tunables, sizeof(tunables));
+    mUnit->processData(&data);
+    EXPECT_EQ(Tunables::getInstance().getJpegQuality(),
+              Tunables::getInstance().getDefaultJpegQuality());
+    EXPECT_EQ(Tunables::getInstance().getEncoderCpuMask(), 0u);
+}
+
+TEST_F(TelemetryUnitTest, TunablesRange) {
+    TelemetryTunables min = getTunables(UVC_GET_MIN);
+    TelemetryTunables max = getTunables(UVC_GET_MAX);
+    TelemetryTunables res = getTunables(UVC_GET_RES);
+    EXPECT_EQ(min.jpegQuality, 1u);
+    EXPECT_EQ(max.jpegQuality, 100u);
+    EXPECT_EQ(max.frameRatePercent, Tunables::kFullFrameRatePercent);
+    EXPECT_EQ(max.encoderCpuMask, UINT64_MAX);
+    EXPECT_EQ(res.jpegQuality, 1u);
+
+    TelemetryTunables def = getTunables(UVC_GET_DEF);
+    EXPECT_EQ(def.jpegQuality,
+              static_cast<uint32_t>(Tunables::getInstance().getDefaultJpegQuality()));
+    EXPECT_EQ(def.encoderCpuMask, 0u);
+    // The defaults are valid.
+    setTunables(def);
+    TelemetryTunables read = getTunables(UVC_GET_CUR);
+    EXPECT_EQ(memcmp(&read, &def, sizeof(read)), 0);
+}
+
+}  // namespace
+}  // namespace webcam
+}  // namespace android
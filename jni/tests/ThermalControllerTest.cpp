@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <gtest/gtest.h>
+
+#include <android-base/file.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <filesystem>
+#include <string>
+
+#include "ThermalController.h"
+#include "Tunables.h"
+
+namespace android {
+namespace webcam {
+namespace {
+
+using namespace std::chrono_literals;
+using Clock = std::chrono::steady_clock;
+
+// Far enough from the epoch for the first step not to wait for a dwell time.
+const Clock::time_point kStart = Clock::time_point() + 1h;
+
+// Polls a ThermalController over a temporary sysfs tree.
+class ThermalControllerTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        Tunables& tunables = Tunables::getInstance();
+        tunables.setDefaults(/*jpegQuality*/ 90, JpegDctMethod::ACCURATE,
+                             /*maxEncoderWorkers*/ 4);
+        tunables.resetToDefaults();
+        tunables.setFrameRatePercent(Tunables::kFullFrameRatePercent);
+    }
+
+    void TearDown() override {
+        std::filesystem::remove_all(mRoot.path);
+        SetUp();
+    }
+
+    std::string path(const std::string& relative) const {
+        return std::string(mRoot.path) + "/" + relative;
+    }
+
+    void write(const std::string& relative, const std::string& contents) {
+        std::filesystem::create_directories(std::filesystem::path(path(relative)).parent_path());
+        ASSERT_TRUE(android::base::WriteStringToFile(contents, path(relative)));
+    }
+
+    void setTemperature(int zone, float celsius) {
+        write("class/thermal/thermal_zone" + std::to_string(zone) + "/temp",
+              std::to_string(static_cast<int64_t>(celsius * 1000)) + "\n");
+    }
+
+    void addZone(int zone, const std::string& type, float celsius) {
+        write("class/thermal/thermal_zone" + std::to_string(zone) + "/type", type + "\n");
+        setTemperature(zone, celsius);
+    }
+
+    // cpuinfo_max_freq is left at 2.4 GHz, only the cap relative to the start counts.
+    void setFrequencyCap(int policy, int64_t khz) {
+        std::string dir = "devices/system/cpu/cpufreq/policy" + std::to_string(policy);
+        write(dir + "/cpuinfo_max_freq", "2400000\n");
+        write(dir + "/scaling_max_freq", std::to_string(khz) + "\n");
+    }
+
+    // Polls until the level reaches target, one degrade dwell apart, returns the time of the
+    // last poll.
+    Clock::time_point degradeTo(ThermalController* controller, int target) {
+        Clock::time_point now = kStart;
+        while (controller->poll(now) < target && now < kStart + 1h) {
+            now += 5s;
+        }
+        EXPECT_EQ(controller->getLevel(), target);
+        return now;
+    }
+
+    android::base::TemporaryDir mRoot;
+};
+
+TEST_F(ThermalControllerTest, SkinZonesArePreferredOverCpuZones) {
+    // Hot enough for the cpu thresholds (70C, 5C a level), not for the skin ones (39C, 2C).
+    addZone(0, "cpu-0-0", 80.0f);
+    addZone(1, "skin-therm", 36.0f);
+    addZone(2, "battery", 90.0f);
+    ThermalController controller(mRoot.path);
+    EXPECT_EQ(controller.poll(kStart), 0);
+    setTemperature(1, 39.5f);
+    EXPECT_EQ(controller.poll(kStart), 1);
+}
+
+TEST_F(ThermalControllerTest, CpuZonesWithoutSkinZones) {
+    addZone(0, "cpu-0-0", 60.0f);
+    addZone(1, "soc", 65.0f);
+    ThermalController controller(mRoot.path);
+    EXPECT_EQ(controller.poll(kStart), 0);
+    setTemperature(1, 76.0f);
+    degradeTo(&controller, 2);
+    EXPECT_EQ(controller.poll(kStart + 1h), 2);
+}
+
+TEST_F(ThermalControllerTest, DegradesOneStepPerDwell) {
+    addZone(0, "skin", 50.0f);
+    ThermalController controller(mRoot.path);
+    EXPECT_EQ(controller.poll(kStart), 1);
+    EXPECT_EQ(controller.poll(kStart + 4s), 1);
+    EXPECT_EQ(controller.poll(kStart + 5s), 2);
+    EXPECT_EQ(controller.poll(kStart + 9s), 2);
+    EXPECT_EQ(controller.poll(kStart + 10s), 3);
+}
+
+TEST_F(ThermalControllerTest, RecoversSlowerWithTemperatureHysteresis) {
+    addZone(0, "skin", 41.5f);
+    ThermalController controller(mRoot.path);
+    Clock::time_point changed = degradeTo(&controller, 2);
+
+    // Below the level 2 threshold (41C), but not by the 2C hysteresis.
+    setTemperature(0, 40.5f);
+    EXPECT_EQ(controller.poll(changed + 1h), 2);
+    // Cool enough for level 0, recovering waits 15s between steps and goes one at a time.
+    setTemperature(0, 36.0f);
+    EXPECT_EQ(controller.poll(changed + 14s), 2);
+    EXPECT_EQ(controller.poll(changed + 15s), 1);
+    EXPECT_EQ(controller.poll(changed + 29s), 1);
+    EXPECT_EQ(controller.poll(changed + 30s), 0);
+}
+
+TEST_F(ThermalControllerTest, RecoversWithFrequencyHysteresis) {
+    setFrequencyCap(0, 2000000);
+    setFrequencyCap(1, 2400000);
+    ThermalController controller(mRoot.path);
+    EXPECT_EQ(controller.poll(kStart), 0);
+    // 89% of the cap at start: level 1 starts below 90%.
+    setFrequencyCap(0, 1780000);
+    EXPECT_EQ(controller.poll(kStart + 1s), 1);
+    // 94% is above the threshold, but not by 5%.
+    setFrequencyCap(0, 1880000);
+    EXPECT_EQ(controller.poll(kStart + 1h), 1);
+    setFrequencyCap(0, 1920000);
+    EXPECT_EQ(controller.poll(kStart + 1h + 1s), 0);
+}
+
+// Devices that cap cpus below cpuinfo_max_freq from boot (or in battery saver) aren't hot.
+TEST_F(ThermalControllerTest, CapAtStartIsNotThermalPressure) {
+    addZone(0, "skin", 30.0f);
+    setFrequencyCap(0, 1200000);
+    ThermalController controller(mRoot.path);
+    controller.start();
+    controller.stop();
+    EXPECT_EQ(controller.poll(kStart), 0);
+    EXPECT_EQ(controller.poll(kStart + 1h), 0);
+    // Capped to half of that since: level 3 and more.
+    setFrequencyCap(0, 600000);
+    degradeTo(&controller, 3);
+    EXPECT_EQ(controller.poll(kStart + 1h), 3);
+}
+
+TEST_F(ThermalControllerTest, ClampsAtTheLastLevel) {
+    addZone(0, "skin", 80.0f);
+    ThermalController controller(mRoot.path);
+    Clock::time_point changed = degradeTo(&controller, ThermalController::kMaxLevel);
+    EXPECT_EQ(controller.poll(changed + 1h), ThermalController::kMaxLevel);
+
+    Tunables& tunables = Tunables::getInstance();
+    EXPECT_EQ(tunables.getJpegQuality(), 65);
+    EXPECT_EQ(tunables.getDctMethod(), JpegDctMethod::FAST);
+    EXPECT_EQ(tunables.getMaxEncoderWorkers(), 1u);
+    EXPECT_EQ(tunables.getFrameRatePercent(), 50u);
+}
+
+TEST_F(ThermalControllerTest, KeepsTheLevelAcrossRestarts) {
+    addZone(0, "skin", 41.5f);
+    ThermalController controller(mRoot.path);
+    degradeTo(&controller, 2);
+    controller.stop();
+
+    // The next stream starts from its own defaults, start() applies the level to them.
+    Tunables& tunables = Tunables::getInstance();
+    tunables.setDefaults(/*jpegQuality*/ 50, JpegDctMethod::ACCURATE, /*maxEncoderWorkers*/ 2);
+    tunables.resetToDefaults();
+    controller.start();
+    controller.stop();
+    EXPECT_EQ(controller.getLevel(), 2);
+    EXPECT_EQ(tunables.getJpegQuality(), 50);
+    EXPECT_EQ(tunables.getDctMethod(), JpegDctMethod::FAST);
+    EXPECT_EQ(tunables.getMaxEncoderWorkers(), 2u);
+}
+
+}  // anonymous namespace
+}  // namespace webcam
+}  // namespace android
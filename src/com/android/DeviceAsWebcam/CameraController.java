@@ -20,6 +20,7 @@ import android.content.Context;
 import android.graphics.Bitmap;
 import android.graphics.BitmapFactory;
 import android.graphics.Canvas;
+import android.graphics.ImageFormat;
 import android.graphics.Matrix;
 import android.graphics.Point;
 import android.graphics.Rect;
@@ -85,6 +86,8 @@ import java.util.function.Consumer;
  * For the webcam stream, it delegates the job of interacting with the native service
  * code - used for encoding ImageReader image callbacks, to the Foreground service (it stores a weak
  * reference to the foreground service during construction).
+ * While both streams run, the native code draws the preview from the webcam frames when it can, so
+ * that the camera has a single output stream.
  */
 public class CameraController {
     private static final String TAG = "CameraController";
@@ -105,6 +108,12 @@ public class CameraController {
     };
 
     private static final int MAX_BUFFERS = 4;
+    // Quality requested from the camera's JPEG encoder when its JPEGs are sent to the host as is.
+    private static final byte JPEG_PASSTHROUGH_QUALITY = 85;
+    // Downscales the native code can apply to the camera's JPEGs, and how much of the downscaled
+    // JPEG it may crop away.
+    private static final int[] JPEG_TRANSFORM_SCALE_DENOMS = {8, 4, 2, 1};
+    private static final float JPEG_TRANSFORM_MAX_CROP = 0.25f;
     // The ratio to the active array size that will be used to determine the metering rectangle
     // size.
     private static final float METERING_RECTANGLE_SIZE_RATIO = 0.15f;
@@ -118,6 +127,8 @@ public class CameraController {
     private boolean mHighQualityModeEnabled = false;
 
     private ImageReader mImgReader;
+    // True if the camera encodes the webcam stream to JPEG itself, for MJPEG streams.
+    private boolean mJpegPassthrough = false;
     private Object mImgReaderLock = new Object();
     private ImageWriter mImageWriter;
 
@@ -144,6 +155,9 @@ public class CameraController {
      */
     private Consumer<Size> mPreviewSizeChangeListener;
     private Surface mPreviewSurface;
+    // True if the native code draws the preview into mPreviewSurface from the webcam frames, in
+    // which case the camera has no output for it.
+    private boolean mNativePreview = false;
     private Size mDisplaySize;
     private Size mPreviewSize;
     // Executor for ImageWriter thread - used when camera is evicted and webcam is streaming.
@@ -673,6 +687,65 @@ public class CameraController {
         return null;
     }
 
+    /**
+     * Returns the AE target fps range to stream at the given frame rate: the narrowest range the
+     * camera supports that contains it, preferably a fixed one. The host may pick a rate the
+     * camera has no range for, eg: one expanded from a stepwise interval range, in which case the
+     * fastest range is used. Only regular capture sessions are opened, the native side doesn't
+     * offer rates above {@link #getMaxFrameRate()}.
+     */
+    private Range<Integer> getAeTargetFpsRange(int fps) {
+        Range<Integer> requested = new Range<>(fps, fps);
+        if (mCameraId == null) {
+            return requested;
+        }
+        Range<Integer>[] ranges = getCameraCharacteristic(mCameraId.mainCameraId,
+                CameraCharacteristics.CONTROL_AE_AVAILABLE_TARGET_FPS_RANGES);
+        if (ranges == null || ranges.length == 0) {
+            return requested;
+        }
+        Range<Integer> ret = null;
+        for (Range<Integer> range : ranges) {
+            if (ret == null) {
+                ret = range;
+            } else if (range.contains(fps)) {
+                if (!ret.contains(fps) || range.getLower() > ret.getLower()
+                        || (range.getLower().equals(ret.getLower())
+                                && range.getUpper() < ret.getUpper())) {
+                    ret = range;
+                }
+            } else if (!ret.contains(fps) && range.getUpper() > ret.getUpper()) {
+                ret = range;
+            }
+        }
+        if (!ret.contains(fps)) {
+            Log.w(TAG, "Camera can't stream at " + fps + "fps, using " + ret);
+        } else if (VERBOSE) {
+            Log.v(TAG, "AE target fps range for " + fps + "fps: " + ret);
+        }
+        return ret;
+    }
+
+    /**
+     * Returns the fastest frame rate the camera streams at in a regular capture session, the
+     * upper end of its fastest AE target fps range, or 0 if unknown. Faster rates, typically
+     * 90 and 120 fps, need a constrained high speed session, which isn't used.
+     */
+    public int getMaxFrameRate() {
+        if (mCameraId == null) {
+            return 0;
+        }
+        Range<Integer>[] ranges = getCameraCharacteristic(mCameraId.mainCameraId,
+                CameraCharacteristics.CONTROL_AE_AVAILABLE_TARGET_FPS_RANGES);
+        int ret = 0;
+        if (ranges != null) {
+            for (Range<Integer> range : ranges) {
+                ret = Math.max(ret, range.getUpper());
+            }
+        }
+        return ret;
+    }
+
     public void setWebcamStreamConfig(boolean mjpeg, int width, int height, int fps) {
         if (VERBOSE) {
             Log.v(TAG, "Set stream config service : mjpeg  ? " + mjpeg + " width" + width +
@@ -681,21 +754,89 @@ public class CameraController {
         synchronized (mSerializationLock) {
             long usage = HardwareBuffer.USAGE_CPU_READ_OFTEN | HardwareBuffer.USAGE_VIDEO_ENCODE;
             mStreamConfigs = new StreamConfigs(mjpeg, width, height, fps);
+            Size jpegSize = mjpeg ? getJpegStreamSize(width, height, fps) : null;
+            mJpegPassthrough = jpegSize != null;
             synchronized (mImgReaderLock) {
                 if (mImgReader != null) {
                     mImgReader.close();
                 }
-                mImgReader = new ImageReader.Builder(width, height)
-                        .setMaxImages(MAX_BUFFERS)
-                        .setDefaultHardwareBufferFormat(HardwareBuffer.YCBCR_420_888)
-                        .setUsage(usage)
-                        .build();
+                ImageReader.Builder builder = mJpegPassthrough
+                        ? new ImageReader.Builder(jpegSize.getWidth(), jpegSize.getHeight())
+                        : new ImageReader.Builder(width, height);
+                builder.setMaxImages(MAX_BUFFERS).setUsage(usage);
+                if (mJpegPassthrough) {
+                    // Native code sends the camera's JPEGs to the host as is, or cropped and
+                    // downscaled without decoding them.
+                    builder.setImageFormat(ImageFormat.JPEG)
+                            .setUsage(HardwareBuffer.USAGE_CPU_READ_OFTEN);
+                } else {
+                    builder.setDefaultHardwareBufferFormat(HardwareBuffer.YCBCR_420_888);
+                }
+                mImgReader = builder.build();
                 mImgReader.setOnImageAvailableListener(mOnImageAvailableListener,
                         mImageReaderHandler);
             }
         }
     }
 
+    /**
+     * Returns the JPEG size the current camera should stream for a webcam stream of the given
+     * size, or null if the camera can't stream a suitable JPEG at the given frame rate (including
+     * the stall JPEG outputs may add to each frame). An exact match is sent to the host as is.
+     * Otherwise the smallest JPEG the native code can crop and downscale by 1/2, 1/4 or 1/8
+     * (without cropping more than a quarter of it) is picked.
+     */
+    @Nullable
+    private Size getJpegStreamSize(int width, int height, int fps) {
+        if (mCameraId == null || fps <= 0) {
+            return null;
+        }
+        StreamConfigurationMap map = getCameraCharacteristic(mCameraId.mainCameraId,
+                CameraCharacteristics.SCALER_STREAM_CONFIGURATION_MAP);
+        if (map == null) {
+            return null;
+        }
+        Size[] jpegSizes = map.getOutputSizes(ImageFormat.JPEG);
+        if (jpegSizes == null) {
+            return null;
+        }
+        long maxFrameDurationNs = TimeUnit.SECONDS.toNanos(1) / fps;
+        Size ret = null;
+        for (Size size : jpegSizes) {
+            long frameDurationNs = map.getOutputMinFrameDuration(ImageFormat.JPEG, size)
+                    + map.getOutputStallDuration(ImageFormat.JPEG, size);
+            if (frameDurationNs > maxFrameDurationNs) {
+                continue;
+            }
+            if (size.getWidth() == width && size.getHeight() == height) {
+                ret = size;
+                break;
+            }
+            if (canTransformJpeg(size, width, height) && (ret == null
+                    || size.getWidth() * size.getHeight() < ret.getWidth() * ret.getHeight())) {
+                ret = size;
+            }
+        }
+        if (VERBOSE) {
+            Log.v(TAG, "JPEG stream for " + width + "x" + height + "@" + fps + "fps: " + ret);
+        }
+        return ret;
+    }
+
+    // Mirrors planJpegTransform() in the native JpegUtils.
+    private static boolean canTransformJpeg(Size jpegSize, int width, int height) {
+        for (int scaleDenom : JPEG_TRANSFORM_SCALE_DENOMS) {
+            long scaledWidth = (long) width * scaleDenom;
+            long scaledHeight = (long) height * scaleDenom;
+            if (scaledWidth > jpegSize.getWidth() || scaledHeight > jpegSize.getHeight()) {
+                continue;
+            }
+            return scaledWidth >= jpegSize.getWidth() * (1 - JPEG_TRANSFORM_MAX_CROP)
+                    && scaledHeight >= jpegSize.getHeight() * (1 - JPEG_TRANSFORM_MAX_CROP);
+        }
+        return false;
+    }
+
     private void fillImageWithCameraAccessBlockedLogo(Image img) {
         Image.Plane[] planes = img.getPlanes();
 
@@ -845,17 +986,15 @@ public class CameraController {
         }
 
         int currentFps = 30;
-        if (mStreamConfigs != null) {
+        if (mStreamConfigs != null && mStreamConfigs.fps != 0) {
             currentFps = mStreamConfigs.fps;
         }
-        Range<Integer> fpsRange;
-        if (currentFps != 0) {
-            fpsRange = new Range<>(currentFps, currentFps);
-        } else {
-            fpsRange = new Range<>(30, 30);
-        }
-        captureRequestBuilder.set(CaptureRequest.CONTROL_AE_TARGET_FPS_RANGE, fpsRange);
+        captureRequestBuilder.set(CaptureRequest.CONTROL_AE_TARGET_FPS_RANGE,
+                getAeTargetFpsRange(currentFps));
         captureRequestBuilder.set(CaptureRequest.CONTROL_ZOOM_RATIO, mZoomRatio);
+        if (mJpegPassthrough) {
+            captureRequestBuilder.set(CaptureRequest.JPEG_QUALITY, JPEG_PASSTHROUGH_QUALITY);
+        }
         captureRequestBuilder.addTarget(targetSurface);
         captureRequestBuilder.set(CaptureRequest.CONTROL_AF_MODE,
                 CaptureRequest.CONTROL_AF_MODE_CONTINUOUS_VIDEO);
@@ -930,6 +1069,10 @@ public class CameraController {
             // Do not use streamusecase if high quality mode is enabled.
             return false;
         }
+        // Stream use cases aren't guaranteed for JPEG outputs.
+        if (mJpegPassthrough) {
+            return false;
+        }
         // Webcam stream - YUV should be <= 1440p
         // Preview stream should be <= PREVIEW - which is already guaranteed by
         // getSuitablePreviewSize()
@@ -950,6 +1093,11 @@ public class CameraController {
             Log.v(TAG, "setupPreviewAlongsideWebcam");
         }
         mPreviewSurface = previewSurface;
+        if (canUseNativePreviewLocked() && startNativePreviewLocked()) {
+            // The camera keeps streaming to the webcam output only.
+            mCurrentState = CameraStreamingState.PREVIEW_AND_WEBCAM_STREAMING;
+            return;
+        }
         mPreviewOutputConfiguration = new OutputConfiguration(mPreviewSurface);
         if (mCameraInfo.isStreamUseCaseSupported() && shouldUseStreamUseCase()) {
             mPreviewOutputConfiguration.setStreamUseCase(
@@ -964,6 +1112,40 @@ public class CameraController {
         createCaptureSessionBlocking();
     }
 
+    /**
+     * Returns true if the native code can draw the preview from the webcam frames. It only sees
+     * decoded frames if it converts them itself, not when the camera's JPEGs are passed through.
+     */
+    private boolean canUseNativePreviewLocked() {
+        return !mJpegPassthrough && mServiceWeak.get() != null;
+    }
+
+    /**
+     * Has the native code draw the preview into mPreviewSurface. mPreviewSurface must not be a
+     * camera output. Returns false if the native code won't, the camera must feed the preview then.
+     */
+    private boolean startNativePreviewLocked() {
+        DeviceAsWebcamFgService service = mServiceWeak.get();
+        mNativePreview = service != null && service.nativeSetPreviewSurface(mPreviewSurface);
+        return mNativePreview;
+    }
+
+    private void stopNativePreviewLocked() {
+        if (!mNativePreview) {
+            return;
+        }
+        mNativePreview = false;
+        DeviceAsWebcamFgService service = mServiceWeak.get();
+        if (service != null) {
+            service.nativeSetPreviewSurface(null);
+        }
+        // The native code's surface stays connected to the SurfaceTexture until it is released, the
+        // camera needs a surface of its own.
+        mPreviewSurface.release();
+        mPreviewSurface =
+                mPreviewSurfaceTexture != null ? new Surface(mPreviewSurfaceTexture) : null;
+    }
+
     public void startPreviewStreaming(SurfaceTexture surfaceTexture, Size previewSize,
             Consumer<Size> previewSizeChangeListener) {
         // Started on a background thread since we don't want to be blocking either the activity's
@@ -1029,6 +1211,17 @@ public class CameraController {
                     CameraMetadata.SCALER_AVAILABLE_STREAM_USE_CASES_VIDEO_CALL);
         }
         mCurrentState = CameraStreamingState.PREVIEW_AND_WEBCAM_STREAMING;
+        if (canUseNativePreviewLocked()) {
+            // The camera lets go of the preview surface with the new session, then the native code
+            // takes it over.
+            mPreviewRequestBuilder.removeTarget(mPreviewSurface);
+            mOutputConfigurations = Arrays.asList(mWebcamOutputConfiguration);
+            createCaptureSessionBlocking();
+            if (startNativePreviewLocked()) {
+                return;
+            }
+            mPreviewRequestBuilder.addTarget(mPreviewSurface);
+        }
         mOutputConfigurations =
                 Arrays.asList(mWebcamOutputConfiguration, mPreviewOutputConfiguration);
         createCaptureSessionBlocking();
@@ -1048,22 +1241,25 @@ public class CameraController {
             return;
         }
 
-        // Removes the original preview surface
-        mPreviewRequestBuilder.removeTarget(mPreviewSurface);
         // Adjusts the SurfaceTexture default buffer size to match the new preview size
         mPreviewSurfaceTexture.setDefaultBufferSize(suitablePreviewSize.getWidth(),
                 suitablePreviewSize.getHeight());
         mPreviewSize = suitablePreviewSize;
-        mPreviewRequestBuilder.addTarget(mPreviewSurface);
-        mPreviewOutputConfiguration = new OutputConfiguration(mPreviewSurface);
-        if (mCameraInfo.isStreamUseCaseSupported()) {
-                mPreviewOutputConfiguration.setStreamUseCase(
-                        CameraMetadata.SCALER_AVAILABLE_STREAM_USE_CASES_PREVIEW);
-        }
+        // The native code picks up the new size when the caller sets the surface again.
+        if (!mNativePreview) {
+            // Replaces the original preview surface
+            mPreviewRequestBuilder.removeTarget(mPreviewSurface);
+            mPreviewRequestBuilder.addTarget(mPreviewSurface);
+            mPreviewOutputConfiguration = new OutputConfiguration(mPreviewSurface);
+            if (mCameraInfo.isStreamUseCaseSupported()) {
+                    mPreviewOutputConfiguration.setStreamUseCase(
+                            CameraMetadata.SCALER_AVAILABLE_STREAM_USE_CASES_PREVIEW);
+            }
 
-        mOutputConfigurations = mWebcamOutputConfiguration != null ? Arrays.asList(
-                mWebcamOutputConfiguration, mPreviewOutputConfiguration) : Arrays.asList(
-                mPreviewOutputConfiguration);
+            mOutputConfigurations = mWebcamOutputConfiguration != null ? Arrays.asList(
+                    mWebcamOutputConfiguration, mPreviewOutputConfiguration) : Arrays.asList(
+                    mPreviewOutputConfiguration);
+        }
 
         // Invokes the preview size change listener so that the preview activity can adjust its
         // size and scale to match the new size.
@@ -1125,9 +1321,14 @@ public class CameraController {
     }
 
     private void stopPreviewStreamOnlyLocked() {
-        mPreviewRequestBuilder.removeTarget(mPreviewSurface);
-        mOutputConfigurations = Arrays.asList(mWebcamOutputConfiguration);
-        createCaptureSessionBlocking();
+        if (mNativePreview) {
+            // The camera session already has the webcam output only.
+            stopNativePreviewLocked();
+        } else {
+            mPreviewRequestBuilder.removeTarget(mPreviewSurface);
+            mOutputConfigurations = Arrays.asList(mWebcamOutputConfiguration);
+            createCaptureSessionBlocking();
+        }
         mPreviewSurfaceTexture = null;
         mPreviewSizeChangeListener = null;
         mPreviewSurface = null;
@@ -1164,6 +1365,16 @@ public class CameraController {
         // Re-configure session to have only the preview stream
         // Setup outputs
         mPreviewRequestBuilder.removeTarget(mImgReader.getSurface());
+        if (mNativePreview) {
+            // The preview was drawn from the webcam frames, it needs a camera output now.
+            stopNativePreviewLocked();
+            mPreviewRequestBuilder.addTarget(mPreviewSurface);
+            mPreviewOutputConfiguration = new OutputConfiguration(mPreviewSurface);
+            if (mCameraInfo.isStreamUseCaseSupported()) {
+                mPreviewOutputConfiguration.setStreamUseCase(
+                        CameraMetadata.SCALER_AVAILABLE_STREAM_USE_CASES_PREVIEW);
+            }
+        }
         mOutputConfigurations =
                 Arrays.asList(mPreviewOutputConfiguration);
         mCurrentState = CameraStreamingState.PREVIEW_STREAMING;
@@ -1180,6 +1391,7 @@ public class CameraController {
             Log.v(TAG, "StopStreamingAltogether");
         }
         mCurrentState = CameraStreamingState.NO_STREAMING;
+        stopNativePreviewLocked();
         synchronized (mImgReaderLock) {
             if (closeImageReader && mImgReader != null) {
                 mImgReader.close();
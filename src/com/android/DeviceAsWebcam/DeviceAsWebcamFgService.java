@@ -30,6 +30,7 @@ import android.os.Binder;
 import android.os.IBinder;
 import android.util.Log;
 import android.util.Size;
+import android.view.Surface;
 
 import androidx.annotation.Nullable;
 import androidx.core.app.NotificationCompat;
@@ -133,7 +134,8 @@ public class DeviceAsWebcamFgService extends Service {
 
     private int setupServicesAndStartListening() {
         String[] ignoredNodes = IgnoredV4L2Nodes.getIgnoredNodes(getApplicationContext());
-        return setupServicesAndStartListeningNative(ignoredNodes);
+        return setupServicesAndStartListeningNative(ignoredNodes,
+                getFilesDir().getAbsolutePath(), mCameraController.getMaxFrameRate());
     }
 
     @Override
@@ -554,10 +556,14 @@ public class DeviceAsWebcamFgService extends Service {
     /**
      * Called during {@link #onStartCommand} to initialize the native side of the service.
      * @param ignoredNodes V4L2 nodes to ignore
+     * @param profileDir directory where the native side keeps its encoder profiles
+     * @param maxFps fastest frame rate the camera streams at, frame rates above it aren't offered
+     *        to the host. 0 if unknown
      * @return 0 if native side code was successfully initialized,
      *         non-0 otherwise
      */
-    private native int setupServicesAndStartListeningNative(String[] ignoredNodes);
+    private native int setupServicesAndStartListeningNative(String[] ignoredNodes,
+            String profileDir, int maxFps);
 
     /**
      * Called by {@link CameraController} to queue frames for encoding. The frames are encoded
@@ -569,6 +575,16 @@ public class DeviceAsWebcamFgService extends Service {
      */
     public native int nativeEncodeImage(HardwareBuffer buffer, long timestamp, int rotation);
 
+    /**
+     * Called by {@link CameraController} to have the native code draw the preview into
+     * {@code surface} from the frames it converts for the webcam stream, instead of the camera
+     * streaming to it. The native code must not draw into a surface the camera streams to.
+     * @param surface surface to draw the preview into, {@code null} to stop drawing it
+     * @return {@code true} if the native code draws the preview into {@code surface} (always if
+     *         {@code surface} is {@code null}), {@code false} if the camera must stream to it
+     */
+    public native boolean nativeSetPreviewSurface(Surface surface);
+
     /**
      * Called by {@link #onDestroy} to give the JNI code a chance to clean up before the service
      * goes out of scope.
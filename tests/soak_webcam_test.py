@@ -0,0 +1,442 @@
+# Copyright 2023 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""Soak test: streams from device as webcam for hours and flags drift.
+
+Runs on a Linux host with the device connected as a webcam and reachable over
+adb (as root). Streams every advertised format / resolution / frame rate in
+turn, one cycle each, with a STREAMOFF / STREAMON between cycles. A cycle of
+a fixed reference stream (the first advertised one by default) runs between
+every two of them. Every sample interval it records:
+  - frame intervals and host side transfer latency percentiles, from the
+    buffer timestamps (frame start) and the time the buffers are dequeued,
+  - frames dropped, ie: not delivered at the advertised frame rate,
+  - RSS and open fds of the service,
+  - the stats of the service's control socket, if enabled.
+Between cycles it checks that the service released all camera buffers.
+
+At the end the samples of the reference stream from the first and the last
+part of the run are compared, and growth past the thresholds below is reported
+as drift. Only the reference samples are compared: memory, latency and drops
+differ between streams, and the other streams are each visited too rarely.
+Samples are written to a JSON lines file for plotting.
+
+Usage:
+  python3 soak_webcam_test.py [--serial <serial>] [--hours 4] [--out soak.jsonl]
+                              [--reference "MJPG 1280x720@30"]
+"""
+
+import argparse
+import errno
+import json
+import logging
+import mmap
+import os
+import select
+import socket
+import statistics
+import subprocess
+import sys
+import time
+
+import v4l2
+
+import linux_webcam_test
+
+_SERVICE_PROCESS = 'com.android.DeviceAsWebcam'
+_CONTROL_SOCKET_PROPERTY = 'debug.deviceaswebcam.control_socket'
+_CONTROL_SOCKET = 'localabstract:deviceaswebcam_control'
+_CONTROL_SOCKET_TIMEOUT = 2  # seconds
+_REQUEST_BUFFER_COUNT = 4
+_DQBUF_TIMEOUT = 2  # seconds
+_STREAMOFF_SETTLE = 1  # seconds, for the service to return its buffers
+
+# Drift thresholds, last part of the run against the first part.
+_WINDOW_FRACTION = 0.2
+_MAX_RSS_GROWTH_KB = 8 * 1024
+_MAX_RSS_GROWTH_RATIO = 0.10
+_MAX_FD_GROWTH = 8
+_MAX_LATENCY_GROWTH_RATIO = 0.25
+_MAX_DROP_RATE_GROWTH = 0.02  # fraction of the expected frames
+
+
+def percentile(values, fraction):
+  if not values:
+    return 0.0
+  values = sorted(values)
+  return values[min(int(fraction * len(values)), len(values) - 1)]
+
+
+class Device:
+  """adb access to the device as webcam service."""
+
+  def __init__(self, serial):
+    self._adb = ['adb'] + (['-s', serial] if serial else [])
+    self._port = None
+
+  def shell(self, command):
+    return subprocess.run(self._adb + ['shell', command], capture_output=True,
+                          text=True, check=False).stdout.strip()
+
+  def get_pid(self):
+    return self.shell(f'pidof {_SERVICE_PROCESS}').split(' ')[0]
+
+  def get_rss_kb(self, pid):
+    for line in self.shell(f'cat /proc/{pid}/status').splitlines():
+      if line.startswith('VmRSS:'):
+        return int(line.split()[1])
+    return 0
+
+  def get_fd_count(self, pid):
+    count = self.shell(f'ls /proc/{pid}/fd | wc -l')
+    return int(count) if count.isdigit() else 0
+
+  def close(self):
+    """Removes the port forward of the control socket, if any."""
+    if self._port is not None:
+      subprocess.run(self._adb + ['forward', '--remove', f'tcp:{self._port}'],
+                     capture_output=True, check=False)
+      self._port = None
+
+  def _forward(self):
+    """Forwards a free host port to the control socket, returns it."""
+    if self._port is None:
+      # tcp:0 lets adb pick an unused port, which it prints.
+      port = subprocess.run(self._adb + ['forward', 'tcp:0', _CONTROL_SOCKET],
+                            capture_output=True, text=True,
+                            check=False).stdout.strip()
+      if port.isdigit():
+        self._port = int(port)
+    return self._port
+
+  def get_stats(self):
+    """Returns the control socket's stats as a dict, empty if unavailable."""
+    port = self._forward()
+    if port is None:
+      return {}
+    try:
+      with socket.create_connection(('localhost', port),
+                                    timeout=_CONTROL_SOCKET_TIMEOUT) as sock:
+        sock.sendall(b'stats\n')
+        reply = b''
+        while not reply.endswith(b'ok\n') and b'error' not in reply:
+          data = sock.recv(4096)
+          if not data:
+            break
+          reply += data
+    except OSError:
+      return {}
+    stats = {}
+    for line in reply.decode('utf-8').splitlines():
+      name, _, value = line.partition(' ')
+      if not value:
+        continue
+      try:
+        stats[name] = float(value) if '.' in value else int(value, 0)
+      except ValueError:
+        stats[name] = value
+    return stats
+
+
+class Stream:
+  """One STREAMON / STREAMOFF cycle at a format, resolution and frame rate."""
+
+  def __init__(self, video_device, fmtdesc, frmsize, frmival):
+    self._video_device = video_device
+    self.fourcc = linux_webcam_test.v4l2_fourcc_to_str(fmtdesc.pixelformat)
+    self.width = frmsize.discrete.width
+    self.height = frmsize.discrete.height
+    self.fps = frmival.discrete.denominator / frmival.discrete.numerator
+    self._pixelformat = fmtdesc.pixelformat
+    self._frmival = frmival
+    self._buffers = []
+    self._req = None
+    self._last_sequence = None
+    self._last_timestamp = None
+    self.reset_sample()
+
+  def __str__(self):
+    return f'{self.fourcc} {self.width}x{self.height}@{self.fps:g}'
+
+  def reset_sample(self):
+    self.intervals_ms = []
+    self.latencies_ms = []
+    self.frames = 0
+    self.sequence_gaps = 0
+    self.sample_start = time.monotonic()
+
+  def _ioctl(self, request, arg):
+    linux_webcam_test.ioctl_retry_error(self._video_device, request, arg,
+                                        OSError, errno.EBUSY)
+
+  def start(self):
+    fmt = v4l2.v4l2_format()
+    fmt.type = v4l2.V4L2_BUF_TYPE_VIDEO_CAPTURE
+    fmt.fmt.pix.pixelformat = self._pixelformat
+    fmt.fmt.pix.width = self.width
+    fmt.fmt.pix.height = self.height
+    self._ioctl(v4l2.VIDIOC_S_FMT, fmt)
+
+    streamparm = v4l2.v4l2_streamparm()
+    streamparm.type = v4l2.V4L2_BUF_TYPE_VIDEO_CAPTURE
+    streamparm.parm.capture.timeperframe.numerator = (
+        self._frmival.discrete.numerator)
+    streamparm.parm.capture.timeperframe.denominator = (
+        self._frmival.discrete.denominator)
+    self._ioctl(v4l2.VIDIOC_S_PARM, streamparm)
+
+    self._req = v4l2.v4l2_requestbuffers()
+    self._req.count = _REQUEST_BUFFER_COUNT
+    self._req.type = v4l2.V4L2_BUF_TYPE_VIDEO_CAPTURE
+    self._req.memory = v4l2.V4L2_MEMORY_MMAP
+    self._ioctl(v4l2.VIDIOC_REQBUFS, self._req)
+    for i in range(self._req.count):
+      buf = v4l2.v4l2_buffer()
+      buf.type = v4l2.V4L2_BUF_TYPE_VIDEO_CAPTURE
+      buf.memory = v4l2.V4L2_MEMORY_MMAP
+      buf.index = i
+      self._ioctl(v4l2.VIDIOC_QUERYBUF, buf)
+      self._buffers.append(mmap.mmap(self._video_device, buf.length,
+                                     flags=mmap.MAP_SHARED,
+                                     prot=mmap.PROT_READ,
+                                     offset=buf.m.offset))
+      self._ioctl(v4l2.VIDIOC_QBUF, buf)
+
+    buf_type = v4l2.v4l2_buf_type(v4l2.V4L2_BUF_TYPE_VIDEO_CAPTURE)
+    self._ioctl(v4l2.VIDIOC_STREAMON, buf_type)
+    self._last_sequence = None
+    self._last_timestamp = None
+    self.reset_sample()
+
+  def stop(self):
+    buf_type = v4l2.v4l2_buf_type(v4l2.V4L2_BUF_TYPE_VIDEO_CAPTURE)
+    self._ioctl(v4l2.VIDIOC_STREAMOFF, buf_type)
+    self._req.count = 0
+    self._ioctl(v4l2.VIDIOC_REQBUFS, self._req)
+    for mapping in self._buffers:
+      mapping.close()
+    self._buffers = []
+
+  def dequeue_frame(self):
+    """Waits for the next frame and requeues it. Returns False on timeout."""
+    readable, _, _ = select.select([self._video_device], [], [],
+                                   _DQBUF_TIMEOUT)
+    if not readable:
+      return False
+    buf = v4l2.v4l2_buffer()
+    buf.type = v4l2.V4L2_BUF_TYPE_VIDEO_CAPTURE
+    buf.memory = v4l2.V4L2_MEMORY_MMAP
+    try:
+      self._ioctl(v4l2.VIDIOC_DQBUF, buf)
+    except BlockingIOError:
+      return True
+    now = time.clock_gettime(time.CLOCK_MONOTONIC)
+    self._ioctl(v4l2.VIDIOC_QBUF, buf)
+
+    # uvcvideo stamps buffers with CLOCK_MONOTONIC when the frame starts
+    # arriving, the difference is the time spent on the bus and in the driver.
+    timestamp = buf.timestamp.secs + buf.timestamp.usecs / 1e6
+    self.latencies_ms.append((now - timestamp) * 1000)
+    if self._last_timestamp is not None:
+      self.intervals_ms.append((timestamp - self._last_timestamp) * 1000)
+    if self._last_sequence is not None:
+      self.sequence_gaps += max(buf.sequence - self._last_sequence - 1, 0)
+    self._last_timestamp = timestamp
+    self._last_sequence = buf.sequence
+    self.frames += 1
+    return True
+
+  def get_sample(self):
+    elapsed = time.monotonic() - self.sample_start
+    expected = max(elapsed * self.fps, 1)
+    return {
+        'stream': str(self),
+        'frames': self.frames,
+        'drop_rate': max(expected - self.frames, 0) / expected,
+        'sequence_gaps': self.sequence_gaps,
+        'interval_p50_ms': percentile(self.intervals_ms, 0.5),
+        'interval_p99_ms': percentile(self.intervals_ms, 0.99),
+        'latency_p50_ms': percentile(self.latencies_ms, 0.5),
+        'latency_p99_ms': percentile(self.latencies_ms, 0.99),
+    }
+
+
+def list_streams(video_device):
+  """Every advertised format / resolution / frame rate combination."""
+  configs = []
+  formats = linux_webcam_test.initialize_formats_and_resolutions(video_device)
+  for fmtdesc, frmsize_list in formats:
+    for frmsize, frmival_list in frmsize_list:
+      for frmival in frmival_list:
+        configs.append((fmtdesc, frmsize, frmival))
+  return configs
+
+
+def collect_device_sample(device, sample):
+  pid = device.get_pid()
+  if pid:
+    sample['rss_kb'] = device.get_rss_kb(pid)
+    sample['fds'] = device.get_fd_count(pid)
+  stats = device.get_stats()
+  for name in ('camera_buffers_held', 'superseded', 'expired', 'no_free_buffer',
+               'avg_wait_us', 'max_wait_us', 'stalls', 'measured_fps'):
+    if name in stats:
+      sample[name] = stats[name]
+
+
+def find_drift(samples, idle_checks):
+  """Returns a description of every metric that drifted."""
+  problems = []
+  reference = [s for s in samples if s.get('reference')]
+  window = max(int(len(reference) * _WINDOW_FRACTION), 1)
+  if len(reference) < 2 * window:
+    return ['not enough reference samples to look for drift']
+
+  def compare(name, is_drift, describe):
+    first = [s[name] for s in reference[:window] if name in s]
+    last = [s[name] for s in reference[-window:] if name in s]
+    if not first or not last:
+      return
+    before = statistics.median(first)
+    after = statistics.median(last)
+    if is_drift(before, after):
+      problems.append(f'{reference[0]["stream"]} {name}: '
+                      f'{describe(before, after)}')
+
+  compare('rss_kb',
+          lambda b, a: a - b > max(_MAX_RSS_GROWTH_KB,
+                                   b * _MAX_RSS_GROWTH_RATIO),
+          lambda b, a: f'{b:.0f} kB -> {a:.0f} kB')
+  compare('fds', lambda b, a: a - b > _MAX_FD_GROWTH,
+          lambda b, a: f'{b:.0f} -> {a:.0f}')
+  for name in ('latency_p99_ms', 'interval_p99_ms'):
+    compare(name, lambda b, a: a > b * (1 + _MAX_LATENCY_GROWTH_RATIO),
+            lambda b, a: f'{b:.1f} ms -> {a:.1f} ms')
+  compare('drop_rate', lambda b, a: a - b > _MAX_DROP_RATE_GROWTH,
+          lambda b, a: f'{b:.1%} -> {a:.1%}')
+
+  leaks = [check for check in idle_checks if check['camera_buffers_held'] > 0]
+  if leaks:
+    problems.append(f'camera buffers still held after STREAMOFF in '
+                    f'{len(leaks)} of {len(idle_checks)} cycles, up to '
+                    f'{max(c["camera_buffers_held"] for c in leaks)}')
+  return problems
+
+
+def pick_reference(streams, name):
+  """The stream called name, the first one if name is empty."""
+  if not name:
+    return streams[0]
+  for stream in streams:
+    if str(stream) == name:
+      return stream
+  return None
+
+
+def run(args):
+  device = Device(args.serial)
+  try:
+    return soak(device, args)
+  finally:
+    device.close()
+
+
+def soak(device, args):
+  device.shell(f'setprop {_CONTROL_SOCKET_PROPERTY} true')
+  if not device.get_stats():
+    logging.warning('Control socket unavailable, restart the service to '
+                    'enable it. Continuing without the service stats.')
+
+  device_path = linux_webcam_test.initialize_device_path()
+  if not device_path:
+    logging.error('Supported device not found!')
+    return False
+  video_device = os.open(device_path, os.O_RDWR | os.O_NONBLOCK)
+  streams = [Stream(video_device, *config)
+             for config in list_streams(video_device)]
+  if not streams:
+    logging.error('Error retrieving formats and resolutions')
+    return False
+  reference = pick_reference(streams, args.reference)
+  if reference is None:
+    logging.error('No stream %s, streams are: %s', args.reference,
+                  ', '.join(str(stream) for stream in streams))
+    return False
+  others = [stream for stream in streams if stream is not reference]
+
+  samples = []
+  idle_checks = []
+  end_time = time.monotonic() + args.hours * 3600
+  cycle = 0
+  with open(args.out, 'w') as out:
+    while time.monotonic() < end_time:
+      # Every other cycle streams the reference, which drift is measured on.
+      if cycle % 2 == 0 or not others:
+        stream = reference
+      else:
+        stream = others[(cycle // 2) % len(others)]
+      cycle += 1
+      logging.info('Cycle %d: %s', cycle, stream)
+      stream.start()
+      cycle_end = min(time.monotonic() + args.cycle_minutes * 60, end_time)
+      while time.monotonic() < cycle_end:
+        if not stream.dequeue_frame():
+          logging.warning('%s: no frame in %ds', stream, _DQBUF_TIMEOUT)
+        if time.monotonic() - stream.sample_start < args.sample_seconds:
+          continue
+        sample = stream.get_sample()
+        sample['time'] = time.time()
+        sample['reference'] = stream is reference
+        collect_device_sample(device, sample)
+        samples.append(sample)
+        out.write(json.dumps(sample) + '\n')
+        out.flush()
+        stream.reset_sample()
+      stream.stop()
+
+      time.sleep(_STREAMOFF_SETTLE)
+      stats = device.get_stats()
+      if 'camera_buffers_held' in stats:
+        idle_checks.append({
+            'cycle': cycle,
+            'camera_buffers_held': stats['camera_buffers_held'],
+        })
+  os.close(video_device)
+
+  problems = find_drift(samples, idle_checks)
+  for problem in problems:
+    logging.error('Drift: %s', problem)
+  if not problems:
+    logging.info('No drift in %d samples over %d cycles', len(samples), cycle)
+  return not problems
+
+
+def main():
+  parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+  parser.add_argument('--serial', help='adb serial of the device')
+  parser.add_argument('--hours', type=float, default=4)
+  parser.add_argument('--cycle_minutes', type=float, default=10,
+                      help='time between STREAMOFF / STREAMON and format '
+                      'switches')
+  parser.add_argument('--sample_seconds', type=float, default=60)
+  parser.add_argument('--reference', default='',
+                      help='stream drift is measured on, like '
+                      '"MJPG 1280x720@30", the first advertised one if empty')
+  parser.add_argument('--out', default='soak.jsonl',
+                      help='JSON lines file the samples are written to')
+  logging.basicConfig(level=logging.INFO, format='%(asctime)s %(message)s')
+  sys.exit(0 if run(parser.parse_args()) else 1)
+
+
+if __name__ == '__main__':
+  main()